@@ -0,0 +1,562 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, James Hughes
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file RaspiCircular.c
+ * Circular buffer of encoded video for recording from before a trigger.
+ *
+ * Encoder output is added as it arrives, dropping the oldest data once the
+ * buffer is full. Each buffer is either copied into a byte ring, or in refs
+ * mode kept by holding a reference on the encoder's own buffer header, so
+ * that nothing is copied at all.
+ *
+ * A trigger queues a clip that starts at a key frame some time before it
+ * (the pre-roll) and runs until some time after it (the post-roll). Clips
+ * are written out in order by a thread of their own while recording goes
+ * on, so a clip can still be saving when the next trigger arrives.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interface/vcos/vcos.h"
+
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/mmal_logging.h"
+#include "interface/mmal/mmal_buffer.h"
+
+#include "RaspiCircular.h"
+
+/**
+ * Drop the oldest entry
+ *
+ * @param cb Circular buffer, locked
+ */
+static void evict_oldest(RASPICIRCULAR *cb)
+{
+   RASPICIRCULAR_ENTRY *entry = &cb->entries[cb->head % cb->num_entries];
+   RASPICIRCULAR_CLIP *clip;
+
+   for (clip = cb->clips; clip; clip = clip->next_clip)
+   {
+      // A clip still looking for its first key frame just moves on, anything
+      // else has lost data it still had to write
+      if (clip->next > cb->head)
+         continue;
+      if (clip->need_key)
+         clip->next = cb->head + 1;
+      else
+         clip->overrun = 1;
+   }
+
+   if (cb->key_head < cb->key_tail && cb->keys[cb->key_head % cb->num_entries] == cb->head)
+      cb->key_head++;
+
+   if (entry->buffer)
+   {
+      mmal_buffer_header_release(entry->buffer);
+      entry->buffer = NULL;
+   }
+
+   cb->bytes -= entry->length;
+   cb->head++;
+   cb->stats.evicted++;
+}
+
+/**
+ * Complete the first clip and free it
+ *
+ * @param cb Circular buffer, locked. Unlocked while the file is closed.
+ * @param ok Whether the whole clip was written
+ */
+static void finish_clip(RASPICIRCULAR *cb, int ok)
+{
+   RASPICIRCULAR_CLIP *clip = cb->clips;
+
+   cb->clips = clip->next_clip;
+   vcos_mutex_unlock(&cb->lock);
+
+   if (fflush(clip->file) != 0)
+      ok = 0;
+   if (clip->close_file)
+      fclose(clip->file);
+
+   if (!ok)
+      vcos_log_error("Circular buffer clip incomplete");
+
+   vcos_mutex_lock(&cb->lock);
+   if (ok)
+      cb->stats.clips++;
+   else
+      cb->stats.failed++;
+   if (cb->waiting)
+      vcos_semaphore_post(&cb->done);
+
+   free(clip);
+}
+
+/**
+ * Write the next entry of the first clip
+ *
+ * @param cb Circular buffer, locked. Unlocked while writing.
+ * @return 0 if there is nothing to write until more is added, 1 otherwise
+ */
+static int write_next(RASPICIRCULAR *cb)
+{
+   RASPICIRCULAR_CLIP *clip = cb->clips;
+   RASPICIRCULAR_ENTRY *entry;
+   MMAL_BUFFER_HEADER_T *buffer = NULL;
+   uint8_t header[RASPICIRCULAR_HEADER_MAX];
+   int header_len = 0, ok = 1;
+   int64_t offset;
+   uint32_t length, first;
+
+   if (clip->overrun)
+   {
+      finish_clip(cb, 0);
+      return 1;
+   }
+
+   if (clip->next == cb->tail)
+   {
+      // Once stopping, a clip ends with whatever has been buffered
+      if (!cb->stopping)
+         return 0;
+      finish_clip(cb, 1);
+      return 1;
+   }
+
+   entry = &cb->entries[clip->next % cb->num_entries];
+
+   if (clip->need_key)
+   {
+      if (!entry->key)
+      {
+         clip->next++;
+         return 1;
+      }
+      clip->need_key = 0;
+   }
+
+   if (entry->frame_start && entry->time > clip->end_time)
+   {
+      finish_clip(cb, 1);
+      return 1;
+   }
+
+   if (!clip->started)
+   {
+      header_len = cb->header_len;
+      memcpy(header, cb->header, header_len);
+      clip->started = 1;
+   }
+
+   length = entry->length;
+   offset = entry->pos % cb->max_bytes;
+   if (entry->buffer)
+   {
+      // Our own reference keeps the data valid, even if the entry is dropped
+      buffer = entry->buffer;
+      mmal_buffer_header_acquire(buffer);
+   }
+   vcos_mutex_unlock(&cb->lock);
+
+   if (header_len && fwrite(header, 1, header_len, clip->file) != header_len)
+      ok = 0;
+
+   if (buffer)
+   {
+      mmal_buffer_header_mem_lock(buffer);
+      if (fwrite(buffer->data + buffer->offset, 1, length, clip->file) != length)
+         ok = 0;
+      mmal_buffer_header_mem_unlock(buffer);
+      mmal_buffer_header_release(buffer);
+   }
+   else
+   {
+      first = cb->max_bytes - offset < length ? cb->max_bytes - offset : length;
+      if (fwrite(cb->data + offset, 1, first, clip->file) != first ||
+          fwrite(cb->data, 1, length - first, clip->file) != length - first)
+         ok = 0;
+   }
+
+   vcos_mutex_lock(&cb->lock);
+
+   // In copy mode the data may have been overwritten while it was written
+   if (!ok || (!buffer && clip->overrun))
+   {
+      finish_clip(cb, 0);
+      return 1;
+   }
+
+   cb->stats.bytes_saved += length + header_len;
+   clip->next++;
+   return 1;
+}
+
+/**
+ * Clip writer thread
+ *
+ * @param arg Pointer to the circular buffer
+ */
+static void *raspicircular_thread(void *arg)
+{
+   RASPICIRCULAR *cb = (RASPICIRCULAR *)arg;
+
+   vcos_mutex_lock(&cb->lock);
+
+   while (cb->clips || !cb->stopping)
+   {
+      if (!cb->clips || !write_next(cb))
+      {
+         vcos_mutex_unlock(&cb->lock);
+         vcos_semaphore_wait(&cb->work);
+         vcos_mutex_lock(&cb->lock);
+      }
+   }
+
+   vcos_mutex_unlock(&cb->lock);
+
+   return NULL;
+}
+
+/**
+ * Create a circular buffer and start its clip writer thread
+ *
+ * @param cb Circular buffer to set up
+ * @param max_bytes Most bytes of video to retain
+ * @param max_buffers Most encoder buffers to retain
+ * @param refs Hold references to the encoder buffers instead of copying them.
+ *             The encoder output pool must have max_buffers + 1 spare buffers.
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+MMAL_STATUS_T raspicircular_create(RASPICIRCULAR *cb, int64_t max_bytes, int max_buffers, int refs)
+{
+   VCOS_STATUS_T status;
+
+   memset(cb, 0, sizeof(*cb));
+   cb->refs = refs;
+   cb->max_bytes = max_bytes;
+   cb->num_entries = max_buffers;
+   cb->frame_start = 1;
+   cb->frame_seq = -1;
+   cb->key_seq = -1;
+
+   if (!refs)
+   {
+      cb->data = malloc(max_bytes);
+      if (!cb->data)
+         goto error_alloc;
+   }
+
+   cb->entries = calloc(max_buffers, sizeof(*cb->entries));
+   cb->keys = calloc(max_buffers, sizeof(*cb->keys));
+   if (!cb->entries || !cb->keys)
+      goto error_alloc;
+
+   status = vcos_mutex_create(&cb->lock, "raspivid-circular");
+   if (status != VCOS_SUCCESS)
+      goto error_alloc;
+
+   status = vcos_semaphore_create(&cb->work, "raspivid-circular", 0);
+   if (status != VCOS_SUCCESS)
+      goto error_work;
+
+   status = vcos_semaphore_create(&cb->done, "raspivid-circular-done", 0);
+   if (status != VCOS_SUCCESS)
+      goto error_done;
+
+   status = vcos_thread_create(&cb->thread, "raspivid-circular", NULL, raspicircular_thread, cb);
+   if (status != VCOS_SUCCESS)
+      goto error_thread;
+
+   cb->running = 1;
+   return MMAL_SUCCESS;
+
+error_thread:
+   vcos_semaphore_delete(&cb->done);
+error_done:
+   vcos_semaphore_delete(&cb->work);
+error_work:
+   vcos_mutex_delete(&cb->lock);
+error_alloc:
+   free(cb->data);
+   free(cb->entries);
+   free(cb->keys);
+   memset(cb, 0, sizeof(*cb));
+   return MMAL_ENOMEM;
+}
+
+/**
+ * Complete any clips with what is buffered, stop the thread and free the
+ * circular buffer
+ *
+ * The encoder output port must be disabled first, so no more buffers arrive.
+ *
+ * @param cb Circular buffer
+ */
+void raspicircular_destroy(RASPICIRCULAR *cb)
+{
+   if (!cb->running)
+      return;
+
+   vcos_mutex_lock(&cb->lock);
+   cb->stopping = 1;
+   vcos_semaphore_post(&cb->work);
+   vcos_mutex_unlock(&cb->lock);
+
+   vcos_thread_join(&cb->thread, NULL);
+   cb->running = 0;
+
+   while (cb->head != cb->tail)
+      evict_oldest(cb);
+
+   vcos_semaphore_delete(&cb->done);
+   vcos_semaphore_delete(&cb->work);
+   vcos_mutex_delete(&cb->lock);
+   free(cb->data);
+   free(cb->entries);
+   free(cb->keys);
+   cb->data = NULL;
+   cb->entries = NULL;
+   cb->keys = NULL;
+}
+
+/**
+ * Add an encoder output buffer, dropping the oldest data if need be
+ *
+ * Constant time, however much is retained. In refs mode a reference is
+ * taken on the buffer, the caller still releases its own.
+ *
+ * @param cb Circular buffer
+ * @param buffer Encoder output buffer
+ */
+void raspicircular_add(RASPICIRCULAR *cb, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPICIRCULAR_ENTRY *entry;
+   int64_t offset;
+   uint32_t first;
+
+   if (!buffer->length || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO))
+      return;
+
+   vcos_mutex_lock(&cb->lock);
+
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+   {
+      // Keep the latest header, to start each clip with
+      if (cb->header_done)
+      {
+         cb->header_len = 0;
+         cb->header_done = 0;
+      }
+
+      if (cb->header_len + buffer->length > sizeof(cb->header))
+      {
+         vcos_log_error("Circular buffer header too large");
+      }
+      else
+      {
+         mmal_buffer_header_mem_lock(buffer);
+         memcpy(cb->header + cb->header_len, buffer->data + buffer->offset, buffer->length);
+         mmal_buffer_header_mem_unlock(buffer);
+         cb->header_len += buffer->length;
+      }
+
+      vcos_mutex_unlock(&cb->lock);
+      return;
+   }
+
+   cb->header_done = 1;
+
+   if (buffer->length > cb->max_bytes)
+   {
+      vcos_log_error("Encoder buffer larger than the circular buffer");
+      vcos_mutex_unlock(&cb->lock);
+      return;
+   }
+
+   while (cb->tail - cb->head == cb->num_entries || cb->bytes + buffer->length > cb->max_bytes)
+      evict_oldest(cb);
+
+   entry = &cb->entries[cb->tail % cb->num_entries];
+   entry->time = vcos_getmicrosecs64();
+   entry->length = buffer->length;
+   entry->frame_start = cb->frame_start;
+   entry->key = 0;
+
+   if (cb->refs)
+   {
+      mmal_buffer_header_acquire(buffer);
+      entry->buffer = buffer;
+   }
+   else
+   {
+      offset = cb->data_pos % cb->max_bytes;
+      first = cb->max_bytes - offset < buffer->length ? cb->max_bytes - offset : buffer->length;
+
+      mmal_buffer_header_mem_lock(buffer);
+      memcpy(cb->data + offset, buffer->data + buffer->offset, first);
+      memcpy(cb->data, buffer->data + buffer->offset + first, buffer->length - first);
+      mmal_buffer_header_mem_unlock(buffer);
+
+      entry->pos = cb->data_pos;
+      cb->data_pos += buffer->length;
+   }
+
+   if (entry->frame_start)
+      cb->frame_seq = cb->tail;
+
+   // The key frame flag need not be on the first buffer of the frame, so
+   // index the frame's first buffer once, when the flag is first seen
+   if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) &&
+       cb->key_seq != cb->frame_seq && cb->frame_seq >= cb->head)
+   {
+      cb->entries[cb->frame_seq % cb->num_entries].key = 1;
+      cb->keys[cb->key_tail++ % cb->num_entries] = cb->frame_seq;
+      cb->key_seq = cb->frame_seq;
+   }
+
+   cb->frame_start = !!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+   cb->bytes += buffer->length;
+   cb->tail++;
+   cb->stats.buffers++;
+
+   if (cb->clips)
+      vcos_semaphore_post(&cb->work);
+
+   vcos_mutex_unlock(&cb->lock);
+}
+
+/**
+ * Queue a clip to be saved
+ *
+ * The clip starts at the latest key frame at least preroll_ms before now,
+ * or the oldest one retained, and ends with the last frame to start within
+ * postroll_ms after now. It is written while recording continues.
+ *
+ * @param cb Circular buffer
+ * @param file File to write the clip to
+ * @param close_file Close the file once the clip is complete
+ * @param preroll_ms Time to save from before now, or -1 for all retained
+ * @param postroll_ms Time to save from after now
+ * @return 0 if queued, -1 otherwise
+ */
+int raspicircular_save(RASPICIRCULAR *cb, FILE *file, int close_file, int preroll_ms, int postroll_ms)
+{
+   RASPICIRCULAR_CLIP *clip, **last;
+   int64_t now = vcos_getmicrosecs64();
+   int64_t start_time = now - (int64_t)preroll_ms * 1000;
+   int64_t lo, hi, mid, found;
+
+   clip = calloc(1, sizeof(*clip));
+   if (!clip)
+      return -1;
+
+   clip->file = file;
+   clip->close_file = close_file;
+   clip->end_time = now + (int64_t)postroll_ms * 1000;
+
+   vcos_mutex_lock(&cb->lock);
+
+   if (cb->key_head == cb->key_tail)
+   {
+      // Nothing decodable is held yet, so start at the next key frame
+      clip->next = cb->tail;
+      clip->need_key = 1;
+   }
+   else
+   {
+      // Key frames are indexed in time order, find the last one at or
+      // before the start time
+      found = cb->key_head;
+      lo = cb->key_head;
+      hi = cb->key_tail - 1;
+      while (preroll_ms >= 0 && lo <= hi)
+      {
+         mid = lo + (hi - lo) / 2;
+         if (cb->entries[cb->keys[mid % cb->num_entries] % cb->num_entries].time <= start_time)
+         {
+            found = mid;
+            lo = mid + 1;
+         }
+         else
+         {
+            hi = mid - 1;
+         }
+      }
+      clip->next = cb->keys[found % cb->num_entries];
+   }
+
+   for (last = &cb->clips; *last; last = &(*last)->next_clip)
+      ;
+   *last = clip;
+
+   vcos_semaphore_post(&cb->work);
+   vcos_mutex_unlock(&cb->lock);
+
+   return 0;
+}
+
+/**
+ * Wait for all queued clips to be saved
+ *
+ * A clip with a post-roll completes only once enough has been added after
+ * the trigger, so recording must continue until this returns.
+ *
+ * @param cb Circular buffer
+ */
+void raspicircular_flush(RASPICIRCULAR *cb)
+{
+   vcos_mutex_lock(&cb->lock);
+   while (cb->clips)
+   {
+      cb->waiting = 1;
+      vcos_mutex_unlock(&cb->lock);
+      vcos_semaphore_wait(&cb->done);
+      vcos_mutex_lock(&cb->lock);
+   }
+   cb->waiting = 0;
+   vcos_mutex_unlock(&cb->lock);
+}
+
+/**
+ * Print the circular buffer counters to stderr
+ *
+ * @param cb Circular buffer
+ */
+void raspicircular_dump_stats(RASPICIRCULAR *cb)
+{
+   RASPICIRCULAR_STATS *stats = &cb->stats;
+
+   fprintf(stderr, "Circular buffer: %u buffers, %u dropped to make room, %s\n",
+           stats->buffers, stats->evicted, cb->refs ? "by reference" : "copied");
+   fprintf(stderr, "Circular buffer: %u clips saved, %lld bytes, %u incomplete\n",
+           stats->clips, (long long)stats->bytes_saved, stats->failed);
+}
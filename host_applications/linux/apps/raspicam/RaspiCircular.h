@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, James Hughes
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RASPICIRCULAR_H_
+#define RASPICIRCULAR_H_
+
+/// Most bytes of SPS/PPS header kept for the start of each clip
+#define RASPICIRCULAR_HEADER_MAX 128
+
+/** An encoder output buffer held in the circular buffer
+ */
+typedef struct
+{
+   int64_t pos;                         /// Stream offset of the data in the byte ring (copy mode)
+   int64_t time;                        /// Arrival time in microseconds
+   uint32_t length;                     /// Bytes of data
+   int frame_start;                     /// First buffer of a frame
+   int key;                             /// First buffer of a key frame
+   MMAL_BUFFER_HEADER_T *buffer;        /// Reference held on the encoder buffer (refs mode)
+} RASPICIRCULAR_ENTRY;
+
+/** A clip being saved from the circular buffer
+ */
+typedef struct RASPICIRCULAR_CLIP_S
+{
+   FILE *file;                          /// Where the clip is written
+   int close_file;                      /// Close file once the clip is complete
+   int64_t next;                        /// Sequence number of the next entry to write
+   int64_t end_time;                    /// Stop at the first frame that starts after this time
+   int need_key;                        /// Skip entries until a key frame
+   int started;                         /// The header has been written
+   int overrun;                         /// Data not yet written was overwritten
+   struct RASPICIRCULAR_CLIP_S *next_clip;
+} RASPICIRCULAR_CLIP;
+
+/** Counters kept by the circular buffer
+ */
+typedef struct
+{
+   unsigned int buffers;                /// Buffers added
+   unsigned int evicted;                /// Buffers dropped from the front to make room
+   unsigned int clips;                  /// Clips saved
+   unsigned int failed;                 /// Clips that could not be saved completely
+   int64_t bytes_saved;                 /// Bytes written to clips
+} RASPICIRCULAR_STATS;
+
+/** Pre-trigger recording buffer
+ *
+ * Entries and the key frame index are rings addressed by sequence number, so
+ * adding a buffer, and dropping the oldest ones to make room for it, is
+ * constant time whatever the length of the buffer. Clips are written by a
+ * thread of their own, so a trigger never blocks the encoder callback.
+ */
+typedef struct
+{
+   int refs;                            /// Hold encoder buffers rather than copy their data
+   int64_t max_bytes;                   /// Most bytes of video retained
+
+   uint8_t *data;                       /// Byte ring (copy mode)
+   int64_t data_pos;                    /// Stream offset of the next byte to add
+   int64_t bytes;                       /// Bytes retained
+
+   RASPICIRCULAR_ENTRY *entries;        /// Entry ring
+   int num_entries;                     /// Size of the entry and key frame rings
+   int64_t head;                        /// Sequence number of the oldest entry
+   int64_t tail;                        /// Sequence number of the next entry to add
+   int64_t *keys;                       /// Sequence numbers of key frame entries, oldest first
+   int64_t key_head;
+   int64_t key_tail;
+   int frame_start;                     /// The next buffer starts a frame
+   int64_t frame_seq;                   /// Sequence number of the current frame's first entry
+   int64_t key_seq;                     /// Sequence number of the last key frame indexed
+
+   uint8_t header[RASPICIRCULAR_HEADER_MAX]; /// Latest SPS/PPS header
+   int header_len;
+   int header_done;                     /// Video has followed the header
+
+   VCOS_MUTEX_T lock;                   /// Protects everything above and the clips
+   VCOS_SEMAPHORE_T work;               /// Posted when there may be more to write
+   VCOS_SEMAPHORE_T done;               /// Posted when a clip completes while someone waits
+   VCOS_THREAD_T thread;                /// Writes clips to file
+   RASPICIRCULAR_CLIP *clips;           /// Clips to save, in order
+   int waiting;                         /// raspicircular_flush is waiting
+   int stopping;                        /// Complete all clips with what is buffered, then exit
+   int running;                         /// Thread has been created
+
+   RASPICIRCULAR_STATS stats;
+} RASPICIRCULAR;
+
+MMAL_STATUS_T raspicircular_create(RASPICIRCULAR *cb, int64_t max_bytes, int max_buffers, int refs);
+void raspicircular_destroy(RASPICIRCULAR *cb);
+void raspicircular_add(RASPICIRCULAR *cb, MMAL_BUFFER_HEADER_T *buffer);
+int raspicircular_save(RASPICIRCULAR *cb, FILE *file, int close_file, int preroll_ms, int postroll_ms);
+void raspicircular_flush(RASPICIRCULAR *cb);
+void raspicircular_dump_stats(RASPICIRCULAR *cb);
+
+#endif /* RASPICIRCULAR_H_ */
@@ -45,7 +45,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * and independent of the image/video. Once started, the application receives
  * commands with a unix-pipe and showes its status on stdout and writes it into
  * a status-file. The program terminates itself after receiving a SIGINT or
- * SIGTERM.
+ * SIGTERM. If http_port is configured, the preview is also served directly
+ * to any number of browsers as multipart/x-mixed-replace MJPEG over HTTP.
  *
  * Usage information in README_RaspiMJPEG.md
  */
@@ -60,6 +61,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <signal.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
@@ -87,6 +97,36 @@ int time_between_pic;
 time_t currTime;
 struct tm *localTime;
 
+#define HTTP_MAX_CLIENTS 16
+#define HTTP_BOUNDARY "raspimjpegframe"
+#define EPOLL_EVENTS 16
+
+typedef struct mjpeg_frame {
+  int refs;
+  unsigned int length, size;
+  unsigned char *data;
+  int header_length;
+  char header[128];
+} mjpeg_frame;
+
+typedef struct http_client {
+  int fd;
+  unsigned char streaming, want_write;
+  mjpeg_frame *frame;
+  unsigned int sent, seq;
+} http_client;
+
+int epoll_fd = -1, wake_fd = -1, timer_fd = -1, pipe_fd = -1, http_fd = -1;
+unsigned int http_port = 0;
+http_client http_clients[HTTP_MAX_CLIENTS];
+char cmd_buf[256];
+int cmd_len = 0;
+
+// frame_latest, frame_seq and all frame refcounts are protected by frame_lock
+pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+mjpeg_frame *frame_latest = NULL, *frame_build = NULL;
+unsigned int frame_seq = 0, frame_size_hint = 0;
+
 void cam_set_annotation();
   
 void error (const char *string) {
@@ -105,7 +145,81 @@ void error (const char *string) {
 
 void term (int signum) {
 
+  uint64_t one = 1;
+
   running = 0;
+  if(wake_fd >= 0) write(wake_fd, &one, sizeof(one));
+
+}
+
+void frame_unref (mjpeg_frame *frame) {
+
+  int refs;
+
+  pthread_mutex_lock(&frame_lock);
+  refs = --frame->refs;
+  pthread_mutex_unlock(&frame_lock);
+  if(refs == 0) {
+    free(frame->data);
+    free(frame);
+  }
+
+}
+
+mjpeg_frame *frame_get_latest (unsigned int *seq) {
+
+  mjpeg_frame *frame;
+
+  pthread_mutex_lock(&frame_lock);
+  frame = frame_latest;
+  if(frame) frame->refs++;
+  *seq = frame_seq;
+  pthread_mutex_unlock(&frame_lock);
+  return frame;
+
+}
+
+void http_append_frame (const unsigned char *data, unsigned int length) {
+
+  unsigned int size;
+
+  if(!frame_build) {
+    frame_build = calloc(1, sizeof(mjpeg_frame));
+    if(!frame_build) error("Could not allocate mjpeg frame");
+  }
+  if(frame_build->length + length > frame_build->size) {
+    // Start from the size of the last frame so a frame is rarely grown twice
+    size = frame_build->size ? frame_build->size * 2 : frame_size_hint + frame_size_hint / 4;
+    if(size < frame_build->length + length) size = frame_build->length + length;
+    frame_build->data = realloc(frame_build->data, size);
+    if(!frame_build->data) error("Could not allocate mjpeg frame");
+    frame_build->size = size;
+  }
+  memcpy(frame_build->data + frame_build->length, data, length);
+  frame_build->length += length;
+
+}
+
+void http_publish_frame (void) {
+
+  mjpeg_frame *frame = frame_build, *old;
+  uint64_t one = 1;
+
+  if(!frame) return;
+  frame_build = NULL;
+  frame_size_hint = frame->length;
+  frame->refs = 1;
+  frame->header_length = snprintf(frame->header, sizeof(frame->header), "--" HTTP_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", frame->length);
+
+  pthread_mutex_lock(&frame_lock);
+  old = frame_latest;
+  frame_latest = frame;
+  frame_seq++;
+  pthread_mutex_unlock(&frame_lock);
+  if(old) frame_unref(old);
+
+  // wake the main loop to send the frame
+  write(wake_fd, &one, sizeof(one));
 
 }
 
@@ -122,32 +236,42 @@ static void jpegencoder_buffer_callback (MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T
   char *filename_temp, *filename_temp2;
 
   if(mjpeg_cnt == 0) {
-    if(!jpegoutput_file) {
-      asprintf(&filename_temp, jpeg_filename, image_cnt);
-      asprintf(&filename_temp2, "%s.part", filename_temp);
-      jpegoutput_file = fopen(filename_temp2, "wb");
-      free(filename_temp);
-      free(filename_temp2);
-      if(!jpegoutput_file) error("Could not open mjpeg-destination");
+    if(jpeg_filename != 0) {
+      if(!jpegoutput_file) {
+        asprintf(&filename_temp, jpeg_filename, image_cnt);
+        asprintf(&filename_temp2, "%s.part", filename_temp);
+        jpegoutput_file = fopen(filename_temp2, "wb");
+        free(filename_temp);
+        free(filename_temp2);
+        if(!jpegoutput_file) error("Could not open mjpeg-destination");
+      }
+      if(buffer->length) {
+        mmal_buffer_header_mem_lock(buffer);
+        bytes_written = fwrite(buffer->data, 1, buffer->length, jpegoutput_file);
+        mmal_buffer_header_mem_unlock(buffer);
+      }
+      if(bytes_written != buffer->length) error("Could not write all bytes");
     }
-    if(buffer->length) {
+    if(http_fd >= 0 && buffer->length) {
       mmal_buffer_header_mem_lock(buffer);
-      bytes_written = fwrite(buffer->data, 1, buffer->length, jpegoutput_file);
+      http_append_frame(buffer->data, buffer->length);
       mmal_buffer_header_mem_unlock(buffer);
     }
-    if(bytes_written != buffer->length) error("Could not write all bytes");
   }
   
   if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+    if(mjpeg_cnt == 0 && http_fd >= 0) http_publish_frame();
     mjpeg_cnt++;
     if(mjpeg_cnt == divider) {
-      fclose(jpegoutput_file);
-      jpegoutput_file = NULL;
-      asprintf(&filename_temp, jpeg_filename, image_cnt);
-      asprintf(&filename_temp2, "%s.part", filename_temp);
-      rename(filename_temp2, filename_temp);
-      free(filename_temp);
-      free(filename_temp2);
+      if(jpeg_filename != 0) {
+        fclose(jpegoutput_file);
+        jpegoutput_file = NULL;
+        asprintf(&filename_temp, jpeg_filename, image_cnt);
+        asprintf(&filename_temp2, "%s.part", filename_temp);
+        rename(filename_temp2, filename_temp);
+        free(filename_temp);
+        free(filename_temp2);
+      }
       image_cnt++;
       mjpeg_cnt = 0;
       cam_set_annotation();
@@ -160,7 +284,7 @@ static void jpegencoder_buffer_callback (MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T
     MMAL_STATUS_T status = MMAL_SUCCESS;
     MMAL_BUFFER_HEADER_T *new_buffer;
 
-    new_buffer = mmal_queue_get(pool_jpegencoder->queue);
+    new_buffer = mmal_pool_get(pool_jpegencoder);
 
     if (new_buffer) status = mmal_port_send_buffer(port, new_buffer);
     if (!new_buffer || status != MMAL_SUCCESS) error("Could not send buffers to port");
@@ -198,7 +322,7 @@ static void jpegencoder2_buffer_callback (MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
     MMAL_STATUS_T status = MMAL_SUCCESS;
     MMAL_BUFFER_HEADER_T *new_buffer;
 
-    new_buffer = mmal_queue_get(pool_jpegencoder2->queue);
+    new_buffer = mmal_pool_get(pool_jpegencoder2);
 
     if (new_buffer) status = mmal_port_send_buffer(port, new_buffer);
     if (!new_buffer || status != MMAL_SUCCESS) error("Could not send buffers to port");
@@ -223,7 +347,7 @@ static void h264encoder_buffer_callback (MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T
     MMAL_STATUS_T status = MMAL_SUCCESS;
     MMAL_BUFFER_HEADER_T *new_buffer;
 
-    new_buffer = mmal_queue_get(pool_h264encoder->queue);
+    new_buffer = mmal_pool_get(pool_h264encoder);
 
     if (new_buffer) status = mmal_port_send_buffer(port, new_buffer);
     if (!new_buffer || status != MMAL_SUCCESS) error("Could not send buffers to port");
@@ -641,7 +765,7 @@ void start_all (void) {
   if(status != MMAL_SUCCESS) error("Could not enable jpeg port");
   max = mmal_queue_length(pool_jpegencoder->queue);
   for(i=0;i<max;i++) {
-    MMAL_BUFFER_HEADER_T *jpegbuffer = mmal_queue_get(pool_jpegencoder->queue);
+    MMAL_BUFFER_HEADER_T *jpegbuffer = mmal_pool_get(pool_jpegencoder);
 
     if(!jpegbuffer) error("Could not create jpeg buffer header");
     status = mmal_port_send_buffer(jpegencoder->output[0], jpegbuffer);
@@ -657,7 +781,7 @@ void start_all (void) {
   if(status != MMAL_SUCCESS) error("Could not enable jpeg port 2");
   max = mmal_queue_length(pool_jpegencoder2->queue);
   for(i=0;i<max;i++) {
-    MMAL_BUFFER_HEADER_T *jpegbuffer2 = mmal_queue_get(pool_jpegencoder2->queue);
+    MMAL_BUFFER_HEADER_T *jpegbuffer2 = mmal_pool_get(pool_jpegencoder2);
 
     if(!jpegbuffer2) error("Could not create jpeg buffer header 2");
     status = mmal_port_send_buffer(jpegencoder2->output[0], jpegbuffer2);
@@ -729,10 +853,233 @@ void capt_img (void) {
 
 }
 
+void epoll_set (int op, int fd, uint32_t events) {
+
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+  if(epoll_ctl(epoll_fd, op, fd, &event) != 0) error("Could not update epoll");
+
+}
+
+void http_init (void) {
+
+  struct sockaddr_in addr;
+  int i, on = 1;
+
+  for(i=0; i<HTTP_MAX_CLIENTS; i++) http_clients[i].fd = -1;
+
+  http_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(http_fd < 0) error("Could not create http socket");
+  setsockopt(http_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(http_port);
+  if(bind(http_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) error("Could not bind http port");
+  if(listen(http_fd, HTTP_MAX_CLIENTS) != 0) error("Could not listen on http port");
+  fcntl(http_fd, F_SETFL, O_NONBLOCK);
+
+}
+
+void http_client_close (http_client *client) {
+
+  close(client->fd);
+  if(client->frame) frame_unref(client->frame);
+  memset(client, 0, sizeof(http_client));
+  client->fd = -1;
+
+}
+
+void http_client_write (http_client *client) {
+
+  struct iovec iov[2];
+  struct msghdr msg;
+  mjpeg_frame *frame;
+  unsigned int seq;
+  int iovcnt;
+  ssize_t n;
+
+  while(1) {
+    if(!client->frame) {
+      // Always move on to the newest frame, frames published while the
+      // client was still sending are dropped for this client only
+      frame = frame_get_latest(&seq);
+      if(!frame || seq == client->seq) {
+        if(frame) frame_unref(frame);
+        break;
+      }
+      client->frame = frame;
+      client->seq = seq;
+      client->sent = 0;
+    }
+    frame = client->frame;
+
+    iovcnt = 0;
+    if(client->sent < frame->header_length) {
+      iov[iovcnt].iov_base = frame->header + client->sent;
+      iov[iovcnt].iov_len = frame->header_length - client->sent;
+      iovcnt++;
+      iov[iovcnt].iov_base = frame->data;
+      iov[iovcnt].iov_len = frame->length;
+      iovcnt++;
+    }
+    else {
+      iov[iovcnt].iov_base = frame->data + (client->sent - frame->header_length);
+      iov[iovcnt].iov_len = frame->length - (client->sent - frame->header_length);
+      iovcnt++;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    n = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+      http_client_close(client);
+      return;
+    }
+    client->sent += n;
+    if(client->sent == frame->header_length + frame->length) {
+      frame_unref(frame);
+      client->frame = NULL;
+    }
+  }
+
+  // Only poll for space while part of a frame is still to be sent
+  if(client->want_write != (client->frame != NULL)) {
+    client->want_write = (client->frame != NULL);
+    epoll_set(EPOLL_CTL_MOD, client->fd, EPOLLIN | (client->want_write ? EPOLLOUT : 0));
+  }
+
+}
+
+void http_accept (void) {
+
+  int fd, i;
+
+  while((fd = accept(http_fd, NULL, NULL)) >= 0) {
+    for(i=0; i<HTTP_MAX_CLIENTS && http_clients[i].fd >= 0; i++);
+    if(i == HTTP_MAX_CLIENTS) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    memset(&http_clients[i], 0, sizeof(http_client));
+    // seq 0 is never published, so the latest frame is sent first
+    http_clients[i].fd = fd;
+    epoll_set(EPOLL_CTL_ADD, fd, EPOLLIN);
+  }
+
+}
+
+void http_client_event (int fd, uint32_t events) {
+
+  static const char response[] = "HTTP/1.0 200 OK\r\nConnection: close\r\nCache-Control: no-cache\r\nPragma: no-cache\r\nContent-Type: multipart/x-mixed-replace;boundary=" HTTP_BOUNDARY "\r\n\r\n";
+  http_client *client = NULL;
+  char request[512];
+  ssize_t n;
+  int i;
+
+  for(i=0; i<HTTP_MAX_CLIENTS; i++) {
+    if(http_clients[i].fd == fd) client = &http_clients[i];
+  }
+  if(!client) return;
+
+  if(events & (EPOLLERR | EPOLLHUP)) {
+    http_client_close(client);
+    return;
+  }
+  if(events & EPOLLIN) {
+    // Any request gets the stream, the request itself is discarded
+    n = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+      http_client_close(client);
+      return;
+    }
+    if(!client->streaming) {
+      if(send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(response) - 1) {
+        http_client_close(client);
+        return;
+      }
+      client->streaming = 1;
+    }
+  }
+  if(client->streaming) http_client_write(client);
+
+}
+
+void http_send_frames (void) {
+
+  int i;
+
+  for(i=0; i<HTTP_MAX_CLIENTS; i++) {
+    if(http_clients[i].fd >= 0 && http_clients[i].streaming && !http_clients[i].frame) http_client_write(&http_clients[i]);
+  }
+
+}
+
+int read_command (char *cmd, int size) {
+
+  char *end;
+  int n, length;
+
+  // Commands end at a newline. A command that was written without one
+  // ends when there is nothing more to read from the pipe.
+  while(1) {
+    end = memchr(cmd_buf, '\n', cmd_len);
+    if(end) {
+      length = end - cmd_buf + 1;
+      break;
+    }
+    if(cmd_len == sizeof(cmd_buf)) {
+      length = cmd_len;
+      break;
+    }
+    n = read(pipe_fd, cmd_buf + cmd_len, sizeof(cmd_buf) - cmd_len);
+    if(n > 0) {
+      cmd_len += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    length = cmd_len;
+    break;
+  }
+
+  n = length < size ? length : size;
+  memcpy(cmd, cmd_buf, n);
+  memmove(cmd_buf, cmd_buf + length, cmd_len - length);
+  cmd_len -= length;
+  return n;
+
+}
+
+void update_timelapse_timer (void) {
+
+  static unsigned char armed = 0;
+  struct itimerspec spec;
+
+  if(armed == timelapse) return;
+  memset(&spec, 0, sizeof(spec));
+  if(timelapse) {
+    // time_between_pic is in 1/10 seconds
+    spec.it_interval.tv_nsec = 100000000;
+    spec.it_value.tv_nsec = 100000000;
+  }
+  if(timerfd_settime(timer_fd, 0, &spec, NULL) != 0) error("Could not set timelapse timer");
+  armed = timelapse;
+
+}
+
 int main (int argc, char* argv[]) {
 
-  int i, max, fd, length;
-  char readbuf[60];
+  int i, max, fd, length, nfds, pipe_ready;
+  char readbuf[61];
+  uint64_t count;
+  struct epoll_event events[EPOLL_EVENTS];
   char *filename_temp, *filename_recording, *cmd_temp, *line = NULL;
   FILE *fp;
 
@@ -795,6 +1142,9 @@ int main (int argc, char* argv[]) {
       else if(strncmp(line, "control_file ", 13) == 0) {
         asprintf(&pipe_filename, "%s", line+13);
       }
+      else if(strncmp(line, "http_port ", 10) == 0) {
+        http_port = atoi(line+10);
+      }
       else if(strncmp(line, "annotation ", 11) == 0) {
         asprintf(&cam_setting_annotation, "%s", line+11);
       }
@@ -922,6 +1272,26 @@ int main (int argc, char* argv[]) {
   //
   // init
   //
+  epoll_fd = epoll_create1(0);
+  if(epoll_fd < 0) error("Could not create epoll");
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  if(wake_fd < 0) error("Could not create eventfd");
+  epoll_set(EPOLL_CTL_ADD, wake_fd, EPOLLIN);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if(timer_fd < 0) error("Could not create timer");
+  epoll_set(EPOLL_CTL_ADD, timer_fd, EPOLLIN);
+  if(pipe_filename != 0) {
+    // Opening for writing as well keeps the pipe from reporting a hangup
+    // each time a writer closes it
+    pipe_fd = open(pipe_filename, O_RDWR | O_NONBLOCK);
+    if(pipe_fd < 0) error("Could not open PIPE");
+    epoll_set(EPOLL_CTL_ADD, pipe_fd, EPOLLIN);
+  }
+  if(http_port) {
+    http_init();
+    epoll_set(EPOLL_CTL_ADD, http_fd, EPOLLIN);
+  }
+
   if(autostart) start_all();
   if(motion_detection) {
     if(system("motion") == -1) error("Could not start Motion");
@@ -959,13 +1329,36 @@ int main (int argc, char* argv[]) {
   }
   
   while(running) {
-    if(pipe_filename != 0) {
+    nfds = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+    if(nfds < 0) {
+      if(errno == EINTR) continue;
+      error("Could not wait for events");
+    }
 
-      fd = open(pipe_filename, O_RDONLY | O_NONBLOCK);
-      if(fd < 0) error("Could not open PIPE");
-      fcntl(fd, F_SETFL, 0);
-      length = read(fd, readbuf, 60);
-      close(fd);
+    pipe_ready = 0;
+    for(i=0; i<nfds; i++) {
+      fd = events[i].data.fd;
+      if(fd == wake_fd) {
+        read(wake_fd, &count, sizeof(count));
+        http_send_frames();
+      }
+      else if(fd == timer_fd) {
+        if(read(timer_fd, &count, sizeof(count)) == sizeof(count) && timelapse) {
+          tl_cnt += count;
+          if(tl_cnt >= time_between_pic) {
+            if(capturing == 0) {
+              capt_img();
+              tl_cnt = 0;
+            }
+          }
+        }
+      }
+      else if(fd == pipe_fd) pipe_ready = 1;
+      else if(fd == http_fd) http_accept();
+      else http_client_event(fd, events[i].events);
+    }
+
+    while(pipe_ready && (length = read_command(readbuf, sizeof(readbuf) - 1)) > 0) {
 
       if(length) {
         if((readbuf[0]=='c') && (readbuf[1]=='a')) {
@@ -995,7 +1388,7 @@ int main (int argc, char* argv[]) {
               if(status != MMAL_SUCCESS) error("Could not enable video port");
               max = mmal_queue_length(pool_h264encoder->queue);
               for(i=0;i<max;i++) {
-                MMAL_BUFFER_HEADER_T *h264buffer = mmal_queue_get(pool_h264encoder->queue);
+                MMAL_BUFFER_HEADER_T *h264buffer = mmal_pool_get(pool_h264encoder);
                 if(!h264buffer) error("Could not create video pool header");
                 status = mmal_port_send_buffer(h264encoder->output[0], h264buffer);
                 if(status != MMAL_SUCCESS) error("Could not send buffers to video port");
@@ -1320,16 +1713,7 @@ int main (int argc, char* argv[]) {
       }
 
     }
-    if(timelapse) {
-      tl_cnt++;
-      if(tl_cnt >= time_between_pic) {
-        if(capturing == 0) {
-          capt_img();
-          tl_cnt = 0;
-        }
-      }
-    }
-    usleep(100000);
+    update_timelapse_timer();
   }
   
   printf("SIGINT/SIGTERM received, stopping\n");
@@ -1338,6 +1722,11 @@ int main (int argc, char* argv[]) {
   // tidy up
   //
   if(!idle) stop_all();
+  if(http_fd >= 0) {
+    for(i=0; i<HTTP_MAX_CLIENTS; i++) {
+      if(http_clients[i].fd >= 0) http_client_close(&http_clients[i]);
+    }
+  }
 
   return 0;
 
@@ -0,0 +1,568 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, James Hughes
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file RaspiMotion.c
+ * Motion detection from the inline motion vectors of the H264 encoder.
+ *
+ * Each frame's vector field is thresholded on vector length and SAD into a
+ * mask of moving macroblocks, then the mask is split into connected regions.
+ * Motion is reported once a large enough region has been seen for a number
+ * of frames, and its end once none has been seen for a number more.
+ *
+ * Nothing here depends on MMAL, so the same code runs in the encoder callback
+ * of RaspiVid and over recorded .imv files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "RaspiMotion.h"
+
+/// Vectors are at most this long, so a longer threshold never matches
+#define MAGNITUDE_MAX 182
+
+/**
+ * Set the detection parameters to their defaults
+ *
+ * @param params Parameters to fill in
+ */
+void raspimotion_set_defaults(RASPIMOTION_PARAMETERS *params)
+{
+   params->magnitude = 8;
+   params->sad = 0;
+   params->min_blocks = 10;
+   params->trigger_frames = 2;
+   params->hold_frames = 30;
+}
+
+/**
+ * Prepare a motion detector
+ *
+ * @param motion Detector to initialise
+ * @param mbx Macroblocks across the frame
+ * @param mby Macroblocks down the frame
+ * @param params Detection parameters, copied
+ * @return 0 if all OK, -1 if out of memory
+ */
+int raspimotion_init(RASPIMOTION *motion, int mbx, int mby, const RASPIMOTION_PARAMETERS *params)
+{
+   size_t blocks = (size_t)mbx * mby;
+
+   memset(motion, 0, sizeof(*motion));
+   motion->params = *params;
+   motion->mbx = mbx;
+   motion->mby = mby;
+   motion->frame_size = (size_t)(mbx + 1) * mby * sizeof(RASPIMOTION_VECTOR);
+
+   if (motion->params.magnitude < 0)
+      motion->params.magnitude = 0;
+   if (motion->params.magnitude > MAGNITUDE_MAX)
+      motion->params.magnitude = MAGNITUDE_MAX;
+   if (motion->params.trigger_frames < 1)
+      motion->params.trigger_frames = 1;
+   if (motion->params.hold_frames < 1)
+      motion->params.hold_frames = 1;
+
+   // A checkerboard mask has the most provisional regions, about half the blocks
+   motion->mask = malloc(blocks);
+   motion->labels = malloc(blocks * sizeof(int));
+   motion->parent = malloc(blocks * sizeof(int));
+   motion->region = malloc(blocks * 5 * sizeof(int));
+
+   if (!motion->mask || !motion->labels || !motion->parent || !motion->region)
+   {
+      raspimotion_destroy(motion);
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Free a motion detector
+ *
+ * @param motion Detector
+ */
+void raspimotion_destroy(RASPIMOTION *motion)
+{
+   free(motion->mask);
+   free(motion->labels);
+   free(motion->parent);
+   free(motion->region);
+   free(motion->partial);
+   memset(motion, 0, sizeof(*motion));
+}
+
+/**
+ * Mark the moving macroblocks of one row of vectors
+ *
+ * Uses NEON or SSE2 when the compiler targets them.
+ *
+ * @param vectors Row of vectors
+ * @param count Macroblocks in the row
+ * @param mag2 Square of the magnitude threshold
+ * @param sad SAD threshold, INT_MAX to ignore SAD
+ * @param out 1 for each moving macroblock, 0 otherwise
+ */
+static void threshold_row(const RASPIMOTION_VECTOR *vectors, int count, int mag2, int sad, uint8_t *out)
+{
+   int i = 0;
+
+#if defined(__ARM_NEON__)
+   /* 16 vectors at a time, de-interleaved into x, y and the two SAD bytes.
+    * x*x + y*y is at most 32768, which fits in 16 bits unsigned. */
+   const uint16x8_t mag2_min = vdupq_n_u16(mag2);
+   const int16x8_t sad_min = vdupq_n_s16(sad > SHRT_MAX ? SHRT_MAX : sad);
+   const uint8x16_t one = vdupq_n_u8(1);
+
+   for (; i + 16 <= count; i += 16)
+   {
+      int8x16x4_t v = vld4q_s8((const int8_t *) &vectors[i]);
+      int16x8_t lo = vmlal_s8(vmull_s8(vget_low_s8(v.val[0]), vget_low_s8(v.val[0])),
+                              vget_low_s8(v.val[1]), vget_low_s8(v.val[1]));
+      int16x8_t hi = vmlal_s8(vmull_s8(vget_high_s8(v.val[0]), vget_high_s8(v.val[0])),
+                              vget_high_s8(v.val[1]), vget_high_s8(v.val[1]));
+      uint16x8_t active_lo = vcgeq_u16(vreinterpretq_u16_s16(lo), mag2_min);
+      uint16x8_t active_hi = vcgeq_u16(vreinterpretq_u16_s16(hi), mag2_min);
+
+      if (sad != INT_MAX)
+      {
+         uint8x16_t sad_l = vreinterpretq_u8_s8(v.val[2]);
+         uint8x16_t sad_h = vreinterpretq_u8_s8(v.val[3]);
+         int16x8_t sad_lo = vreinterpretq_s16_u16(vorrq_u16(vmovl_u8(vget_low_u8(sad_l)), vshll_n_u8(vget_low_u8(sad_h), 8)));
+         int16x8_t sad_hi = vreinterpretq_s16_u16(vorrq_u16(vmovl_u8(vget_high_u8(sad_l)), vshll_n_u8(vget_high_u8(sad_h), 8)));
+         active_lo = vorrq_u16(active_lo, vcgeq_s16(sad_lo, sad_min));
+         active_hi = vorrq_u16(active_hi, vcgeq_s16(sad_hi, sad_min));
+      }
+
+      vst1q_u8(&out[i], vandq_u8(vcombine_u8(vmovn_u16(active_lo), vmovn_u16(active_hi)), one));
+   }
+#elif defined(__SSE2__)
+   /* 4 vectors to a register. Sign extend x and y into the two 16-bit halves
+    * of each lane so one multiply-add gives x*x + y*y, and shift down the SAD. */
+   const __m128i mag2_min = _mm_set1_epi32(mag2 - 1);
+   const __m128i sad_min = _mm_set1_epi32(sad == INT_MAX ? INT_MAX : sad - 1);
+   const __m128i low_half = _mm_set1_epi32(0x0000FFFF);
+   const __m128i one = _mm_set1_epi8(1);
+
+   for (; i + 16 <= count; i += 16)
+   {
+      __m128i active[4];
+      int k;
+
+      for (k = 0; k < 4; k++)
+      {
+         __m128i v = _mm_loadu_si128((const __m128i *) &vectors[i + k * 4]);
+         __m128i x = _mm_srai_epi16(_mm_slli_epi16(v, 8), 8);
+         __m128i y = _mm_srai_epi16(v, 8);
+         __m128i xy = _mm_or_si128(_mm_and_si128(x, low_half), _mm_slli_epi32(y, 16));
+         __m128i len2 = _mm_madd_epi16(xy, xy);
+
+         active[k] = _mm_or_si128(_mm_cmpgt_epi32(len2, mag2_min),
+                                  _mm_cmpgt_epi32(_mm_srai_epi32(v, 16), sad_min));
+      }
+
+      active[0] = _mm_packs_epi16(_mm_packs_epi32(active[0], active[1]),
+                                  _mm_packs_epi32(active[2], active[3]));
+      _mm_storeu_si128((__m128i *) &out[i], _mm_and_si128(active[0], one));
+   }
+#endif
+
+   for (; i < count; i++)
+   {
+      int x = vectors[i].x_vector, y = vectors[i].y_vector;
+      out[i] = x * x + y * y >= mag2 || vectors[i].sad >= sad;
+   }
+}
+
+/**
+ * Find the root of a provisional region
+ */
+static int find_root(int *parent, int label)
+{
+   while (parent[label] != label)
+   {
+      parent[label] = parent[parent[label]];
+      label = parent[label];
+   }
+   return label;
+}
+
+/**
+ * Split the mask into 4-connected regions and describe the largest
+ *
+ * One pass labels each macroblock from its left and upper neighbours and
+ * merges regions that meet, a second totals each region.
+ *
+ * @param motion Detector holding the mask
+ * @param result Filled in with the active blocks and regions
+ */
+static void find_regions(RASPIMOTION *motion, RASPIMOTION_RESULT *result)
+{
+   const uint8_t *mask = motion->mask;
+   int *labels = motion->labels;
+   int *parent = motion->parent;
+   int *region = motion->region;
+   int mbx = motion->mbx, mby = motion->mby;
+   int i, j, next = 0, largest = -1;
+
+   for (j = 0; j < mby; j++)
+   {
+      for (i = 0; i < mbx; i++)
+      {
+         int index = j * mbx + i;
+         int left, up;
+
+         if (!mask[index])
+         {
+            labels[index] = -1;
+            continue;
+         }
+
+         result->active++;
+         left = i ? labels[index - 1] : -1;
+         up = j ? labels[index - mbx] : -1;
+
+         if (left < 0 && up < 0)
+         {
+            parent[next] = next;
+            labels[index] = next++;
+         }
+         else if (up < 0)
+            labels[index] = left;
+         else if (left < 0)
+            labels[index] = up;
+         else
+         {
+            int a = find_root(parent, left), b = find_root(parent, up);
+
+            // Keep the lower label as the root, so roots come before their children
+            if (a < b)
+               parent[b] = a;
+            else
+               parent[a] = b;
+            labels[index] = a < b ? a : b;
+         }
+      }
+   }
+
+   if (!next)
+      return;
+
+   for (i = 0; i < next; i++)
+   {
+      parent[i] = parent[parent[i]];
+      if (parent[i] == i)
+      {
+         int *r = &region[i * 5];
+         r[0] = 0;
+         r[1] = INT_MAX;
+         r[2] = INT_MAX;
+         r[3] = -1;
+         r[4] = -1;
+      }
+   }
+
+   for (j = 0; j < mby; j++)
+   {
+      for (i = 0; i < mbx; i++)
+      {
+         int label = labels[j * mbx + i];
+         int *r;
+
+         if (label < 0)
+            continue;
+
+         r = &region[parent[label] * 5];
+         r[0]++;
+         if (i < r[1]) r[1] = i;
+         if (j < r[2]) r[2] = j;
+         if (i > r[3]) r[3] = i;
+         if (j > r[4]) r[4] = j;
+      }
+   }
+
+   for (i = 0; i < next; i++)
+   {
+      if (parent[i] != i || region[i * 5] < motion->params.min_blocks)
+         continue;
+
+      result->regions++;
+      if (largest < 0 || region[i * 5] > region[largest * 5])
+         largest = i;
+   }
+
+   if (largest >= 0)
+   {
+      int *r = &region[largest * 5];
+      result->largest = r[0];
+      result->left = r[1];
+      result->top = r[2];
+      result->right = r[3];
+      result->bottom = r[4];
+   }
+}
+
+/**
+ * Analyse one frame of vectors
+ *
+ * @param motion Detector
+ * @param vectors Vector field of frame_size bytes
+ * @param result Filled in with the analysis of the frame and detector state
+ */
+void raspimotion_analyse(RASPIMOTION *motion, const RASPIMOTION_VECTOR *vectors, RASPIMOTION_RESULT *result)
+{
+   int mag2 = motion->params.magnitude * motion->params.magnitude;
+   int sad = motion->params.sad > 0 ? motion->params.sad : INT_MAX;
+   int detected, j;
+
+   memset(result, 0, sizeof(*result));
+
+   for (j = 0; j < motion->mby; j++)
+      threshold_row(&vectors[j * (motion->mbx + 1)], motion->mbx, mag2, sad, &motion->mask[j * motion->mbx]);
+
+   find_regions(motion, result);
+
+   detected = result->regions > 0;
+   if (detected != motion->motion)
+   {
+      if (++motion->run >= (detected ? motion->params.trigger_frames : motion->params.hold_frames))
+      {
+         motion->motion = detected;
+         motion->run = 0;
+         result->changed = 1;
+         if (detected)
+            motion->events++;
+      }
+   }
+   else
+      motion->run = 0;
+
+   result->motion = motion->motion;
+   motion->frames++;
+}
+
+/**
+ * Add vector data as it comes from the encoder
+ *
+ * A buffer holding a whole frame is analysed where it is, anything else is
+ * gathered until a frame is complete.
+ *
+ * @param motion Detector
+ * @param data Vector data
+ * @param length Bytes of data
+ * @param result Filled in when a frame is analysed
+ * @return 1 if a frame was analysed, 0 if more data is needed, -1 if the data
+ *         does not match the frame size
+ */
+int raspimotion_add_data(RASPIMOTION *motion, const uint8_t *data, size_t length, RASPIMOTION_RESULT *result)
+{
+   if (!motion->partial_len && length == motion->frame_size)
+   {
+      raspimotion_analyse(motion, (const RASPIMOTION_VECTOR *) data, result);
+      return 1;
+   }
+
+   if (motion->partial_len + length > motion->frame_size)
+   {
+      motion->partial_len = 0;
+      return -1;
+   }
+
+   if (!motion->partial)
+   {
+      motion->partial = malloc(motion->frame_size);
+      if (!motion->partial)
+         return -1;
+   }
+
+   memcpy(motion->partial + motion->partial_len, data, length);
+   motion->partial_len += length;
+
+   if (motion->partial_len < motion->frame_size)
+      return 0;
+
+   motion->partial_len = 0;
+   raspimotion_analyse(motion, (const RASPIMOTION_VECTOR *) motion->partial, result);
+   return 1;
+}
+
+/**
+ * Integer square root, rounded down
+ */
+static int isqrt(int n)
+{
+   int root = 0, bit = 1 << 14;
+
+   while (bit > n)
+      bit >>= 2;
+
+   while (bit)
+   {
+      if (n >= root + bit)
+      {
+         n -= root + bit;
+         root = (root >> 1) + bit;
+      }
+      else
+         root >>= 1;
+      bit >>= 2;
+   }
+
+   return root;
+}
+
+/**
+ * Compute the length of each vector, rounded down
+ *
+ * Uses SSE2 when the compiler targets it. ARMv7 NEON has no vector square
+ * root, so there the lengths are computed one at a time.
+ *
+ * @param vectors Vector field
+ * @param mbx Macroblocks across the frame
+ * @param mby Macroblocks down the frame
+ * @param out mbx * mby lengths, a row at a time without the extra column
+ */
+void raspimotion_magnitudes(const RASPIMOTION_VECTOR *vectors, int mbx, int mby, uint8_t *out)
+{
+   int i, j;
+
+   for (j = 0; j < mby; j++, vectors += mbx + 1, out += mbx)
+   {
+      i = 0;
+
+#if defined(__SSE2__) && !defined(__ARM_NEON__)
+      {
+         const __m128i low_half = _mm_set1_epi32(0x0000FFFF);
+
+         for (; i + 16 <= mbx; i += 16)
+         {
+            __m128i len[4];
+            int k;
+
+            for (k = 0; k < 4; k++)
+            {
+               __m128i v = _mm_loadu_si128((const __m128i *) &vectors[i + k * 4]);
+               __m128i x = _mm_srai_epi16(_mm_slli_epi16(v, 8), 8);
+               __m128i y = _mm_srai_epi16(v, 8);
+               __m128i xy = _mm_or_si128(_mm_and_si128(x, low_half), _mm_slli_epi32(y, 16));
+
+               // Square roots of integers this small are exact in single precision
+               len[k] = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(xy, xy))));
+            }
+
+            len[0] = _mm_packus_epi16(_mm_packs_epi32(len[0], len[1]),
+                                      _mm_packs_epi32(len[2], len[3]));
+            _mm_storeu_si128((__m128i *) &out[i], len[0]);
+         }
+      }
+#endif
+
+      for (; i < mbx; i++)
+      {
+         int x = vectors[i].x_vector, y = vectors[i].y_vector;
+         out[i] = isqrt(x * x + y * y);
+      }
+   }
+}
+
+/**
+ * Open a recorded .imv file for reading a frame at a time
+ *
+ * @param reader Reader to initialise
+ * @param filename File to read, "-" for stdin
+ * @param mbx Macroblocks across the frame
+ * @param mby Macroblocks down the frame
+ * @return 0 if all OK, -1 otherwise
+ */
+int raspimotion_reader_open(RASPIMOTION_READER *reader, const char *filename, int mbx, int mby)
+{
+   memset(reader, 0, sizeof(*reader));
+   reader->frame_size = (size_t)(mbx + 1) * mby * sizeof(RASPIMOTION_VECTOR);
+
+   if (mbx <= 0 || mby <= 0)
+      return -1;
+
+   reader->frame = malloc(reader->frame_size);
+   if (!reader->frame)
+      return -1;
+
+   if (strcmp(filename, "-") == 0)
+      reader->file = stdin;
+   else
+   {
+      reader->file = fopen(filename, "rb");
+      reader->close_file = 1;
+   }
+
+   if (!reader->file)
+   {
+      raspimotion_reader_close(reader);
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Read the next frame
+ *
+ * @param reader Reader
+ * @return The frame's vectors, valid until the next call, or NULL at the end
+ *         of the file
+ */
+const RASPIMOTION_VECTOR *raspimotion_reader_next(RASPIMOTION_READER *reader)
+{
+   if (fread(reader->frame, 1, reader->frame_size, reader->file) != reader->frame_size)
+      return NULL;
+
+   reader->frames++;
+   return reader->frame;
+}
+
+/**
+ * Close a reader
+ *
+ * @param reader Reader
+ */
+void raspimotion_reader_close(RASPIMOTION_READER *reader)
+{
+   if (reader->file && reader->close_file)
+      fclose(reader->file);
+   free(reader->frame);
+   memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, James Hughes
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RASPIMOTION_H_
+#define RASPIMOTION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/// Macroblocks needed to cover a number of pixels
+#define RASPIMOTION_MBS(pixels) (((pixels) + 15) / 16)
+
+/** One macroblock of the inline motion vectors output by the H264 encoder
+ *
+ * Each row of the vector field has one more entry than there are macroblocks
+ * across the frame.
+ */
+typedef struct
+{
+   int8_t x_vector;
+   int8_t y_vector;
+   int16_t sad;                         /// Sum of absolute differences of the match
+} RASPIMOTION_VECTOR;
+
+/** Detection parameters
+ */
+typedef struct
+{
+   int magnitude;                       /// Macroblock is moving if its vector is at least this long
+   int sad;                             /// Or if its SAD is at least this, 0 to ignore SAD
+   int min_blocks;                      /// Smallest connected region of moving macroblocks that counts
+   int trigger_frames;                  /// Consecutive frames with motion before it is reported
+   int hold_frames;                     /// Consecutive frames without motion before its end is reported
+} RASPIMOTION_PARAMETERS;
+
+/** Analysis of one frame
+ */
+typedef struct
+{
+   int active;                          /// Macroblocks over either threshold
+   int regions;                         /// Connected regions of at least min_blocks macroblocks
+   int largest;                         /// Macroblocks in the largest region
+   int left, top, right, bottom;        /// Bounding box of the largest region, in macroblocks
+   int motion;                          /// Motion detected, after trigger_frames and hold_frames
+   int changed;                         /// motion changed with this frame
+} RASPIMOTION_RESULT;
+
+/** Motion detector for a stream of vector fields
+ */
+typedef struct
+{
+   RASPIMOTION_PARAMETERS params;
+   int mbx;                             /// Macroblocks across the frame
+   int mby;                             /// Macroblocks down the frame
+   size_t frame_size;                   /// Bytes of vectors per frame
+
+   uint8_t *mask;                       /// 1 for each moving macroblock
+   int *labels;                         /// Provisional region of each macroblock
+   int *parent;                         /// Union-find forest over the provisional regions
+   int *region;                         /// Macroblocks and bounding box of each region, 5 ints each
+
+   uint8_t *partial;                    /// Frame being assembled from several buffers
+   size_t partial_len;
+
+   int run;                             /// Consecutive frames that disagree with motion
+   int motion;                          /// Current detector state
+
+   unsigned int frames;                 /// Frames analysed
+   unsigned int events;                 /// Times motion has started
+} RASPIMOTION;
+
+/** Reads a recorded .imv file one frame at a time
+ */
+typedef struct
+{
+   FILE *file;
+   int close_file;                      /// file was opened by the reader
+   size_t frame_size;
+   RASPIMOTION_VECTOR *frame;           /// Latest frame read
+   unsigned int frames;                 /// Frames read
+} RASPIMOTION_READER;
+
+void raspimotion_set_defaults(RASPIMOTION_PARAMETERS *params);
+int raspimotion_init(RASPIMOTION *motion, int mbx, int mby, const RASPIMOTION_PARAMETERS *params);
+void raspimotion_destroy(RASPIMOTION *motion);
+void raspimotion_analyse(RASPIMOTION *motion, const RASPIMOTION_VECTOR *vectors, RASPIMOTION_RESULT *result);
+int raspimotion_add_data(RASPIMOTION *motion, const uint8_t *data, size_t length, RASPIMOTION_RESULT *result);
+void raspimotion_magnitudes(const RASPIMOTION_VECTOR *vectors, int mbx, int mby, uint8_t *out);
+
+int raspimotion_reader_open(RASPIMOTION_READER *reader, const char *filename, int mbx, int mby);
+const RASPIMOTION_VECTOR *raspimotion_reader_next(RASPIMOTION_READER *reader);
+void raspimotion_reader_close(RASPIMOTION_READER *reader);
+
+#endif /* RASPIMOTION_H_ */
@@ -792,7 +792,7 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       MMAL_STATUS_T status = MMAL_SUCCESS;
       MMAL_BUFFER_HEADER_T *new_buffer;
 
-      new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue);
+      new_buffer = mmal_pool_get(pData->pstate->encoder_pool);
 
       if (new_buffer)
       {
@@ -1838,7 +1838,7 @@ int main(int argc, const char **argv)
 
                   for (q=0;q<num;q++)
                   {
-                     MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+                     MMAL_BUFFER_HEADER_T *buffer = mmal_pool_get(state.encoder_pool);
 
                      if (!buffer)
                         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
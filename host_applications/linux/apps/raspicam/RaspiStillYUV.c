@@ -587,7 +587,7 @@ static void camera_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buff
    if (port->is_enabled)
    {
       MMAL_STATUS_T status;
-      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pData->pstate->camera_pool->queue);
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_pool_get(pData->pstate->camera_pool);
 
       // and back to the port from there.
       if (new_buffer)
@@ -1334,7 +1334,7 @@ int main(int argc, const char **argv)
 
                for (q=0;q<num;q++)
                {
-                  MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.camera_pool->queue);
+                  MMAL_BUFFER_HEADER_T *buffer = mmal_pool_get(state.camera_pool);
 
                   if (!buffer)
                      vcos_log_error("Unable to get a required buffer %d from pool queue", q);
@@ -38,6 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <GLES/gl.h>
 #include <GLES/glext.h>
 #include "RaspiTexUtil.h"
+#include <bcm_host.h>
 #include "interface/vcos/vcos.h"
 #include "interface/mmal/mmal_buffer.h"
 #include "interface/mmal/util/mmal_util.h"
@@ -92,13 +93,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define DEFAULT_WIDTH   640
 #define DEFAULT_HEIGHT  480
 
+/* Refresh period assumed by frame pacing when there are no vsync callbacks */
+#define PACING_REFRESH_MS  17
+
 #define CommandGLScene   1
 #define CommandGLWin     2
+#define CommandGLPace    3
 
 static COMMAND_LIST cmdline_commands[] =
 {
    { CommandGLScene, "-glscene",  "gs",  "GL scene square,teapot,mirror,yuv,sobel", 1 },
    { CommandGLWin,   "-glwin",    "gw",  "GL window settings <'x,y,w,h'>", 1 },
+   { CommandGLPace,  "-glpace",   "gp",  "Only draw new frames, at most once per display refresh", 0 },
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
@@ -165,6 +171,13 @@ int raspitex_parse_cmdline(RASPITEX_STATE *state,
          used = 2;
          break;
       }
+
+      case CommandGLPace: // Frame-paced rendering
+      {
+         state->frame_pacing = 1;
+         used = 1;
+         break;
+      }
    }
    return used;
 }
@@ -178,15 +191,28 @@ void raspitex_display_help()
    raspicli_display_help(cmdline_commands, cmdline_commands_size);
 }
 
-static void update_fps()
+/**
+ * Updates the frame counters and logs the frame rate every few seconds.
+ * @param state RASPITEX STATE
+ * @param frame_time_us Time taken to draw the frame that was just swapped.
+ */
+static void update_fps(RASPITEX_STATE *state, uint32_t frame_time_us)
 {
    static int frame_count = 0;
    static long long time_start = 0;
+   static uint64_t frame_time_total = 0;
+   static uint32_t frame_time_max = 0;
+   RASPITEX_STATS *stats = &state->stats;
    long long time_now;
    struct timeval te;
    float fps;
 
    frame_count++;
+   stats->frames++;
+   stats->frame_time_us = frame_time_us;
+   frame_time_total += frame_time_us;
+   if (frame_time_us > frame_time_max)
+      frame_time_max = frame_time_us;
 
    gettimeofday(&te, NULL);
    time_now = te.tv_sec * 1000LL + te.tv_usec / 1000;
@@ -198,39 +224,184 @@ static void update_fps()
    else if (time_now - time_start > 5000)
    {
       fps = (float) frame_count / ((time_now - time_start) / 1000.0);
+      stats->fps = fps;
+      stats->frame_time_avg_us = (uint32_t) (frame_time_total / frame_count);
+      stats->frame_time_max_us = frame_time_max;
       frame_count = 0;
+      frame_time_total = 0;
+      frame_time_max = 0;
       time_start = time_now;
-      vcos_log_info("%3.2f FPS", fps);
+      vcos_log_info("%3.2f FPS, frame time %u us (max %u us), %u dropped",
+            fps, stats->frame_time_avg_us, stats->frame_time_max_us,
+            stats->dropped_frames);
    }
 }
 
+/* Bytes swizzled and written per step when streaming a capture to file */
+#define CAPTURE_WRITE_CHUNK   (64 * 1024)
+
 /**
- * Captures the frame-buffer if requested.
+ * Captures the frame-buffer into the next requested capture slot, if any.
+ * Only the readback happens on the GL thread. The slot is handed to the
+ * capture thread for the byte swap and file write.
  * @param state RASPITEX STATE
- * @return Zero if successful.
  */
 static void raspitex_do_capture(RASPITEX_STATE *state)
 {
-   uint8_t *buffer = NULL;
-   size_t size = 0;
+   RASPITEX_CAPTURE *capture = &state->capture;
+   RASPITEX_CAPTURE_SLOT *slot = NULL;
+   uint8_t *buffer;
+   size_t size;
+
+   /* Requests are read back in ring order, once filled in */
+   vcos_mutex_lock(&capture->lock);
+   if (capture->pending && capture->slots[capture->readback_idx].ready)
+      slot = &capture->slots[capture->readback_idx];
+   vcos_mutex_unlock(&capture->lock);
+
+   if (! slot)
+      return;
+
+   buffer = slot->buffer;
+   size = slot->alloc_size;
+   if (! slot->file)
+   {
+      slot->size = 0; // Failed request, nothing to read back
+   }
+   else if (state->ops.capture(state, &buffer, &size) == 0)
+   {
+      if (buffer != slot->buffer)
+      {
+         /* The scene allocated a new buffer, the slot takes ownership */
+         free(slot->buffer);
+         slot->buffer = buffer;
+         slot->alloc_size = size;
+      }
+      slot->size = size;
+   }
+   else
+   {
+      slot->size = 0; // Zero indicates an error
+   }
+
+   vcos_mutex_lock(&capture->lock);
+   slot->ready = 0;
+   capture->readback_idx = (capture->readback_idx + 1) % RASPITEX_CAPTURE_SLOTS;
+   capture->pending--;
+   capture->filled++;
+   vcos_mutex_unlock(&capture->lock);
+   vcos_semaphore_post(&capture->filled_sem);
+}
+
+/**
+ * Once the GL thread has exited, hands the requests that have been filled in
+ * to the capture thread as failed, in ring order. Called with the capture
+ * lock held.
+ * @param capture The capture ring.
+ */
+static void raspitex_fail_ready_captures(RASPITEX_CAPTURE *capture)
+{
+   while (capture->pending && capture->slots[capture->readback_idx].ready)
+   {
+      capture->slots[capture->readback_idx].size = 0;
+      capture->slots[capture->readback_idx].ready = 0;
+      capture->readback_idx = (capture->readback_idx + 1) % RASPITEX_CAPTURE_SLOTS;
+      capture->pending--;
+      capture->filled++;
+      vcos_semaphore_post(&capture->filled_sem);
+   }
+}
+
+/**
+ * Fails any capture requests that the GL thread will never read back and
+ * rejects new ones. Requests still being filled in are failed by their
+ * caller. Called when the preview worker exits.
+ * @param state RASPITEX STATE
+ */
+static void raspitex_cancel_captures(RASPITEX_STATE *state)
+{
+   RASPITEX_CAPTURE *capture = &state->capture;
+
+   vcos_mutex_lock(&capture->lock);
+   capture->stopped = 1;
+   raspitex_fail_ready_captures(capture);
+   vcos_mutex_unlock(&capture->lock);
+}
+
+/**
+ * Writes a captured frame to its TGA file. The BGRA to RGBA swap is done
+ * a chunk at a time just before each chunk is written, while it is still
+ * in the cache.
+ * @param slot The capture slot to write.
+ * @return Zero if successful.
+ */
+static int raspitex_write_capture(RASPITEX_CAPTURE_SLOT *slot)
+{
+   size_t offset, len;
+
+   if (slot->size == 0)
+      return -1;
+
+   if (write_tga_header(slot->file, slot->width, slot->height) != 0)
+      return -1;
+
+   for (offset = 0; offset < slot->size; offset += len)
+   {
+      len = slot->size - offset;
+      if (len > CAPTURE_WRITE_CHUNK)
+         len = CAPTURE_WRITE_CHUNK;
+
+      raspitexutil_brga_to_rgba(slot->buffer + offset, len);
+      if (fwrite(slot->buffer + offset, 1, len, slot->file) != len)
+         return -1;
+   }
+
+   return fflush(slot->file) == 0 ? 0 : -1;
+}
+
+/** Capture thread.
+ * Writes read back frames to file in the order they were requested and
+ * returns their slots to the ring.
+ * @param arg  Pointer to state.
+ * @return NULL always.
+ */
+static void *capture_worker(void *arg)
+{
+   RASPITEX_STATE *state = arg;
+   RASPITEX_CAPTURE *capture = &state->capture;
+   RASPITEX_CAPTURE_SLOT *slot;
 
-   if (state->capture.request)
+   while (1)
    {
-      if (state->ops.capture(state, &buffer, &size) == 0)
+      vcos_semaphore_wait(&capture->filled_sem);
+
+      /* Posted with nothing filled by raspitex_destroy */
+      vcos_mutex_lock(&capture->lock);
+      if (! capture->filled)
       {
-         /* Pass ownership of buffer to main thread via capture state */
-         state->capture.buffer = buffer;
-         state->capture.size = size;
+         vcos_mutex_unlock(&capture->lock);
+         break;
       }
-      else
+      vcos_mutex_unlock(&capture->lock);
+
+      /* Failed requests have already been reported to the caller */
+      slot = &capture->slots[capture->write_idx];
+      if (slot->file && raspitex_write_capture(slot) != 0)
       {
-         state->capture.buffer = NULL; // Null indicates an error
-         state->capture.size = 0;
+         vcos_log_error("%s: capture failed", VCOS_FUNCTION);
+         vcos_mutex_lock(&capture->lock);
+         capture->errors++;
+         vcos_mutex_unlock(&capture->lock);
       }
 
-      state->capture.request = 0; // Always clear request and post sem
-      vcos_semaphore_post(&state->capture.completed_sem);
+      slot->file = NULL;
+      capture->write_idx = (capture->write_idx + 1) % RASPITEX_CAPTURE_SLOTS;
+      vcos_mutex_lock(&capture->lock);
+      capture->filled--;
+      vcos_mutex_unlock(&capture->lock);
+      vcos_semaphore_post(&capture->free_sem);
    }
+   return NULL;
 }
 
 /**
@@ -259,6 +430,7 @@ static int check_egl_image(RASPITEX_STATE *state)
  */
 static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
 {
+   uint32_t time_start = vcos_getmicrosecs();
    int rc = 0;
 
    /* If buf is non-NULL then there is a new viewfinder frame available
@@ -333,7 +505,7 @@ static int raspitex_draw(RASPITEX_STATE *state, MMAL_BUFFER_HEADER_T *buf)
       raspitex_do_capture(state);
 
       eglSwapBuffers(state->display, state->surface);
-      update_fps();
+      update_fps(state, vcos_getmicrosecs() - time_start);
    }
    else
    {
@@ -383,6 +555,78 @@ static int preview_process_returned_bufs(RASPITEX_STATE* state)
    return rc;
 }
 
+/**
+ * Dispmanx vsync callback. Wakes the render loop in frame pacing mode.
+ * @param update Unused.
+ * @param arg RASPITEX STATE
+ */
+static void raspitex_vsync_cb(DISPMANX_UPDATE_HANDLE_T update, void *arg)
+{
+   RASPITEX_STATE *state = arg;
+   (void) update;
+
+   vcos_semaphore_post(&state->vsync_sem);
+}
+
+/**
+ * Process preview buffers in frame pacing mode.
+ *
+ * Waits for the next vsync, then draws the newest preview buffer and
+ * returns any older queued buffers to the camera without drawing them.
+ * If no new buffer has arrived then the scene is only redrawn if it
+ * animates, i.e. it has its own update_model. Otherwise, this blocks on
+ * the preview queue so an unchanging preview costs no GL time.
+ * @param   state The GL preview window state.
+ * @return Zero if successful.
+ */
+static int preview_process_paced(RASPITEX_STATE *state)
+{
+   MMAL_BUFFER_HEADER_T *buf, *newer;
+   int animated = (state->ops.update_model != raspitexutil_update_model);
+   int rc = 0;
+
+   /* Draw at most once per refresh. A vsync that happened since the last
+    * draw, such as the one eglSwapBuffers waited for, starts the next frame
+    * straight away; only wait if there has been none. Several refreshes
+    * missed are caught up with one draw. */
+   if (state->vsync_enabled)
+   {
+      if (vcos_semaphore_trywait(&state->vsync_sem) != VCOS_SUCCESS)
+         vcos_semaphore_wait_timeout(&state->vsync_sem, 2 * PACING_REFRESH_MS);
+      while (vcos_semaphore_trywait(&state->vsync_sem) == VCOS_SUCCESS)
+         ;
+   }
+
+   buf = mmal_queue_get(state->preview_queue);
+   if (! buf && ! (animated && state->vsync_enabled))
+      buf = mmal_queue_timedwait(state->preview_queue, PACING_REFRESH_MS);
+
+   while (buf && (newer = mmal_queue_get(state->preview_queue)) != NULL)
+   {
+      mmal_buffer_header_release(buf);
+      state->stats.dropped_frames++;
+      buf = newer;
+   }
+
+   if (state->preview_stop)
+   {
+      if (buf)
+         mmal_buffer_header_release(buf);
+      return 0;
+   }
+
+   if (buf || animated)
+   {
+      rc = raspitex_draw(state, buf);
+      if (rc != 0)
+      {
+         vcos_log_error("%s: Error drawing frame. Stopping.", VCOS_FUNCTION);
+         state->preview_stop = 1;
+      }
+   }
+   return rc;
+}
+
 /** Preview worker thread.
  * Ensures camera preview is supplied with buffers and sends preview frames to GL.
  * @param arg  Pointer to state.
@@ -406,10 +650,20 @@ static void *preview_worker(void *arg)
    if (rc != 0)
       goto end;
 
+   if (state->frame_pacing)
+   {
+      if (state->disp != DISPMANX_NO_HANDLE &&
+            vc_dispmanx_vsync_callback(state->disp, raspitex_vsync_cb, state) == 0)
+         state->vsync_enabled = 1;
+      else
+         vcos_log_warn("%s: no vsync callback, pacing at %d ms",
+               VCOS_FUNCTION, PACING_REFRESH_MS);
+   }
+
    while (state->preview_stop == 0)
    {
       /* Send empty buffers to camera preview port */
-      while ((buf = mmal_queue_get(state->preview_pool->queue)) != NULL)
+      while ((buf = mmal_pool_get(state->preview_pool)) != NULL)
       {
          st = mmal_port_send_buffer(preview_port, buf);
          if (st != MMAL_SUCCESS)
@@ -418,7 +672,12 @@ static void *preview_worker(void *arg)
          }
       }
       /* Process returned buffers */
-      if (preview_process_returned_bufs(state) != 0)
+      if (state->frame_pacing)
+         rc = preview_process_paced(state);
+      else
+         rc = preview_process_returned_bufs(state);
+
+      if (rc != 0)
       {
          vcos_log_error("Preview error. Exiting.");
          state->preview_stop = 1;
@@ -426,6 +685,14 @@ static void *preview_worker(void *arg)
    }
 
 end:
+   if (state->vsync_enabled)
+   {
+      vc_dispmanx_vsync_callback(state->disp, NULL, NULL);
+      state->vsync_enabled = 0;
+   }
+
+   raspitex_cancel_captures(state);
+
    /* Make sure all buffers are returned on exit */
    while ((buf = mmal_queue_get(state->preview_queue)) != NULL)
       mmal_buffer_header_release(buf);
@@ -522,8 +789,17 @@ int raspitex_configure_preview_port(RASPITEX_STATE *state,
       goto end;
    }
 
-   /* Place filled buffers from the preview port in a queue to render */
-   state->preview_queue = mmal_queue_create();
+   /* Only the preview worker takes buffers from the pool */
+   status = mmal_pool_single_consumer_enable(state->preview_pool);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Error setting up pool");
+      goto end;
+   }
+
+   /* Place filled buffers from the preview port in a queue to render,
+    * which only the preview worker reads from */
+   state->preview_queue = mmal_queue_create_with_flags(MMAL_QUEUE_FLAG_SINGLE_CONSUMER);
    if (! state->preview_queue)
    {
       vcos_log_error("Error allocating queue");
@@ -558,13 +834,26 @@ int raspitex_init(RASPITEX_STATE *state)
          state->verbose ? VCOS_LOG_INFO : VCOS_LOG_WARN);
    vcos_log_trace("%s", VCOS_FUNCTION);
 
-   status = vcos_semaphore_create(&state->capture.start_sem,
-         "glcap_start_sem", 1);
+   status = vcos_mutex_create(&state->capture.lock, "glcap_lock");
+   if (status != VCOS_SUCCESS)
+      goto error;
+
+   status = vcos_semaphore_create(&state->capture.free_sem,
+         "glcap_free_sem", RASPITEX_CAPTURE_SLOTS);
+   if (status != VCOS_SUCCESS)
+      goto error;
+
+   status = vcos_semaphore_create(&state->capture.filled_sem,
+         "glcap_filled_sem", 0);
    if (status != VCOS_SUCCESS)
       goto error;
 
-   status = vcos_semaphore_create(&state->capture.completed_sem,
-         "glcap_completed_sem", 0);
+   status = vcos_thread_create(&state->capture.thread, "capture-worker",
+         NULL, capture_worker, state);
+   if (status != VCOS_SUCCESS)
+      goto error;
+
+   status = vcos_semaphore_create(&state->vsync_sem, "gl_vsync_sem", 0);
    if (status != VCOS_SUCCESS)
       goto error;
 
@@ -604,6 +893,8 @@ error:
  */
 void raspitex_destroy(RASPITEX_STATE *state)
 {
+   int i;
+
    vcos_log_trace("%s", VCOS_FUNCTION);
    if (state->preview_pool)
    {
@@ -623,8 +914,20 @@ void raspitex_destroy(RASPITEX_STATE *state)
    if (state->ops.close)
       state->ops.close(state);
 
-   vcos_semaphore_delete(&state->capture.start_sem);
-   vcos_semaphore_delete(&state->capture.completed_sem);
+   /* Wake the capture thread with nothing to write so that it exits */
+   vcos_semaphore_post(&state->capture.filled_sem);
+   vcos_thread_join(&state->capture.thread, NULL);
+   for (i = 0; i < RASPITEX_CAPTURE_SLOTS; i++)
+   {
+      free(state->capture.slots[i].buffer);
+      state->capture.slots[i].buffer = NULL;
+      state->capture.slots[i].alloc_size = 0;
+   }
+
+   vcos_mutex_delete(&state->capture.lock);
+   vcos_semaphore_delete(&state->capture.free_sem);
+   vcos_semaphore_delete(&state->capture.filled_sem);
+   vcos_semaphore_delete(&state->vsync_sem);
 }
 
 /* Initialise the GL / window state to sensible defaults.
@@ -685,6 +988,11 @@ int raspitex_start(RASPITEX_STATE *state)
    VCOS_STATUS_T status;
 
    vcos_log_trace("%s", VCOS_FUNCTION);
+
+   vcos_mutex_lock(&state->capture.lock);
+   state->capture.stopped = 0;
+   vcos_mutex_unlock(&state->capture.lock);
+
    status = vcos_thread_create(&state->preview_thread, "preview-worker",
          NULL, preview_worker, state);
 
@@ -696,53 +1004,117 @@ int raspitex_start(RASPITEX_STATE *state)
 }
 
 /**
- * Writes the next GL frame-buffer to a RAW .ppm formatted file
- * using the specified file-handle.
+ * Requests a capture of the next GL frame-buffer to a TGA file and returns
+ * without waiting for it. Only the readback is done on the GL thread, the
+ * file is written by the capture thread, so a burst of captures doesn't
+ * stall the preview. This blocks only if RASPITEX_CAPTURE_SLOTS captures
+ * are already in flight. The file must stay open until
+ * raspitex_capture_flush returns.
  * @param state Pointer to the GL preview state.
- * @param outpt_file Output file handle for the ppm image.
+ * @param output_file Output file handle for the TGA image.
  * @return Zero on success.
  */
-int raspitex_capture(RASPITEX_STATE *state, FILE *output_file)
+int raspitex_capture_queue(RASPITEX_STATE *state, FILE *output_file)
 {
-   int rc = 0;
-   uint8_t *buffer = NULL;
-   size_t size = 0;
+   RASPITEX_CAPTURE *capture;
+   RASPITEX_CAPTURE_SLOT *slot;
+   size_t size;
+   int failed;
 
    vcos_log_trace("%s: state %p file %p", VCOS_FUNCTION,
          state, output_file);
 
-   if (state && output_file)
-   {
-      /* Only request one capture at a time */
-      vcos_semaphore_wait(&state->capture.start_sem);
-      state->capture.request = 1;
-
-      /* Wait for capture to start */
-      vcos_semaphore_wait(&state->capture.completed_sem);
-
-      /* Take ownership of the captured buffer */
-      buffer = state->capture.buffer;
-      size = state->capture.size;
+   if (! state || ! output_file)
+      return -1;
 
-      state->capture.request = 0;
-      state->capture.buffer = 0;
-      state->capture.size = 0;
+   capture = &state->capture;
+   size = state->width * state->height * 4;
 
-      /* Allow another capture to be requested */
-      vcos_semaphore_post(&state->capture.start_sem);
+   /* Reserve the next slot. Several callers can get past free_sem, each
+    * gets a slot of its own. */
+   vcos_semaphore_wait(&capture->free_sem);
+   vcos_mutex_lock(&capture->lock);
+   if (capture->stopped)
+   {
+      vcos_mutex_unlock(&capture->lock);
+      vcos_semaphore_post(&capture->free_sem);
+      vcos_log_error("%s: capture failed", VCOS_FUNCTION);
+      return -1;
+   }
+   slot = &capture->slots[capture->request_idx];
+   capture->request_idx = (capture->request_idx + 1) % RASPITEX_CAPTURE_SLOTS;
+   capture->pending++;
+   vcos_mutex_unlock(&capture->lock);
+
+   /* Allocate and touch the readback buffer here rather than on the
+    * GL thread. It is reused by later captures. */
+   if (slot->alloc_size < size)
+   {
+      free(slot->buffer);
+      slot->buffer = calloc(size, 1);
+      slot->alloc_size = slot->buffer ? size : 0;
    }
-   if (size == 0 || ! buffer)
+   slot->size = 0;
+   slot->width = state->width;
+   slot->height = state->height;
+   slot->file = slot->buffer ? output_file : NULL;
+   failed = ! slot->file;
+
+   /* The slot is in the ring now, so a failed request still goes round it.
+    * It may be reused as soon as the lock is released. */
+   vcos_mutex_lock(&capture->lock);
+   slot->ready = 1;
+   if (capture->stopped)
+      raspitex_fail_ready_captures(capture);
+   vcos_mutex_unlock(&capture->lock);
+
+   if (failed)
    {
       vcos_log_error("%s: capture failed", VCOS_FUNCTION);
-      rc = -1;
-      goto end;
+      return -1;
    }
+   return 0;
+}
 
-   raspitexutil_brga_to_rgba(buffer, size);
-   rc = write_tga(output_file, state->width, state->height, buffer, size);
-   fflush(output_file);
+/**
+ * Waits until every queued capture has been written to file.
+ * @param state Pointer to the GL preview state.
+ * @return Zero if all captures since the last flush succeeded.
+ */
+int raspitex_capture_flush(RASPITEX_STATE *state)
+{
+   RASPITEX_CAPTURE *capture = &state->capture;
+   int errors;
+   int i;
+
+   /* Every slot is free once the capture thread has caught up */
+   for (i = 0; i < RASPITEX_CAPTURE_SLOTS; i++)
+      vcos_semaphore_wait(&capture->free_sem);
+   for (i = 0; i < RASPITEX_CAPTURE_SLOTS; i++)
+      vcos_semaphore_post(&capture->free_sem);
+
+   vcos_mutex_lock(&capture->lock);
+   errors = capture->errors;
+   capture->errors = 0;
+   vcos_mutex_unlock(&capture->lock);
+
+   return errors ? -1 : 0;
+}
+
+/**
+ * Writes the next GL frame-buffer to a TGA formatted file
+ * using the specified file-handle and waits for it to complete.
+ * @param state Pointer to the GL preview state.
+ * @param output_file Output file handle for the TGA image.
+ * @return Zero on success.
+ */
+int raspitex_capture(RASPITEX_STATE *state, FILE *output_file)
+{
+   int rc;
+
+   rc = raspitex_capture_queue(state, output_file);
+   if (rc == 0)
+      rc = raspitex_capture_flush(state);
 
-end:
-   free(buffer);
    return rc;
 }
@@ -38,7 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "interface/mmal/mmal.h"
 
 #define RASPITEX_VERSION_MAJOR 1
-#define RASPITEX_VERSION_MINOR 0
+#define RASPITEX_VERSION_MINOR 2
 
 typedef enum {
    RASPITEX_SCENE_SQUARE = 0,
@@ -82,8 +82,8 @@ typedef struct RASPITEX_SCENE_OPS
    /// Draw the scene - called after update_model
    int (*redraw)(struct RASPITEX_STATE *state);
 
-   /// Allocates a buffer and copies the pixels from the current
-   /// frame-buffer into it.
+   /// Copies the pixels from the current frame-buffer into *buffer if
+   /// it is big enough, otherwise allocates a new buffer for them.
    int (*capture)(struct RASPITEX_STATE *state,
          uint8_t **buffer, size_t *buffer_size);
 
@@ -97,25 +97,79 @@ typedef struct RASPITEX_SCENE_OPS
    void (*close)(struct RASPITEX_STATE *state);
 } RASPITEX_SCENE_OPS;
 
+/// Number of frame-buffer readback buffers, i.e. the number of captures
+/// that may be in flight before raspitex_capture_queue blocks.
+#define RASPITEX_CAPTURE_SLOTS 4
+
+typedef struct RASPITEX_CAPTURE_SLOT
+{
+   /// The readback buffer. Kept between captures.
+   uint8_t *buffer;
+
+   /// Allocated size of the buffer in bytes
+   size_t alloc_size;
+
+   /// Size of the captured frame in bytes, zero if the readback failed
+   size_t size;
+
+   /// Dimensions of the captured frame
+   int width;
+   int height;
+
+   /// The TGA file to write, NULL if the request failed
+   FILE *file;
+
+   /// Set under the capture lock once the request has been filled in
+   int ready;
+} RASPITEX_CAPTURE_SLOT;
+
 typedef struct RASPITEX_CAPTURE
 {
-   /// Wait for previous capture to complete
-   VCOS_SEMAPHORE_T start_sem;
+   /// Ring of readback buffers. Slots are requested, read back by the
+   /// GL thread and written out by the capture thread in ring order.
+   RASPITEX_CAPTURE_SLOT slots[RASPITEX_CAPTURE_SLOTS];
 
-   /// Posted once the capture is complete
-   VCOS_SEMAPHORE_T completed_sem;
+   /// Protects the ring indices and counts
+   VCOS_MUTEX_T lock;
 
-   /// The RGB capture buffer
-   uint8_t *buffer;
+   /// Counts slots that are free for a new capture request
+   VCOS_SEMAPHORE_T free_sem;
 
-   /// Size of the captured buffer in bytes
-   size_t size;
+   /// Counts slots that have been read back and are waiting to be written
+   VCOS_SEMAPHORE_T filled_sem;
+
+   /// Writes captured frames to file off the GL thread
+   VCOS_THREAD_T thread;
 
-   /// Frame-buffer capture has been requested. Could use
-   /// a queue instead here to allow multiple capture requests.
-   int request;
+   int request_idx;     /// Next slot to request
+   int readback_idx;    /// Next slot for the GL thread to read back
+   int write_idx;       /// Next slot for the capture thread to write
+   int pending;         /// Reserved slots not yet read back
+   int filled;          /// Read back slots not yet written
+   int errors;          /// Failed captures since the last flush
+   int stopped;         /// The GL thread has exited, reject new requests
 } RASPITEX_CAPTURE;
 
+typedef struct RASPITEX_STATS
+{
+   /// Frames drawn per second, updated every few seconds
+   float fps;
+
+   /// Total number of frames drawn
+   uint32_t frames;
+
+   /// Camera frames returned without being drawn because a newer
+   /// frame was already queued. Only counted in frame pacing mode.
+   uint32_t dropped_frames;
+
+   /// Time taken to update the textures, draw and swap the last frame
+   uint32_t frame_time_us;
+
+   /// Mean and worst frame time over the same period as fps
+   uint32_t frame_time_avg_us;
+   uint32_t frame_time_max_us;
+} RASPITEX_STATS;
+
 /**
  * Contains the internal state and configuration for the GL rendered
  * preview window.
@@ -174,6 +228,12 @@ typedef struct RASPITEX_STATE
 
    RASPITEX_CAPTURE capture;           /// Frame-buffer capture state
 
+   /* Added in version 1.1 */
+   int frame_pacing;                   /// Only draw new frames, once per vsync
+   RASPITEX_STATS stats;               /// Frame rate and frame time counters
+   VCOS_SEMAPHORE_T vsync_sem;         /// Posted on each display vsync
+   int vsync_enabled;                  /// Whether vsync_sem is being posted
+
 } RASPITEX_STATE;
 
 int raspitex_init(RASPITEX_STATE *state);
@@ -187,5 +247,7 @@ void raspitex_display_help();
 int raspitex_parse_cmdline(RASPITEX_STATE *state,
       const char *arg1, const char *arg2);
 int raspitex_capture(RASPITEX_STATE *state, FILE* output_file);
+int raspitex_capture_queue(RASPITEX_STATE *state, FILE* output_file);
+int raspitex_capture_flush(RASPITEX_STATE *state);
 
 #endif /* RASPITEX_H_ */
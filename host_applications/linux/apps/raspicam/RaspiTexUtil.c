@@ -31,6 +31,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <bcm_host.h>
 #include <GLES2/gl2.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 VCOS_LOG_CAT_T raspitex_log_category;
 
 /**
@@ -433,6 +439,7 @@ void raspitexutil_close(RASPITEX_STATE* raspitex_state)
 
 /**
  * Performs an in-place byte swap from BGRA to RGBA.
+ * Uses NEON or SSE2 when the compiler targets them.
  * @param buffer The buffer to modify.
  * @param size Size of the buffer in bytes.
  */
@@ -441,6 +448,34 @@ void raspitexutil_brga_to_rgba(uint8_t *buffer, size_t size)
    uint8_t* out = buffer;
    uint8_t* end = buffer + size;
 
+#if defined(__ARM_NEON__)
+   /* 16 pixels at a time, de-interleaved into one register per channel */
+   while (end - out >= 64)
+   {
+      uint8x16x4_t px = vld4q_u8(out);
+      uint8x16_t tmp = px.val[0];
+      px.val[0] = px.val[2];
+      px.val[2] = tmp;
+      vst4q_u8(out, px);
+      out += 64;
+   }
+#elif defined(__SSE2__)
+   /* 4 pixels at a time. Keep G and A, then swap bytes 0 and 2 of each
+    * 32-bit pixel with a pair of shifts. */
+   const __m128i ga_mask = _mm_set1_epi32(0xFF00FF00);
+
+   while (end - out >= 16)
+   {
+      __m128i px = _mm_loadu_si128((__m128i *) out);
+      __m128i rb = _mm_andnot_si128(ga_mask, px);
+      px = _mm_and_si128(px, ga_mask);
+      px = _mm_or_si128(px, _mm_srli_epi32(rb, 16));
+      px = _mm_or_si128(px, _mm_slli_epi32(rb, 16));
+      _mm_storeu_si128((__m128i *) out, px);
+      out += 16;
+   }
+#endif
+
    while (out < end)
    {
       uint8_t tmp = out[0];
@@ -451,43 +486,50 @@ void raspitexutil_brga_to_rgba(uint8_t *buffer, size_t size)
 }
 
 /**
- * Uses glReadPixels to grab the current frame-buffer contents
- * and returns the result in a newly allocate buffer along with
- * the its size.
+ * Uses glReadPixels to grab the current frame-buffer contents.
+ * If *buffer is non-null and *buffer_size is large enough the pixels are
+ * read into it, otherwise they are returned in a newly allocated buffer.
+ * On return *buffer_size is the size of the frame.
  * Data is returned in BGRA format for TGA output. PPM output doesn't
  * require the channel order swap but would require a vflip. The TGA
  * format also supports alpha. The byte swap is not done in this function
  * to avoid blocking the GL rendering thread.
  * @param state Pointer to the GL preview state.
- * @param buffer Address of pointer to set to pointer to new buffer.
- * @param buffer_size The size of the new buffer in bytes (out param)
- * @return Zero if successful.
+ * @param buffer Address of pointer to the buffer to use or to set to
+ *               the new buffer.
+ * @param buffer_size Size of the buffer in bytes (in/out param)
+ * @return Zero if successful. On failure any buffer allocated here is
+ *         freed and the caller's buffer is left unchanged.
  */
 int raspitexutil_capture_bgra(RASPITEX_STATE *state,
       uint8_t **buffer, size_t *buffer_size)
 {
    const int bytes_per_pixel = 4;
+   size_t size = state->width * state->height * bytes_per_pixel;
+   uint8_t *pixels = *buffer;
 
    vcos_log_trace("%s: %dx%d %d", VCOS_FUNCTION,
          state->width, state->height, bytes_per_pixel);
 
-   *buffer_size = state->width * state->height * bytes_per_pixel;
-   *buffer = calloc(*buffer_size, 1);
-   if (! *buffer)
-      goto error;
+   if (! pixels || *buffer_size < size)
+   {
+      pixels = calloc(size, 1);
+      if (! pixels)
+         goto error;
+   }
 
    glReadPixels(0, 0, state->width, state->height, GL_RGBA,
-         GL_UNSIGNED_BYTE, *buffer);
+         GL_UNSIGNED_BYTE, pixels);
    if (glGetError() != GL_NO_ERROR)
       goto error;
 
+   *buffer = pixels;
+   *buffer_size = size;
    return 0;
 
 error:
-   *buffer_size = 0;
-   if (*buffer)
-      free(*buffer);
-   *buffer = NULL;
+   if (pixels && pixels != *buffer)
+      free(pixels);
    return -1;
 }
 
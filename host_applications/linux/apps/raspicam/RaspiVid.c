@@ -40,8 +40,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * Camera component has three ports, preview, video and stills.
  * This program connects preview and stills to the preview and video
  * encoder. Using mmal we don't need to worry about buffers between these
- * components, but we do need to handle buffers from the encoder, which
- * are simply written straight to the file in the requisite buffer callback.
+ * components, but we do need to handle buffers from the encoder. The buffer
+ * callback queues them for a writer thread, which writes them to file and
+ * returns them to the encoder, so that a slow filesystem doesn't hold up the
+ * encoder.
  *
  * We use the RaspiCamControl code to handle the specific camera settings.
  * We use the RaspiPreview code to handle the (generic) preview window
@@ -55,6 +57,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <memory.h>
 #include <sysexits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #define VERSION_STRING "v1.3.12"
 
@@ -72,6 +77,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "RaspiCamControl.h"
 #include "RaspiPreview.h"
 #include "RaspiCLI.h"
+#include "RaspiCircular.h"
+#include "RaspiMotion.h"
 
 #include <semaphore.h>
 
@@ -94,6 +101,13 @@ const int MAX_BITRATE = 25000000; // 25Mbits/s
 /// Interval at which we check for an failure abort during capture
 const int ABORT_INTERVAL = 100; // ms
 
+/// Default number of encoder buffers that may be waiting for the writer thread
+#define WRITER_QUEUE_DEFAULT 8
+/// Most encoder buffers that may be waiting for the writer thread
+#define WRITER_QUEUE_MAX     64
+/// Most buffers written to file in one go
+#define WRITER_BATCH_MAX     16
+
 
 /// Capture/Pause switch method
 /// Simply capture for time specified
@@ -106,6 +120,8 @@ const int ABORT_INTERVAL = 100; // ms
 #define WAIT_METHOD_SIGNAL         3
 /// Run/record forever
 #define WAIT_METHOD_FOREVER        4
+/// Switch between capture and pause as motion starts and stops
+#define WAIT_METHOD_MOTION         5
 
 
 
@@ -115,6 +131,46 @@ static void signal_handler(int signal_number);
 // Forward
 typedef struct RASPIVID_STATE_S RASPIVID_STATE;
 
+/** A buffer waiting for the writer thread
+ */
+typedef struct
+{
+   MMAL_BUFFER_HEADER_T *buffer;        /// Encoder output buffer
+   int split;                           /// Start the next segment file before writing the buffer
+} WRITER_ENTRY;
+
+/** Counters kept by the writer
+ */
+typedef struct
+{
+   unsigned int buffers;                /// Buffers written (or discarded if not wanted)
+   unsigned int writes;                 /// Calls made to write to file
+   unsigned int max_depth;              /// Most buffers waiting at once
+   unsigned int dropped_buffers;        /// Buffers discarded because the queue was full
+   unsigned int dropped_frames;         /// Frames lost to discarded buffers
+   int64_t stall_us;                    /// Time spent blocked on the filesystem
+   int64_t max_stall_us;                /// Longest single block on the filesystem
+} WRITER_STATS;
+
+/** Thread writing encoded data to file, fed by a ring of buffers from the encoder callback
+ */
+typedef struct
+{
+   VCOS_THREAD_T thread;
+   VCOS_MUTEX_T lock;                   /// Protects the ring and the drop state
+   VCOS_SEMAPHORE_T work;               /// Posted for each buffer queued, and to stop
+   WRITER_ENTRY *ring;                  /// Buffers waiting to be written
+   int depth;                           /// Size of the ring
+   int head;                            /// Next entry to write
+   int count;                           /// Entries in use
+   int stopping;                        /// Exit once the ring is empty
+   int dropping;                        /// Discarding buffers until the next key frame
+   int frame_start;                     /// The next buffer starts a frame
+   int split_pending;                   /// A segment split was dropped
+   int running;                         /// Thread has been created
+   WRITER_STATS stats;
+} RASPIVID_WRITER;
+
 /** Struct used to pass information in encoder port userdata to callback
  */
 typedef struct
@@ -122,18 +178,15 @@ typedef struct
    FILE *file_handle;                   /// File handle to write buffer data to.
    RASPIVID_STATE *pstate;              /// pointer to our state in case required in callback
    int abort;                           /// Set to 1 in callback if an error occurs to attempt to abort the capture
-   char *cb_buff;                       /// Circular buffer
-   int   cb_len;                        /// Length of buffer
-   int   cb_wptr;                       /// Current write pointer
-   int   cb_wrap;                       /// Has buffer wrapped at least once?
-   int   cb_data;                       /// Valid bytes in buffer
-#define IFRAME_BUFSIZE (60*1000)
-   int   iframe_buff[IFRAME_BUFSIZE];          /// buffer of iframe pointers
-   int   iframe_buff_wpos;
-   int   iframe_buff_rpos;
-   char  header_bytes[29];
-   int  header_wptr;
+   RASPICIRCULAR circular;              /// Pre-trigger buffer used in circular mode
+   RASPIMOTION motion;                  /// Motion detector fed with the inline motion vectors
+   VCOS_SEMAPHORE_T motion_sem;         /// Posted when the motion detector changes state
+   int motion_skip;                     /// Discarding output until a header or key frame
+   int64_t motion_time;                 /// Total time spent analysing vectors, microseconds
+   int64_t motion_time_max;             /// Longest analysis of one frame, microseconds
    FILE *imv_file_handle;               /// File handle to write inline motion vectors to.
+   MMAL_PORT_T *port;                   /// Encoder output port
+   RASPIVID_WRITER writer;              /// Thread writing to file_handle and imv_file_handle
 } PORT_USERDATA;
 
 /** Structure containing all state information for the current run
@@ -186,6 +239,15 @@ struct RASPIVID_STATE_S
    
    int cameraNum;                       /// Camera number
    int settings;                        /// Request settings from the camera
+   int writerQueue;                     /// Buffers that may wait for the writer thread, 0 to write from the callback
+   int circularPreroll;                 /// Video saved from before each trigger in ms, -1 for all that is buffered
+   int circularPostroll;                /// Video saved after each trigger in ms
+   int circularRefs;                    /// Circular buffer holds encoder buffers instead of copies
+   int circularBuffers;                 /// Encoder buffers the circular buffer may hold
+   int circularClips;                   /// Clips saved from the circular buffer
+   RASPIMOTION_PARAMETERS motion_parameters; /// Motion detection setup parameters
+   int motionHold;                      /// Keep capturing for this long after motion stops, ms
+   unsigned int motionEvents;           /// Starts of motion already acted upon
 
 };
 
@@ -239,6 +301,12 @@ static void display_valid_parameters(char *app_name);
 #define CommandIMV          23
 #define CommandCamSelect    24
 #define CommandSettings     25
+#define CommandWriterQueue  26
+#define CommandPreroll      27
+#define CommandPostroll     28
+#define CommandCircularRefs 29
+#define CommandMotion       30
+#define CommandMotionHold   31
 
 static COMMAND_LIST cmdline_commands[] =
 {
@@ -268,6 +336,12 @@ static COMMAND_LIST cmdline_commands[] =
    { CommandIMV,           "-vectors",    "x",  "Output filename <filename> for inline motion vectors", 1 },
    { CommandCamSelect,     "-camselect",  "cs", "Select camera <number>. Default 0", 1 },
    { CommandSettings, "-settings",  "set","Retrieve camera settings and write to stdout", 0},
+   { CommandWriterQueue,   "-writequeue", "wq", "Buffers that may be queued for writing to file <n>. 0 to write from the encoder callback. Default 8", 1},
+   { CommandPreroll,       "-preroll",    "pr", "In circular mode, save <ms> of video from before each trigger. Default all that is buffered", 1},
+   { CommandPostroll,      "-postroll",   "po", "In circular mode, keep saving for <ms> after each trigger. Default 0", 1},
+   { CommandCircularRefs,  "-cbrefs",     "cr", "In circular mode, hold encoder buffers rather than copying their data", 0},
+   { CommandMotion,        "-motion",     "mo", "Cycle between capture and pause on motion. -motion len[,sad[,blocks]] thresholds for vector length, SAD and region size. Default 8,0,10", 1},
+   { CommandMotionHold,    "-motionhold", "mh", "In motion mode, keep capturing for <ms> after motion stops. Default 1000", 1},
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
@@ -284,6 +358,7 @@ static struct
       {"Cycle on time",          WAIT_METHOD_TIMED},
       {"Cycle on keypress",      WAIT_METHOD_KEYPRESS},
       {"Cycle on signal",        WAIT_METHOD_SIGNAL},
+      {"Cycle on motion",        WAIT_METHOD_MOTION},
 };
 
 static int wait_method_description_size = sizeof(wait_method_description) / sizeof(wait_method_description[0]);
@@ -335,6 +410,12 @@ static void default_status(RASPIVID_STATE *state)
    
    state->cameraNum = 0;
    state->settings = 0;
+   state->writerQueue = WRITER_QUEUE_DEFAULT;
+   state->circularPreroll = -1;
+   state->circularPostroll = 0;
+   state->circularRefs = 0;
+   raspimotion_set_defaults(&state->motion_parameters);
+   state->motionHold = 1000;
 
    // Setup preview window defaults
    raspipreview_set_defaults(&state->preview_parameters);
@@ -363,6 +444,15 @@ static void dump_status(RASPIVID_STATE *state)
    fprintf(stderr, "bitrate %d, framerate %d, time delay %d\n", state->bitrate, state->framerate, state->timeout);
    fprintf(stderr, "H264 Profile %s\n", raspicli_unmap_xref(state->profile, profile_map, profile_map_size));
    fprintf(stderr, "H264 Quantisation level %d, Inline headers %s\n", state->quantisationParameter, state->bInlineHeaders ? "Yes" : "No");
+   fprintf(stderr, "Writer queue %d\n", state->writerQueue);
+
+   if (state->waitMethod == WAIT_METHOD_MOTION)
+      fprintf(stderr, "Motion vector length %d, SAD %d, region %d blocks, hold %d ms\n", state->motion_parameters.magnitude,
+              state->motion_parameters.sad, state->motion_parameters.min_blocks, state->motionHold);
+
+   if (state->bCircularBuffer)
+      fprintf(stderr, "Circular buffer pre-roll %d, post-roll %d, %s\n", state->circularPreroll,
+              state->circularPostroll, state->circularRefs ? "holding encoder buffers" : "copying data");
 
    // Not going to display segment data unless asked for it.
    if (state->segmentSize)
@@ -682,6 +772,63 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
          state->settings = 1;
          break;
 
+      case CommandWriterQueue:
+      {
+         if (sscanf(argv[i + 1], "%d", &state->writerQueue) == 1 &&
+             state->writerQueue >= 0 && state->writerQueue <= WRITER_QUEUE_MAX)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandPreroll:
+      {
+         if (sscanf(argv[i + 1], "%u", &state->circularPreroll) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandPostroll:
+      {
+         if (sscanf(argv[i + 1], "%u", &state->circularPostroll) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandCircularRefs:
+      {
+         state->circularRefs = 1;
+         break;
+      }
+
+      case CommandMotion:
+      {
+         RASPIMOTION_PARAMETERS *params = &state->motion_parameters;
+
+         if (sscanf(argv[i + 1], "%d,%d,%d", &params->magnitude, &params->sad, &params->min_blocks) >= 1)
+         {
+            i++;
+            state->waitMethod = WAIT_METHOD_MOTION;
+         }
+         else
+            valid = 0;
+         break;
+      }
+
+      case CommandMotionHold:
+      {
+         if (sscanf(argv[i + 1], "%u", &state->motionHold) == 1)
+            i++;
+         else
+            valid = 0;
+         break;
+      }
+
       default:
       {
          // Try parsing for any image specific parameters
@@ -874,17 +1021,457 @@ static FILE *open_imv_filename(RASPIVID_STATE *pState)
    return new_handle;
 }
 
+/**
+ * Close the current output files and open those for the next segment
+ *
+ * @param pData Pointer to the encoder port userdata
+ */
+static void start_next_segment(PORT_USERDATA *pData)
+{
+   FILE *new_handle;
+
+   pData->pstate->segmentNumber++;
+
+   // Only wrap if we have a wrap point set
+   if (pData->pstate->segmentWrap && pData->pstate->segmentNumber > pData->pstate->segmentWrap)
+      pData->pstate->segmentNumber = 1;
+
+   new_handle = open_filename(pData->pstate);
+
+   if (new_handle)
+   {
+      fclose(pData->file_handle);
+      pData->file_handle = new_handle;
+   }
+
+   new_handle = open_imv_filename(pData->pstate);
+
+   if (new_handle)
+   {
+      fclose(pData->imv_file_handle);
+      pData->imv_file_handle = new_handle;
+   }
+}
+
+/**
+ * Return the file an encoder output buffer should be written to
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param buffer mmal buffer header pointer
+ * @return File handle, or NULL if the data is not wanted
+ */
+static FILE *buffer_file(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
+{
+   if (!buffer->length)
+      return NULL;
+
+   if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
+   {
+      //We do not want to save inlineMotionVectors unless asked to...
+      return pData->pstate->inlineMotionVectors ? pData->imv_file_handle : NULL;
+   }
+
+   return pData->file_handle;
+}
+
+/**
+ * Write the data of consecutive encoder output buffers to a file in one go
+ *
+ * @param file File to write to
+ * @param buffers Buffers to write
+ * @param count Number of buffers, no more than WRITER_BATCH_MAX
+ * @return 0 if all the data was written, -1 otherwise
+ */
+static int write_buffers(FILE *file, MMAL_BUFFER_HEADER_T **buffers, int count)
+{
+   struct iovec iov[WRITER_BATCH_MAX];
+   int i, first = 0, result = 0;
+
+   for (i = 0; i < count; i++)
+   {
+      mmal_buffer_header_mem_lock(buffers[i]);
+      iov[i].iov_base = buffers[i]->data;
+      iov[i].iov_len = buffers[i]->length;
+   }
+
+   // Anything written through the stdio handle must go first
+   fflush(file);
+
+   while (first < count)
+   {
+      ssize_t written = writev(fileno(file), iov + first, count - first);
+
+      if (written < 0 && errno == EINTR)
+         continue;
+
+      if (written <= 0)
+      {
+         vcos_log_error("Failed to write buffer data (%s)", written ? strerror(errno) : "no progress");
+         result = -1;
+         break;
+      }
+
+      // Skip what has been written, which may end part way through a buffer
+      while (first < count && (size_t)written >= iov[first].iov_len)
+      {
+         written -= iov[first].iov_len;
+         first++;
+      }
+
+      if (first < count)
+      {
+         iov[first].iov_base = (uint8_t *)iov[first].iov_base + written;
+         iov[first].iov_len -= written;
+      }
+   }
+
+   for (i = 0; i < count; i++)
+      mmal_buffer_header_mem_unlock(buffers[i]);
+
+   return result;
+}
+
+/**
+ * Release an encoder output buffer and send one back to the port (if still open)
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param buffer mmal buffer header pointer
+ */
+static void return_buffer(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_PORT_T *port = pData->port;
+   MMAL_BUFFER_HEADER_T *new_buffer;
+
+   // release buffer back to the pool
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled)
+   {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+
+      new_buffer = mmal_pool_get(pData->pstate->encoder_pool);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+
+      // With a writer thread the pool may be empty while buffers wait to be written,
+      // as may a circular buffer holding references
+      if ((!new_buffer && !pData->writer.running && !pData->circular.refs) || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the encoder port");
+   }
+}
+
+/**
+ * Write a run of entries taken from the writer ring, then return their buffers
+ *
+ * Stops before any buffer that starts a new segment, other than the first, or
+ * that goes to a different file.
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param entries Entries to write
+ * @param count Number of entries
+ * @return Number of entries dealt with
+ */
+static int writer_write_entries(PORT_USERDATA *pData, WRITER_ENTRY *entries, int count)
+{
+   RASPIVID_WRITER *writer = &pData->writer;
+   MMAL_BUFFER_HEADER_T *buffers[WRITER_BATCH_MAX];
+   int64_t start, stall;
+   FILE *file;
+   int n = 0, i;
+
+   start = vcos_getmicrosecs64();
+
+   // Segment rollover happens here, so the callback never waits for the filesystem
+   if (entries[0].split)
+      start_next_segment(pData);
+
+   file = buffer_file(pData, entries[0].buffer);
+   do
+   {
+      buffers[n] = entries[n].buffer;
+      n++;
+   }
+   while (n < count && n < WRITER_BATCH_MAX && !entries[n].split &&
+          buffer_file(pData, entries[n].buffer) == file);
+
+   if (file)
+   {
+      if (write_buffers(file, buffers, n) != 0)
+         pData->abort = 1;
+      writer->stats.writes++;
+   }
+
+   stall = vcos_getmicrosecs64() - start;
+   writer->stats.stall_us += stall;
+   if (stall > writer->stats.max_stall_us)
+      writer->stats.max_stall_us = stall;
+   writer->stats.buffers += n;
+
+   for (i = 0; i < n; i++)
+      return_buffer(pData, buffers[i]);
+
+   return n;
+}
+
+/**
+ * Writer thread: write out buffers queued by the encoder callback, in order
+ *
+ * @param arg Pointer to the encoder port userdata
+ */
+static void *writer_thread(void *arg)
+{
+   PORT_USERDATA *pData = (PORT_USERDATA *)arg;
+   RASPIVID_WRITER *writer = &pData->writer;
+   WRITER_ENTRY batch[WRITER_BATCH_MAX];
+   int n, done, i;
+
+   while (1)
+   {
+      vcos_semaphore_wait(&writer->work);
+
+      // Take everything ready, up to a batch, so that the ring has room again
+      // as early as possible
+      vcos_mutex_lock(&writer->lock);
+      for (n = 0; n < writer->count && n < WRITER_BATCH_MAX; n++)
+         batch[n] = writer->ring[(writer->head + n) % writer->depth];
+      writer->head = (writer->head + n) % writer->depth;
+      writer->count -= n;
+      if (!n && writer->stopping)
+      {
+         vcos_mutex_unlock(&writer->lock);
+         break;
+      }
+      vcos_mutex_unlock(&writer->lock);
+
+      // The semaphore was posted once per entry taken
+      for (i = 1; i < n; i++)
+         vcos_semaphore_wait(&writer->work);
+
+      for (done = 0; done < n; )
+         done += writer_write_entries(pData, batch + done, n - done);
+   }
+
+   return NULL;
+}
+
+/**
+ * Start the writer thread
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param depth Number of buffers that may wait to be written
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T writer_start(PORT_USERDATA *pData, int depth)
+{
+   RASPIVID_WRITER *writer = &pData->writer;
+   VCOS_STATUS_T status;
+
+   memset(writer, 0, sizeof(*writer));
+   writer->depth = depth;
+   writer->frame_start = 1;
+
+   writer->ring = calloc(depth, sizeof(*writer->ring));
+   if (!writer->ring)
+      return MMAL_ENOMEM;
+
+   status = vcos_mutex_create(&writer->lock, "raspivid-writer");
+   if (status != VCOS_SUCCESS)
+      goto error_mutex;
+
+   status = vcos_semaphore_create(&writer->work, "raspivid-writer", 0);
+   if (status != VCOS_SUCCESS)
+      goto error_semaphore;
+
+   // Set before the thread can make the callback see an empty pool as normal
+   writer->running = 1;
+   status = vcos_thread_create(&writer->thread, "raspivid-writer", NULL, writer_thread, pData);
+   if (status != VCOS_SUCCESS)
+      goto error_thread;
+
+   return MMAL_SUCCESS;
+
+error_thread:
+   writer->running = 0;
+   vcos_semaphore_delete(&writer->work);
+error_semaphore:
+   vcos_mutex_delete(&writer->lock);
+error_mutex:
+   free(writer->ring);
+   writer->ring = NULL;
+   return MMAL_ENOMEM;
+}
+
+/**
+ * Stop the writer thread once everything queued has been written
+ *
+ * The encoder output port must be disabled first, so no more buffers arrive.
+ *
+ * @param pData Pointer to the encoder port userdata
+ */
+static void writer_stop(PORT_USERDATA *pData)
+{
+   RASPIVID_WRITER *writer = &pData->writer;
+
+   if (!writer->running)
+      return;
+
+   vcos_mutex_lock(&writer->lock);
+   writer->stopping = 1;
+   vcos_semaphore_post(&writer->work);
+   vcos_mutex_unlock(&writer->lock);
+
+   vcos_thread_join(&writer->thread, NULL);
+   writer->running = 0;
+
+   vcos_semaphore_delete(&writer->work);
+   vcos_mutex_delete(&writer->lock);
+   free(writer->ring);
+   writer->ring = NULL;
+
+   if (pData->pstate->verbose)
+   {
+      WRITER_STATS *stats = &writer->stats;
+      fprintf(stderr, "Writer: %u buffers in %u writes, queue depth max %u/%d\n",
+              stats->buffers, stats->writes, stats->max_depth, writer->depth);
+      fprintf(stderr, "Writer: stalled %lld ms in total, %lld ms at most\n",
+              (long long)stats->stall_us / 1000, (long long)stats->max_stall_us / 1000);
+      fprintf(stderr, "Writer: dropped %u buffers, %u frames\n",
+              stats->dropped_buffers, stats->dropped_frames);
+   }
+}
+
+/**
+ * Queue an encoder output buffer for the writer thread, without blocking
+ *
+ * If the ring is full the buffer is dropped, along with everything up to the
+ * next key frame, as the stream would not decode with part of a frame missing.
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param buffer mmal buffer header pointer
+ * @param split Start the next segment before writing the buffer
+ * @return 0 if queued, -1 if the buffer was dropped and should be returned
+ */
+static int writer_queue(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer, int split)
+{
+   RASPIVID_WRITER *writer = &pData->writer;
+   int side_info = buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO;
+   int frame_start, result = 0;
+
+   vcos_mutex_lock(&writer->lock);
+
+   frame_start = writer->frame_start;
+   if (!side_info)
+      writer->frame_start = !!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+
+   // Resume at the header or key frame that starts a new group of pictures
+   if (writer->dropping && writer->count < writer->depth &&
+       ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) ||
+        (frame_start && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME))))
+      writer->dropping = 0;
+
+   if (writer->dropping || writer->count == writer->depth)
+   {
+      if (!writer->dropping)
+         vcos_log_error("Writer queue full, dropping output until the next key frame");
+      writer->dropping = 1;
+      writer->stats.dropped_buffers++;
+      if (!side_info && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END))
+         writer->stats.dropped_frames++;
+      // A dropped segment split is made where writing resumes instead
+      writer->split_pending |= split;
+      result = -1;
+   }
+   else
+   {
+      WRITER_ENTRY *entry = &writer->ring[(writer->head + writer->count) % writer->depth];
+      entry->buffer = buffer;
+      entry->split = split || writer->split_pending;
+      writer->split_pending = 0;
+      writer->count++;
+      if (writer->count > writer->stats.max_depth)
+         writer->stats.max_depth = writer->count;
+      vcos_semaphore_post(&writer->work);
+   }
+
+   vcos_mutex_unlock(&writer->lock);
+
+   return result;
+}
+
+/**
+ * Feed inline motion vectors to the motion detector, and decide whether
+ * a buffer is wanted
+ *
+ * Capture follows the motion, except in circular mode where each start of
+ * motion is a trigger. The camera keeps running while capture is paused, so
+ * that motion can still be seen, and output is discarded until capture
+ * resumes at a header or key frame.
+ *
+ * @param pData Pointer to the encoder port userdata
+ * @param buffer Encoder output buffer
+ * @return 1 if the buffer should be discarded, 0 otherwise
+ */
+static int motion_filter(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPIVID_STATE *pstate = pData->pstate;
+   int side_info = buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO;
+
+   if (side_info && buffer->length)
+   {
+      RASPIMOTION_RESULT result;
+      int64_t start = vcos_getmicrosecs64(), elapsed;
+      int analysed;
+
+      mmal_buffer_header_mem_lock(buffer);
+      analysed = raspimotion_add_data(&pData->motion, buffer->data + buffer->offset, buffer->length, &result);
+      mmal_buffer_header_mem_unlock(buffer);
+
+      elapsed = vcos_getmicrosecs64() - start;
+      pData->motion_time += elapsed;
+      if (elapsed > pData->motion_time_max)
+         pData->motion_time_max = elapsed;
+
+      if (analysed < 0)
+         vcos_log_error("Inline motion vectors do not match the frame size");
+      else if (analysed && result.changed)
+      {
+         if (pstate->verbose)
+            fprintf(stderr, "Motion %s, %d blocks at %d,%d-%d,%d\n", result.motion ? "started" : "stopped",
+                    result.largest, result.left, result.top, result.right, result.bottom);
+         vcos_semaphore_post(&pData->motion_sem);
+      }
+   }
+
+   if (!pstate->bCircularBuffer)
+   {
+      if (!pstate->bCapturing)
+         pData->motion_skip = 1;
+      else if (pData->motion_skip && !side_info &&
+               (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_CONFIG | MMAL_BUFFER_HEADER_FLAG_KEYFRAME)))
+         pData->motion_skip = 0;
+
+      if (pData->motion_skip)
+         return 1;
+   }
+
+   // Vectors only wanted for detection
+   return side_info && !pstate->inlineMotionVectors;
+}
+
 /**
  *  buffer header callback function for encoder
  *
- *  Callback will dump buffer data to the specific file
+ *  Callback will queue the buffer for the writer thread, or copy it to the
+ *  circular buffer, or dump the buffer data to the specific file if there is
+ *  no writer thread
  *
  * @param port Pointer to port from which callback originated
  * @param buffer mmal buffer header pointer
  */
 static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-   MMAL_BUFFER_HEADER_T *new_buffer;
    static int64_t base_time =  -1;
 
    // All our segment times based on the receipt of the first encoder callback
@@ -897,93 +1484,24 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 
    if (pData)
    {
-      int bytes_written = buffer->length;
       int64_t current_time = vcos_getmicrosecs64()/1000;
 
       vcos_assert(pData->file_handle);
       if(pData->pstate->inlineMotionVectors) vcos_assert(pData->imv_file_handle);
 
-      if (pData->cb_buff)
+      if (pData->pstate->waitMethod == WAIT_METHOD_MOTION && motion_filter(pData, buffer))
       {
-         int space_in_buff = pData->cb_len - pData->cb_wptr;
-         int copy_to_end = space_in_buff > buffer->length ? buffer->length : space_in_buff;
-         int copy_to_start = buffer->length - copy_to_end;
-
-         if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
-         {
-            if(pData->header_wptr + buffer->length > sizeof(pData->header_bytes))
-            {
-               vcos_log_error("Error in header bytes\n");
-            }
-            else
-            {
-               // These are the header bytes, save them for final output
-               mmal_buffer_header_mem_lock(buffer);
-               memcpy(pData->header_bytes + pData->header_wptr, buffer->data, buffer->length);
-               mmal_buffer_header_mem_unlock(buffer);
-               pData->header_wptr += buffer->length;
-            }
-         }
-         else if((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO))
-         {
-            // Do something with the inline motion vectors...
-         }
-         else
-         {
-            static int frame_start = -1;
-            int i;
-
-            if(frame_start == -1)
-               frame_start = pData->cb_wptr;
-
-            if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
-            {
-               pData->iframe_buff[pData->iframe_buff_wpos] = frame_start;
-               pData->iframe_buff_wpos = (pData->iframe_buff_wpos + 1) % IFRAME_BUFSIZE;
-            }
-
-            if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-               frame_start = -1;
-
-            // If we overtake the iframe rptr then move the rptr along
-            if((pData->iframe_buff_rpos + 1) % IFRAME_BUFSIZE != pData->iframe_buff_wpos)
-            {
-               while(
-                  (
-                     pData->cb_wptr <= pData->iframe_buff[pData->iframe_buff_rpos] &&
-                    (pData->cb_wptr + buffer->length) > pData->iframe_buff[pData->iframe_buff_rpos]
-                  ) ||
-                  (
-                    (pData->cb_wptr > pData->iframe_buff[pData->iframe_buff_rpos]) &&
-                    (pData->cb_wptr + buffer->length) > (pData->iframe_buff[pData->iframe_buff_rpos] + pData->cb_len)
-                  )
-               )
-                  pData->iframe_buff_rpos = (pData->iframe_buff_rpos + 1) % IFRAME_BUFSIZE;
-            }
-
-            mmal_buffer_header_mem_lock(buffer);
-            // We are pushing data into a circular buffer
-            memcpy(pData->cb_buff + pData->cb_wptr, buffer->data, copy_to_end);
-            memcpy(pData->cb_buff, buffer->data + copy_to_end, copy_to_start);
-            mmal_buffer_header_mem_unlock(buffer);
-
-            if((pData->cb_wptr + buffer->length) > pData->cb_len)
-               pData->cb_wrap = 1;
-
-            pData->cb_wptr = (pData->cb_wptr + buffer->length) % pData->cb_len;
-
-            for(i = pData->iframe_buff_rpos; i != pData->iframe_buff_wpos; i = (i + 1) % IFRAME_BUFSIZE)
-            {
-               int p = pData->iframe_buff[i];
-               if(pData->cb_buff[p] != 0 || pData->cb_buff[p+1] != 0 || pData->cb_buff[p+2] != 0 || pData->cb_buff[p+3] != 1)
-               {
-                  vcos_log_error("Error in iframe list\n");
-               }
-            }
-         }
+         // Not wanted, straight back to the encoder
       }
-      else 
+      else if (pData->pstate->bCircularBuffer)
       {
+         // The circular buffer copies the data, or takes its own reference
+         raspicircular_add(&pData->circular, buffer);
+      }
+      else
+      {
+         int split = 0;
+
          // For segmented record mode, we need to see if we have exceeded our time/size,
          // but also since we have inline headers turned on we need to break when we get one to
          // ensure that the new stream has the header in it. If we break on an I-frame, the
@@ -992,58 +1510,29 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
              ((pData->pstate->segmentSize && current_time > base_time + pData->pstate->segmentSize) ||
               (pData->pstate->splitWait && pData->pstate->splitNow)))
          {
-            FILE *new_handle;
-
             base_time = current_time;
 
             pData->pstate->splitNow = 0;
-            pData->pstate->segmentNumber++;
-
-            // Only wrap if we have a wrap point set
-            if (pData->pstate->segmentWrap && pData->pstate->segmentNumber > pData->pstate->segmentWrap)
-               pData->pstate->segmentNumber = 1;
-
-            new_handle = open_filename(pData->pstate);
-
-            if (new_handle)
-            {
-               fclose(pData->file_handle);
-               pData->file_handle = new_handle;
-            }
-
-            new_handle = open_imv_filename(pData->pstate);
+            split = 1;
+         }
 
-            if (new_handle)
-            {
-               fclose(pData->imv_file_handle);
-               pData->imv_file_handle = new_handle;
-            }
+         if (pData->writer.running)
+         {
+            // The writer thread returns the buffer once it has been written
+            if (writer_queue(pData, buffer, split) == 0)
+               return;
          }
-         if (buffer->length)
+         else
          {
-            mmal_buffer_header_mem_lock(buffer);
-            if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
-            {
-               if(pData->pstate->inlineMotionVectors)
-               {
-                  bytes_written = fwrite(buffer->data, 1, buffer->length, pData->imv_file_handle);
-               }
-               else
-               {
-                  //We do not want to save inlineMotionVectors...
-                  bytes_written = buffer->length;
-               }
-            }
-            else
-            {
-               bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);            
-            }
+            FILE *file;
 
-            mmal_buffer_header_mem_unlock(buffer);
+            if (split)
+               start_next_segment(pData);
 
-            if (bytes_written != buffer->length)
+            file = buffer_file(pData, buffer);
+            if (file && write_buffers(file, &buffer, 1) != 0)
             {
-               vcos_log_error("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
+               vcos_log_error("Failed to write buffer data - aborting");
                pData->abort = 1;
             }
          }
@@ -1052,24 +1541,11 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    else
    {
       vcos_log_error("Received a encoder buffer callback with no state");
+      mmal_buffer_header_release(buffer);
+      return;
    }
 
-   // release buffer back to the pool
-   mmal_buffer_header_release(buffer);
-
-   // and send one back to the port (if still open)
-   if (port->is_enabled)
-   {
-      MMAL_STATUS_T status;
-
-      new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue);
-
-      if (new_buffer)
-         status = mmal_port_send_buffer(port, new_buffer);
-
-      if (!new_buffer || status != MMAL_SUCCESS)
-         vcos_log_error("Unable to return a buffer to the encoder port");
-   }
+   return_buffer(pData, buffer);
 }
 
 
@@ -1373,6 +1849,20 @@ static MMAL_STATUS_T create_encoder_component(RASPIVID_STATE *state)
    if (encoder_output->buffer_num < encoder_output->buffer_num_min)
       encoder_output->buffer_num = encoder_output->buffer_num_min;
 
+   // Buffers waiting for the writer thread need replacing so the encoder keeps going
+   if (!state->bCircularBuffer)
+      encoder_output->buffer_num += state->writerQueue;
+   else if (state->circularRefs)
+   {
+      // A circular buffer holding references keeps up to a frame, or a buffer's
+      // worth of data, for each buffer over the whole length of the recording
+      int64_t bytes = (int64_t)state->bitrate * (state->timeout / 1000) / 8;
+
+      state->circularBuffers = (state->timeout / 1000) * state->framerate +
+                               (int)(bytes / encoder_output->buffer_size);
+      encoder_output->buffer_num += state->circularBuffers + 1;
+   }
+
    // We need to set the frame rate on output to 0, to ensure it gets
    // updated correctly from the input framerate when port connected
    encoder_output->format->es->video.frame_rate.num = 0;
@@ -1469,7 +1959,8 @@ static MMAL_STATUS_T create_encoder_component(RASPIVID_STATE *state)
    }
    
    //set INLINE VECTORS flag to request motion vector estimates
-   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, state->inlineMotionVectors) != MMAL_SUCCESS)
+   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS,
+                                       state->inlineMotionVectors || state->waitMethod == WAIT_METHOD_MOTION) != MMAL_SUCCESS)
    {
       vcos_log_error("failed to set INLINE VECTORS parameters");
       // Continue rather than abort..
@@ -1634,8 +2125,9 @@ static int wait_for_next_change(RASPIVID_STATE *state)
    if (complete_time == -1)
       complete_time =  current_time + state->timeout;
 
-   // if we have run out of time, flag we need to exit
-   if (current_time >= complete_time && state->timeout != 0)
+   // if we have run out of time, flag we need to exit. In circular mode the
+   // timeout is the length of the buffer instead
+   if (current_time >= complete_time && state->timeout != 0 && !state->bCircularBuffer)
       keep_running = 0;
 
    switch (state->waitMethod)
@@ -1683,6 +2175,28 @@ static int wait_for_next_change(RASPIVID_STATE *state)
          return keep_running;
    }
 
+   case WAIT_METHOD_MOTION:
+   {
+      PORT_USERDATA *pData = &state->callback_data;
+
+      if (state->verbose)
+         fprintf(stderr, "Waiting for motion to %s\n", state->bCircularBuffer ? "start" : state->bCapturing ? "stop" : "start");
+
+      // In circular mode wait for motion to start again, otherwise for it to
+      // disagree with whether we are capturing
+      while (state->bCircularBuffer ? pData->motion.events == state->motionEvents :
+                                      pData->motion.motion == state->bCapturing)
+      {
+         if (vcos_semaphore_wait_timeout(&pData->motion_sem, ABORT_INTERVAL) != VCOS_SUCCESS &&
+             state->timeout != 0 && !state->bCircularBuffer &&
+             vcos_getmicrosecs64()/1000 >= complete_time)
+            return 0;
+      }
+
+      state->motionEvents = pData->motion.events;
+      return keep_running;
+   }
+
    case WAIT_METHOD_SIGNAL:
    {
       // Need to wait for a SIGUSR1 signal
@@ -1715,6 +2229,52 @@ static int wait_for_next_change(RASPIVID_STATE *state)
    return keep_running;
 }
 
+/**
+ * Save a clip from the circular buffer
+ *
+ * The first clip goes to the output file opened at startup. In split mode each
+ * later one goes to a file of its own, named from the next segment number.
+ * The clip is written in the background, and the file closed once it is.
+ *
+ * @param state Pointer to state
+ *
+ * @return 0 if the clip was started, -1 if not
+ */
+static int save_circular_clip(RASPIVID_STATE *state)
+{
+   FILE *file = state->callback_data.file_handle;
+   int close_file = 0;
+
+   if (state->circularClips && file != stdout)
+   {
+      state->segmentNumber++;
+
+      if (state->segmentWrap && state->segmentNumber > state->segmentWrap)
+         state->segmentNumber = 1;
+
+      file = open_filename(state);
+      close_file = 1;
+   }
+
+   if (!file)
+      return -1;
+
+   if (state->verbose)
+      fprintf(stderr, "Saving circular buffer clip %d\n", state->circularClips + 1);
+
+   if (raspicircular_save(&state->callback_data.circular, file, close_file,
+                          state->circularPreroll, state->circularPostroll) != 0)
+   {
+      vcos_log_error("Failed to save circular buffer clip");
+      if (close_file)
+         fclose(file);
+      return -1;
+   }
+
+   state->circularClips++;
+   return 0;
+}
+
 /**
  * main
  */
@@ -1889,9 +2449,10 @@ int main(int argc, const char **argv)
                vcos_log_error("%s: Error, circular buffer size is based on timeout must be greater than zero\n", __func__);
                goto error;
             }
-            else if(state.waitMethod != WAIT_METHOD_KEYPRESS && state.waitMethod != WAIT_METHOD_SIGNAL)
+            else if(state.waitMethod != WAIT_METHOD_KEYPRESS && state.waitMethod != WAIT_METHOD_SIGNAL &&
+                    state.waitMethod != WAIT_METHOD_MOTION)
             {
-               vcos_log_error("%s: Error, Circular buffer mode requires either keypress (-k) or signal (-s) triggering\n", __func__);
+               vcos_log_error("%s: Error, Circular buffer mode requires keypress (-k), signal (-s) or motion (-mo) triggering\n", __func__);
                goto error;
             }
             else if(!state.callback_data.file_handle)
@@ -1901,33 +2462,65 @@ int main(int argc, const char **argv)
             }
             else
             {
-               int count = state.bitrate * (state.timeout / 1000) / 8;
+               int64_t bytes = (int64_t)state.bitrate * (state.timeout / 1000) / 8;
+               // Without references, allow a few buffers per frame before the bytes run out
+               int max_buffers = state.circularRefs ? state.circularBuffers :
+                                 vcos_max(256, (state.timeout / 1000) * state.framerate * 4);
 
-               state.callback_data.cb_buff = (char *) malloc(count);
-               if(state.callback_data.cb_buff == NULL)
+               if (raspicircular_create(&state.callback_data.circular, bytes, max_buffers, state.circularRefs) != MMAL_SUCCESS)
                {
                   vcos_log_error("%s: Unable to allocate circular buffer for %d seconds at %.1f Mbits\n", __func__, state.timeout / 1000, (double)state.bitrate/1000000.0);
                   goto error;
                }
-               else
-               {
-                  state.callback_data.cb_len = count;
-                  state.callback_data.cb_wptr = 0;
-                  state.callback_data.cb_wrap = 0;
-                  state.callback_data.cb_data = 0;
-                  state.callback_data.iframe_buff_wpos = 0;
-                  state.callback_data.iframe_buff_rpos = 0;
-                  state.callback_data.header_wptr = 0;
-               }
+            }
+         }
+
+         if (state.waitMethod == WAIT_METHOD_MOTION)
+         {
+            state.motion_parameters.hold_frames = vcos_max(1, state.motionHold * state.framerate / 1000);
+
+            // Start paused, capture begins with the first motion
+            if (!state.bCircularBuffer)
+               state.bCapturing = 1;
+
+            if (vcos_semaphore_create(&state.callback_data.motion_sem, "raspivid-motion", 0) != VCOS_SUCCESS)
+            {
+               vcos_log_error("%s: Failed to create motion semaphore", __func__);
+               goto error;
+            }
+
+            // The detector is only allocated once the semaphore exists, see the cleanup below
+            if (raspimotion_init(&state.callback_data.motion, RASPIMOTION_MBS(state.width), RASPIMOTION_MBS(state.height),
+                                 &state.motion_parameters) != 0)
+            {
+               vcos_log_error("%s: Failed to allocate the motion detector", __func__);
+               vcos_semaphore_delete(&state.callback_data.motion_sem);
+               goto error;
             }
          }
 
          // Set up our userdata - this is passed though to the callback where we need the information.
          state.callback_data.pstate = &state;
          state.callback_data.abort = 0;
+         state.callback_data.port = encoder_output_port;
 
          encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&state.callback_data;
 
+         // Writing to file is done off the callback thread, unless asked not to
+         if (state.callback_data.file_handle && !state.bCircularBuffer && state.writerQueue)
+         {
+            if (state.verbose)
+               fprintf(stderr, "Starting writer thread\n");
+
+            status = writer_start(&state.callback_data, state.writerQueue);
+
+            if (status != MMAL_SUCCESS)
+            {
+               vcos_log_error("Failed to start writer thread");
+               goto error;
+            }
+         }
+
          if (state.verbose)
             fprintf(stderr, "Enabling encoder output port\n");
 
@@ -1969,7 +2562,7 @@ int main(int argc, const char **argv)
                   int q;
                   for (q=0;q<num;q++)
                   {
-                     MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+                     MMAL_BUFFER_HEADER_T *buffer = mmal_pool_get(state.encoder_pool);
 
                      if (!buffer)
                         vcos_log_error("Unable to get a required buffer %d from pool queue", q);
@@ -1986,15 +2579,24 @@ int main(int argc, const char **argv)
 
                   state.bCapturing = !state.bCapturing;
 
-                  if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, state.bCapturing) != MMAL_SUCCESS)
+                  // In circular buffer mode a trigger saves a clip while capture carries on,
+                  // then we exit unless each trigger is to have a file of its own
+                  if(state.bCircularBuffer && !state.bCapturing)
                   {
-                     // How to handle?
+                     state.bCapturing = 1;
+
+                     if (save_circular_clip(&state) != 0 || !state.splitWait)
+                        break;
+
+                     running = wait_for_next_change(&state);
+                     continue;
                   }
 
-                  // In circular buffer mode, exit and save the buffer (make sure we do this after having paused the capture
-                  if(state.bCircularBuffer && !state.bCapturing)
+                  // Motion can only be seen while the camera runs, so pausing just discards the output
+                  if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE,
+                                                      state.bCapturing || state.waitMethod == WAIT_METHOD_MOTION) != MMAL_SUCCESS)
                   {
-                     break;
+                     // How to handle?
                   }
 
                   if (state.verbose)
@@ -2005,20 +2607,20 @@ int main(int argc, const char **argv)
                         fprintf(stderr, "Pausing video capture\n");
                   }
                   
-                  if(state.splitWait)
+                  // Resumed motion output is held back until a key frame, so ask for one now
+                  // rather than waiting for the next intra period
+                  if (state.bCapturing && (state.splitWait || state.waitMethod == WAIT_METHOD_MOTION))
                   {
-                     if(state.bCapturing)
-                     {
-                        if (mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1) != MMAL_SUCCESS)
-                        {
-                           vcos_log_error("failed to request I-FRAME");
-                        }
-                     }
-                     else
+                     if (mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1) != MMAL_SUCCESS)
                      {
-                        if(!initialCapturing)
-                           state.splitNow=1;   
+                        vcos_log_error("failed to request I-FRAME");
                      }
+                  }
+
+                  if(state.splitWait)
+                  {
+                     if(!state.bCapturing && !initialCapturing)
+                        state.splitNow=1;
                      initialCapturing=0;
                   }
                   running = wait_for_next_change(&state);
@@ -2048,21 +2650,12 @@ int main(int argc, const char **argv)
 
       if(state.bCircularBuffer)
       {
-         int copy_from_end, copy_from_start;
-
-         copy_from_end = state.callback_data.cb_len - state.callback_data.iframe_buff[state.callback_data.iframe_buff_rpos];
-         copy_from_start = state.callback_data.cb_len - copy_from_end;
-         copy_from_start = state.callback_data.cb_wptr < copy_from_start ? state.callback_data.cb_wptr : copy_from_start;
-         if(!state.callback_data.cb_wrap)
-         {
-            copy_from_start = state.callback_data.cb_wptr;
-            copy_from_end = 0;
-         }
+         // Exiting without a trigger saves what is buffered, as a trigger would
+         if (!state.circularClips)
+            save_circular_clip(&state);
 
-         fwrite(state.callback_data.header_bytes, 1, state.callback_data.header_wptr, state.callback_data.file_handle);
-         // Save circular buffer
-         fwrite(state.callback_data.cb_buff + state.callback_data.iframe_buff[state.callback_data.iframe_buff_rpos], 1, copy_from_end, state.callback_data.file_handle);
-         fwrite(state.callback_data.cb_buff, 1, copy_from_start, state.callback_data.file_handle);
+         // Wait for post-roll, with the encoder still running
+         raspicircular_flush(&state.callback_data.circular);
       }
 
 error:
@@ -2076,6 +2669,26 @@ error:
       check_disable_port(camera_still_port);
       check_disable_port(encoder_output_port);
 
+      // Write out anything still queued, now no more can arrive
+      writer_stop(&state.callback_data);
+
+      if (state.verbose && state.bCircularBuffer)
+         raspicircular_dump_stats(&state.callback_data.circular);
+
+      raspicircular_destroy(&state.callback_data.circular);
+
+      if (state.callback_data.motion.mask)
+      {
+         if (state.verbose && state.callback_data.motion.frames)
+            fprintf(stderr, "Motion: %u frames analysed, %u starts, %lld us per frame, %lld us at most\n",
+                    state.callback_data.motion.frames, state.callback_data.motion.events,
+                    (long long)(state.callback_data.motion_time / state.callback_data.motion.frames),
+                    (long long)state.callback_data.motion_time_max);
+
+         raspimotion_destroy(&state.callback_data.motion);
+         vcos_semaphore_delete(&state.callback_data.motion_sem);
+      }
+
       if (state.preview_parameters.wantPreview && state.preview_connection)
          mmal_connection_destroy(state.preview_connection);
 
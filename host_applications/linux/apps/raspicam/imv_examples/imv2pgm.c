@@ -27,62 +27,55 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h> 
 
-typedef struct
-{
-   signed char x_vector;
-   signed char y_vector;
-   short sad;
-} INLINE_MOTION_VECTOR; 
+#include "../RaspiMotion.h"
 
 int main(int argc, const char **argv)
 {
    if(argc!=5)
    {
       printf("usage: %s data.imv mbx mby out.pgm\n",argv[0]);
+      printf("out.pgm may contain a format such as %%04d, to write every frame numbered from 1\n");
       return 0;
    }
    int mbx=atoi(argv[2]);
    int mby=atoi(argv[3]);
- 
-   ///////////////////////////////
-   //  Read raw file to buffer  //
-   ///////////////////////////////
-   FILE *f = fopen(argv[1], "rb");
-   fseek(f, 0, SEEK_END);
-   long fsize = ftell(f);
-   fseek(f, 0, SEEK_SET);
-   char *buffer = malloc(fsize + 1);
-   fread(buffer, fsize, 1, f);
-   fclose(f); 
-   buffer[fsize] = 0;
-   
-   ///////////////////
-   //  Fill struct  //
-   ///////////////////
-   if(fsize<(mbx+1)*mby*4)
+   int every=strchr(argv[4],'%')!=NULL;
+
+   ////////////////////////////////////
+   //  Read the file frame by frame  //
+   ////////////////////////////////////
+   RASPIMOTION_READER reader;
+   if(raspimotion_reader_open(&reader,argv[1],mbx,mby)!=0)
    {
-      printf("File to short!\n");
+      printf("Cannot read %s\n",argv[1]);
       return 0;
    }
-   INLINE_MOTION_VECTOR *imv; 
-   imv = malloc((mbx+1)*mby*sizeof(INLINE_MOTION_VECTOR));
-   memcpy ( &imv[0], &buffer[0], (mbx+1)*mby*sizeof(INLINE_MOTION_VECTOR) );
 
-   /////////////////////
-   //  Export to PGM  //
-   /////////////////////    
-   FILE *out = fopen(argv[4], "w");
-   fprintf(out,"P5\n%d %d\n255\n",mbx,mby);  
-   int i,j;
-   for(j=0;j<mby; j++)
-      for(i=0;i<mbx; i++)
+   unsigned char *mag=malloc(mbx*mby);
+   const RASPIMOTION_VECTOR *imv;
+   while((imv=raspimotion_reader_next(&reader))!=NULL)
    {
-         unsigned char magU=floor(sqrt(imv[i+(mbx+1)*j].x_vector*imv[i+(mbx+1)*j].x_vector+imv[i+(mbx+1)*j].y_vector*imv[i+(mbx+1)*j].y_vector));
-         fputc(magU,out);
+      /////////////////////
+      //  Export to PGM  //
+      /////////////////////
+      char name[1024];
+      snprintf(name,sizeof(name),argv[4],reader.frames);
+      raspimotion_magnitudes(imv,mbx,mby,mag);
+      FILE *out = fopen(name, "w");
+      fprintf(out,"P5\n%d %d\n255\n",mbx,mby);
+      fwrite(mag,1,mbx*mby,out);
+      fclose(out);
+
+      if(!every)
+         break;
    }
-   fclose(out);
+
+   if(!reader.frames)
+      printf("File to short!\n");
+
+   free(mag);
+   raspimotion_reader_close(&reader);
  return 0;
  
 }
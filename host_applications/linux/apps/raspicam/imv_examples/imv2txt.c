@@ -26,14 +26,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
-typedef struct
-{
-   signed char x_vector;
-   signed char y_vector;
-   short sad;
-} INLINE_MOTION_VECTOR; 
+#include "../RaspiMotion.h"
 
 int main(int argc, const char **argv)
 {
@@ -45,29 +39,22 @@ int main(int argc, const char **argv)
    int mbx=atoi(argv[2]);
    int mby=atoi(argv[3]);
  
-   ///////////////////////////////
-   //  Read raw file to buffer  //
-   ///////////////////////////////
-   FILE *f = fopen(argv[1], "rb");
-   fseek(f, 0, SEEK_END);
-   long fsize = ftell(f);
-   fseek(f, 0, SEEK_SET);
-   char *buffer = malloc(fsize + 1);
-   fread(buffer, fsize, 1, f);
-   fclose(f); 
-   buffer[fsize] = 0;
-   
-   ///////////////////
-   //  Fill struct  //
-   ///////////////////
-   if(fsize<(mbx+1)*mby*4)
+   ////////////////////////////////
+   //  Read the first frame only  //
+   ////////////////////////////////
+   RASPIMOTION_READER reader;
+   if(raspimotion_reader_open(&reader,argv[1],mbx,mby)!=0)
+   {
+      printf("Cannot read %s\n",argv[1]);
+      return 0;
+   }
+   const RASPIMOTION_VECTOR *imv=raspimotion_reader_next(&reader);
+   if(!imv)
    {
       printf("File to short!\n");
+      raspimotion_reader_close(&reader);
       return 0;
    }
-   INLINE_MOTION_VECTOR *imv; 
-   imv = malloc((mbx+1)*mby*sizeof(INLINE_MOTION_VECTOR));
-   memcpy ( &imv[0], &buffer[0], (mbx+1)*mby*sizeof(INLINE_MOTION_VECTOR) );
 
    //////////////////////////
    //  Export to txt data  //
@@ -81,6 +68,7 @@ int main(int argc, const char **argv)
       fprintf(out,"%g %g %d %d %d\n",(i+0.5)*16.,(mby-j-0.5)*16.,-imv[i+(mbx+1)*j].x_vector,imv[i+(mbx+1)*j].y_vector,imv[i+(mbx+1)*j].sad);
    }
    fclose(out);
+   raspimotion_reader_close(&reader);
  return 0;
  
 }
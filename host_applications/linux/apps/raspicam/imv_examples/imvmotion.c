@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2014, Christian Kroener
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../RaspiMotion.h"
+
+int main(int argc, const char **argv)
+{
+   if(argc<4 || argc>5)
+   {
+      printf("usage: %s data.imv mbx mby [len[,sad[,blocks]]]\n",argv[0]);
+      return 0;
+   }
+   int mbx=atoi(argv[2]);
+   int mby=atoi(argv[3]);
+
+   RASPIMOTION_PARAMETERS params;
+   raspimotion_set_defaults(&params);
+   if(argc==5)
+      sscanf(argv[4],"%d,%d,%d",&params.magnitude,&params.sad,&params.min_blocks);
+
+   RASPIMOTION motion;
+   RASPIMOTION_READER reader;
+   if(raspimotion_init(&motion,mbx,mby,&params)!=0 || raspimotion_reader_open(&reader,argv[1],mbx,mby)!=0)
+   {
+      printf("Cannot read %s\n",argv[1]);
+      return 0;
+   }
+
+   ////////////////////////////////////////////
+   //  Replay the frames through the detector  //
+   ////////////////////////////////////////////
+   printf("#frame active regions largest left top right bottom motion\n");
+   const RASPIMOTION_VECTOR *imv;
+   double total=0;
+   while((imv=raspimotion_reader_next(&reader))!=NULL)
+   {
+      RASPIMOTION_RESULT result;
+      struct timespec t0,t1;
+
+      clock_gettime(CLOCK_MONOTONIC,&t0);
+      raspimotion_analyse(&motion,imv,&result);
+      clock_gettime(CLOCK_MONOTONIC,&t1);
+      total+=(t1.tv_sec-t0.tv_sec)*1e6+(t1.tv_nsec-t0.tv_nsec)/1e3;
+
+      printf("%u %d %d %d %d %d %d %d %d%s\n",reader.frames,result.active,result.regions,result.largest,
+             result.left,result.top,result.right,result.bottom,result.motion,result.changed?" *":"");
+   }
+
+   if(reader.frames)
+      printf("#%u frames, %u motion starts, %.1f us per frame\n",reader.frames,motion.events,total/reader.frames);
+
+   raspimotion_reader_close(&reader);
+   raspimotion_destroy(&motion);
+ return 0;
+
+}
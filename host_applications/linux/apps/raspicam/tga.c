@@ -31,8 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define TGA_WRITE(FP, F) \
    if (fwrite((&F), sizeof(F), 1, (FP)) != 1) goto write_fail
-int write_tga(FILE *fp, int width, int height,
-      uint8_t *buffer, size_t buffer_size)
+int write_tga_header(FILE *fp, int width, int height)
 {
    struct tga_header header;
    memset(&header, 0, sizeof(header));
@@ -55,14 +54,23 @@ int write_tga(FILE *fp, int width, int height,
    TGA_WRITE(fp, header.image_info.bpp);
    TGA_WRITE(fp, header.image_info.descriptor);
 
-   if (fwrite(buffer, 1, buffer_size, fp) != buffer_size)
-      goto write_fail;
-
    return 0;
 write_fail:
    return -1;
 }
 
+int write_tga(FILE *fp, int width, int height,
+      uint8_t *buffer, size_t buffer_size)
+{
+   if (write_tga_header(fp, width, height) != 0)
+      return -1;
+
+   if (fwrite(buffer, 1, buffer_size, fp) != buffer_size)
+      return -1;
+
+   return 0;
+}
+
 #define TGA_READ(FP, F) if (fread((&F), sizeof(F), 1, (FP)) != 1) goto read_fail
 
 static int read_header(FILE *fp, struct tga_header *header) {
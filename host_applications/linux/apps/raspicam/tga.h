@@ -67,6 +67,7 @@ struct tga_header {
    struct tga_image_info image_info;
 };
 
+int write_tga_header(FILE* fp, int width, int height);
 int write_tga(FILE* fp, int width, int height, uint8_t *buffer, size_t buffer_size);
 unsigned char *load_tga(const char *filename, struct tga_header *header);
 
@@ -48,17 +48,32 @@ typedef struct
 
 } VCSM_CACHE_MUTEX_LKUP_T;
 
+typedef struct VCSM_HDL_CACHE_ENTRY_T
+{
+   struct VCSM_HDL_CACHE_ENTRY_T *next;
+   unsigned int handle;
+   unsigned int size;      /* Size of the allocation, as seen by the driver. */
+   unsigned int addr;      /* Address returned by the last lock, 0 if none. */
+
+} VCSM_HDL_CACHE_ENTRY_T;
+
 #define VCSM_DEVICE_NAME      "/dev/vcsm"
 #define VCSM_INVALID_HANDLE   (-1)
 
+#define VCSM_HDL_CACHE_BUCKETS   64    /* Must be a power of 2. */
+#define VCSM_CACHE_LINE_SIZE     64    /* Default, must be a power of 2. */
+
 static VCOS_LOG_CAT_T usrvcsm_log_category;
 #define VCOS_LOG_CATEGORY (&usrvcsm_log_category)
 static int vcsm_handle = VCSM_INVALID_HANDLE;
 static int vcsm_refcount;
 static unsigned int vcsm_page_size = 0;
+static unsigned int vcsm_cache_line_size = VCSM_CACHE_LINE_SIZE;
 
 static VCOS_ONCE_T vcsm_once = VCOS_ONCE_INIT;
 static VCOS_MUTEX_T vcsm_mutex;
+static VCSM_HDL_CACHE_ENTRY_T *vcsm_hdl_cache[VCSM_HDL_CACHE_BUCKETS];
+static VCSM_STATS_T vcsm_stats;
 /* Cache [(current, new) -> outcome] mapping table, ignoring identity.
 **
 ** Note: Videocore cache mode cannot be udpated 'lock' time.
@@ -110,6 +125,234 @@ static VCSM_CACHE_TYPE_T vcsm_cache_table_lookup( VCSM_CACHE_TYPE_T current,
    return current;
 }
 
+/* Handle cache.
+**
+** Remembers the size of, and the address last returned by a lock of, each
+** handle this process has used so that repeated locks and unlocks of the
+** same buffer do not have to query the driver for it every time.  Entries
+** are dropped whenever the size or mapping of a buffer may change (free,
+** resize, cache mode change) and when the device is closed.
+**
+** Protected by vcsm_mutex, which is never held across an ioctl.
+*/
+static unsigned int vcsm_hdl_cache_hash( unsigned int handle )
+{
+   return (handle ^ (handle >> 8)) & (VCSM_HDL_CACHE_BUCKETS - 1);
+}
+
+static VCSM_HDL_CACHE_ENTRY_T **vcsm_hdl_cache_find( unsigned int handle )
+{
+   VCSM_HDL_CACHE_ENTRY_T **pp_entry = &vcsm_hdl_cache[vcsm_hdl_cache_hash( handle )];
+
+   while ( (*pp_entry != NULL) && ((*pp_entry)->handle != handle) )
+   {
+      pp_entry = &(*pp_entry)->next;
+   }
+   return pp_entry;
+}
+
+/* Returns 1 and fills in size (and addr, if known) when the handle is cached.
+*/
+static int vcsm_hdl_cache_lookup( unsigned int handle,
+                                  unsigned int *size,
+                                  unsigned int *addr )
+{
+   VCSM_HDL_CACHE_ENTRY_T *entry;
+
+   vcos_mutex_lock( &vcsm_mutex );
+   entry = *vcsm_hdl_cache_find( handle );
+   if ( entry != NULL )
+   {
+      *size = entry->size;
+      if ( addr != NULL )
+      {
+         *addr = entry->addr;
+      }
+      vcsm_stats.hdl_cache_hits++;
+   }
+   else
+   {
+      vcsm_stats.hdl_cache_misses++;
+   }
+   vcos_mutex_unlock( &vcsm_mutex );
+
+   return (entry != NULL);
+}
+
+static void vcsm_hdl_cache_update( unsigned int handle,
+                                   unsigned int size,
+                                   unsigned int addr )
+{
+   VCSM_HDL_CACHE_ENTRY_T **pp_entry;
+
+   vcos_mutex_lock( &vcsm_mutex );
+   pp_entry = vcsm_hdl_cache_find( handle );
+   if ( *pp_entry == NULL )
+   {
+      /* Failing to allocate only costs us a size query later on.
+      */
+      *pp_entry = vcos_calloc( 1, sizeof(**pp_entry), "vcsm hdl cache" );
+   }
+   if ( *pp_entry != NULL )
+   {
+      (*pp_entry)->handle = handle;
+      (*pp_entry)->size   = size;
+      (*pp_entry)->addr   = addr;
+   }
+   vcos_mutex_unlock( &vcsm_mutex );
+}
+
+static void vcsm_hdl_cache_remove( unsigned int handle )
+{
+   VCSM_HDL_CACHE_ENTRY_T **pp_entry;
+   VCSM_HDL_CACHE_ENTRY_T *entry;
+
+   vcos_mutex_lock( &vcsm_mutex );
+   pp_entry = vcsm_hdl_cache_find( handle );
+   entry = *pp_entry;
+   if ( entry != NULL )
+   {
+      *pp_entry = entry->next;
+   }
+   vcos_mutex_unlock( &vcsm_mutex );
+
+   vcos_free( entry );
+}
+
+/* Called with vcsm_mutex held.
+*/
+static void vcsm_hdl_cache_clear( void )
+{
+   VCSM_HDL_CACHE_ENTRY_T *entry;
+   unsigned int i;
+
+   for ( i = 0; i < VCSM_HDL_CACHE_BUCKETS; i++ )
+   {
+      while ( (entry = vcsm_hdl_cache[i]) != NULL )
+      {
+         vcsm_hdl_cache[i] = entry->next;
+         vcos_free( entry );
+      }
+   }
+}
+
+/* Clamps [offset; offset + size[ to a buffer of 'buf_size' bytes and widens
+** it to whole cache lines.  Returns the number of bytes to operate on, 0 if
+** the range is empty.
+*/
+static unsigned int vcsm_clip_range( unsigned int buf_size,
+                                     unsigned int *offset,
+                                     unsigned int size )
+{
+   unsigned int start, end;
+
+   if ( (*offset >= buf_size) || (size == 0) )
+   {
+      return 0;
+   }
+
+   end   = (size > buf_size - *offset) ? buf_size : *offset + size;
+   start = *offset & ~(vcsm_cache_line_size - 1);
+   end   = (end + vcsm_cache_line_size - 1) & ~(vcsm_cache_line_size - 1);
+   if ( end > buf_size )
+   {
+      end = buf_size;
+   }
+
+   *offset = start;
+   return end - start;
+}
+
+/* Invalidates (VMCS_SM_IOCTL_MEM_INVALID) or cleans (VMCS_SM_IOCTL_MEM_FLUSH)
+** the host cache for part of a locked buffer and accounts for it.
+*/
+static int vcsm_cache_op( unsigned int cmd,
+                          unsigned int handle,
+                          unsigned int addr,
+                          unsigned int size )
+{
+   struct vmcs_sm_ioctl_cache cache;
+   const char *what = (cmd == VMCS_SM_IOCTL_MEM_INVALID) ? "invalidate" : "flush";
+   int rc;
+
+   memset( &cache, 0, sizeof(cache) );
+
+   cache.handle = handle;
+   cache.addr   = addr;
+   cache.size   = size;
+
+   rc = ioctl( vcsm_handle,
+               cmd,
+               &cache );
+
+   vcos_log_trace( "[%s]: [%d]: ioctl %s (cache) %d (hdl: %x, addr: %x, size: %u)",
+                   __func__,
+                   getpid(),
+                   what,
+                   rc,
+                   cache.handle,
+                   cache.addr,
+                   cache.size );
+
+   if ( rc < 0 )
+   {
+      vcos_log_error( "[%s]: [%d]: %s failed (rc: %d) - [%x;%x] - size: %u (hdl: %x) - cache incoherency",
+                      __func__,
+                      getpid(),
+                      what,
+                      rc,
+                      (unsigned int) cache.addr,
+                      (unsigned int) (cache.addr + cache.size),
+                      (unsigned int) (cache.addr + cache.size) - (unsigned int) cache.addr,
+                      cache.handle );
+      return rc;
+   }
+
+   vcos_mutex_lock( &vcsm_mutex );
+   if ( cmd == VMCS_SM_IOCTL_MEM_INVALID )
+   {
+      vcsm_stats.bytes_invalidated += size;
+   }
+   else
+   {
+      vcsm_stats.bytes_cleaned += size;
+   }
+   vcos_mutex_unlock( &vcsm_mutex );
+
+   return rc;
+}
+
+/* Unlocks a handle all the way through videocore and accounts for it.
+*/
+static int vcsm_mem_unlock( unsigned int handle )
+{
+   struct vmcs_sm_ioctl_lock_unlock lock_unlock;
+   int rc;
+
+   memset( &lock_unlock, 0, sizeof(lock_unlock) );
+
+   lock_unlock.handle    = handle;
+
+   rc = ioctl( vcsm_handle,
+               VMCS_SM_IOCTL_MEM_UNLOCK,
+               &lock_unlock );
+
+   vcos_log_trace( "[%s]: [%d]: ioctl mem-unlock %d (hdl: %x)",
+                   __func__,
+                   getpid(),
+                   rc,
+                   lock_unlock.handle );
+
+   if ( rc >= 0 )
+   {
+      vcos_mutex_lock( &vcsm_mutex );
+      vcsm_stats.unlock_count++;
+      vcos_mutex_unlock( &vcsm_mutex );
+   }
+
+   return rc;
+}
+
 /* A one off vcsm initialization routine
 */
 static void vcsm_init_once(void)
@@ -118,6 +361,20 @@ static void vcsm_init_once(void)
    vcos_log_set_level(&usrvcsm_log_category, VCOS_LOG_ERROR);
    usrvcsm_log_category.flags.want_prefix = 0;
    vcos_log_register( "usrvcsm", &usrvcsm_log_category );
+
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+   /* Cache maintenance ranges are widened to whole lines, so only ever go
+   ** for a larger line than the default.
+   */
+   {
+      long line = sysconf( _SC_LEVEL1_DCACHE_LINESIZE );
+
+      if ( (line > VCSM_CACHE_LINE_SIZE) && !(line & (line - 1)) )
+      {
+         vcsm_cache_line_size = (unsigned int) line;
+      }
+   }
+#endif
 }
 
 
@@ -190,6 +447,7 @@ void vcsm_exit( void )
 
    close( vcsm_handle );
    vcsm_handle = VCSM_INVALID_HANDLE;
+   vcsm_hdl_cache_clear();
 
 out:
    vcos_mutex_unlock( &vcsm_mutex );
@@ -285,6 +543,8 @@ unsigned int vcsm_malloc_cache( unsigned int size, VCSM_CACHE_TYPE_T cache, char
       goto error;
    }
 
+   vcsm_hdl_cache_update( alloc.handle, alloc.size, 0 );
+
    return alloc.handle;
 
  error:
@@ -481,6 +741,7 @@ void vcsm_free( unsigned int handle )
 
    /* Free the allocated buffer all the way through videocore.
    */
+   vcsm_hdl_cache_remove( sz.handle );
    alloc_free.handle    = sz.handle;
 
    rc = ioctl( vcsm_handle,
@@ -805,26 +1066,21 @@ unsigned int vcsm_usr_handle( void *usr_ptr )
 }
 
 
-/* Locks the memory associated with this opaque handle.
-**
-** Returns:        NULL on error
-**                 a valid pointer on success.
-**
-** A user MUST lock the handle received from vcsm_malloc
-** in order to be able to use the memory associated with it.
-**
-** On success, the pointer returned is only valid within
-** the lock content (ie until a corresponding vcsm_unlock_xx
-** is invoked).
+/* Locks a handle and invalidates the host cache for the part of the buffer
+** described by [offset; offset + size[ (clipped to the buffer), the whole
+** buffer if 'whole' is set.  The size of the buffer is taken from the handle
+** cache when possible.
 */
-void *vcsm_lock( unsigned int handle )
+static void *vcsm_lock_internal( unsigned int handle,
+                                 unsigned int offset,
+                                 unsigned int size,
+                                 int whole )
 {
    int rc;
    struct vmcs_sm_ioctl_lock_unlock lock_unlock;
    struct vmcs_sm_ioctl_size sz;
-   struct vmcs_sm_ioctl_map map;
-   struct vmcs_sm_ioctl_cache cache;
    void *usr_ptr = NULL;
+   int cached;
 
    if ( (vcsm_handle == VCSM_INVALID_HANDLE) || (handle == 0) ) 
    {
@@ -837,29 +1093,31 @@ void *vcsm_lock( unsigned int handle )
 
    memset( &sz, 0, sizeof(sz) );
    memset( &lock_unlock, 0, sizeof(lock_unlock) );
-   memset( &map, 0, sizeof(map) );
-   memset( &cache, 0, sizeof(cache) );
 
-   /* Verify what we want is valid.
-   */
    sz.handle = handle;
 
-   rc = ioctl( vcsm_handle,
-               VMCS_SM_IOCTL_SIZE_USR_HDL,
-               &sz );
+   cached = vcsm_hdl_cache_lookup( handle, &sz.size, NULL );
+   if ( !cached )
+   {
+      /* Verify what we want is valid.
+      */
+      rc = ioctl( vcsm_handle,
+                  VMCS_SM_IOCTL_SIZE_USR_HDL,
+                  &sz );
 
-   vcos_log_trace( "[%s]: [%d]: ioctl size-usr-hdl %d (hdl: %x) - size %u",
-                   __func__,
-                   getpid(),
-                   rc,
-                   sz.handle,
-                   sz.size );
+      vcos_log_trace( "[%s]: [%d]: ioctl size-usr-hdl %d (hdl: %x) - size %u",
+                      __func__,
+                      getpid(),
+                      rc,
+                      sz.handle,
+                      sz.size );
 
-   /* We will not be able to lock the resource!
-   */
-   if ( (rc < 0) || (sz.size == 0) )
-   {
-      goto out;
+      /* We will not be able to lock the resource!
+      */
+      if ( (rc < 0) || (sz.size == 0) )
+      {
+         goto out;
+      }
    }
 
    /* Lock the allocated buffer all the way through videocore.
@@ -876,54 +1134,114 @@ void *vcsm_lock( unsigned int handle )
                    rc,
                    lock_unlock.handle );
 
-   /* We will not be able to lock the resource!
+   /* We will not be able to lock the resource!  If the size came from the
+   ** handle cache, the handle is likely stale so forget about it.
    */
    if ( rc < 0 )
    {
+      if ( cached )
+      {
+         vcsm_hdl_cache_remove( handle );
+      }
       goto out;
    }
 
    usr_ptr = (void *) lock_unlock.addr;
+   vcsm_hdl_cache_update( sz.handle, sz.size, lock_unlock.addr );
+
+   vcos_mutex_lock( &vcsm_mutex );
+   vcsm_stats.lock_count++;
+   vcos_mutex_unlock( &vcsm_mutex );
 
    /* If applicable, invalidate the cache now.
    */
-   if ( usr_ptr && sz.size )
+   if ( whole )
    {
-      cache.handle = sz.handle;
-      cache.addr   = (unsigned int) usr_ptr;
-      cache.size   = sz.size;
+      offset = 0;
+      size   = sz.size;
+   }
+   size = vcsm_clip_range( sz.size, &offset, size );
+   if ( usr_ptr && size )
+   {
+      vcsm_cache_op( VMCS_SM_IOCTL_MEM_INVALID,
+                     sz.handle,
+                     lock_unlock.addr + offset,
+                     size );
+   }
 
-      rc = ioctl( vcsm_handle,
-                  VMCS_SM_IOCTL_MEM_INVALID,
-                  &cache );
+out:
+   return usr_ptr;
+}
 
-      vcos_log_trace( "[%s]: [%d]: ioctl invalidate (cache) %d (hdl: %x, addr: %x, size: %u)",
-                      __func__,
-                      getpid(),
-                      rc,
-                      cache.handle,
-                      cache.addr,
-                      cache.size );
 
-      if ( rc < 0 )
+/* Locks the memory associated with this opaque handle.
+**
+** Returns:        NULL on error
+**                 a valid pointer on success.
+**
+** A user MUST lock the handle received from vcsm_malloc
+** in order to be able to use the memory associated with it.
+**
+** On success, the pointer returned is only valid within
+** the lock content (ie until a corresponding vcsm_unlock_xx
+** is invoked).
+*/
+void *vcsm_lock( unsigned int handle )
+{
+   return vcsm_lock_internal( handle, 0, 0, 1 );
+}
+
+
+/* Locks the memory associated with this opaque handle, only invalidating
+** the host cache for [offset; offset + size[.
+**
+** Returns:        NULL on error
+**                 the address of the start of the buffer on success.
+*/
+void *vcsm_lock_range( unsigned int handle, unsigned int offset, unsigned int size )
+{
+   return vcsm_lock_internal( handle, offset, size, 0 );
+}
+
+
+/* Locks 'count' handles.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_lock_batch( const unsigned int *handles, void **usr_ptrs, unsigned int count )
+{
+   unsigned int i;
+
+   if ( (handles == NULL) || (usr_ptrs == NULL) )
+   {
+      return -EINVAL;
+   }
+
+   for ( i = 0; i < count; i++ )
+   {
+      usr_ptrs[i] = vcsm_lock_internal( handles[i], 0, 0, 1 );
+      if ( usr_ptrs[i] == NULL )
       {
-         vcos_log_error( "[%s]: [%d]: invalidate failed (rc: %d) - [%x;%x] - size: %u (hdl: %x) - cache incoherency",
+         vcos_log_error( "[%s]: [%d]: lock %u/%u failed (hdl: %x)",
                          __func__,
                          getpid(),
-                         rc,
-                         (unsigned int) cache.addr,
-                         (unsigned int) (cache.addr + cache.size),
-                         (unsigned int) (cache.addr + cache.size) - (unsigned int) cache.addr,
-                         cache.handle );
+                         i,
+                         count,
+                         handles[i] );
+
+         /* All or nothing: give back what we already hold.
+         */
+         while ( i-- > 0 )
+         {
+            vcsm_unlock_hdl_sp( handles[i], 1 );
+            usr_ptrs[i] = NULL;
+         }
+         return -EIO;
       }
    }
 
-   /* Done.
-   */
-   goto out;
-
-out:
-   return usr_ptr;
+   return 0;
 }
 
 
@@ -1043,6 +1361,7 @@ void *vcsm_lock_cache( unsigned int handle,
    /* At this point we know we want to lock the buffer and apply a cache
    ** behavior change.  Start by cleaning out whatever is already setup.
    */
+   vcsm_hdl_cache_remove( chk.handle );
    if ( chk.addr && chk.size )
    {
       munmap( (void *)chk.addr, chk.size );
@@ -1125,32 +1444,16 @@ void *vcsm_lock_cache( unsigned int handle,
    cache.size   = (chk.size != 0) ? chk.size : sz.size;
    if ( usr_ptr && cache.size )
    {
-      cache.handle = chk.handle;
-      cache.addr   = (unsigned int) usr_ptr;
+      vcsm_hdl_cache_update( chk.handle, cache.size, (unsigned int) usr_ptr );
 
-      rc = ioctl( vcsm_handle,
-                  VMCS_SM_IOCTL_MEM_INVALID,
-                  &cache );
-
-      vcos_log_trace( "[%s]: [%d]: ioctl invalidate (cache) %d (hdl: %x, addr: %x, size: %u)",
-                      __func__,
-                      getpid(),
-                      rc,
-                      cache.handle,
-                      cache.addr,
-                      cache.size );
+      vcos_mutex_lock( &vcsm_mutex );
+      vcsm_stats.lock_count++;
+      vcos_mutex_unlock( &vcsm_mutex );
 
-      if ( rc < 0 )
-      {
-         vcos_log_error( "[%s]: [%d]: invalidate failed (rc: %d) - [%x;%x] - size: %u (hdl: %x) - cache incoherency",
-                         __func__,
-                         getpid(),
-                         rc,
-                         (unsigned int) cache.addr,
-                         (unsigned int) (cache.addr + cache.size),
-                         (unsigned int) (cache.addr + cache.size) - (unsigned int) cache.addr,
-                         cache.handle );
-      }
+      vcsm_cache_op( VMCS_SM_IOCTL_MEM_INVALID,
+                     chk.handle,
+                     (unsigned int) usr_ptr,
+                     cache.size );
    }
 
    /* Update the caller with the information it expects to see.
@@ -1190,9 +1493,7 @@ out:
 int vcsm_unlock_ptr_sp( void *usr_ptr, int cache_no_flush )
 {
    int rc;
-   struct vmcs_sm_ioctl_lock_unlock lock_unlock;
    struct vmcs_sm_ioctl_map map;
-   struct vmcs_sm_ioctl_cache cache;
 
    if ( (vcsm_handle == VCSM_INVALID_HANDLE) || (usr_ptr == NULL) ) 
    {
@@ -1205,8 +1506,6 @@ int vcsm_unlock_ptr_sp( void *usr_ptr, int cache_no_flush )
    }
 
    memset( &map, 0, sizeof(map) );
-   memset( &lock_unlock, 0, sizeof(lock_unlock) );
-   memset( &cache, 0, sizeof(cache) );
 
    /* Retrieve the handle of the memory we want to lock.
    */
@@ -1236,48 +1535,15 @@ int vcsm_unlock_ptr_sp( void *usr_ptr, int cache_no_flush )
    */
    if ( !cache_no_flush && map.addr && map.size )
    {
-      cache.handle = map.handle;
-      cache.addr   = map.addr;
-      cache.size   = map.size;
-
-      rc = ioctl( vcsm_handle,
-                  VMCS_SM_IOCTL_MEM_FLUSH,
-                  &cache );
-
-      vcos_log_trace( "[%s]: [%d]: ioctl flush (cache) %d (hdl: %x, addr: %x, size: %u)",
-                      __func__,
-                      getpid(),
-                      rc,
-                      cache.handle,
-                      cache.addr,
-                      cache.size );
-
-      if ( rc < 0 )
-      {
-         vcos_log_error( "[%s]: [%d]: flush failed (rc: %d) - [%x;%x] - size: %u (hdl: %x) - cache incoherency",
-                         __func__,
-                         getpid(),
-                         rc,
-                         (unsigned int) cache.addr,
-                         (unsigned int) (cache.addr + cache.size),
-                         (unsigned int) (cache.addr + cache.size) - (unsigned int) cache.addr,
-                         cache.handle );
-      }
+      vcsm_cache_op( VMCS_SM_IOCTL_MEM_FLUSH,
+                     map.handle,
+                     map.addr,
+                     map.size );
    }
 
    /* Unock the allocated buffer all the way through videocore.
    */
-   lock_unlock.handle    = map.handle;  /* From above ioctl. */
-
-   rc = ioctl( vcsm_handle,
-               VMCS_SM_IOCTL_MEM_UNLOCK,
-               &lock_unlock );
-
-   vcos_log_trace( "[%s]: [%d]: ioctl mem-unlock %d (hdl: %x)",
-                   __func__,
-                   getpid(),
-                   rc,
-                   lock_unlock.handle );
+   rc = vcsm_mem_unlock( map.handle );  /* From above ioctl. */
 
 out:
    return rc;
@@ -1298,6 +1564,83 @@ int vcsm_unlock_ptr( void *usr_ptr )
 }
 
 
+/* Unlocks a handle, first cleaning the host cache for the part of the buffer
+** described by [offset; offset + size[ (clipped to the buffer), the whole
+** buffer if 'whole' is set.  The mapping of the buffer is taken from the
+** handle cache when possible.
+*/
+static int vcsm_unlock_hdl_internal( unsigned int handle,
+                                     unsigned int offset,
+                                     unsigned int size,
+                                     int whole )
+{
+   int rc;
+   struct vmcs_sm_ioctl_chk chk;
+
+   if ( (vcsm_handle == VCSM_INVALID_HANDLE) || (handle == 0) ) 
+   {
+      vcos_log_error( "[%s]: [%d]: invalid device or invalid handle!",
+                      __func__,
+                      getpid() );
+
+      rc = -EIO;
+      goto out;
+   }
+
+   memset( &chk, 0, sizeof(chk) );
+
+   chk.handle = handle;
+
+   if ( !vcsm_hdl_cache_lookup( handle, &chk.size, &chk.addr ) ||
+        (chk.addr == 0) )
+   {
+      /* Retrieve the handle of the memory we want to lock.
+      */
+      rc = ioctl( vcsm_handle,
+                  VMCS_SM_IOCTL_CHK_USR_HDL,
+                  &chk );
+
+      vcos_log_trace( "[%s]: [%d]: ioctl chk-usr-hdl %d (hdl: %x, addr: %x, sz: %u)",
+                      __func__,
+                      getpid(),
+                      rc,
+                      chk.handle,
+                      chk.addr,
+                      chk.size );
+
+      /* We will not be able to flush/unlock the resource!
+      */
+      if ( rc < 0 )
+      {
+         goto out;
+      }
+   }
+
+   /* If applicable, flush the cache now.
+   */
+   if ( whole )
+   {
+      offset = 0;
+      size   = chk.size;
+   }
+   size = vcsm_clip_range( chk.size, &offset, size );
+   if ( chk.addr && size )
+   {
+      vcsm_cache_op( VMCS_SM_IOCTL_MEM_FLUSH,
+                     chk.handle,
+                     chk.addr + offset,
+                     size );
+   }
+
+   /* Unlock the allocated buffer all the way through videocore.
+   */
+   rc = vcsm_mem_unlock( chk.handle );
+
+out:
+   return rc;
+}
+
+
 /* Unlocks the memory associated with this user opaque handle.
 ** Apply special processing that would override the otherwise
 ** default behavior.
@@ -1315,11 +1658,77 @@ int vcsm_unlock_ptr( void *usr_ptr )
 */
 int vcsm_unlock_hdl_sp( unsigned int handle, int cache_no_flush )
 {
-   int rc;
-   struct vmcs_sm_ioctl_lock_unlock lock_unlock;
+   return vcsm_unlock_hdl_internal( handle, 0, 0, !cache_no_flush );
+}
+
+
+/* Unlocks the memory associated with this user opaque handle.
+**
+** Returns:        0 on success
+**                 -errno on error.
+**
+** After unlocking an opaque handle, the user should no longer
+** attempt to reference the mapped addressed once associated
+** with it.
+*/
+int vcsm_unlock_hdl( unsigned int handle )
+{
+   return vcsm_unlock_hdl_sp( handle, 0 );
+}
+
+
+/* Unlocks the memory associated with this user opaque handle, only
+** cleaning the host cache for [offset; offset + size[.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_unlock_hdl_range( unsigned int handle, unsigned int offset, unsigned int size )
+{
+   return vcsm_unlock_hdl_internal( handle, offset, size, 0 );
+}
+
+
+/* Unlocks 'count' handles.
+**
+** Returns:        0 on success
+**                 -errno of the last failure otherwise.
+*/
+int vcsm_unlock_hdl_batch( const unsigned int *handles, unsigned int count, int cache_no_flush )
+{
+   unsigned int i;
+   int rc = 0;
+   int ret;
+
+   if ( handles == NULL )
+   {
+      return -EINVAL;
+   }
+
+   /* Keep going on error, there is no point holding on to the others.
+   */
+   for ( i = 0; i < count; i++ )
+   {
+      ret = vcsm_unlock_hdl_sp( handles[i], cache_no_flush );
+      if ( ret < 0 )
+      {
+         rc = ret;
+      }
+   }
+
+   return rc;
+}
+
+
+/* Performs host cache maintenance on part of a locked buffer.
+*/
+static int vcsm_range_op( unsigned int cmd,
+                          unsigned int handle,
+                          unsigned int offset,
+                          unsigned int size )
+{
    struct vmcs_sm_ioctl_chk chk;
-   struct vmcs_sm_ioctl_cache cache;
-   struct vmcs_sm_ioctl_map map;
+   int rc;
 
    if ( (vcsm_handle == VCSM_INVALID_HANDLE) || (handle == 0) ) 
    {
@@ -1327,101 +1736,83 @@ int vcsm_unlock_hdl_sp( unsigned int handle, int cache_no_flush )
                       __func__,
                       getpid() );
 
-      rc = -EIO;
-      goto out;
+      return -EIO;
    }
 
    memset( &chk, 0, sizeof(chk) );
-   memset( &lock_unlock, 0, sizeof(lock_unlock) );
-   memset( &cache, 0, sizeof(cache) );
-   memset( &map, 0, sizeof(map) );
 
-   /* Retrieve the handle of the memory we want to lock.
-   */
    chk.handle = handle;
 
-   rc = ioctl( vcsm_handle,
-               VMCS_SM_IOCTL_CHK_USR_HDL,
-               &chk );
-
-   vcos_log_trace( "[%s]: [%d]: ioctl chk-usr-hdl %d (hdl: %x, addr: %x, sz: %u) nf %d",
-                   __func__,
-                   getpid(),
-                   rc,
-                   chk.handle,
-                   chk.addr,
-                   chk.size,
-                   cache_no_flush);
-
-   /* We will not be able to flush/unlock the resource!
-   */
-   if ( rc < 0 )
+   if ( !vcsm_hdl_cache_lookup( handle, &chk.size, &chk.addr ) ||
+        (chk.addr == 0) )
    {
-      goto out;
-   }
-
-   /* If applicable, flush the cache now.
-   */
-   if ( !cache_no_flush && chk.addr && chk.size )
-   {
-      cache.handle = chk.handle;
-      cache.addr   = chk.addr;
-      cache.size   = chk.size;
-
       rc = ioctl( vcsm_handle,
-                  VMCS_SM_IOCTL_MEM_FLUSH,
-                  &cache );
+                  VMCS_SM_IOCTL_CHK_USR_HDL,
+                  &chk );
 
-      vcos_log_trace( "[%s]: [%d]: ioctl flush (cache) %d (hdl: %x)",
+      vcos_log_trace( "[%s]: [%d]: ioctl chk-usr-hdl %d (hdl: %x, addr: %x, sz: %u)",
                       __func__,
                       getpid(),
                       rc,
-                      cache.handle );
+                      chk.handle,
+                      chk.addr,
+                      chk.size );
 
       if ( rc < 0 )
       {
-         vcos_log_error( "[%s]: [%d]: flush failed (rc: %d) - [%x;%x] - size: %u (hdl: %x) - cache incoherency",
-                         __func__,
-                         getpid(),
-                         rc,
-                         (unsigned int) cache.addr,
-                         (unsigned int) (cache.addr + cache.size),
-                         (unsigned int) (cache.addr + cache.size) - (unsigned int) cache.addr,
-                         cache.handle );
+         return rc;
       }
    }
 
-   /* Unlock the allocated buffer all the way through videocore.
-   */
-   lock_unlock.handle    = chk.handle;
+   size = vcsm_clip_range( chk.size, &offset, size );
+   if ( (chk.addr == 0) || (size == 0) )
+   {
+      return 0;
+   }
 
-   rc = ioctl( vcsm_handle,
-               VMCS_SM_IOCTL_MEM_UNLOCK,
-               &lock_unlock );
+   return vcsm_cache_op( cmd, chk.handle, chk.addr + offset, size );
+}
 
-   vcos_log_trace( "[%s]: [%d]: ioctl mem-unlock %d (hdl: %x)",
-                   __func__,
-                   getpid(),
-                   rc,
-                   lock_unlock.handle );
 
-out:
-   return rc;
+/* Invalidates the host cache for part of a locked buffer.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_invalidate_range( unsigned int handle, unsigned int offset, unsigned int size )
+{
+   return vcsm_range_op( VMCS_SM_IOCTL_MEM_INVALID, handle, offset, size );
 }
 
 
-/* Unlocks the memory associated with this user opaque handle.
+/* Cleans the host cache for part of a locked buffer.
 **
 ** Returns:        0 on success
 **                 -errno on error.
-**
-** After unlocking an opaque handle, the user should no longer
-** attempt to reference the mapped addressed once associated
-** with it.
 */
-int vcsm_unlock_hdl( unsigned int handle )
+int vcsm_clean_range( unsigned int handle, unsigned int offset, unsigned int size )
 {
-   return vcsm_unlock_hdl_sp( handle, 0 );
+   return vcsm_range_op( VMCS_SM_IOCTL_MEM_FLUSH, handle, offset, size );
+}
+
+
+/* Retrieves the lock and cache maintenance counters, optionally resetting
+** them.
+*/
+void vcsm_stats_get( VCSM_STATS_T *stats, int reset )
+{
+   vcos_once(&vcsm_once, vcsm_init_once);
+
+   vcos_mutex_lock( &vcsm_mutex );
+   if ( stats != NULL )
+   {
+      *stats = vcsm_stats;
+   }
+   if ( reset )
+   {
+      memset( &vcsm_stats, 0, sizeof(vcsm_stats) );
+   }
+   vcos_mutex_unlock( &vcsm_mutex );
 }
 
 /* Resizes a block of memory allocated previously by vcsm_alloc.
@@ -1512,6 +1903,7 @@ int vcsm_resize( unsigned int handle, unsigned int new_size )
 
    /* Resize the allocated buffer all the way through videocore.
    */
+   vcsm_hdl_cache_remove( sz.handle );
    resize.handle    = sz.handle;
    resize.new_size  = size_aligned;
 
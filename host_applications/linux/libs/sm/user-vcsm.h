@@ -107,6 +107,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ** A complete API is defined below.
 */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -146,6 +148,21 @@ typedef enum
 
 } VCSM_CACHE_TYPE_T;
 
+/* Lock and cache maintenance counters, see vcsm_stats_get.
+*/
+typedef struct
+{
+   unsigned int lock_count;         // Successful locks.
+   unsigned int unlock_count;       // Successful unlocks.
+   unsigned int hdl_cache_hits;     // Handle lookups served without asking
+                                    // the driver.
+   unsigned int hdl_cache_misses;   // Handle lookups that needed a size or
+                                    // mapping query.
+   uint64_t     bytes_invalidated;  // Host cache bytes invalidated.
+   uint64_t     bytes_cleaned;      // Host cache bytes cleaned (flushed).
+
+} VCSM_STATS_T;
+
 /* Initialize the vcsm processing.
 **
 ** Must be called once before attempting to do anything else.
@@ -329,6 +346,37 @@ void *vcsm_usr_address( unsigned int handle );
 void *vcsm_lock( unsigned int handle );
 
 
+/* Locks the memory associated with this opaque handle, like vcsm_lock, but
+** only invalidates the host cache for the bytes [offset; offset + size[ of
+** the buffer (widened to whole cache lines and clipped to the buffer).
+**
+** Use this when only a region of interest will be read after the lock; the
+** rest of the buffer must then not be read from until it is invalidated,
+** see vcsm_invalidate_range.
+**
+** Returns:        NULL on error
+**                 a valid pointer to the start of the buffer on success.
+*/
+void *vcsm_lock_range( unsigned int handle,
+                       unsigned int offset,
+                       unsigned int size );
+
+
+/* Locks 'count' handles, as vcsm_lock does, storing the pointers to their
+** memory in 'usr_ptrs'.
+**
+** The size and mapping of each handle are remembered between calls, so
+** locking a set of buffers that has been locked before costs a lock and an
+** invalidate per handle and no other round trip to the driver.
+**
+** Returns:        0 on success, all handles are locked
+**                 -errno on error, no handle is locked.
+*/
+int vcsm_lock_batch( const unsigned int *handles,
+                     void **usr_ptrs,
+                     unsigned int count );
+
+
 /* Locks the memory associated with this opaque handle.  The lock
 ** also gives a chance to update the *host* cache behavior of the
 ** allocated buffer if so desired.  The *videocore* cache behavior
@@ -418,6 +466,62 @@ int vcsm_unlock_hdl( unsigned int handle );
 */
 int vcsm_unlock_hdl_sp( unsigned int handle, int cache_no_flush );
 
+
+/* Unlocks the memory associated with this user opaque handle, like
+** vcsm_unlock_hdl, but only cleans the host cache for the bytes
+** [offset; offset + size[ of the buffer (widened to whole cache lines
+** and clipped to the buffer).
+**
+** Use this when only a region of interest was written to while locked.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_unlock_hdl_range( unsigned int handle,
+                           unsigned int offset,
+                           unsigned int size );
+
+
+/* Unlocks 'count' opaque handles, as vcsm_unlock_hdl_sp does.  All the
+** handles are unlocked even if some of them fail.
+**
+** Returns:        0 on success
+**                 -errno of the last failure on error.
+*/
+int vcsm_unlock_hdl_batch( const unsigned int *handles,
+                           unsigned int count,
+                           int cache_no_flush );
+
+
+/* Invalidates the host cache for the bytes [offset; offset + size[ of a
+** locked buffer, so that data written by videocore is seen by the host.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_invalidate_range( unsigned int handle,
+                           unsigned int offset,
+                           unsigned int size );
+
+
+/* Cleans the host cache for the bytes [offset; offset + size[ of a locked
+** buffer, so that data written by the host is seen by videocore.
+**
+** Returns:        0 on success
+**                 -errno on error.
+*/
+int vcsm_clean_range( unsigned int handle,
+                      unsigned int offset,
+                      unsigned int size );
+
+
+/* Retrieves the lock and cache maintenance counters of this process.
+**
+** If 'reset' is non zero the counters are cleared after being read.
+** 'stats' may be NULL to only reset them.
+*/
+void vcsm_stats_get( VCSM_STATS_T *stats, int reset );
+
 #ifdef __cplusplus
 }
 #endif
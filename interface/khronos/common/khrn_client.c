@@ -293,6 +293,10 @@ void client_thread_state_init(CLIENT_THREAD_STATE_T *state)
 
    state->merge_pos = 0;
    state->merge_end = 0;
+   state->merge_hint = 0;
+
+   state->bulk = NULL;
+   memset(&state->rpc_stats, 0, sizeof(state->rpc_stats));
 
 	state->glgeterror_hack = 0;
 	state->async_error_notification = false;
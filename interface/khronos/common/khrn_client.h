@@ -66,6 +66,34 @@ extern void client_try_unload_server(CLIENT_PROCESS_STATE_T *process);
 
 #define MERGE_BUFFER_SIZE  4080
 
+/*
+   counters kept by the rpc layer for each thread (see rpc_get_stats)
+*/
+
+typedef enum {
+   RPC_FLUSH_FULL,         /* the next control message did not fit */
+   RPC_FLUSH_EARLY,        /* the next control message was not expected to fit */
+   RPC_FLUSH_BULK,         /* a bulk transfer followed */
+   RPC_FLUSH_RECV,         /* a reply was wanted */
+   RPC_FLUSH_PRIORITY,     /* switching to or from the high priority service */
+   RPC_FLUSH_EXPLICIT,     /* rpc_flush */
+
+   RPC_FLUSH_REASONS
+} RPC_FLUSH_REASON_T;
+
+typedef struct {
+   uint32_t flushes[RPC_FLUSH_REASONS];
+   uint32_t messages_merged;
+   uint64_t bytes_merged;
+
+   uint32_t bulks_sync;    /* bulk transfers waited for before returning */
+   uint32_t bulks_async;   /* bulk transfers left in flight from a staging buffer */
+   uint32_t stage_waits;   /* times a staging buffer was still in flight when wanted */
+   uint64_t bulk_bytes;
+} RPC_STATS_T;
+
+struct RPC_BULK_STATE;
+
 typedef struct {
    EGL_CONTEXT_T *context;
    EGL_SURFACE_T *draw;
@@ -121,6 +149,14 @@ struct CLIENT_THREAD_STATE {
    uint32_t merge_pos;
    uint32_t merge_end;
 
+   /* largest recent control message, used to flush before the buffer overflows */
+   uint32_t merge_hint;
+
+   /* staging buffers for bulk transfers, allocated by the platform rpc code */
+   struct RPC_BULK_STATE *bulk;
+
+   RPC_STATS_T rpc_stats;
+
 	/* Try to reduce impact of repeated consecutive glGetError() calls */
 	int32_t glgeterror_hack;
 	bool async_error_notification;
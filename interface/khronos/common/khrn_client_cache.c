@@ -121,21 +121,35 @@ static void heap_free(KHRN_CACHE_T *cache, int block)
    }
 }
 
-static uint32_t hash(const void *data, int len, int sig)
+/*
+   the key of a range is made from the hashes of its blocks, so that when part
+   of a range changes only the blocks which have changed need hashing again
+*/
+
+static uint32_t hash_block(KHRN_CACHE_T *cache, const void *data, int len, int block)
 {
-   int hash;
+   int off = block << CACHE_LOG2_HASH_BLOCK_SIZE;
+   int n = _min(len - off, CACHE_HASH_BLOCK_SIZE);
 
-//   if (len > 256)     // TODO: turn this on later
-//      len = 256;
+   cache->stats.bytes_hashed += n;
 
-   if (!((size_t)data & 3) && !(len & 3))
-      hash = khrn_hashword((uint32_t *)data, len >> 2, 0);
-   else
-      hash = khrn_hashlittle(data, len, 0);
+   return khrn_hashfast((const uint8_t *)data + off, n, 0);
+}
+
+static uint32_t hash_key(const uint32_t *block_hash, int blocks, int len, int sig)
+{
+   uint32_t hash = khrn_hashword(block_hash, blocks, (uint32_t)len);
 
    return (hash & ~0xf) | sig;
 }
 
+static CACHE_RECENT_T *recent_slot(KHRN_CACHE_T *cache, const void *data, int sig)
+{
+   uint32_t hash = ((uint32_t)(size_t)data ^ (uint32_t)sig) * 2654435761U;
+
+   return &cache->recent[hash >> (32 - CACHE_LOG2_RECENT_SLOTS)];
+}
+
 int khrn_cache_init(KHRN_CACHE_T *cache)
 {
    cache->tree = NULL;
@@ -149,11 +163,19 @@ int khrn_cache_init(KHRN_CACHE_T *cache)
    cache->end.prev = &cache->start;
    cache->end.next = NULL;
 
+   memset(cache->recent, 0, sizeof(cache->recent));
+   memset(&cache->stats, 0, sizeof(cache->stats));
+
    return khrn_pointer_map_init(&cache->map, 64);
 }
 
 void khrn_cache_term(KHRN_CACHE_T *cache)
 {
+   int i;
+
+   for (i = 0; i < CACHE_RECENT_SLOTS; i++)
+      khrn_platform_free(cache->recent[i].block_hash);
+
    khrn_platform_free(cache->tree);
    khrn_platform_free(cache->data);
 
@@ -316,9 +338,11 @@ static bool xxx_first = true;
 #endif
 int khrn_cache_lookup(CLIENT_THREAD_STATE_T *thread, KHRN_CACHE_T *cache, const void *data, int len, int sig)
 {
-   int key = hash(data, len, sig);
-
-   CACHE_ENTRY_T *entry = (CACHE_ENTRY_T *)khrn_pointer_map_lookup(&cache->map, key);
+   CACHE_RECENT_T *recent = recent_slot(cache, data, sig);
+   int blocks = (len + CACHE_HASH_BLOCK_SIZE - 1) >> CACHE_LOG2_HASH_BLOCK_SIZE;
+   bool rehash = true;
+   CACHE_ENTRY_T *entry;
+   int key, i;
 
 #ifdef SIMPENROSE_RECORD_OUTPUT
    if (xxx_first)
@@ -331,11 +355,75 @@ int khrn_cache_lookup(CLIENT_THREAD_STATE_T *thread, KHRN_CACHE_T *cache, const
    }
 #endif
 
+   if (recent->data == data && recent->len == len && recent->sig == sig) {
+      entry = recent->key ? (CACHE_ENTRY_T *)(cache->data + recent->offset) : NULL;
+
+      if (entry && khrn_pointer_map_lookup(&cache->map, recent->key) == entry && entry->len >= len) {
+         /*
+            the block hashes are those of the cached copy, so compare with
+            it a block at a time and only hash the blocks which differ
+         */
+
+         bool changed = false;
+
+         for (i = 0; i < blocks; i++) {
+            int off = i << CACHE_LOG2_HASH_BLOCK_SIZE;
+
+            if (memcmp(entry->data + off, (const uint8_t *)data + off, _min(len - off, CACHE_HASH_BLOCK_SIZE))) {
+               recent->block_hash[i] = hash_block(cache, data, len, i);
+               changed = true;
+            }
+         }
+
+         cache->stats.bytes_compared += len;
+         rehash = false;
+
+         if (!changed) {
+            cache->stats.hits++;
+            cache->stats.fast_hits++;
+
+            link_remove(&entry->link);
+            link_insert(&entry->link, cache->end.prev, &cache->end);
+
+            return recent->offset;
+         }
+      }
+   } else {
+      if (recent->block_hash_size < blocks) {
+         uint32_t *block_hash = (uint32_t *)khrn_platform_malloc(blocks * sizeof(uint32_t), "CACHE_RECENT_T.block_hash");
+
+         if (!block_hash)
+            return -1;
+
+         khrn_platform_free(recent->block_hash);
+         recent->block_hash = block_hash;
+         recent->block_hash_size = blocks;
+      }
+
+      recent->data = data;
+      recent->len = len;
+      recent->sig = sig;
+   }
+
+   recent->key = 0;
+
+   if (rehash) {
+      for (i = 0; i < blocks; i++)
+         recent->block_hash[i] = hash_block(cache, data, len, i);
+   }
+
+   key = hash_key(recent->block_hash, blocks, len, sig);
+
+   entry = (CACHE_ENTRY_T *)khrn_pointer_map_lookup(&cache->map, key);
+
    if (entry && entry->len >= len && !memcmp(entry->data, data, len)) {
       /*
          move link to end of discard queue
       */
 
+      cache->stats.hits++;
+      cache->stats.bytes_compared += len;
+
       link_remove(&entry->link);
       link_insert(&entry->link, cache->end.prev, &cache->end);
    } else {
@@ -344,6 +432,8 @@ int khrn_cache_lookup(CLIENT_THREAD_STATE_T *thread, KHRN_CACHE_T *cache, const
 
       CACHE_LINK_T *link;
 
+      cache->stats.misses++;
+
       if (entry)
          discard(thread, cache, entry);
 
@@ -371,12 +461,22 @@ int khrn_cache_lookup(CLIENT_THREAD_STATE_T *thread, KHRN_CACHE_T *cache, const
 
       send_create(thread, (int)((uint8_t *)entry - cache->data));
       send_data(thread, (int)(entry->data - cache->data), data, len);
+
+      cache->stats.bytes_uploaded += len;
    }
 
-   return (int)((uint8_t *)entry - cache->data);
+   recent->key = key;
+   recent->offset = (int)((uint8_t *)entry - cache->data);
+
+   return recent->offset;
 }
 
 int khrn_cache_get_entries(KHRN_CACHE_T *cache)
 {
    return cache->map.entries;
 }
+
+void khrn_cache_get_stats(KHRN_CACHE_T *cache, KHRN_CACHE_STATS_T *stats)
+{
+   *stats = cache->stats;
+}
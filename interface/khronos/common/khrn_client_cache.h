@@ -55,6 +55,38 @@ typedef struct {
    uint8_t data[1];
 } CACHE_ENTRY_T;
 
+/*
+   the client range most recently looked up at a given address, and the hash
+   of each of its blocks. when the same range is looked up again, it is compared
+   block by block with the cached copy and only the blocks which have changed
+   are hashed again
+*/
+
+typedef struct {
+   const void *data;
+   int len;
+   int sig;
+
+   int key;          // key of the entry the range matched, or 0
+   int offset;       // offset of that entry in the cache data
+
+   uint32_t *block_hash;
+   int block_hash_size;
+} CACHE_RECENT_T;
+
+typedef struct {
+   uint32_t hits;
+   uint32_t misses;
+   uint32_t fast_hits;        // hits on a recent range which needed no hashing
+
+   uint64_t bytes_hashed;
+   uint64_t bytes_compared;
+   uint64_t bytes_uploaded;
+} KHRN_CACHE_STATS_T;
+
+#define CACHE_LOG2_RECENT_SLOTS  4
+#define CACHE_RECENT_SLOTS       (1 << CACHE_LOG2_RECENT_SLOTS)
+
 typedef struct {
    uint8_t *tree;
    uint8_t *data;
@@ -66,11 +98,18 @@ typedef struct {
    CACHE_LINK_T end;
 
    KHRN_POINTER_MAP_T map;
+
+   CACHE_RECENT_T recent[CACHE_RECENT_SLOTS];
+
+   KHRN_CACHE_STATS_T stats;
 } KHRN_CACHE_T;
 
 #define CACHE_LOG2_BLOCK_SIZE    6
 #define CACHE_MAX_DEPTH          16
 
+#define CACHE_LOG2_HASH_BLOCK_SIZE  10
+#define CACHE_HASH_BLOCK_SIZE       (1 << CACHE_LOG2_HASH_BLOCK_SIZE)
+
 #define CACHE_SIG_ATTRIB_0    0
 #define CACHE_SIG_ATTRIB_1    1
 #define CACHE_SIG_ATTRIB_2    2
@@ -87,6 +126,7 @@ extern void khrn_cache_term(KHRN_CACHE_T *cache);
 
 extern int khrn_cache_lookup(CLIENT_THREAD_STATE_T *thread, KHRN_CACHE_T *cache, const void *data, int len, int sig);
 extern int khrn_cache_get_entries(KHRN_CACHE_T *cache);
+extern void khrn_cache_get_stats(KHRN_CACHE_T *cache, KHRN_CACHE_STATS_T *stats);
 
 #endif
 
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+   Benchmark for the client side attribute cache.
+
+   The RPC layer is replaced by stubs which accept everything, so the timings
+   are of the client side work alone: hashing, comparing and copying. Each
+   pass looks up the same client array, either unchanged, with a few bytes
+   changed, or alternating with a second array, and reports the time per
+   lookup along with the cache statistics.
+*/
+
+#include "interface/khronos/common/khrn_int_common.h"
+#include "interface/khronos/common/khrn_client_cache.h"
+#include "interface/khronos/common/khrn_client_platform.h"
+#include "interface/khronos/common/khrn_client_rpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_LOOKUPS 2000
+
+static uint32_t ctrl_bytes;
+
+/*
+   stubs for the parts of the client which the cache calls
+*/
+
+void rpc_begin(CLIENT_THREAD_STATE_T *thread) { UNUSED(thread); }
+void rpc_end(CLIENT_THREAD_STATE_T *thread) { UNUSED(thread); }
+
+void rpc_send_ctrl_begin(CLIENT_THREAD_STATE_T *thread, uint32_t len)
+{
+   UNUSED(thread);
+   ctrl_bytes += len;
+}
+
+void rpc_send_ctrl_write(CLIENT_THREAD_STATE_T *thread, const uint32_t msg[], uint32_t msglen)
+{
+   UNUSED(thread);
+   UNUSED(msg);
+   UNUSED(msglen);
+}
+
+void rpc_send_ctrl_end(CLIENT_THREAD_STATE_T *thread) { UNUSED(thread); }
+
+uint32_t rpc_recv(CLIENT_THREAD_STATE_T *thread, void *out, uint32_t *len, RPC_RECV_FLAG_T flags)
+{
+   UNUSED(thread);
+   UNUSED(out);
+   UNUSED(len);
+   UNUSED(flags);
+
+   /* the only result the cache asks for is whether the server grew its copy */
+   return 1;
+}
+
+void *khrn_platform_malloc(size_t size, const char *desc)
+{
+   UNUSED(desc);
+   return malloc(size);
+}
+
+void khrn_platform_free(void *v)
+{
+   free(v);
+}
+
+void platform_memcpy(void *aTrg, const void *aSrc, size_t aLength)
+{
+   memcpy(aTrg, aSrc, aLength);
+}
+
+typedef enum {
+   BENCH_STATIC,
+   BENCH_PATCHED,
+   BENCH_ALTERNATE
+} BENCH_MODE_T;
+
+static const char *mode_name[] = { "static", "patched", "alternate" };
+
+static int run(BENCH_MODE_T mode, int len)
+{
+   KHRN_CACHE_T cache;
+   KHRN_CACHE_STATS_T stats;
+   uint8_t *data[2];
+   uint32_t start, end;
+   int i, j, result = 0;
+
+   data[0] = (uint8_t *)malloc(len);
+   data[1] = (uint8_t *)malloc(len);
+   if (!data[0] || !data[1] || !khrn_cache_init(&cache)) {
+      printf("out of memory\n");
+      exit(1);
+   }
+
+   for (j = 0; j != len; ++j) {
+      data[0][j] = (uint8_t)rand();
+      data[1][j] = (uint8_t)rand();
+   }
+
+   ctrl_bytes = 0;
+   start = vcos_getmicrosecs();
+
+   for (i = 0; i != BENCH_LOOKUPS; ++i) {
+      const uint8_t *p = data[0];
+      int offset;
+
+      if (mode == BENCH_PATCHED)
+         data[0][(i * 4099) % len] ^= 0xff;
+      else if (mode == BENCH_ALTERNATE)
+         p = data[i & 1];
+
+      offset = khrn_cache_lookup(NULL, &cache, p, len, 0);
+      if (offset < 0 || memcmp(((CACHE_ENTRY_T *)(cache.data + offset))->data, p, len)) {
+         printf("%s: lookup %d returned the wrong entry\n", mode_name[mode], i);
+         result = 1;
+         break;
+      }
+   }
+
+   end = vcos_getmicrosecs();
+
+   khrn_cache_get_stats(&cache, &stats);
+   printf("%-9s %7d bytes: %8.2f us/lookup, hits %u (fast %u) misses %u, "
+      "hashed %llu compared %llu uploaded %llu, ctrl %u\n",
+      mode_name[mode], len, (double)(end - start) / BENCH_LOOKUPS,
+      stats.hits, stats.fast_hits, stats.misses,
+      (unsigned long long)stats.bytes_hashed, (unsigned long long)stats.bytes_compared,
+      (unsigned long long)stats.bytes_uploaded, ctrl_bytes);
+
+   khrn_cache_term(&cache);
+   free(data[0]);
+   free(data[1]);
+
+   return result;
+}
+
+int main(int argc, char **argv)
+{
+   static const int lens[] = { 256, 4096, 65536, 1 << 20 };
+   int i, result = 0;
+
+   UNUSED(argc);
+   UNUSED(argv);
+
+   vcos_init();
+
+   for (i = 0; i != sizeof(lens) / sizeof(lens[0]); ++i) {
+      result |= run(BENCH_STATIC, lens[i]);
+      result |= run(BENCH_PATCHED, lens[i]);
+      result |= run(BENCH_ALTERNATE, lens[i]);
+   }
+
+   return result;
+}
@@ -346,10 +346,14 @@ core api
 extern bool khclient_rpc_init(void);
 extern void rpc_term(void);
 
+extern void rpc_term_thread(CLIENT_THREAD_STATE_T *thread);
+
 extern void rpc_flush(CLIENT_THREAD_STATE_T *thread);
 extern void rpc_high_priority_begin(CLIENT_THREAD_STATE_T *thread);
 extern void rpc_high_priority_end(CLIENT_THREAD_STATE_T *thread);
 
+extern void rpc_get_stats(CLIENT_THREAD_STATE_T *thread, RPC_STATS_T *stats, bool reset);
+
 static INLINE uint32_t rpc_pad_ctrl(uint32_t len) { return (len + 0x3) & ~0x3; }
 static INLINE uint32_t rpc_pad_bulk(uint32_t len) { return len; }
 
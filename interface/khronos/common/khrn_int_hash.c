@@ -308,3 +308,126 @@ uint32_t khrn_hashlittle( const void *key, int length, uint32_t initval)
   final(a,b,c);
   return c;
 }
+
+/*
+-------------------------------------------------------------------------------
+khrn_hashfast() -- hash a variable-length key into a 32-bit value, quickly
+
+This is the xxHash32 algorithm. Most of the key is consumed 16 bytes at a
+time in four independent 32-bit lanes, which map straight onto NEON or SSE
+registers, so it runs several times faster than khrn_hashlittle() on large
+keys. The vector and scalar versions give the same result. The key need not
+be aligned.
+-------------------------------------------------------------------------------
+*/
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HASHFAST_NEON
+#endif
+
+#define HASHFAST_PRIME1 2654435761U
+#define HASHFAST_PRIME2 2246822519U
+#define HASHFAST_PRIME3 3266489917U
+#define HASHFAST_PRIME4 668265263U
+#define HASHFAST_PRIME5 374761393U
+
+static inline uint32_t hashfast_read32(const uint8_t *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+#if defined(__SSE2__)
+/* Multiply the 32-bit lanes of a and b, keeping the low 32 bits of each product */
+static inline __m128i hashfast_mullo(__m128i a, __m128i b)
+{
+#if defined(__SSE4_1__)
+   return _mm_mullo_epi32(a, b);
+#else
+   __m128i even = _mm_mul_epu32(a, b);
+   __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+   return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                             _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+#endif
+
+uint32_t khrn_hashfast(const void *key, int length, uint32_t seed)
+{
+   const uint8_t *p = (const uint8_t *)key;
+   const uint8_t *end = p + length;
+   uint32_t h;
+
+   if (length >= 16)
+   {
+      const uint8_t *limit = end - 16;
+      uint32_t v[4];
+
+      v[0] = seed + HASHFAST_PRIME1 + HASHFAST_PRIME2;
+      v[1] = seed + HASHFAST_PRIME2;
+      v[2] = seed;
+      v[3] = seed - HASHFAST_PRIME1;
+
+#if defined(__SSE2__)
+      {
+         __m128i acc = _mm_loadu_si128((const __m128i *)v);
+         const __m128i prime1 = _mm_set1_epi32((int)HASHFAST_PRIME1);
+         const __m128i prime2 = _mm_set1_epi32((int)HASHFAST_PRIME2);
+         do {
+            acc = _mm_add_epi32(acc, hashfast_mullo(_mm_loadu_si128((const __m128i *)p), prime2));
+            acc = _mm_or_si128(_mm_slli_epi32(acc, 13), _mm_srli_epi32(acc, 19));
+            acc = hashfast_mullo(acc, prime1);
+            p += 16;
+         } while (p <= limit);
+         _mm_storeu_si128((__m128i *)v, acc);
+      }
+#elif defined(HASHFAST_NEON)
+      {
+         uint32x4_t acc = vld1q_u32(v);
+         const uint32x4_t prime1 = vdupq_n_u32(HASHFAST_PRIME1);
+         const uint32x4_t prime2 = vdupq_n_u32(HASHFAST_PRIME2);
+         do {
+            acc = vmlaq_u32(acc, vreinterpretq_u32_u8(vld1q_u8(p)), prime2);
+            acc = vorrq_u32(vshlq_n_u32(acc, 13), vshrq_n_u32(acc, 19));
+            acc = vmulq_u32(acc, prime1);
+            p += 16;
+         } while (p <= limit);
+         vst1q_u32(v, acc);
+      }
+#else
+      do {
+         v[0] = rot(v[0] + hashfast_read32(p +  0) * HASHFAST_PRIME2, 13) * HASHFAST_PRIME1;
+         v[1] = rot(v[1] + hashfast_read32(p +  4) * HASHFAST_PRIME2, 13) * HASHFAST_PRIME1;
+         v[2] = rot(v[2] + hashfast_read32(p +  8) * HASHFAST_PRIME2, 13) * HASHFAST_PRIME1;
+         v[3] = rot(v[3] + hashfast_read32(p + 12) * HASHFAST_PRIME2, 13) * HASHFAST_PRIME1;
+         p += 16;
+      } while (p <= limit);
+#endif
+
+      h = rot(v[0], 1) + rot(v[1], 7) + rot(v[2], 12) + rot(v[3], 18);
+   }
+   else
+      h = seed + HASHFAST_PRIME5;
+
+   h += (uint32_t)length;
+
+   for (; p + 4 <= end; p += 4)
+      h = rot(h + hashfast_read32(p) * HASHFAST_PRIME3, 17) * HASHFAST_PRIME4;
+   for (; p < end; p++)
+      h = rot(h + *p * HASHFAST_PRIME5, 11) * HASHFAST_PRIME1;
+
+   h ^= h >> 15;
+   h *= HASHFAST_PRIME2;
+   h ^= h >> 13;
+   h *= HASHFAST_PRIME3;
+   h ^= h >> 16;
+
+   return h;
+}
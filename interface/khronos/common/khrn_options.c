@@ -74,6 +74,7 @@ void khrn_init_options(void)
    khrn_options.reg_dump_on_lock       = read_bool_option(  "V3D_REG_DUMP_ON_LOCK",       khrn_options.reg_dump_on_lock);
    khrn_options.clif_dump_on_lock      = read_bool_option(  "V3D_CLIF_DUMP_ON_LOCK",      khrn_options.clif_dump_on_lock);
    khrn_options.force_dither_off       = read_bool_option(  "V3D_FORCE_DITHER_OFF",       khrn_options.force_dither_off);
+   khrn_options.sync_bulk              = read_bool_option(  "V3D_SYNC_BULK",              khrn_options.sync_bulk);
 
    khrn_options.bin_block_size         = read_uint32_option("V3D_BIN_BLOCK_SIZE",         khrn_options.bin_block_size);
    khrn_options.max_bin_blocks         = read_uint32_option("V3D_MAX_BIN_BLOCKS",         khrn_options.max_bin_blocks);
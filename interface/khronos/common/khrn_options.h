@@ -38,6 +38,7 @@ typedef struct {
    bool     reg_dump_on_lock;          /* Dump h/w registers if the h/w locks-up */
    bool     clif_dump_on_lock;         /* Dump clif file and memory on h/w lock-up */
    bool     force_dither_off;          /* Ensure dithering is always off */
+   bool     sync_bulk;                 /* Wait for each gathered bulk transfer to complete */
    uint32_t bin_block_size;            /* Set the size of binning memory blocks */
    uint32_t max_bin_blocks;            /* Set the maximum number of binning block in use */
 
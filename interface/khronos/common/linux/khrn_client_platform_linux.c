@@ -361,7 +361,7 @@ void platform_init_rpc(struct CLIENT_THREAD_STATE *state)
 
 void platform_term_rpc(struct CLIENT_THREAD_STATE *state)
 {
-   assert(1);
+   rpc_term_thread(state);
 }
 
 void platform_maybe_free_process(void)
@@ -0,0 +1,444 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+   Throughput benchmark for the linux rpc layer.
+
+   Runs khrn_client_rpc_linux against the vchiq loopback backend, with a fake
+   VideoCore khronos service on the far side. Each upload is a small control
+   message followed by a gathered bulk transfer, as made by texture uploads
+   from a client image with padded rows, and is preceded by a few small calls
+   which are merged into the control buffer. The uploads are made first with
+   every bulk transfer waited for and then pipelined through the staging
+   buffers, and the time taken and the rpc counters are reported for each.
+
+   Use -w to give the simulated link a bandwidth; the gathering only
+   overlaps the transfers when they take time.
+*/
+
+#include "interface/khronos/common/khrn_int_common.h"
+#include "interface/khronos/common/khrn_client.h"
+#include "interface/khronos/common/khrn_client_rpc.h"
+#include "interface/khronos/common/khrn_options.h"
+#include "interface/vchiq_arm/vchiq_loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern void vc_vchi_khronos_init();
+
+VCOS_LOG_CAT_T khrn_client_log = VCOS_LOG_INIT("khrn_client", VCOS_LOG_WARN);
+
+/*
+   messages understood by the fake server. every message is a whole number of
+   words and starts with its id
+*/
+
+#define BENCH_NOP     0x42000000  /* stands in for the make current, CLIENT_MAKE_CURRENT_SIZE bytes */
+#define BENCH_CALL    0x42000001  /* n, n words */
+#define BENCH_UPLOAD  0x42000002  /* len, seq, data follows in its own message or a bulk */
+#define BENCH_SYNC    0x42000003  /* reply when all uploads have arrived */
+
+#define BENCH_CHECK_STEP 997
+
+static struct {
+   unsigned int handle;
+   uint8_t *rx_buf;
+   uint32_t expect;           /* length of upload data expected as a message */
+   uint32_t seq;              /* sequence number of the upload in progress */
+   uint32_t pending;          /* bulk receives queued and not yet complete */
+   bool sync_wanted;
+   uint32_t calls;
+   uint32_t uploads;
+   uint32_t errors;
+   uint64_t bytes;
+} server;
+
+static uint8_t pattern(uint32_t seq, uint32_t i)
+{
+   return (uint8_t)(seq * 7 + i);
+}
+
+static void server_check(const uint8_t *data, uint32_t len, uint32_t seq)
+{
+   uint32_t i;
+
+   for (i = 0; i < len; i += BENCH_CHECK_STEP)
+      if (data[i] != pattern(seq, i))
+         break;
+   if (i < len || (len && data[len - 1] != pattern(seq, len - 1)))
+      server.errors++;
+
+   server.uploads++;
+   server.bytes += len;
+}
+
+static void server_reply(void)
+{
+   uint32_t reply[3];
+   VCHIQ_ELEMENT_T element;
+
+   reply[0] = server.uploads;
+   reply[1] = server.calls;
+   reply[2] = server.errors;
+
+   element.data = reply;
+   element.size = sizeof(reply);
+   vchiq_loopback_queue_message(server.handle, &element, 1);
+   server.sync_wanted = false;
+}
+
+static int server_open(unsigned int handle, void *userdata, void **pconn)
+{
+   *pconn = NULL;
+   /* only the normal priority service is used */
+   if (userdata)
+      server.handle = handle;
+   return 0;
+}
+
+static void server_close(unsigned int handle, void *conn)
+{
+   UNUSED(handle);
+   UNUSED(conn);
+}
+
+static void server_message(unsigned int handle, void *conn, const void *data, unsigned int size)
+{
+   const uint32_t *msg = (const uint32_t *)data;
+   const uint32_t *end = msg + size / 4;
+
+   UNUSED(conn);
+
+   if (server.expect) {
+      if (size != server.expect)
+         server.errors++;
+      server_check((const uint8_t *)data, vcos_min(size, server.expect), server.seq);
+      server.expect = 0;
+      return;
+   }
+
+   while (msg < end) {
+      switch (msg[0]) {
+      case BENCH_NOP:
+         msg += CLIENT_MAKE_CURRENT_SIZE / 4;
+         break;
+      case BENCH_CALL:
+         server.calls++;
+         msg += 2 + msg[1];
+         break;
+      case BENCH_UPLOAD:
+         server.seq = msg[2];
+         if (msg[1] <= KHDISPATCH_CTRL_THRESHOLD)
+            server.expect = msg[1];
+         else if (vchiq_loopback_queue_bulk_receive(handle, server.rx_buf, msg[1], (void *)(size_t)msg[2]) == VCHIQ_SUCCESS)
+            server.pending++;
+         else
+            server.errors++;
+         msg += 3;
+         break;
+      case BENCH_SYNC:
+         server.sync_wanted = true;
+         if (!server.pending)
+            server_reply();
+         msg += 1;
+         break;
+      default:
+         printf("server: unknown message %08x\n", msg[0]);
+         server.errors++;
+         return;
+      }
+   }
+}
+
+static void server_bulk(unsigned int handle, void *conn, VCHIQ_REASON_T reason,
+   void *data, unsigned int size, void *bulk_userdata)
+{
+   UNUSED(handle);
+   UNUSED(conn);
+
+   if (reason == VCHIQ_BULK_RECEIVE_DONE)
+      server_check((const uint8_t *)data, size, (uint32_t)(size_t)bulk_userdata);
+   else
+      server.errors++;
+
+   if (!--server.pending && server.sync_wanted)
+      server_reply();
+}
+
+/*
+   stubs for the parts of the client the rpc layer calls
+*/
+
+void client_send_make_current(CLIENT_THREAD_STATE_T *thread)
+{
+   uint32_t msg[CLIENT_MAKE_CURRENT_SIZE / 4];
+
+   memset(msg, 0, sizeof(msg));
+   msg[0] = BENCH_NOP;
+
+   rpc_send_ctrl_begin(thread, sizeof(msg));
+   rpc_send_ctrl_write(thread, msg, sizeof(msg));
+   rpc_send_ctrl_end(thread);
+}
+
+uint64_t khronos_platform_get_process_id(void)
+{
+   return 0;
+}
+
+VCOS_STATUS_T khronos_platform_semaphore_create(PLATFORM_SEMAPHORE_T *sem, int name[3], int count)
+{
+   UNUSED(sem);
+   UNUSED(name);
+   UNUSED(count);
+   return VCOS_EINVAL;
+}
+
+void *khrn_platform_malloc(size_t size, const char *desc)
+{
+   UNUSED(desc);
+   return malloc(size);
+}
+
+void khrn_platform_free(void *v)
+{
+   free(v);
+}
+
+/*
+   client side
+*/
+
+static void bench_call(CLIENT_THREAD_STATE_T *thread, uint32_t words)
+{
+   uint32_t msg[2 + 16];
+   uint32_t i;
+
+   vcos_assert(words <= 16);
+   msg[0] = BENCH_CALL;
+   msg[1] = words;
+   for (i = 0; i != words; ++i)
+      msg[2 + i] = i;
+
+   rpc_begin(thread);
+   rpc_send_ctrl_begin(thread, (2 + words) * 4);
+   rpc_send_ctrl_write(thread, msg, (2 + words) * 4);
+   rpc_send_ctrl_end(thread);
+   rpc_end(thread);
+}
+
+static void bench_upload(CLIENT_THREAD_STATE_T *thread, const uint8_t *image, uint32_t len, int32_t stride, uint32_t n, uint32_t seq)
+{
+   uint32_t msg[3];
+
+   msg[0] = BENCH_UPLOAD;
+   msg[1] = len * n;
+   msg[2] = seq;
+
+   rpc_begin(thread);
+   rpc_send_ctrl_begin(thread, sizeof(msg));
+   rpc_send_ctrl_write(thread, msg, sizeof(msg));
+   rpc_send_ctrl_end(thread);
+   rpc_send_bulk_gather(thread, image, len, stride, n);
+   rpc_end(thread);
+}
+
+static void bench_sync(CLIENT_THREAD_STATE_T *thread, uint32_t reply[3])
+{
+   uint32_t msg = BENCH_SYNC;
+   uint32_t len = 3 * sizeof(uint32_t);
+
+   rpc_begin(thread);
+   rpc_send_ctrl_begin(thread, sizeof(msg));
+   rpc_send_ctrl_write(thread, &msg, sizeof(msg));
+   rpc_send_ctrl_end(thread);
+   rpc_recv(thread, reply, &len, RPC_RECV_FLAG_CTRL);
+   rpc_end(thread);
+}
+
+static void fill(uint8_t *image, uint32_t len, int32_t stride, uint32_t n, uint32_t seq)
+{
+   uint32_t y, x;
+
+   for (y = 0; y != n; ++y) {
+      uint8_t *row = image + y * stride;
+      for (x = 0; x != len; ++x)
+         row[x] = pattern(seq, y * len + x);
+      memset(row + len, 0xee, stride - len);
+   }
+}
+
+static int run(bool sync_bulk, uint32_t uploads, uint32_t calls, uint32_t len, int32_t stride, uint32_t n)
+{
+   CLIENT_THREAD_STATE_T *thread;
+   RPC_STATS_T stats;
+   uint8_t *images[2];
+   uint32_t reply[3], expected, i, j;
+   int64_t start, elapsed;
+
+   thread = (CLIENT_THREAD_STATE_T *)calloc(1, sizeof(CLIENT_THREAD_STATE_T));
+   images[0] = (uint8_t *)malloc(stride * n);
+   images[1] = (uint8_t *)malloc(stride * n);
+   if (!thread || !images[0] || !images[1]) {
+      printf("out of memory\n");
+      exit(1);
+   }
+
+   khrn_options.sync_bulk = sync_bulk;
+   client_send_make_current(thread);
+
+   bench_sync(thread, reply);
+   expected = reply[0] + uploads;
+
+   /*
+      the image is refilled between uploads, as a client producing the next
+      one would, so only two copies are needed whether or not the last is
+      still being sent
+   */
+
+   start = vcos_getmicrosecs64();
+
+   for (i = 0; i != uploads; ++i) {
+      fill(images[i & 1], len, stride, n, reply[0] + i);
+      for (j = 0; j != calls; ++j)
+         bench_call(thread, j & 15);
+      bench_upload(thread, images[i & 1], len, stride, n, reply[0] + i);
+   }
+   bench_sync(thread, reply);
+
+   elapsed = vcos_getmicrosecs64() - start;
+
+   rpc_get_stats(thread, &stats, false);
+   printf("%-5s: %u uploads of %u bytes in %lld us: %.1f MB/s\n",
+      sync_bulk ? "sync" : "async", uploads, len * n, (long long)elapsed,
+      elapsed ? (double)uploads * len * n / elapsed * 1000000.0 / (1 << 20) : 0.0);
+   printf("       flushes: full %u, early %u, bulk %u, recv %u; %u messages merged (%llu bytes)\n",
+      stats.flushes[RPC_FLUSH_FULL], stats.flushes[RPC_FLUSH_EARLY],
+      stats.flushes[RPC_FLUSH_BULK], stats.flushes[RPC_FLUSH_RECV],
+      stats.messages_merged, (unsigned long long)stats.bytes_merged);
+   printf("       bulks: %u sync, %u async, %u stage waits\n",
+      stats.bulks_sync, stats.bulks_async, stats.stage_waits);
+
+   rpc_term_thread(thread);
+   free(thread);
+   free(images[0]);
+   free(images[1]);
+
+   if (reply[0] != expected || reply[2]) {
+      printf("server saw %u uploads, expected %u, %u errors\n", reply[0], expected, reply[2]);
+      return 1;
+   }
+   return 0;
+}
+
+static void usage(void)
+{
+   printf("Usage: khrn_client_rpc_bench [-n <uploads>] [-l <bytes>] [-p <bytes>] [-r <rows>] [-c <calls>] [-w <MB/s>]\n");
+   printf("    -n <n>        number of uploads (default 200)\n");
+   printf("    -l <bytes>    bytes in each row (default 2048)\n");
+   printf("    -p <bytes>    padding after each row in the client image (default 64)\n");
+   printf("    -r <rows>     rows in each upload (default 128)\n");
+   printf("    -c <calls>    small calls made before each upload (default 8)\n");
+   printf("    -w <MB/s>     bandwidth of the simulated link (default 200, 0 for unlimited)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   static const int fourcc[] = {
+      VCHIQ_MAKE_FOURCC('K', 'H', 'A', 'N'),
+      VCHIQ_MAKE_FOURCC('K', 'H', 'R', 'N'),
+      VCHIQ_MAKE_FOURCC('K', 'H', 'H', 'N')
+   };
+   VCHIQ_LOOPBACK_SERVICE_T service;
+   VCHIQ_LOOPBACK_LINK_T link;
+   uint32_t uploads = 200, len = 2048, pad = 64, rows = 128, calls = 8, bandwidth = 200;
+   int argn, result = 0;
+   uint32_t i;
+
+   for (argn = 1; argn < argc; argn++) {
+      if (!strcmp(argv[argn], "-n") && argn + 1 < argc)
+         uploads = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-l") && argn + 1 < argc)
+         len = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-p") && argn + 1 < argc)
+         pad = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-r") && argn + 1 < argc)
+         rows = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-c") && argn + 1 < argc)
+         calls = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-w") && argn + 1 < argc)
+         bandwidth = atoi(argv[++argn]);
+      else
+         usage();
+   }
+
+   if (!uploads || !len || !rows || len * rows > KHDISPATCH_WORKSPACE_SIZE)
+      usage();
+
+   vcos_init();
+   vcos_log_register("khrn_client", &khrn_client_log);
+   khrn_init_options();
+
+   server.rx_buf = (uint8_t *)malloc(len * rows);
+   if (!server.rx_buf)
+      return 1;
+
+   memset(&service, 0, sizeof(service));
+   service.version = VC_KHRN_VERSION;
+   service.version_min = VC_KHRN_VERSION;
+   service.open = server_open;
+   service.close = server_close;
+   service.message = server_message;
+   service.bulk = server_bulk;
+   for (i = 0; i != sizeof(fourcc) / sizeof(fourcc[0]); ++i) {
+      service.fourcc = fourcc[i];
+      service.userdata = (void *)(size_t)(fourcc[i] == VCHIQ_MAKE_FOURCC('K', 'H', 'R', 'N'));
+      vchiq_loopback_register_service(&service);
+   }
+
+   memset(&link, 0, sizeof(link));
+   link.bulk_bandwidth = bandwidth << 20;
+   vchiq_loopback_set_link(&link);
+   vchiq_loopback_enable(1);
+
+   vc_vchi_khronos_init();
+   if (!khclient_rpc_init()) {
+      printf("failed to initialise rpc\n");
+      return 1;
+   }
+
+   result |= run(true, uploads, calls, len, len + pad, rows);
+   result |= run(false, uploads, calls, len, len + pad, rows);
+
+   rpc_term();
+   free(server.rx_buf);
+
+   return result;
+}
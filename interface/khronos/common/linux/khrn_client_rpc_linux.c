@@ -32,6 +32,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "interface/khronos/common/khrn_client.h"
 #include "interface/khronos/common/khrn_client_rpc.h"
+#include "interface/khronos/common/khrn_options.h"
 
 
 #include <string.h>
@@ -57,6 +58,38 @@ static VCHIU_QUEUE_T khhn_queue;
 
 static VCOS_EVENT_T bulk_event;
 
+/*
+   gathered bulk transfers are sent from per-thread staging buffers and are
+   not waited for, so that gathering the next one can overlap sending the
+   last. a staging buffer is only waited for when it is wanted again, when
+   switching service and when the thread terminates
+
+   transfers queued without userdata are waited for on bulk_event as before
+*/
+
+#define RPC_BULK_STAGES 2
+#define RPC_BULK_STAGE_ALIGN 0x10000
+
+typedef struct {
+   void *data;
+   uint32_t size;
+   bool busy;                 /* queued and not yet waited for */
+   VCOS_SEMAPHORE_T done;     /* posted by the callback when the transfer completes */
+} RPC_BULK_STAGE_T;
+
+struct RPC_BULK_STATE {
+   RPC_BULK_STAGE_T stage[RPC_BULK_STAGES];
+   uint32_t next;
+};
+
+static void bulk_done(void *bulk_userdata)
+{
+   if (bulk_userdata)
+      vcos_semaphore_post(&((RPC_BULK_STAGE_T *)bulk_userdata)->done);
+   else
+      vcos_event_signal(&bulk_event);
+}
+
 VCHIQ_STATUS_T khrn_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
                   VCHIQ_SERVICE_HANDLE_T handle, void *bulk_userdata)
 {
@@ -66,7 +99,7 @@ VCHIQ_STATUS_T khrn_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
       break;
    case VCHIQ_BULK_TRANSMIT_DONE:
    case VCHIQ_BULK_RECEIVE_DONE:
-      vcos_event_signal(&bulk_event);
+      bulk_done(bulk_userdata);
       break;
    case VCHIQ_SERVICE_OPENED:
    case VCHIQ_SERVICE_CLOSED:
@@ -87,7 +120,7 @@ VCHIQ_STATUS_T khhn_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
       break;
    case VCHIQ_BULK_TRANSMIT_DONE:
    case VCHIQ_BULK_RECEIVE_DONE:
-      vcos_event_signal(&bulk_event);
+      bulk_done(bulk_userdata);
       break;
    case VCHIQ_SERVICE_OPENED:
    case VCHIQ_SERVICE_CLOSED:
@@ -261,7 +294,118 @@ static void check_workspace(uint32_t size)
    }
 }
 
-static void merge_flush(CLIENT_THREAD_STATE_T *thread)
+static void stage_wait(RPC_BULK_STAGE_T *stage)
+{
+   if (stage->busy) {
+      VCOS_STATUS_T vcos_status = vcos_semaphore_wait(&stage->done);
+      UNUSED_NDEBUG(vcos_status);
+      vcos_assert(vcos_status == VCOS_SUCCESS);
+
+      stage->busy = false;
+   }
+}
+
+static void stage_wait_all(CLIENT_THREAD_STATE_T *thread)
+{
+   if (thread->bulk) {
+      uint32_t i;
+      for (i = 0; i != RPC_BULK_STAGES; ++i)
+         stage_wait(&thread->bulk->stage[i]);
+   }
+}
+
+/*
+   returns the next staging buffer with room for size bytes, or NULL if
+   there isn't one and the transfer should be made synchronously. stages are
+   never larger than the workspace, so neither is size for a staged transfer
+*/
+
+static RPC_BULK_STAGE_T *stage_get(CLIENT_THREAD_STATE_T *thread, uint32_t size)
+{
+   RPC_BULK_STAGE_T *stage;
+
+   if (khrn_options.sync_bulk || size > KHDISPATCH_WORKSPACE_SIZE)
+      return NULL;
+
+   if (!thread->bulk) {
+      uint32_t i;
+
+      thread->bulk = (struct RPC_BULK_STATE *)khrn_platform_malloc(sizeof(struct RPC_BULK_STATE), "RPC_BULK_STATE");
+      if (!thread->bulk)
+         return NULL;
+
+      for (i = 0; i != RPC_BULK_STAGES; ++i) {
+         thread->bulk->stage[i].data = NULL;
+         thread->bulk->stage[i].size = 0;
+         thread->bulk->stage[i].busy = false;
+         if (vcos_semaphore_create(&thread->bulk->stage[i].done, "rpc_bulk_stage", 0) != VCOS_SUCCESS) {
+            while (i--)
+               vcos_semaphore_delete(&thread->bulk->stage[i].done);
+            khrn_platform_free(thread->bulk);
+            thread->bulk = NULL;
+            return NULL;
+         }
+      }
+      thread->bulk->next = 0;
+   }
+
+   stage = &thread->bulk->stage[thread->bulk->next];
+
+   if (stage->busy)
+      thread->rpc_stats.stage_waits++;
+   stage_wait(stage);
+
+   if (stage->size < size) {
+      uint32_t alloc = _min((size + RPC_BULK_STAGE_ALIGN - 1) & ~(RPC_BULK_STAGE_ALIGN - 1), KHDISPATCH_WORKSPACE_SIZE);
+
+      khrn_platform_free(stage->data);
+      stage->data = khrn_platform_malloc(alloc, "rpc_bulk_stage");
+      stage->size = stage->data ? alloc : 0;
+      if (!stage->data)
+         return NULL;
+   }
+
+   thread->bulk->next = (thread->bulk->next + 1) % RPC_BULK_STAGES;
+
+   return stage;
+}
+
+void rpc_term_thread(CLIENT_THREAD_STATE_T *thread)
+{
+   if (thread->bulk) {
+      uint32_t i;
+
+      stage_wait_all(thread);
+
+      for (i = 0; i != RPC_BULK_STAGES; ++i) {
+         khrn_platform_free(thread->bulk->stage[i].data);
+         vcos_semaphore_delete(&thread->bulk->stage[i].done);
+      }
+      khrn_platform_free(thread->bulk);
+      thread->bulk = NULL;
+   }
+
+   vcos_log_info("rpc: %u flushes (full %u, early %u, bulk %u, recv %u, priority %u, explicit %u), %u messages merged (%llu bytes), "
+      "%u sync and %u async bulks (%llu bytes), %u stage waits",
+      thread->rpc_stats.flushes[RPC_FLUSH_FULL] + thread->rpc_stats.flushes[RPC_FLUSH_EARLY] +
+      thread->rpc_stats.flushes[RPC_FLUSH_BULK] + thread->rpc_stats.flushes[RPC_FLUSH_RECV] +
+      thread->rpc_stats.flushes[RPC_FLUSH_PRIORITY] + thread->rpc_stats.flushes[RPC_FLUSH_EXPLICIT],
+      thread->rpc_stats.flushes[RPC_FLUSH_FULL], thread->rpc_stats.flushes[RPC_FLUSH_EARLY],
+      thread->rpc_stats.flushes[RPC_FLUSH_BULK], thread->rpc_stats.flushes[RPC_FLUSH_RECV],
+      thread->rpc_stats.flushes[RPC_FLUSH_PRIORITY], thread->rpc_stats.flushes[RPC_FLUSH_EXPLICIT],
+      thread->rpc_stats.messages_merged, (unsigned long long)thread->rpc_stats.bytes_merged,
+      thread->rpc_stats.bulks_sync, thread->rpc_stats.bulks_async,
+      (unsigned long long)thread->rpc_stats.bulk_bytes, thread->rpc_stats.stage_waits);
+}
+
+void rpc_get_stats(CLIENT_THREAD_STATE_T *thread, RPC_STATS_T *stats, bool reset)
+{
+   *stats = thread->rpc_stats;
+   if (reset)
+      memset(&thread->rpc_stats, 0, sizeof(thread->rpc_stats));
+}
+
+static void merge_flush(CLIENT_THREAD_STATE_T *thread, RPC_FLUSH_REASON_T reason)
 {
    vcos_log_trace("merge_flush start");
    
@@ -286,6 +430,7 @@ static void merge_flush(CLIENT_THREAD_STATE_T *thread)
       vcos_assert(success == VCHIQ_SUCCESS);
 
       thread->merge_pos = 0;
+      thread->rpc_stats.flushes[reason]++;
 
       client_send_make_current(thread);
 
@@ -299,20 +444,27 @@ static void merge_flush(CLIENT_THREAD_STATE_T *thread)
 
 void rpc_flush(CLIENT_THREAD_STATE_T *thread)
 {
-   merge_flush(thread);
+   merge_flush(thread, RPC_FLUSH_EXPLICIT);
 }
 
+/*
+   transfers on the two services aren't ordered with respect to each other,
+   so anything still in flight must complete before switching
+*/
+
 void rpc_high_priority_begin(CLIENT_THREAD_STATE_T *thread)
 {
    vcos_assert(!thread->high_priority);
-   merge_flush(thread);
+   merge_flush(thread, RPC_FLUSH_PRIORITY);
+   stage_wait_all(thread);
    thread->high_priority = true;
 }
 
 void rpc_high_priority_end(CLIENT_THREAD_STATE_T *thread)
 {
    vcos_assert(thread->high_priority);
-   merge_flush(thread);
+   merge_flush(thread, RPC_FLUSH_PRIORITY);
+   stage_wait_all(thread);
    thread->high_priority = false;
 }
 
@@ -331,10 +483,16 @@ void rpc_send_ctrl_begin(CLIENT_THREAD_STATE_T *thread, uint32_t len)
 
    vcos_assert(len == rpc_pad_ctrl(len));
    if ((thread->merge_pos + len) > MERGE_BUFFER_SIZE) {
-      merge_flush(thread);
+      merge_flush(thread, RPC_FLUSH_FULL);
    }
 
    thread->merge_end = thread->merge_pos + len;
+
+   /* remember the largest recent message, forgetting it slowly */
+   thread->merge_hint = _max(len, thread->merge_hint - (thread->merge_hint >> 3));
+
+   thread->rpc_stats.messages_merged++;
+   thread->rpc_stats.bytes_merged += len;
 }
 
 void rpc_send_ctrl_write(CLIENT_THREAD_STATE_T *thread, const uint32_t in[], uint32_t len) /* len bytes read, rpc_pad_ctrl(len) bytes written */
@@ -351,10 +509,22 @@ void rpc_send_ctrl_end(CLIENT_THREAD_STATE_T *thread)
    //CLIENT_THREAD_STATE_T *thread = CLIENT_GET_THREAD_STATE();
 
    vcos_assert(thread->merge_pos == thread->merge_end);
+
+   /*
+      if a message like the recent ones wouldn't fit, send what we have now
+      rather than waiting for the next call to find the buffer full, so the
+      server can get on with it in the meantime
+   */
+
+   if ((MERGE_BUFFER_SIZE - thread->merge_pos) < thread->merge_hint) {
+      merge_flush(thread, RPC_FLUSH_EARLY);
+   }
 }
 
 static void send_bulk(CLIENT_THREAD_STATE_T *thread, const void *in, uint32_t len)
 {
+   thread->rpc_stats.bulk_bytes += len;
+
    if (len <= KHDISPATCH_CTRL_THRESHOLD) {
       VCHIQ_ELEMENT_T element;
 
@@ -371,6 +541,33 @@ static void send_bulk(CLIENT_THREAD_STATE_T *thread, const void *in, uint32_t le
       VCOS_STATUS_T vcos_status = vcos_event_wait(&bulk_event);
       UNUSED_NDEBUG(vcos_status);      
       vcos_assert(vcos_status == VCOS_SUCCESS);
+      thread->rpc_stats.bulks_sync++;
+   }
+}
+
+/*
+   send len bytes already gathered into stage, leaving the transfer in flight
+*/
+
+static void send_bulk_staged(CLIENT_THREAD_STATE_T *thread, RPC_BULK_STAGE_T *stage, uint32_t len)
+{
+   thread->rpc_stats.bulk_bytes += len;
+
+   if (len <= KHDISPATCH_CTRL_THRESHOLD) {
+      VCHIQ_ELEMENT_T element;
+
+      element.data = stage->data;
+      element.size = len;
+
+      VCHIQ_STATUS_T vchiq_status = vchiq_queue_message(get_handle(thread), &element, 1);
+      UNUSED_NDEBUG(vchiq_status);
+      vcos_assert(vchiq_status == VCHIQ_SUCCESS);
+   } else {
+      VCHIQ_STATUS_T vchiq_status = vchiq_queue_bulk_transmit(get_handle(thread), stage->data, rpc_pad_bulk(len), stage);
+      UNUSED_NDEBUG(vchiq_status);
+      vcos_assert(vchiq_status == VCHIQ_SUCCESS);
+      stage->busy = true;
+      thread->rpc_stats.bulks_async++;
    }
 }
 
@@ -396,7 +593,7 @@ void rpc_send_bulk(CLIENT_THREAD_STATE_T *thread, const void *in, uint32_t len)
    if (in && len) {
       //CLIENT_THREAD_STATE_T *thread = CLIENT_GET_THREAD_STATE();
 
-      merge_flush(thread);
+      merge_flush(thread, RPC_FLUSH_BULK);
 
       send_bulk(thread, in, len);
    }
@@ -408,15 +605,21 @@ void rpc_send_bulk_gather(CLIENT_THREAD_STATE_T *thread, const void *in, uint32_
    if (in && len) {
       //CLIENT_THREAD_STATE_T *thread = CLIENT_GET_THREAD_STATE();
 
-      merge_flush(thread);
+      merge_flush(thread, RPC_FLUSH_BULK);
 
       if (len == stride) {
          /* hopefully should be the common case */
          send_bulk(thread, in, n * len);
       } else {
-         check_workspace(n * len);
-         rpc_gather(workspace, in, len, stride, n);
-         send_bulk(thread, workspace, n * len);
+         RPC_BULK_STAGE_T *stage = stage_get(thread, n * len);
+         if (stage) {
+            rpc_gather(stage->data, in, len, stride, n);
+            send_bulk_staged(thread, stage, n * len);
+         } else {
+            check_workspace(n * len);
+            rpc_gather(workspace, in, len, stride, n);
+            send_bulk(thread, workspace, n * len);
+         }
       }
    }
 #else
@@ -437,7 +640,7 @@ uint32_t rpc_recv(CLIENT_THREAD_STATE_T *thread, void *out, uint32_t *len_io, RP
    vcos_assert(!(flags & RPC_RECV_FLAG_CTRL) || !(flags & RPC_RECV_FLAG_BULK)); /* can't receive user data over both bulk and control... */
 
    if (recv_ctrl || len_io[0]) { /* do nothing if we're just receiving bulk of length 0 */
-      merge_flush(thread);
+      merge_flush(thread, RPC_FLUSH_RECV);
 
       if (recv_ctrl) {
          VCHIQ_HEADER_T *header = vchiu_queue_pop(get_queue(thread));
@@ -62,6 +62,7 @@ typedef struct MMAL_BUFFER_HEADER_PRIVATE_T
 
    void *component_data;      /**< Field reserved for use by the component */
    void *payload_handle;      /**< Field reserved for mmal_buffer_header_mem_lock */
+   uint32_t send_time;        /**< Time (us) the buffer header was last sent to a port */
 
    uint8_t driver_area[MMAL_DRIVER_BUFFER_SIZE];
 
@@ -27,7 +27,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "interface/vcos/vcos.h"
 #include "interface/mmal/mmal_logging.h"
-#include "interface/mmal/util/mmal_list.h"
 #include "interface/mmal/util/mmal_util_rational.h"
 #include "interface/mmal/core/mmal_clock_private.h"
 
@@ -48,9 +47,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* 1.0 in Q16 format */
 #define Q16_ONE  (1 << 16)
 
-/* Maximum number of pending requests */
+/* Number of request slots allocated at a time */
 #define CLOCK_REQUEST_SLOTS  32
 
+/* Maximum number of pending requests */
+#define CLOCK_REQUEST_SLOTS_MAX  16384
+#define CLOCK_REQUEST_BLOCKS     (CLOCK_REQUEST_SLOTS_MAX / CLOCK_REQUEST_SLOTS)
+
+/* Heap index of a request slot which is not pending */
+#define CLOCK_REQUEST_NOT_PENDING  0xFFFFFFFF
+
 /* Number of microseconds the clock tries to service requests early
  * to account for processing overhead */
 #define CLOCK_TARGET_OFFSET  20
@@ -92,7 +98,12 @@ typedef VCOS_TIMER_T MMAL_TIMER_T;
 
 typedef struct MMAL_CLOCK_REQUEST_T
 {
-   MMAL_LIST_ELEMENT_T link; /**< must be first */
+   struct MMAL_CLOCK_REQUEST_T *next_free;
+                             /**< next slot in the list of free slots */
+   uint32_t heap_index;      /**< position in the pending heap, or CLOCK_REQUEST_NOT_PENDING */
+   uint32_t seq;             /**< insertion order, so equal media-times are serviced in order */
+   MMAL_CLOCK_REQUEST_ID_T id;
+                             /**< slot number in the low 16 bits, reuse count above */
    MMAL_CLOCK_VOID_FP priv;  /**< client-supplied function pointer */
    MMAL_CLOCK_REQUEST_CB cb; /**< client-supplied callback to invoke */
    void *cb_data;            /**< client-supplied callback data */
@@ -148,12 +159,22 @@ typedef struct MMAL_CLOCK_PRIVATE_T
    int64_t  update_threshold_upper;
                               /**< Time differences above this threshold reset media time */
 
-   /* Client requests */
+   /* Client requests. Pending requests are kept in a binary heap keyed on adjusted
+    * media-time, with the next one due in the direction of playback at the top, so
+    * adding, cancelling and servicing a request are all O(log n). Keys are media-times,
+    * so they stay valid across scale changes; only the timer delay to the top request
+    * depends on the scale. */
    struct
    {
-      MMAL_LIST_T* list_free;
-      MMAL_LIST_T* list_pending;
-      MMAL_CLOCK_REQUEST_T pool[CLOCK_REQUEST_SLOTS];
+      MMAL_CLOCK_REQUEST_T *free;     /**< unused request slots */
+      MMAL_CLOCK_REQUEST_T **heap;    /**< pending requests */
+      unsigned int pending;           /**< number of requests in the heap */
+      unsigned int heap_size;         /**< number of entries allocated for the heap */
+      unsigned int slots;             /**< number of request slots allocated */
+      uint32_t seq;                   /**< sequence number of the next request */
+      MMAL_BOOL_T reverse;            /**< heap is ordered for a negative scale */
+      MMAL_CLOCK_REQUEST_T *blocks[CLOCK_REQUEST_BLOCKS];
+                                      /**< request slots, CLOCK_REQUEST_SLOTS per block */
    } request;
 
 } MMAL_CLOCK_PRIVATE_T;
@@ -252,66 +273,223 @@ static int64_t mmal_clock_media_time_get_locked(MMAL_CLOCK_PRIVATE_T *private)
    return private->media_time;
 }
 
-/* Comparison function used for inserting a request into
- * the list of pending requests when clock scale is positive. */
-static int mmal_clock_request_compare_pos(MMAL_LIST_ELEMENT_T *lhs, MMAL_LIST_ELEMENT_T *rhs)
+/* Return true if request a is due before request b in the direction of playback */
+static inline MMAL_BOOL_T mmal_clock_request_before(MMAL_CLOCK_PRIVATE_T *private,
+      const MMAL_CLOCK_REQUEST_T *a, const MMAL_CLOCK_REQUEST_T *b)
 {
-   return ((MMAL_CLOCK_REQUEST_T*)lhs)->media_time_adj < ((MMAL_CLOCK_REQUEST_T*)rhs)->media_time_adj;
+   if (a->media_time_adj != b->media_time_adj)
+      return private->request.reverse ? (a->media_time_adj > b->media_time_adj) :
+                                        (a->media_time_adj < b->media_time_adj);
+   return (int32_t)(a->seq - b->seq) < 0;
 }
 
-/* Comparison function used for inserting a request into
- * the list of pending requests when clock scale is negative. */
-static int mmal_clock_request_compare_neg(MMAL_LIST_ELEMENT_T *lhs, MMAL_LIST_ELEMENT_T *rhs)
+/* Move a pending request towards the top of the heap until it is in order */
+static void mmal_clock_heap_up(MMAL_CLOCK_PRIVATE_T *private, unsigned int index)
 {
-   return ((MMAL_CLOCK_REQUEST_T*)lhs)->media_time_adj > ((MMAL_CLOCK_REQUEST_T*)rhs)->media_time_adj;
+   MMAL_CLOCK_REQUEST_T **heap = private->request.heap;
+   MMAL_CLOCK_REQUEST_T *request = heap[index];
+
+   while (index > 0)
+   {
+      unsigned int parent = (index - 1) / 2;
+      if (!mmal_clock_request_before(private, request, heap[parent]))
+         break;
+      heap[index] = heap[parent];
+      heap[index]->heap_index = index;
+      index = parent;
+   }
+   heap[index] = request;
+   request->heap_index = index;
 }
 
-/* Insert a new request into the list of pending requests */
-static MMAL_BOOL_T mmal_clock_request_insert(MMAL_CLOCK_PRIVATE_T *private, MMAL_CLOCK_REQUEST_T *request)
+/* Move a pending request towards the bottom of the heap until it is in order */
+static void mmal_clock_heap_down(MMAL_CLOCK_PRIVATE_T *private, unsigned int index)
 {
-   MMAL_LIST_T *list = private->request.list_pending;
-   MMAL_CLOCK_REQUEST_T *pending;
+   MMAL_CLOCK_REQUEST_T **heap = private->request.heap;
+   MMAL_CLOCK_REQUEST_T *request = heap[index];
+   unsigned int count = private->request.pending;
 
-   if (private->stop_thread)
-      return MMAL_FALSE; /* the clock is being destroyed */
+   while (1)
+   {
+      unsigned int child = 2 * index + 1;
+      if (child >= count)
+         break;
+      if (child + 1 < count && mmal_clock_request_before(private, heap[child + 1], heap[child]))
+         child++;
+      if (!mmal_clock_request_before(private, heap[child], request))
+         break;
+      heap[index] = heap[child];
+      heap[index]->heap_index = index;
+      index = child;
+   }
+   heap[index] = request;
+   request->heap_index = index;
+}
+
+/* Re-order the heap for the direction of playback. This is O(n) but only
+ * happens when the clock scale changes sign. */
+static void mmal_clock_heap_reorder(MMAL_CLOCK_PRIVATE_T *private, MMAL_BOOL_T reverse)
+{
+   unsigned int i = private->request.pending / 2;
+
+   if (private->request.reverse == reverse)
+      return;
+   private->request.reverse = reverse;
 
-   if (list->length == 0)
+   while (i-- > 0)
+      mmal_clock_heap_down(private, i);
+}
+
+/* Allocate another block of request slots */
+static MMAL_BOOL_T mmal_clock_request_grow(MMAL_CLOCK_PRIVATE_T *private)
+{
+   unsigned int block = private->request.slots / CLOCK_REQUEST_SLOTS;
+   MMAL_CLOCK_REQUEST_T *slots;
+   unsigned int i;
+
+   if (block >= CLOCK_REQUEST_BLOCKS)
+      return MMAL_FALSE;
+
+   if (private->request.heap_size < private->request.slots + CLOCK_REQUEST_SLOTS)
    {
-      mmal_list_push_front(list, &request->link);
-      return MMAL_TRUE;
+      unsigned int heap_size = private->request.heap_size ? 2 * private->request.heap_size : CLOCK_REQUEST_SLOTS;
+      MMAL_CLOCK_REQUEST_T **heap = vcos_malloc(heap_size * sizeof(*heap), "mmal-clock heap");
+      if (!heap)
+         return MMAL_FALSE;
+      if (private->request.heap)
+      {
+         memcpy(heap, private->request.heap, private->request.pending * sizeof(*heap));
+         vcos_free(private->request.heap);
+      }
+      private->request.heap = heap;
+      private->request.heap_size = heap_size;
    }
 
-   /* It is more likely for requests to be received in sequence,
-    * so try adding to the back of the list first before doing
-    * a more expensive list insert. */
-   pending = (MMAL_CLOCK_REQUEST_T*)list->last;
-   if ((private->scale >= 0 && (request->media_time_adj >= pending->media_time_adj)) ||
-       (private->scale <  0 && (request->media_time_adj <= pending->media_time_adj)))
+   slots = vcos_calloc(CLOCK_REQUEST_SLOTS, sizeof(*slots), "mmal-clock requests");
+   if (!slots)
+      return MMAL_FALSE;
+   private->request.blocks[block] = slots;
+
+   for (i = 0; i < CLOCK_REQUEST_SLOTS; i++)
    {
-      mmal_list_push_back(list, &request->link);
+      slots[i].id = private->request.slots + i;
+      slots[i].heap_index = CLOCK_REQUEST_NOT_PENDING;
+      slots[i].next_free = private->request.free;
+      private->request.free = &slots[i];
    }
-   else
+   private->request.slots += CLOCK_REQUEST_SLOTS;
+
+   return MMAL_TRUE;
+}
+
+/* Get a free request slot, allocating more if needed */
+static MMAL_CLOCK_REQUEST_T *mmal_clock_request_alloc(MMAL_CLOCK_PRIVATE_T *private)
+{
+   MMAL_CLOCK_REQUEST_T *request = private->request.free;
+   uint32_t reuse;
+
+   if (!request)
    {
-      mmal_list_insert(list, &request->link,
-            (private->scale >= 0) ? mmal_clock_request_compare_pos : mmal_clock_request_compare_neg);
+      if (!mmal_clock_request_grow(private))
+         return NULL;
+      request = private->request.free;
    }
+   private->request.free = request->next_free;
+
+   /* Change the id each time the slot is used so that stale ids can be detected */
+   reuse = (request->id >> 16) + 1;
+   if (reuse > 0xFFFF)
+      reuse = 1;
+   request->id = (reuse << 16) | (request->id & 0xFFFF);
+
+   return request;
+}
+
+/* Recycle a request slot */
+static void mmal_clock_request_release(MMAL_CLOCK_PRIVATE_T *private, MMAL_CLOCK_REQUEST_T *request)
+{
+   request->next_free = private->request.free;
+   private->request.free = request;
+}
+
+/* Free all request slots */
+static void mmal_clock_request_free_slots(MMAL_CLOCK_PRIVATE_T *private)
+{
+   unsigned int i;
+
+   for (i = 0; i < private->request.slots / CLOCK_REQUEST_SLOTS; i++)
+      vcos_free(private->request.blocks[i]);
+   if (private->request.heap)
+      vcos_free(private->request.heap);
+
+   private->request.heap = NULL;
+   private->request.heap_size = 0;
+   private->request.slots = 0;
+   private->request.free = NULL;
+}
+
+/* Find the pending request with the given id */
+static MMAL_CLOCK_REQUEST_T *mmal_clock_request_find(MMAL_CLOCK_PRIVATE_T *private, MMAL_CLOCK_REQUEST_ID_T id)
+{
+   unsigned int slot = id & 0xFFFF;
+   MMAL_CLOCK_REQUEST_T *request;
+
+   if (slot >= private->request.slots)
+      return NULL;
+
+   request = &private->request.blocks[slot / CLOCK_REQUEST_SLOTS][slot % CLOCK_REQUEST_SLOTS];
+   if (request->id != id || request->heap_index == CLOCK_REQUEST_NOT_PENDING)
+      return NULL;
+
+   return request;
+}
+
+/* Insert a new request into the heap of pending requests */
+static MMAL_BOOL_T mmal_clock_request_insert(MMAL_CLOCK_PRIVATE_T *private, MMAL_CLOCK_REQUEST_T *request)
+{
+   if (private->stop_thread)
+      return MMAL_FALSE; /* the clock is being destroyed */
+
+   request->seq = private->request.seq++;
+   private->request.heap[private->request.pending++] = request;
+   mmal_clock_heap_up(private, private->request.pending - 1);
    return MMAL_TRUE;
 }
 
+/* Remove a request from the heap of pending requests */
+static void mmal_clock_request_remove(MMAL_CLOCK_PRIVATE_T *private, MMAL_CLOCK_REQUEST_T *request)
+{
+   unsigned int index = request->heap_index;
+   MMAL_CLOCK_REQUEST_T *last = private->request.heap[--private->request.pending];
+
+   request->heap_index = CLOCK_REQUEST_NOT_PENDING;
+   if (last == request)
+      return;
+
+   /* Fill the gap with the last request and restore the heap order around it */
+   private->request.heap[index] = last;
+   last->heap_index = index;
+   if (index > 0 && mmal_clock_request_before(private, last, private->request.heap[(index - 1) / 2]))
+      mmal_clock_heap_up(private, index);
+   else
+      mmal_clock_heap_down(private, index);
+}
+
 /* Flush all pending requests */
 static MMAL_STATUS_T mmal_clock_request_flush_locked(MMAL_CLOCK_PRIVATE_T *private,
                                                      int64_t media_time)
 {
-   MMAL_LIST_T *pending = private->request.list_pending;
-   MMAL_LIST_T *list_free = private->request.list_free;
    MMAL_CLOCK_REQUEST_T *request;
 
-   while ((request = (MMAL_CLOCK_REQUEST_T *)mmal_list_pop_front(pending)) != NULL)
+   /* Service the requests in order */
+   while (private->request.pending)
    {
+      request = private->request.heap[0];
+      mmal_clock_request_remove(private, request);
       /* Inform the client */
       request->cb(&private->clock, media_time, request->cb_data, request->priv);
       /* Recycle request slot */
-      mmal_list_push_back(list_free, &request->link);
+      mmal_clock_request_release(private, request);
    }
 
    private->media_time_at_timer = 0;
@@ -323,11 +501,9 @@ static MMAL_STATUS_T mmal_clock_request_flush_locked(MMAL_CLOCK_PRIVATE_T *priva
 static void mmal_clock_process_requests(MMAL_CLOCK_PRIVATE_T *private)
 {
    int64_t media_time_now;
-   MMAL_LIST_T* free = private->request.list_free;
-   MMAL_LIST_T* pending = private->request.list_pending;
    MMAL_CLOCK_REQUEST_T *next;
 
-   if (pending->length == 0 || !private->is_active)
+   if (private->request.pending == 0 || !private->is_active)
       return;
 
    LOCK(private);
@@ -340,8 +516,8 @@ static void mmal_clock_process_requests(MMAL_CLOCK_PRIVATE_T *private)
       if (private->scale > 0 &&
           media_time_now + private->discont_threshold < private->media_time_at_timer)
       {
-         LOG_INFO("discontinuity: was=%" PRIi64 " now=%" PRIi64 " pending=%d",
-                  private->media_time_at_timer, media_time_now, pending->length);
+         LOG_INFO("discontinuity: was=%" PRIi64 " now=%" PRIi64 " pending=%u",
+                  private->media_time_at_timer, media_time_now, private->request.pending);
 
          /* It's likely that packets from before the discontinuity will continue to arrive for
           * a short time. Ensure these are detected and the requests fired immediately. */
@@ -354,10 +530,10 @@ static void mmal_clock_process_requests(MMAL_CLOCK_PRIVATE_T *private)
       }
    }
 
-   /* Earliest request is always at the front */
-   next = (MMAL_CLOCK_REQUEST_T*)mmal_list_pop_front(pending);
-   while (next)
+   /* Earliest request is always at the top of the heap */
+   while (private->request.pending)
    {
+      next = private->request.heap[0];
       media_time_now = mmal_clock_media_time_get_locked(private);
 
       if (private->discont_expiry != 0 && private->wall_time > private->discont_expiry)
@@ -372,12 +548,11 @@ static void mmal_clock_process_requests(MMAL_CLOCK_PRIVATE_T *private)
           (private->scale < 0 && ((media_time_now - MIN_TIMER_DELAY) <= next->media_time_adj)))
       {
          LOG_TRACE("servicing request: next %"PRIi64" now %"PRIi64, next->media_time_adj, media_time_now);
+         mmal_clock_request_remove(private, next);
          /* Inform the client */
          next->cb(&private->clock, media_time_now, next->cb_data, next->priv);
          /* Recycle the request slot */
-         mmal_list_push_back(free, &next->link);
-         /* Move onto next pending request */
-         next = (MMAL_CLOCK_REQUEST_T*)mmal_list_pop_front(pending);
+         mmal_clock_request_release(private, next);
       }
       else
       {
@@ -389,15 +564,12 @@ static void mmal_clock_process_requests(MMAL_CLOCK_PRIVATE_T *private)
          if (private->scale == 0)
             wall_time_delay = CLOCK_WAIT_TIME; /* Clock is paused */
 
-         /* Put next request back into pending list */
-         mmal_list_push_front(pending, &next->link);
-         next = NULL;
-
          /* Set the timer */
          private->media_time_at_timer = media_time_now;
          mmal_clock_timer_set(&private->timer, wall_time_delay);
 
          LOG_TRACE("re-schedule timer: now %"PRIi64" delay %"PRIi64, media_time_now, wall_time_delay);
+         break;
       }
    }
 
@@ -442,7 +614,6 @@ static void* mmal_clock_worker_thread(void *ctx)
 /* Create scheduling resources */
 static MMAL_STATUS_T mmal_clock_create_scheduling(MMAL_CLOCK_PRIVATE_T *private)
 {
-   unsigned int i;
    MMAL_BOOL_T timer_status = MMAL_FALSE;
    VCOS_STATUS_T event_status = VCOS_EINVAL;
    VCOS_UNSIGNED priority;
@@ -461,18 +632,14 @@ static MMAL_STATUS_T mmal_clock_create_scheduling(MMAL_CLOCK_PRIVATE_T *private)
       goto error;
    }
 
-   private->request.list_free = mmal_list_create();
-   private->request.list_pending = mmal_list_create();
-   if (!private->request.list_free || !private->request.list_pending)
+   /* Allocate the first block of request slots; more are added as needed */
+   private->request.reverse = private->scale < 0;
+   if (!mmal_clock_request_grow(private))
    {
-      LOG_ERROR("failed to create list %p %p", private->request.list_free, private->request.list_pending);
+      LOG_ERROR("failed to allocate request slots");
       goto error;
    }
 
-   /* Populate the list of available request slots */
-   for (i = 0; i < CLOCK_REQUEST_SLOTS; ++i)
-      mmal_list_push_back(private->request.list_free, &private->request.pool[i].link);
-
    if (vcos_thread_create(&private->thread, "mmal-clock thread", NULL,
                           mmal_clock_worker_thread, private) != VCOS_SUCCESS)
    {
@@ -489,8 +656,7 @@ static MMAL_STATUS_T mmal_clock_create_scheduling(MMAL_CLOCK_PRIVATE_T *private)
 error:
    if (event_status == VCOS_SUCCESS) vcos_semaphore_delete(&private->event);
    if (timer_status) mmal_clock_timer_destroy(&private->timer);
-   if (private->request.list_free) mmal_list_destroy(private->request.list_free);
-   if (private->request.list_pending) mmal_list_destroy(private->request.list_pending);
+   mmal_clock_request_free_slots(private);
    return MMAL_ENOSPC;
 }
 
@@ -501,8 +667,7 @@ static void mmal_clock_destroy_scheduling(MMAL_CLOCK_PRIVATE_T *private)
 
    mmal_clock_request_flush(&private->clock);
 
-   mmal_list_destroy(private->request.list_free);
-   mmal_list_destroy(private->request.list_pending);
+   mmal_clock_request_free_slots(private);
 
    vcos_semaphore_delete(&private->event);
 
@@ -596,6 +761,13 @@ MMAL_STATUS_T mmal_clock_destroy(MMAL_CLOCK_T *clock)
 /* Add new client request to list of pending requests */
 MMAL_STATUS_T mmal_clock_request_add(MMAL_CLOCK_T *clock, int64_t media_time,
       MMAL_CLOCK_REQUEST_CB cb, void *cb_data, MMAL_CLOCK_VOID_FP priv)
+{
+   return mmal_clock_request_add_id(clock, media_time, cb, cb_data, priv, NULL);
+}
+
+/* Add new client request to list of pending requests, returning its id */
+MMAL_STATUS_T mmal_clock_request_add_id(MMAL_CLOCK_T *clock, int64_t media_time,
+      MMAL_CLOCK_REQUEST_CB cb, void *cb_data, MMAL_CLOCK_VOID_FP priv, MMAL_CLOCK_REQUEST_ID_T *id)
 {
    MMAL_CLOCK_PRIVATE_T *private = (MMAL_CLOCK_PRIVATE_T*)clock;
    MMAL_CLOCK_REQUEST_T *request;
@@ -629,7 +801,7 @@ MMAL_STATUS_T mmal_clock_request_add(MMAL_CLOCK_T *clock, int64_t media_time,
       }
    }
 
-   request = (MMAL_CLOCK_REQUEST_T*)mmal_list_pop_front(private->request.list_free);
+   request = mmal_clock_request_alloc(private);
    if (request == NULL)
    {
       LOG_ERROR("no more free clock request slots");
@@ -644,7 +816,16 @@ MMAL_STATUS_T mmal_clock_request_add(MMAL_CLOCK_T *clock, int64_t media_time,
    request->media_time_adj = media_time - (int64_t)(private->scale * CLOCK_TARGET_OFFSET >> 16);
 
    if (mmal_clock_request_insert(private, request))
-      wake_thread = private->is_active;
+   {
+      /* The timer only needs re-arming if this is now the earliest request */
+      wake_thread = private->is_active && request->heap_index == 0;
+      if (id)
+         *id = request->id;
+   }
+   else
+   {
+      mmal_clock_request_release(private, request);
+   }
 
    UNLOCK(private);
 
@@ -655,6 +836,27 @@ MMAL_STATUS_T mmal_clock_request_add(MMAL_CLOCK_T *clock, int64_t media_time,
    return MMAL_SUCCESS;
 }
 
+/* Remove a client request from the list of pending requests */
+MMAL_STATUS_T mmal_clock_request_cancel(MMAL_CLOCK_T *clock, MMAL_CLOCK_REQUEST_ID_T id)
+{
+   MMAL_CLOCK_PRIVATE_T *private = (MMAL_CLOCK_PRIVATE_T*)clock;
+   MMAL_CLOCK_REQUEST_T *request = NULL;
+
+   LOCK(private);
+   if (private->scheduling)
+      request = mmal_clock_request_find(private, id);
+   if (request)
+   {
+      mmal_clock_request_remove(private, request);
+      mmal_clock_request_release(private, request);
+   }
+   UNLOCK(private);
+
+   /* There is no need to re-arm the timer if the earliest request was cancelled;
+    * it will simply find the next one is not yet due. */
+   return request ? MMAL_SUCCESS : MMAL_EINVAL;
+}
+
 /* Flush all pending requests */
 MMAL_STATUS_T mmal_clock_request_flush(MMAL_CLOCK_T *clock)
 {
@@ -754,6 +956,11 @@ MMAL_STATUS_T mmal_clock_scale_set(MMAL_CLOCK_T *clock, MMAL_RATIONAL_T scale)
    else
       private->scale_inv = Q16_ONE; /* clock is paused */
 
+   /* Pending requests are keyed on media-time, so a new scale only changes the
+    * timer delay to the earliest one, unless the direction of playback changes */
+   if (private->scheduling)
+      mmal_clock_heap_reorder(private, private->scale < 0);
+
    UNLOCK(private);
 
    mmal_clock_wake_thread(private);
@@ -0,0 +1,240 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Stress test for clock request scheduling.
+ *
+ * Registers a large number of requests spread over a short stretch of media
+ * time, in random order, cancels some of them, then starts the clock and
+ * reports how long adding and cancelling took and how far from its requested
+ * media-time each request was serviced. It also checks that every request
+ * which was not cancelled is serviced exactly once and in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmal.h"
+#include "core/mmal_clock_private.h"
+
+/* Media-time of the first request, giving the clock thread time to start */
+#define BENCH_LEAD_TIME  50000
+
+typedef struct BENCH_REQUEST_T
+{
+   int64_t media_time;           /**< requested media-time */
+   MMAL_CLOCK_REQUEST_ID_T id;
+   int cancelled;
+   unsigned int fired;
+   int64_t error;                /**< media-time at which it fired, less media_time */
+} BENCH_REQUEST_T;
+
+static BENCH_REQUEST_T *requests;
+static volatile unsigned int fired_total;
+static int64_t last_fired;
+static unsigned int out_of_order;
+
+static void bench_cb(MMAL_CLOCK_T *clock, int64_t media_time, void *cb_data, MMAL_CLOCK_VOID_FP priv)
+{
+   BENCH_REQUEST_T *request = (BENCH_REQUEST_T *)cb_data;
+   MMAL_PARAM_UNUSED(clock);
+   MMAL_PARAM_UNUSED(priv);
+
+   /* Callbacks are made one at a time from the clock thread */
+   if (request->media_time < last_fired)
+      out_of_order++;
+   last_fired = request->media_time;
+
+   request->error = media_time - request->media_time;
+   request->fired++;
+   fired_total++;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+   int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+   printf("Usage: mmal_clock_bench [-n <requests>] [-d <ms>] [-c <cancels>] [-s <num/den>]\n");
+   printf("    -n <n>        pending requests (default 10000)\n");
+   printf("    -d <ms>       media-time the requests are spread over (default 2000)\n");
+   printf("    -c <n>        requests cancelled before the clock starts (default 1000)\n");
+   printf("    -s <num/den>  change the clock scale half way through (default none)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int num_requests = 10000, spread_ms = 2000, num_cancels = 1000;
+   MMAL_RATIONAL_T scale = { 0, 0 };
+   MMAL_CLOCK_T *clock;
+   unsigned int *order, i, expected, lost = 0, repeated = 0, stray = 0, n = 0;
+   int64_t *errors, sum = 0;
+   uint32_t start, add_us, cancel_us, timeout;
+   int argn;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-n") && argn + 1 < argc)
+         num_requests = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-d") && argn + 1 < argc)
+         spread_ms = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-c") && argn + 1 < argc)
+         num_cancels = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-s") && argn + 1 < argc &&
+               sscanf(argv[argn + 1], "%d/%d", &scale.num, &scale.den) == 2 && scale.den > 0)
+         argn++;
+      else
+         usage();
+   }
+
+   if (!num_requests || !spread_ms || num_cancels > num_requests)
+      usage();
+
+   vcos_init();
+
+   requests = calloc(num_requests, sizeof(*requests));
+   order = calloc(num_requests, sizeof(*order));
+   errors = calloc(num_requests, sizeof(*errors));
+   if (!requests || !order || !errors || mmal_clock_create(&clock) != MMAL_SUCCESS)
+   {
+      printf("out of memory\n");
+      return 1;
+   }
+
+   /* Requests evenly spaced in media-time, added in random order */
+   srand(1);
+   for (i = 0; i < num_requests; i++)
+   {
+      requests[i].media_time = BENCH_LEAD_TIME + (int64_t)i * spread_ms * 1000 / num_requests;
+      order[i] = i;
+   }
+   for (i = num_requests - 1; i > 0; i--)
+   {
+      unsigned int j = rand() % (i + 1), tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+   }
+
+   start = vcos_getmicrosecs();
+   for (i = 0; i < num_requests; i++)
+   {
+      BENCH_REQUEST_T *request = &requests[order[i]];
+      if (mmal_clock_request_add_id(clock, request->media_time, bench_cb, request, NULL,
+                                    &request->id) != MMAL_SUCCESS)
+      {
+         printf("failed to add request %u\n", i);
+         return 1;
+      }
+   }
+   add_us = vcos_getmicrosecs() - start;
+
+   /* Cancel a random selection of the requests */
+   start = vcos_getmicrosecs();
+   for (i = 0; i < num_cancels; i++)
+   {
+      BENCH_REQUEST_T *request = &requests[order[i]];
+      if (mmal_clock_request_cancel(clock, request->id) != MMAL_SUCCESS)
+         stray++;
+      request->cancelled = 1;
+   }
+   cancel_us = vcos_getmicrosecs() - start;
+
+   /* A stale id must not cancel anything */
+   if (num_cancels && mmal_clock_request_cancel(clock, requests[order[0]].id) == MMAL_SUCCESS)
+      stray++;
+
+   printf("%u requests over %u ms, %u cancelled\n", num_requests, spread_ms, num_cancels);
+   printf("add:    %6.2f us per request\n", (double)add_us / num_requests);
+   if (num_cancels)
+      printf("cancel: %6.2f us per request\n", (double)cancel_us / num_cancels);
+
+   mmal_clock_media_time_set(clock, 0);
+   mmal_clock_active_set(clock, MMAL_TRUE);
+
+   expected = num_requests - num_cancels;
+   timeout = spread_ms * 4 + 1000;
+   if (scale.num > 0)
+   {
+      /* Allow for the run taking longer at the new scale */
+      timeout = timeout * scale.den / scale.num + 1000;
+      vcos_sleep((BENCH_LEAD_TIME / 1000 + spread_ms) / 2);
+      mmal_clock_scale_set(clock, scale);
+      printf("scale changed to %d/%d\n", scale.num, scale.den);
+   }
+   else if (scale.num < 0 || scale.den)
+      printf("ignoring scale %d/%d; only forward play is tested\n", scale.num, scale.den);
+
+   start = vcos_getmicrosecs();
+   while (fired_total < expected && vcos_getmicrosecs() - start < timeout * 1000)
+      vcos_sleep(10);
+   vcos_sleep(50); /* catch any stray callbacks */
+
+   mmal_clock_active_set(clock, MMAL_FALSE);
+   mmal_clock_destroy(clock);
+
+   for (i = 0; i < num_requests; i++)
+   {
+      if (requests[i].cancelled)
+      {
+         if (requests[i].fired)
+            stray++;
+         continue;
+      }
+      if (!requests[i].fired)
+         lost++;
+      else if (requests[i].fired > 1)
+         repeated++;
+      else
+      {
+         errors[n++] = requests[i].error;
+         sum += requests[i].error;
+      }
+   }
+
+   if (n)
+   {
+      qsort(errors, n, sizeof(*errors), compare_int64);
+      printf("serviced %u requests, media-time error (us, negative is early):\n", n);
+      printf("  min %"PRIi64"  median %"PRIi64"  mean %"PRIi64"  p99 %"PRIi64"  max %"PRIi64"\n",
+             errors[0], errors[n / 2], sum / n, errors[n - n / 100 - 1], errors[n - 1]);
+      printf("  jitter (p99 - p1) %"PRIi64"\n", errors[n - n / 100 - 1] - errors[n / 100]);
+   }
+   printf("lost %u, repeated %u, out of order %u, fired after cancel %u\n",
+          lost, repeated, out_of_order, stray);
+
+   free(errors);
+   free(order);
+   free(requests);
+
+   return (lost || repeated || out_of_order || stray) ? 1 : 0;
+}
@@ -69,6 +69,9 @@ MMAL_STATUS_T mmal_clock_destroy(MMAL_CLOCK_T *clock);
 typedef void (*MMAL_CLOCK_VOID_FP)(void);
 typedef void (*MMAL_CLOCK_REQUEST_CB)(MMAL_CLOCK_T *clock, int64_t media_time, void *cb_data, MMAL_CLOCK_VOID_FP priv);
 
+/** Identifies a pending clock request so that it can be cancelled. */
+typedef uint32_t MMAL_CLOCK_REQUEST_ID_T;
+
 /** Register a request with the clock.
  * When the specified media-time is reached, the clock will invoke the supplied callback.
  *
@@ -83,6 +86,30 @@ typedef void (*MMAL_CLOCK_REQUEST_CB)(MMAL_CLOCK_T *clock, int64_t media_time, v
 MMAL_STATUS_T mmal_clock_request_add(MMAL_CLOCK_T *clock, int64_t media_time,
                                      MMAL_CLOCK_REQUEST_CB cb, void *cb_data, MMAL_CLOCK_VOID_FP priv);
 
+/** Register a request with the clock, returning an id which can be used to cancel it.
+ *
+ * @param clock      The clock
+ * @param media_time The media-time at which the callback should be invoked (microseconds)
+ * @param cb         Callback to invoke
+ * @param cb_data    Client-supplied callback data
+ * @param priv       Function pointer used by the framework
+ * @param id         Returned request id (may be NULL)
+ *
+ * @return MMAL_SUCCESS on success
+ */
+MMAL_STATUS_T mmal_clock_request_add_id(MMAL_CLOCK_T *clock, int64_t media_time,
+                                        MMAL_CLOCK_REQUEST_CB cb, void *cb_data, MMAL_CLOCK_VOID_FP priv,
+                                        MMAL_CLOCK_REQUEST_ID_T *id);
+
+/** Cancel a pending clock request without invoking its callback.
+ *
+ * @param clock      The clock
+ * @param id         Id returned when the request was registered
+ *
+ * @return MMAL_SUCCESS on success, MMAL_EINVAL if the request is no longer pending
+ */
+MMAL_STATUS_T mmal_clock_request_cancel(MMAL_CLOCK_T *clock, MMAL_CLOCK_REQUEST_ID_T id);
+
 /** Remove all previously registered clock requests.
  *
  * @param clock      The clock
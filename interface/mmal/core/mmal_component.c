@@ -29,6 +29,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "core/mmal_component_private.h"
 #include "core/mmal_port_private.h"
 #include "core/mmal_core_private.h"
+#include "core/mmal_executor_private.h"
 #include "mmal_logging.h"
 
 /* Minimum number of buffers that will be available on the control port */
@@ -48,6 +49,10 @@ typedef struct
    VCOS_MUTEX_T action_mutex;
    MMAL_BOOL_T action_quit;
 
+   /** Action run by the shared executor instead of the action thread */
+   MMAL_EXECUTOR_TASK_T action_task;
+   MMAL_BOOL_T action_shared;
+
    VCOS_MUTEX_T lock; /**< Used to lock access to the component */
    MMAL_BOOL_T destruction_pending;
 
@@ -567,6 +572,17 @@ static void *mmal_component_action_thread_func(void *arg)
    return 0;
 }
 
+/** Runs the action of a component from the shared executor */
+static void mmal_component_action_task_func(void *arg)
+{
+   MMAL_COMPONENT_T *component = (MMAL_COMPONENT_T *)arg;
+   MMAL_COMPONENT_CORE_PRIVATE_T *private = (MMAL_COMPONENT_CORE_PRIVATE_T *)component->priv;
+
+   vcos_mutex_lock(&private->action_mutex);
+   private->pf_action(component);
+   vcos_mutex_unlock(&private->action_mutex);
+}
+
 /** Registers an action with the core */
 MMAL_STATUS_T mmal_component_action_register(MMAL_COMPONENT_T *component,
                                              void (*pf_action)(MMAL_COMPONENT_T *) )
@@ -578,14 +594,24 @@ MMAL_STATUS_T mmal_component_action_register(MMAL_COMPONENT_T *component,
    if (private->pf_action)
       return MMAL_EINVAL;
 
-   status = vcos_event_create(&private->action_event, component->name);
+   status = vcos_mutex_create(&private->action_mutex, component->name);
    if (status != VCOS_SUCCESS)
       return MMAL_ENOMEM;
 
-   status = vcos_mutex_create(&private->action_mutex, component->name);
+   /* Use the shared executor when it is enabled, otherwise give the
+    * action a thread of its own */
+   if (mmal_executor_task_init(&private->action_task, mmal_component_action_task_func,
+                               component) == MMAL_SUCCESS)
+   {
+      private->action_shared = MMAL_TRUE;
+      private->pf_action = pf_action;
+      return MMAL_SUCCESS;
+   }
+
+   status = vcos_event_create(&private->action_event, component->name);
    if (status != VCOS_SUCCESS)
    {
-      vcos_event_delete(&private->action_event);
+      vcos_mutex_delete(&private->action_mutex);
       return MMAL_ENOMEM;
    }
 
@@ -613,6 +639,15 @@ MMAL_STATUS_T mmal_component_action_deregister(MMAL_COMPONENT_T *component)
    if (!private->pf_action)
       return MMAL_EINVAL;
 
+   if (private->action_shared)
+   {
+      mmal_executor_task_deinit(&private->action_task);
+      vcos_mutex_delete(&private->action_mutex);
+      private->action_shared = MMAL_FALSE;
+      private->pf_action = NULL;
+      return MMAL_SUCCESS;
+   }
+
    private->action_quit = 1;
    vcos_event_signal(&private->action_event);
    vcos_thread_join(&private->action_thread, NULL);
@@ -631,7 +666,10 @@ MMAL_STATUS_T mmal_component_action_trigger(MMAL_COMPONENT_T *component)
    if (!private->pf_action)
       return MMAL_EINVAL;
 
-   vcos_event_signal(&private->action_event);
+   if (private->action_shared)
+      mmal_executor_task_schedule(&private->action_task);
+   else
+      vcos_event_signal(&private->action_event);
    return MMAL_SUCCESS;
 }
 
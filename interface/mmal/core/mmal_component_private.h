@@ -97,6 +97,10 @@ MMAL_STATUS_T mmal_component_parameter_get(MMAL_PORT_T *control_port,
   * The MMAL core allows components to register an action which will be run
   * from a separate thread context when the action is explicitly triggered by
   * the component.
+  * Each action normally gets a thread of its own. When the MMAL_EXECUTOR_THREADS
+  * environment variable is set, actions are run by a shared pool of that many
+  * worker threads instead, still never more than one at a time per component.
+  * The component's action thread priority does not apply in that case.
   *
   * @param component    component registering the action.
   * @param action       action to register.
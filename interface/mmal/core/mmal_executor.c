@@ -0,0 +1,449 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+
+#include "mmal.h"
+#include "mmal_logging.h"
+#include "core/mmal_executor_private.h"
+
+/* Shared executor for component actions.
+ *
+ * A fixed number of worker threads run tasks from per-worker queues. A worker
+ * takes its own newest task first, so an action that triggers the next
+ * component along a pipeline usually runs it straight away on the same thread.
+ * An idle worker steals the oldest task of another worker. Tasks scheduled
+ * from outside the executor are shared out between the workers in turn.
+ *
+ * The queues are short critical sections under a mutex each. Task state is
+ * changed with atomic operations so that scheduling an already queued task
+ * costs nothing. */
+
+/** Task states */
+#define TASK_IDLE     0  /**< Not queued */
+#define TASK_QUEUED   1  /**< On a worker queue */
+#define TASK_RUNNING  2  /**< Being run by a worker */
+#define TASK_RERUN    3  /**< Being run, and scheduled again meanwhile */
+#define TASK_DEAD     4  /**< Removed, never runs again */
+/** Set on a running task being removed, so that the worker running it sees
+ * it in the same atomic operation which gives the task up */
+#define TASK_QUIT     8
+
+typedef struct MMAL_EXECUTOR_WORKER_T
+{
+   VCOS_MUTEX_T lock;                    /**< Protects the queue */
+   MMAL_EXECUTOR_TASK_T *queue[MMAL_EXECUTOR_TASKS_MAX];
+   unsigned int head;                    /**< Oldest task, taken by thieves */
+   unsigned int count;                   /**< Tasks queued, the newest is taken by the owner */
+   VCOS_THREAD_T thread;
+
+   unsigned int runs;                    /**< Tasks run */
+   unsigned int steals;                  /**< Tasks taken from other workers */
+} MMAL_EXECUTOR_WORKER_T;
+
+static struct
+{
+   VCOS_MUTEX_T lock;                    /**< Protects starting and stopping */
+   unsigned int tasks;                   /**< Tasks registered */
+   unsigned int num_workers;
+   MMAL_EXECUTOR_WORKER_T *workers;
+   VCOS_TLS_KEY_T current;               /**< Worker running on this thread, if any */
+   VCOS_SEMAPHORE_T wake;                /**< Posted to wake a sleeping worker */
+   volatile int sleeping;                /**< Workers waiting on wake */
+   volatile int quit;
+   volatile unsigned int next;           /**< Worker to queue the next outside task on */
+} executor;
+
+/*****************************************************************************/
+static void mmal_executor_push(MMAL_EXECUTOR_WORKER_T *worker, MMAL_EXECUTOR_TASK_T *task,
+                               MMAL_BOOL_T oldest)
+{
+   unsigned int count;
+
+   vcos_mutex_lock(&worker->lock);
+   /* Each task is queued at most once and there are no more than
+    * MMAL_EXECUTOR_TASKS_MAX tasks, so there is always room */
+   if (oldest)
+   {
+      worker->head = (worker->head + MMAL_EXECUTOR_TASKS_MAX - 1) % MMAL_EXECUTOR_TASKS_MAX;
+      worker->queue[worker->head] = task;
+   }
+   else
+   {
+      worker->queue[(worker->head + worker->count) % MMAL_EXECUTOR_TASKS_MAX] = task;
+   }
+   count = ++worker->count;
+   vcos_mutex_unlock(&worker->lock);
+
+   /* The owner will get round to its own task anyway, only wake another worker
+    * to take the surplus */
+   __sync_synchronize();
+   if (executor.sleeping && (count > 1 || worker != vcos_tls_get(executor.current)))
+      vcos_semaphore_post(&executor.wake);
+}
+
+static MMAL_EXECUTOR_TASK_T *mmal_executor_pop(MMAL_EXECUTOR_WORKER_T *worker)
+{
+   MMAL_EXECUTOR_TASK_T *task = NULL;
+
+   vcos_mutex_lock(&worker->lock);
+   if (worker->count)
+      task = worker->queue[(worker->head + --worker->count) % MMAL_EXECUTOR_TASKS_MAX];
+   vcos_mutex_unlock(&worker->lock);
+   return task;
+}
+
+static MMAL_EXECUTOR_TASK_T *mmal_executor_steal(MMAL_EXECUTOR_WORKER_T *worker)
+{
+   unsigned int i, start = worker - executor.workers;
+   MMAL_EXECUTOR_TASK_T *task = NULL;
+
+   for (i = 1; i < executor.num_workers && !task; i++)
+   {
+      MMAL_EXECUTOR_WORKER_T *victim = &executor.workers[(start + i) % executor.num_workers];
+
+      if (!victim->count)
+         continue;
+
+      vcos_mutex_lock(&victim->lock);
+      if (victim->count)
+      {
+         task = victim->queue[victim->head];
+         victim->head = (victim->head + 1) % MMAL_EXECUTOR_TASKS_MAX;
+         victim->count--;
+      }
+      vcos_mutex_unlock(&victim->lock);
+   }
+
+   if (task)
+      worker->steals++;
+   return task;
+}
+
+/** Let a task being removed know it has stopped. The task can be freed as
+ * soon as this is done. */
+static void mmal_executor_finish(MMAL_EXECUTOR_TASK_T *task)
+{
+   __sync_lock_test_and_set(&task->state, TASK_DEAD);
+   vcos_semaphore_post(&task->finished);
+}
+
+static void mmal_executor_run(MMAL_EXECUTOR_WORKER_T *worker, MMAL_EXECUTOR_TASK_T *task)
+{
+   /* A queued task is only removed while it is still on a queue, so once
+    * popped nothing else touches its state */
+   __sync_lock_test_and_set(&task->state, TASK_RUNNING);
+
+   task->pf_run(task->data);
+   worker->runs++;
+
+   /* The task must not be touched once it is idle, as it may be removed and
+    * freed straight away. Removal while running is seen by this failing. */
+   if (__sync_bool_compare_and_swap(&task->state, TASK_RUNNING, TASK_IDLE))
+      return;
+
+   /* Scheduled again while running. Queue it behind everything else this
+    * worker has, so one busy task cannot starve the others. */
+   if (__sync_bool_compare_and_swap(&task->state, TASK_RERUN, TASK_QUEUED))
+   {
+      mmal_executor_push(worker, task, MMAL_TRUE);
+      return;
+   }
+
+   mmal_executor_finish(task);
+}
+
+/** Take a queued task off whichever worker queue it is on and mark it dead.
+ * Returns MMAL_FALSE if it is on none, because it is being pushed or has just
+ * been popped. */
+static MMAL_BOOL_T mmal_executor_unqueue(MMAL_EXECUTOR_TASK_T *task)
+{
+   unsigned int i, j;
+
+   for (i = 0; i < executor.num_workers; i++)
+   {
+      MMAL_EXECUTOR_WORKER_T *worker = &executor.workers[i];
+
+      vcos_mutex_lock(&worker->lock);
+      for (j = 0; j < worker->count; j++)
+      {
+         if (worker->queue[(worker->head + j) % MMAL_EXECUTOR_TASKS_MAX] == task)
+            break;
+      }
+      if (j < worker->count)
+      {
+         /* Close the gap. Workers only pop under this lock, and scheduling
+          * leaves a queued task alone, so nothing else moves it off QUEUED. */
+         for (; j + 1 < worker->count; j++)
+            worker->queue[(worker->head + j) % MMAL_EXECUTOR_TASKS_MAX] =
+               worker->queue[(worker->head + j + 1) % MMAL_EXECUTOR_TASKS_MAX];
+         worker->count--;
+         __sync_lock_test_and_set(&task->state, TASK_DEAD);
+         vcos_mutex_unlock(&worker->lock);
+         return MMAL_TRUE;
+      }
+      vcos_mutex_unlock(&worker->lock);
+   }
+   return MMAL_FALSE;
+}
+
+static void *mmal_executor_worker(void *arg)
+{
+   MMAL_EXECUTOR_WORKER_T *worker = (MMAL_EXECUTOR_WORKER_T *)arg;
+   MMAL_EXECUTOR_TASK_T *task;
+
+   vcos_tls_set(executor.current, worker);
+
+   while (1)
+   {
+      task = mmal_executor_pop(worker);
+      if (!task)
+         task = mmal_executor_steal(worker);
+
+      if (!task)
+      {
+         /* Announce we are going to sleep before looking one last time, so
+          * that anything queued from now on wakes us */
+         __sync_fetch_and_add(&executor.sleeping, 1);
+         task = mmal_executor_pop(worker);
+         if (!task)
+            task = mmal_executor_steal(worker);
+         if (!task && !executor.quit)
+            vcos_semaphore_wait(&executor.wake);
+         __sync_fetch_and_sub(&executor.sleeping, 1);
+
+         if (!task)
+         {
+            if (executor.quit)
+               break;
+            continue;
+         }
+      }
+
+      mmal_executor_run(worker, task);
+   }
+
+   return 0;
+}
+
+/*****************************************************************************/
+static void mmal_executor_stop(void)
+{
+   unsigned int i, runs = 0, steals = 0;
+
+   executor.quit = 1;
+   __sync_synchronize();
+   for (i = 0; i < executor.num_workers; i++)
+      vcos_semaphore_post(&executor.wake);
+
+   for (i = 0; i < executor.num_workers; i++)
+   {
+      vcos_thread_join(&executor.workers[i].thread, NULL);
+      vcos_mutex_delete(&executor.workers[i].lock);
+      runs += executor.workers[i].runs;
+      steals += executor.workers[i].steals;
+   }
+
+   LOG_INFO("executor stopped: %u workers, %u runs, %u steals", executor.num_workers, runs, steals);
+
+   vcos_semaphore_delete(&executor.wake);
+   vcos_tls_delete(executor.current);
+   vcos_free(executor.workers);
+   executor.workers = NULL;
+   executor.num_workers = 0;
+}
+
+static MMAL_STATUS_T mmal_executor_start(unsigned int num_workers)
+{
+   VCOS_THREAD_ATTR_T attrs;
+   unsigned int i;
+
+   executor.workers = vcos_calloc(num_workers, sizeof(*executor.workers), "mmal executor");
+   if (!executor.workers)
+      return MMAL_ENOMEM;
+
+   if (vcos_tls_create(&executor.current) != VCOS_SUCCESS)
+      goto error_tls;
+   if (vcos_semaphore_create(&executor.wake, "mmal executor", 0) != VCOS_SUCCESS)
+      goto error_wake;
+
+   executor.quit = 0;
+   executor.sleeping = 0;
+   vcos_thread_attr_init(&attrs);
+
+   for (i = 0; i < num_workers; i++)
+   {
+      MMAL_EXECUTOR_WORKER_T *worker = &executor.workers[i];
+
+      if (vcos_mutex_create(&worker->lock, "mmal executor worker") != VCOS_SUCCESS)
+         break;
+      if (vcos_thread_create(&worker->thread, "mmal executor", &attrs,
+                             mmal_executor_worker, worker) != VCOS_SUCCESS)
+      {
+         vcos_mutex_delete(&worker->lock);
+         break;
+      }
+      executor.num_workers++;
+   }
+
+   if (executor.num_workers == num_workers)
+   {
+      LOG_INFO("executor started with %u workers", num_workers);
+      return MMAL_SUCCESS;
+   }
+
+   mmal_executor_stop();
+   return MMAL_ENOMEM;
+
+ error_wake:
+   vcos_tls_delete(executor.current);
+ error_tls:
+   vcos_free(executor.workers);
+   executor.workers = NULL;
+   return MMAL_ENOMEM;
+}
+
+static void mmal_executor_init_once(void)
+{
+   vcos_mutex_create(&executor.lock, "mmal executor");
+}
+
+/** Add a task to the shared executor */
+MMAL_STATUS_T mmal_executor_task_init(MMAL_EXECUTOR_TASK_T *task,
+                                      void (*pf_run)(void *data), void *data)
+{
+   static VCOS_ONCE_T once = VCOS_ONCE_INIT;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+
+   vcos_once(&once, mmal_executor_init_once);
+   vcos_mutex_lock(&executor.lock);
+
+   if (!executor.num_workers)
+   {
+      const char *env = getenv(MMAL_EXECUTOR_THREADS_ENV);
+      unsigned int num_workers = env ? (unsigned int)atoi(env) : 0;
+
+      if (!num_workers)
+         status = MMAL_ENOSYS;
+      else
+         status = mmal_executor_start(num_workers > MMAL_EXECUTOR_WORKERS_MAX ?
+                                      MMAL_EXECUTOR_WORKERS_MAX : num_workers);
+   }
+   else if (executor.tasks == MMAL_EXECUTOR_TASKS_MAX)
+      status = MMAL_ENOSPC;
+
+   if (status == MMAL_SUCCESS &&
+       vcos_semaphore_create(&task->finished, "mmal executor task", 0) != VCOS_SUCCESS)
+   {
+      if (!executor.tasks && !vcos_tls_get(executor.current))
+         mmal_executor_stop();
+      status = MMAL_ENOMEM;
+   }
+
+   if (status == MMAL_SUCCESS)
+   {
+      task->pf_run = pf_run;
+      task->data = data;
+      task->state = TASK_IDLE;
+      executor.tasks++;
+   }
+
+   vcos_mutex_unlock(&executor.lock);
+   return status;
+}
+
+/** Remove a task from the executor */
+void mmal_executor_task_deinit(MMAL_EXECUTOR_TASK_T *task)
+{
+   /* An idle or queued task is removed here and now. Only a running task
+    * is waited for, and the worker running it marks it dead once it stops.
+    * Waiting for a worker to pop a queued task could deadlock, as the only
+    * worker may be the caller. */
+   while (1)
+   {
+      int state = task->state;
+
+      if (state == TASK_IDLE)
+      {
+         if (__sync_bool_compare_and_swap(&task->state, TASK_IDLE, TASK_DEAD))
+            break;
+      }
+      else if (state == TASK_QUEUED)
+      {
+         if (mmal_executor_unqueue(task))
+            break;
+         /* Being pushed or just popped, which resolves in a moment */
+         vcos_sleep(1);
+      }
+      else if (__sync_bool_compare_and_swap(&task->state, state, state | TASK_QUIT))
+      {
+         vcos_semaphore_wait(&task->finished);
+         break;
+      }
+   }
+   vcos_semaphore_delete(&task->finished);
+
+   /* A worker cannot wait for itself to stop, so if the last task is removed
+    * from an action the workers stay idle until a task is added again */
+   vcos_mutex_lock(&executor.lock);
+   if (!--executor.tasks && !vcos_tls_get(executor.current))
+      mmal_executor_stop();
+   vcos_mutex_unlock(&executor.lock);
+}
+
+/** Schedule a task to run */
+void mmal_executor_task_schedule(MMAL_EXECUTOR_TASK_T *task)
+{
+   MMAL_EXECUTOR_WORKER_T *worker;
+
+   while (1)
+   {
+      int state = task->state;
+
+      if (state == TASK_RUNNING)
+      {
+         if (__sync_bool_compare_and_swap(&task->state, TASK_RUNNING, TASK_RERUN))
+            return;
+      }
+      else if (state == TASK_IDLE)
+      {
+         if (__sync_bool_compare_and_swap(&task->state, TASK_IDLE, TASK_QUEUED))
+            break;
+      }
+      else
+      {
+         /* Already queued or rescheduled, or removed */
+         return;
+      }
+   }
+
+   worker = vcos_tls_get(executor.current);
+   if (!worker)
+      worker = &executor.workers[__sync_fetch_and_add(&executor.next, 1) % executor.num_workers];
+
+   mmal_executor_push(worker, task, MMAL_FALSE);
+}
@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Loopback benchmark for component actions.
+ *
+ * A ring of pass-through components hands buffers from one to the next, each
+ * hop being a queue put and an action trigger, as connection-driven
+ * components do. The same ring is run with a thread per component and on the
+ * shared executor with various numbers of workers, reporting buffer hops per
+ * second and context switches per thousand hops. It also checks that no
+ * component's action ever runs on two threads at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mmal.h"
+#include "core/mmal_component_private.h"
+#include "core/mmal_executor_private.h"
+
+#define BENCH_MAX_STAGES 64
+#define BENCH_MAX_MODES 8
+
+typedef struct BENCH_STAGE_T
+{
+   MMAL_COMPONENT_T *component;
+   MMAL_QUEUE_T *queue;
+   struct BENCH_STAGE_T *next;
+   volatile int running;
+   unsigned int hops;
+   unsigned int overlaps;
+} BENCH_STAGE_T;
+
+static BENCH_STAGE_T stages[BENCH_MAX_STAGES];
+static unsigned int work = 0;
+static volatile int bench_stop;
+
+static void bench_action(MMAL_COMPONENT_T *component)
+{
+   BENCH_STAGE_T *stage = (BENCH_STAGE_T *)component->priv->module;
+   MMAL_BUFFER_HEADER_T *buffer;
+
+   if (__sync_fetch_and_add(&stage->running, 1))
+      stage->overlaps++;
+
+   while ((buffer = mmal_queue_get(stage->queue)) != NULL)
+   {
+      volatile unsigned int i;
+      for (i = 0; i < work; i++)
+         ;
+
+      stage->hops++;
+      if (bench_stop)
+      {
+         mmal_buffer_header_release(buffer);
+         continue;
+      }
+      mmal_queue_put(stage->next->queue, buffer);
+      mmal_component_action_trigger(stage->next->component);
+   }
+
+   __sync_fetch_and_sub(&stage->running, 1);
+}
+
+static MMAL_STATUS_T bench_constructor(const char *name, MMAL_COMPONENT_T *component)
+{
+   MMAL_PARAM_UNUSED(name);
+   MMAL_PARAM_UNUSED(component);
+   return MMAL_SUCCESS;
+}
+
+static unsigned long context_switches(void)
+{
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static int bench_run(unsigned int workers, unsigned int num_stages, unsigned int num_buffers,
+                     unsigned int duration_ms)
+{
+   MMAL_POOL_T *pool;
+   unsigned int i, hops = 0, overlaps = 0;
+   unsigned long switches;
+   uint32_t start, elapsed;
+   char value[16];
+
+   snprintf(value, sizeof(value), "%u", workers);
+   setenv(MMAL_EXECUTOR_THREADS_ENV, value, 1);
+   bench_stop = 0;
+
+   pool = mmal_pool_create(num_buffers, 0);
+   if (!pool)
+      return -1;
+
+   memset(stages, 0, sizeof(stages));
+   for (i = 0; i < num_stages; i++)
+   {
+      stages[i].next = &stages[(i + 1) % num_stages];
+      stages[i].queue = mmal_queue_create();
+      if (!stages[i].queue ||
+          mmal_component_create_with_constructor("bench", bench_constructor,
+             (struct MMAL_COMPONENT_MODULE_T *)&stages[i], &stages[i].component) != MMAL_SUCCESS ||
+          mmal_component_action_register(stages[i].component, bench_action) != MMAL_SUCCESS)
+      {
+         printf("failed to create stage %u\n", i);
+         return -1;
+      }
+   }
+
+   switches = context_switches();
+   start = vcos_getmicrosecs();
+
+   /* Start every buffer off at the first stage */
+   for (i = 0; i < num_buffers; i++)
+      mmal_queue_put(stages[0].queue, mmal_pool_get(pool));
+   mmal_component_action_trigger(stages[0].component);
+
+   vcos_sleep(duration_ms);
+   bench_stop = 1;
+   while (mmal_queue_length(pool->queue) < num_buffers)
+      vcos_sleep(1);
+
+   elapsed = vcos_getmicrosecs() - start;
+   switches = context_switches() - switches;
+
+   for (i = 0; i < num_stages; i++)
+   {
+      hops += stages[i].hops;
+      overlaps += stages[i].overlaps;
+      mmal_component_destroy(stages[i].component);
+      mmal_queue_destroy(stages[i].queue);
+   }
+   mmal_pool_destroy(pool);
+
+   if (workers)
+      printf("executor, %2u workers:  ", workers);
+   else
+      printf("thread per component: ");
+   printf("%9.0f buffers/s, %7.1f context switches per 1000 buffers, %u overlaps\n",
+          hops * 1000000.0 / elapsed, switches * 1000.0 / (hops ? hops : 1), overlaps);
+
+   return overlaps ? -1 : 0;
+}
+
+static void usage(void)
+{
+   printf("Usage: mmal_executor_bench [-s <stages>] [-b <buffers>] [-w <work>] [-d <ms>] [-e <workers,...>]\n");
+   printf("    -s <n>      components in the loop (default 12)\n");
+   printf("    -b <n>      buffers going round the loop (default 4)\n");
+   printf("    -w <n>      busy loop iterations per buffer and component (default 0)\n");
+   printf("    -d <ms>     duration of each run (default 2000)\n");
+   printf("    -e <list>   executor workers for each run, 0 for a thread per component (default 0,1,2,4)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int num_stages = 12, num_buffers = 4, duration_ms = 2000;
+   unsigned int modes[BENCH_MAX_MODES] = {0, 1, 2, 4};
+   unsigned int num_modes = 4, i;
+   int argn, result = 0;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-s") && argn + 1 < argc)
+         num_stages = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         num_buffers = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-w") && argn + 1 < argc)
+         work = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-d") && argn + 1 < argc)
+         duration_ms = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-e") && argn + 1 < argc)
+      {
+         char *list = argv[++argn];
+         for (num_modes = 0; num_modes < BENCH_MAX_MODES && *list; num_modes++)
+         {
+            modes[num_modes] = strtoul(list, &list, 10);
+            if (*list == ',')
+               list++;
+         }
+      }
+      else
+         usage();
+   }
+
+   if (num_stages < 2 || num_stages > BENCH_MAX_STAGES || !num_buffers || !num_modes)
+      usage();
+
+   vcos_init();
+   printf("%u components, %u buffers in flight, %u iterations of work per hop\n",
+          num_stages, num_buffers, work);
+
+   for (i = 0; i < num_modes; i++)
+      if (bench_run(modes[i], num_stages, num_buffers, duration_ms) != 0)
+         result = 1;
+
+   return result;
+}
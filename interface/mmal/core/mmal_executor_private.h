@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MMAL_EXECUTOR_PRIVATE_H
+#define MMAL_EXECUTOR_PRIVATE_H
+
+#include "interface/vcos/vcos.h"
+#include "mmal_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Name of the environment variable giving the number of executor worker threads.
+ * When unset or 0, every component action gets a thread of its own. */
+#define MMAL_EXECUTOR_THREADS_ENV "MMAL_EXECUTOR_THREADS"
+
+/** Most worker threads the executor will start */
+#define MMAL_EXECUTOR_WORKERS_MAX 16
+
+/** Most tasks the executor will take. Tasks beyond this are refused, and the
+ * caller falls back to a thread of its own. */
+#define MMAL_EXECUTOR_TASKS_MAX 256
+
+/** A task run by the shared executor.
+ * A task is queued at most once however often it is scheduled, and never runs
+ * on two workers at the same time. Scheduling it while it runs makes it run
+ * again afterwards. */
+typedef struct MMAL_EXECUTOR_TASK_T
+{
+   void (*pf_run)(void *data);   /**< Work to do, run from a worker thread */
+   void *data;                   /**< Argument passed to pf_run */
+
+   volatile int state;           /**< Idle, queued, running, running and rescheduled, or finished,
+                                      and whether it is being removed */
+   VCOS_SEMAPHORE_T finished;    /**< Posted when a task being removed stops */
+} MMAL_EXECUTOR_TASK_T;
+
+/** Add a task to the shared executor, starting the executor if need be.
+ *
+ * @param task    task to initialise.
+ * @param pf_run  work to do each time the task runs.
+ * @param data    argument passed to pf_run.
+ * @return MMAL_SUCCESS, MMAL_ENOSYS if the executor is not enabled, or
+ *         another status on error.
+ */
+MMAL_STATUS_T mmal_executor_task_init(MMAL_EXECUTOR_TASK_T *task,
+                                      void (*pf_run)(void *data), void *data);
+
+/** Remove a task from the executor.
+ * Waits for the task to finish running if it is, and drops it if it is queued.
+ * The executor stops once its last task is removed.
+ *
+ * @param task    task to remove.
+ */
+void mmal_executor_task_deinit(MMAL_EXECUTOR_TASK_T *task);
+
+/** Schedule a task to run.
+ * From a worker thread the task goes on that worker's own queue, so it
+ * usually runs next on the same thread without a context switch.
+ *
+ * @param task    task to run.
+ */
+void mmal_executor_task_schedule(MMAL_EXECUTOR_TASK_T *task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MMAL_EXECUTOR_PRIVATE_H */
@@ -30,6 +30,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "core/mmal_buffer_private.h"
 #include "mmal_logging.h"
 
+/** Per-thread cache (magazine) of released buffer headers */
+typedef struct MMAL_POOL_CACHE_T
+{
+   struct MMAL_POOL_CACHE_T *next; /**< Next cache registered with the pool */
+   VCOS_MUTEX_T lock;              /**< Only contended when another thread steals from it */
+   unsigned int num;               /**< Number of headers currently cached */
+   MMAL_POOL_CACHE_STATS_T stats;  /**< Statistics for the owning thread */
+   MMAL_BUFFER_HEADER_T *header[1];/**< Cached headers (actually cache_size long) */
+} MMAL_POOL_CACHE_T;
+
 /** Definition of a pool */
 typedef struct MMAL_POOL_PRIVATE_T
 {
@@ -47,12 +57,19 @@ typedef struct MMAL_POOL_PRIVATE_T
 
    unsigned int headers_alloc_num; /**< Number of buffer headers allocated as part of the private structure */
 
+   unsigned int cache_size;     /**< Size of the per-thread caches, 0 if disabled */
+   VCOS_TLS_KEY_T cache_key;    /**< Key to the calling thread's cache */
+   VCOS_MUTEX_T cache_lock;     /**< Protects the list of caches */
+   MMAL_POOL_CACHE_T *caches;   /**< List of all the caches created for this pool */
+
 } MMAL_POOL_PRIVATE_T;
 
 #define ROUND_UP(s,align) ((((unsigned long)(s)) & ~((align)-1)) + (align))
 #define ALIGN  8
 
 static void mmal_pool_buffer_header_release(MMAL_BUFFER_HEADER_T *header);
+static void mmal_pool_cache_flush(MMAL_POOL_T *pool);
+static void mmal_pool_cache_destroy(MMAL_POOL_T *pool);
 
 static void *mmal_pool_allocator_default_alloc(void *context, uint32_t size)
 {
@@ -209,6 +226,8 @@ void mmal_pool_destroy(MMAL_POOL_T *pool)
          priv->pf_payload_free(priv->payload_context, priv->payload);
    }
 
+   mmal_pool_cache_destroy(pool);
+
    if (pool->header)
       vcos_free(pool->header);
 
@@ -230,6 +249,7 @@ MMAL_STATUS_T mmal_pool_resize(MMAL_POOL_T *pool, unsigned int headers, uint32_t
       return MMAL_SUCCESS;
 
    /* Remove all the headers from the queue */
+   mmal_pool_cache_flush(pool);
    for (i = 0; i < pool->headers_num; i++)
       mmal_queue_get(pool->queue);
 
@@ -263,6 +283,293 @@ MMAL_STATUS_T mmal_pool_resize(MMAL_POOL_T *pool, unsigned int headers, uint32_t
    return MMAL_SUCCESS;
 }
 
+/*****************************************************************************
+ * Per-thread caches.
+ * Each thread releasing or getting buffer headers keeps a small stash of them
+ * which it exchanges with the pool's queue in batches of half the cache size.
+ * The lock of a cache is only ever contended when a thread which ran out of
+ * buffer headers steals from another thread's cache.
+ *****************************************************************************/
+
+static MMAL_POOL_CACHE_T *mmal_pool_cache_get(MMAL_POOL_T *pool)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_POOL_CACHE_T *cache = vcos_tls_get(private->cache_key);
+
+   if (cache)
+      return cache;
+
+   cache = vcos_calloc(1, sizeof(*cache) + sizeof(cache->header[0]) * (private->cache_size - 1),
+                       "MMAL pool cache");
+   if (!cache)
+      return NULL;
+   if (vcos_mutex_create(&cache->lock, "MMAL pool cache lock") != VCOS_SUCCESS)
+   {
+      vcos_free(cache);
+      return NULL;
+   }
+
+   vcos_mutex_lock(&private->cache_lock);
+   cache->next = private->caches;
+   private->caches = cache;
+   vcos_mutex_unlock(&private->cache_lock);
+
+   vcos_tls_set(private->cache_key, cache);
+   return cache;
+}
+
+static void mmal_pool_cache_lock(MMAL_POOL_CACHE_T *cache)
+{
+   if (vcos_mutex_trylock(&cache->lock) == VCOS_SUCCESS)
+      return;
+   vcos_mutex_lock(&cache->lock);
+   cache->stats.contended++;
+}
+
+static void mmal_pool_cache_put(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *header)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_POOL_CACHE_T *cache = mmal_pool_cache_get(pool);
+   unsigned int batch = (private->cache_size + 1) / 2;
+
+   if (!cache)
+   {
+      mmal_queue_put(pool->queue, header);
+      return;
+   }
+
+   mmal_pool_cache_lock(cache);
+   if (cache->num == private->cache_size)
+   {
+      /* Cache is full, hand back a batch of the oldest headers to the pool */
+      unsigned int i;
+      for (i = 0; i < batch; i++)
+         mmal_queue_put(pool->queue, cache->header[i]);
+      memmove(cache->header, cache->header + batch, (cache->num - batch) * sizeof(cache->header[0]));
+      cache->num -= batch;
+      cache->stats.flushes++;
+   }
+   cache->header[cache->num++] = header;
+   vcos_mutex_unlock(&cache->lock);
+}
+
+/* Take all the headers out of another thread's cache */
+static MMAL_BUFFER_HEADER_T *mmal_pool_cache_steal(MMAL_POOL_T *pool, MMAL_POOL_CACHE_T *cache)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_BUFFER_HEADER_T *header = NULL;
+   MMAL_POOL_CACHE_T *victim;
+
+   vcos_mutex_lock(&private->cache_lock);
+   for (victim = private->caches; victim && !header; victim = victim->next)
+   {
+      unsigned int i;
+
+      if (victim == cache || !victim->num)
+         continue;
+
+      mmal_pool_cache_lock(victim);
+      if (victim->num)
+      {
+         header = victim->header[--victim->num];
+         for (i = 0; i < victim->num; i++)
+            mmal_queue_put(pool->queue, victim->header[i]);
+         cache->stats.steals += victim->num + 1;
+         victim->num = 0;
+      }
+      vcos_mutex_unlock(&victim->lock);
+   }
+   vcos_mutex_unlock(&private->cache_lock);
+
+   return header;
+}
+
+static MMAL_BUFFER_HEADER_T *mmal_pool_cache_take(MMAL_POOL_T *pool)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_POOL_CACHE_T *cache = mmal_pool_cache_get(pool);
+   MMAL_BUFFER_HEADER_T *header;
+   unsigned int batch = (private->cache_size + 1) / 2;
+
+   if (!cache)
+      return mmal_queue_get(pool->queue);
+
+   mmal_pool_cache_lock(cache);
+   if (cache->num)
+   {
+      cache->stats.hits++;
+      header = cache->header[--cache->num];
+      vcos_mutex_unlock(&cache->lock);
+      return header;
+   }
+
+   /* Refill a batch from the pool's queue */
+   cache->stats.misses++;
+   header = mmal_queue_get(pool->queue);
+   if (header)
+   {
+      MMAL_BUFFER_HEADER_T *extra;
+      cache->stats.refills++;
+      while (cache->num < batch - 1 && (extra = mmal_queue_get(pool->queue)) != NULL)
+         cache->header[cache->num++] = extra;
+   }
+   vcos_mutex_unlock(&cache->lock);
+
+   /* The remaining headers might be sitting in the caches of other threads */
+   if (!header)
+      header = mmal_pool_cache_steal(pool, cache);
+
+   return header;
+}
+
+/* Return all cached headers to the pool's queue */
+static void mmal_pool_cache_flush(MMAL_POOL_T *pool)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_POOL_CACHE_T *cache;
+
+   if (!private->cache_size)
+      return;
+
+   vcos_mutex_lock(&private->cache_lock);
+   for (cache = private->caches; cache; cache = cache->next)
+   {
+      unsigned int i;
+      mmal_pool_cache_lock(cache);
+      for (i = 0; i < cache->num; i++)
+         mmal_queue_put(pool->queue, cache->header[i]);
+      if (cache->num)
+         cache->stats.flushes++;
+      cache->num = 0;
+      vcos_mutex_unlock(&cache->lock);
+   }
+   vcos_mutex_unlock(&private->cache_lock);
+}
+
+static void mmal_pool_cache_destroy(MMAL_POOL_T *pool)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+
+   if (!private->cache_size)
+      return;
+
+   mmal_pool_cache_flush(pool);
+   while (private->caches)
+   {
+      MMAL_POOL_CACHE_T *cache = private->caches;
+      private->caches = cache->next;
+      vcos_mutex_delete(&cache->lock);
+      vcos_free(cache);
+   }
+   vcos_tls_delete(private->cache_key);
+   vcos_mutex_delete(&private->cache_lock);
+   private->cache_size = 0;
+}
+
+/** Enable per-thread caching of buffer headers */
+MMAL_STATUS_T mmal_pool_thread_cache_enable(MMAL_POOL_T *pool, unsigned int size)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+
+   if (!pool || size < 2)
+      return MMAL_EINVAL;
+   if (private->cache_size)
+      return MMAL_EINVAL;
+
+   if (vcos_mutex_create(&private->cache_lock, "MMAL pool cache list") != VCOS_SUCCESS)
+      return MMAL_ENOSPC;
+   if (vcos_tls_create(&private->cache_key) != VCOS_SUCCESS)
+   {
+      vcos_mutex_delete(&private->cache_lock);
+      return MMAL_ENOSPC;
+   }
+   private->caches = NULL;
+   private->cache_size = size;
+   return MMAL_SUCCESS;
+}
+
+/** Return all the buffer headers held in per-thread caches to the pool's queue */
+void mmal_pool_thread_cache_flush(MMAL_POOL_T *pool)
+{
+   if (pool)
+      mmal_pool_cache_flush(pool);
+}
+
+/** Get the statistics of the per-thread caches of a pool */
+MMAL_STATUS_T mmal_pool_thread_cache_stats_get(MMAL_POOL_T *pool, MMAL_POOL_CACHE_STATS_T *stats)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+   MMAL_POOL_CACHE_T *cache;
+
+   if (!pool || !stats)
+      return MMAL_EINVAL;
+
+   memset(stats, 0, sizeof(*stats));
+   if (!private->cache_size)
+      return MMAL_SUCCESS;
+
+   vcos_mutex_lock(&private->cache_lock);
+   for (cache = private->caches; cache; cache = cache->next)
+   {
+      stats->hits += cache->stats.hits;
+      stats->misses += cache->stats.misses;
+      stats->refills += cache->stats.refills;
+      stats->flushes += cache->stats.flushes;
+      stats->steals += cache->stats.steals;
+      stats->contended += cache->stats.contended;
+      stats->cached += cache->num;
+   }
+   vcos_mutex_unlock(&private->cache_lock);
+
+   return MMAL_SUCCESS;
+}
+
+/** Get a buffer header from a pool */
+MMAL_BUFFER_HEADER_T *mmal_pool_get(MMAL_POOL_T *pool)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+
+   if (!pool)
+      return NULL;
+   if (private->cache_size)
+      return mmal_pool_cache_take(pool);
+   return mmal_queue_get(pool->queue);
+}
+
+/** Give back a buffer header which could not be used */
+void mmal_pool_put_back(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *header)
+{
+   MMAL_POOL_PRIVATE_T *private = (MMAL_POOL_PRIVATE_T *)pool;
+
+   if (!pool || !header)
+      return;
+   if (private->cache_size)
+      mmal_pool_cache_put(pool, header); /* Taken first by the next get */
+   else
+      mmal_queue_put_back(pool->queue, header);
+}
+
+/** Switch the queue of a pool to the single consumer implementation */
+MMAL_STATUS_T mmal_pool_single_consumer_enable(MMAL_POOL_T *pool)
+{
+   MMAL_BUFFER_HEADER_T *header;
+   MMAL_QUEUE_T *queue;
+
+   if (!pool)
+      return MMAL_EINVAL;
+
+   queue = mmal_queue_create_with_flags(MMAL_QUEUE_FLAG_SINGLE_CONSUMER);
+   if (!queue)
+      return MMAL_ENOMEM;
+
+   /* Move the headers across in order */
+   while ((header = mmal_queue_get(pool->queue)) != NULL)
+      mmal_queue_put(queue, header);
+   mmal_queue_destroy(pool->queue);
+   pool->queue = queue;
+   return MMAL_SUCCESS;
+}
+
 /** Buffer header release callback.
  * Call out to a further client callback and put the buffer back in the queue
  * so it can be reused, unless the client callback prevents it. */
@@ -275,7 +582,12 @@ static void mmal_pool_buffer_header_release(MMAL_BUFFER_HEADER_T *header)
    header->priv->refcount = 1;
    if(private->cb)
       queue_buffer = private->cb(pool, header, private->userdata);
-   if (queue_buffer)
+   if (!queue_buffer)
+      return;
+
+   if (private->cache_size)
+      mmal_pool_cache_put(pool, header);
+   else
       mmal_queue_put(pool->queue, header);
 }
 
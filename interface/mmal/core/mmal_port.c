@@ -29,6 +29,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "util/mmal_util.h"
 #include "core/mmal_component_private.h"
 #include "core/mmal_port_private.h"
+#include "core/mmal_buffer_private.h"
 #include "interface/vcos/vcos.h"
 #include "mmal_logging.h"
 #include "interface/mmal/util/mmal_util.h"
@@ -48,6 +49,23 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 # define MMAL_COLLECT_PORT_STATS_ENABLED 0
 #endif
 
+/** Port stats are updated without locking, using atomic operations where available.
+ * Other platforms get best-effort statistics. */
+#if defined(__GNUC__)
+# define STATS_ADD(a,v) __sync_fetch_and_add(&(a), (v))
+# define STATS_SWAP(a,v) __sync_lock_test_and_set(&(a), (v))
+# define STATS_CAS(a,o,v) __sync_bool_compare_and_swap(&(a), (o), (v))
+#else
+# define STATS_ADD(a,v) ((a) += (v))
+static uint32_t stats_swap(uint32_t *a, uint32_t v) { uint32_t o = *a; *a = v; return o; }
+# define STATS_SWAP(a,v) stats_swap(&(a), (v))
+# define STATS_CAS(a,o,v) ((a) == (o) ? ((a) = (v)), 1 : 0)
+#endif
+
+/** Parameters only known to the core on the host, which are handled without
+ * asking the component */
+#define mmal_port_parameter_is_core_only(id) ((id) == MMAL_PARAMETER_CORE_STATISTICS_EXT)
+
 static MMAL_STATUS_T mmal_port_private_parameter_get(MMAL_PORT_T *port,
                                                      MMAL_PARAMETER_HEADER_T *param);
 
@@ -62,7 +80,6 @@ typedef struct MMAL_PORT_PRIVATE_CORE_T
 {
    VCOS_MUTEX_T lock; /**< Used to lock access to the port */
    VCOS_MUTEX_T send_lock; /**< Used to lock access while sending buffer to the port */
-   VCOS_MUTEX_T stats_lock; /**< Used to lock access to the stats */
    VCOS_MUTEX_T connection_lock; /**< Used to lock access to a connection */
 
    /** Callback set by client to call when buffer headers need to be returned */
@@ -94,6 +111,11 @@ typedef struct MMAL_PORT_PRIVATE_CORE_T
 
    /** Per-port statistics collected directly by the MMAL core */
    MMAL_CORE_PORT_STATISTICS_T stats;
+   /** Histograms of the delay between consecutive buffers (rx and tx) */
+   uint32_t inter_buffer_hist[2][MMAL_CORE_HISTOGRAM_BUCKETS];
+   /** Histogram of the time buffers spend in the port */
+   uint32_t latency_hist[MMAL_CORE_HISTOGRAM_BUCKETS];
+   uint32_t latency_max;
 
    char *name; /**< Port name */
    unsigned int name_size; /** Size of the memory area reserved for the name string */
@@ -116,7 +138,8 @@ static void mmal_port_connected_output_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
 static MMAL_BOOL_T mmal_port_connected_pool_cb(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *buffer, void *userdata);
 
 static void mmal_port_name_update(MMAL_PORT_T *port);
-static void mmal_port_update_port_stats(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR direction);
+static void mmal_port_update_port_stats(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
+static void mmal_port_count_buffer(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR direction, uint32_t stc);
 
 /*****************************************************************************/
 
@@ -144,6 +167,18 @@ static void mmal_port_update_port_stats(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR d
    if (!--(a)->priv->core->transit_buffer_headers) \
       vcos_semaphore_post(&(a)->priv->core->transit_sema); \
    vcos_mutex_unlock(&(a)->priv->core->transit_lock)
+#define IN_TRANSIT_ADD(a,n) \
+   vcos_mutex_lock(&(a)->priv->core->transit_lock); \
+   if (!(a)->priv->core->transit_buffer_headers) \
+      vcos_semaphore_wait(&(a)->priv->core->transit_sema); \
+   (a)->priv->core->transit_buffer_headers += (n); \
+   vcos_mutex_unlock(&(a)->priv->core->transit_lock)
+#define IN_TRANSIT_SUB(a,n) \
+   vcos_mutex_lock(&(a)->priv->core->transit_lock); \
+   (a)->priv->core->transit_buffer_headers -= (n); \
+   if (!(a)->priv->core->transit_buffer_headers) \
+      vcos_semaphore_post(&(a)->priv->core->transit_sema); \
+   vcos_mutex_unlock(&(a)->priv->core->transit_lock)
 #define IN_TRANSIT_WAIT(a) \
    vcos_semaphore_wait(&(a)->priv->core->transit_sema); \
    vcos_semaphore_post(&(a)->priv->core->transit_sema)
@@ -163,7 +198,7 @@ MMAL_PORT_T *mmal_port_alloc(MMAL_COMPONENT_T *component, MMAL_PORT_TYPE_T type,
    unsigned int size = sizeof(*port) + sizeof(MMAL_PORT_PRIVATE_T) +
       sizeof(MMAL_PORT_PRIVATE_CORE_T) + name_size + extra_size;
    MMAL_BOOL_T lock = 0, lock_send = 0, lock_transit = 0, sema_transit = 0;
-   MMAL_BOOL_T lock_stats = 0, lock_connection = 0;
+   MMAL_BOOL_T lock_connection = 0;
 
    LOG_TRACE("component:%s type:%u extra:%u", component->name, type, extra_size);
 
@@ -191,13 +226,12 @@ MMAL_PORT_T *mmal_port_alloc(MMAL_COMPONENT_T *component, MMAL_PORT_TYPE_T type,
    lock_send = vcos_mutex_create(&port->priv->core->send_lock, "mmal port send lock") == VCOS_SUCCESS;
    lock_transit = vcos_mutex_create(&port->priv->core->transit_lock, "mmal port transit lock") == VCOS_SUCCESS;
    sema_transit = vcos_semaphore_create(&port->priv->core->transit_sema, "mmal port transit sema", 1) == VCOS_SUCCESS;
-   lock_stats = vcos_mutex_create(&port->priv->core->stats_lock, "mmal stats lock") == VCOS_SUCCESS;
    lock_connection = vcos_mutex_create(&port->priv->core->connection_lock, "mmal connection lock") == VCOS_SUCCESS;
 
-   if (!lock || !lock_send || !lock_transit || !sema_transit || !lock_stats || !lock_connection)
+   if (!lock || !lock_send || !lock_transit || !sema_transit || !lock_connection)
    {
-      LOG_ERROR("%s: failed to create sync objects (%u,%u,%u,%u,%u,%u)",
-            port->name, lock, lock_send, lock_transit, sema_transit, lock_stats, lock_connection);
+      LOG_ERROR("%s: failed to create sync objects (%u,%u,%u,%u,%u)",
+            port->name, lock, lock_send, lock_transit, sema_transit, lock_connection);
       goto error;
    }
 
@@ -217,7 +251,6 @@ MMAL_PORT_T *mmal_port_alloc(MMAL_COMPONENT_T *component, MMAL_PORT_TYPE_T type,
    if (lock_send) vcos_mutex_delete(&port->priv->core->send_lock);
    if (lock_transit) vcos_mutex_delete(&port->priv->core->transit_lock);
    if (sema_transit) vcos_semaphore_delete(&port->priv->core->transit_sema);
-   if (lock_stats) vcos_mutex_delete(&port->priv->core->stats_lock);
    if (lock_connection) vcos_mutex_delete(&port->priv->core->connection_lock);
    if (port->format) mmal_format_free(port->format);
    vcos_free(port);
@@ -235,7 +268,6 @@ void mmal_port_free(MMAL_PORT_T *port)
    vcos_assert(port->format == port->priv->core->format_ptr_copy);
    mmal_format_free(port->priv->core->format_ptr_copy);
    vcos_mutex_delete(&port->priv->core->connection_lock);
-   vcos_mutex_delete(&port->priv->core->stats_lock);
    vcos_semaphore_delete(&port->priv->core->transit_sema);
    vcos_mutex_delete(&port->priv->core->transit_lock);
    vcos_mutex_delete(&port->priv->core->send_lock);
@@ -710,6 +742,7 @@ MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
    MMAL_BUFFER_HEADER_T *buffer)
 {
    MMAL_STATUS_T status = MMAL_SUCCESS;
+   uint32_t stc;
 
    if (!port || !port->priv)
    {
@@ -747,6 +780,11 @@ MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
       buffer->length = 0;
    }
 
+   /* The buffer is timestamped before the component can see it, as it may be
+    * sent back, and even recycled, before pf_send returns */
+   stc = vcos_getmicrosecs();
+   buffer->priv->send_time = stc;
+
    /* coverity[lock] transit_sema is used for signalling, and is not a lock */
    /* coverity[lock_order] since transit_sema is not a lock, there is no ordering conflict */
    IN_TRANSIT_INCREMENT(port);
@@ -766,12 +804,112 @@ MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
 
    if (status != MMAL_SUCCESS)
    {
+      buffer->priv->send_time = 0;
       IN_TRANSIT_DECREMENT(port);
       LOG_ERROR("%s: send failed: %s", port->name, mmal_status_to_string(status));
    }
    else
    {
-      mmal_port_update_port_stats(port, MMAL_CORE_STATS_RX);
+      /* Only the port is touched here, the buffer may already be gone */
+      mmal_port_count_buffer(port, MMAL_CORE_STATS_RX, stc);
+   }
+
+   UNLOCK_SENDING(port);
+   return status;
+}
+
+/** Send a batch of buffer headers to a port */
+MMAL_STATUS_T mmal_port_send_buffers(MMAL_PORT_T *port,
+   MMAL_BUFFER_HEADER_T **buffers, unsigned int num)
+{
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   unsigned int i, sent = 0;
+   uint32_t stc;
+
+   if (!port || !port->priv)
+   {
+      LOG_ERROR("invalid port");
+      return MMAL_EINVAL;
+   }
+
+   if (!num)
+      return MMAL_SUCCESS;
+   if (!buffers)
+      return MMAL_EINVAL;
+
+   for (i = 0; i < num; i++)
+   {
+      if (!buffers[i] ||
+          (!buffers[i]->data && !(port->capabilities & MMAL_PORT_CAPABILITY_PASSTHROUGH)))
+      {
+         LOG_ERROR("%s(%p) received invalid buffer header", port->name, port);
+         return MMAL_EINVAL;
+      }
+   }
+
+   if (!port->priv->pf_send)
+      return MMAL_ENOSYS;
+
+   LOCK_SENDING(port);
+
+   if (!port->is_enabled)
+   {
+      UNLOCK_SENDING(port);
+      return MMAL_EINVAL;
+   }
+
+   /* As in mmal_port_send_buffer, the buffers are timestamped before the
+    * component can see them but only counted once they have been sent */
+   stc = vcos_getmicrosecs();
+   for (i = 0; i < num; i++)
+   {
+      if (port->type == MMAL_PORT_TYPE_OUTPUT && buffers[i]->length)
+      {
+         LOG_DEBUG("given an output buffer with length != 0");
+         buffers[i]->length = 0;
+      }
+      buffers[i]->priv->send_time = stc;
+   }
+
+   /* coverity[lock] transit_sema is used for signalling, and is not a lock */
+   IN_TRANSIT_ADD(port, num);
+
+   if (port->priv->core->is_paused)
+   {
+      /* Add buffers to our internal queue */
+      for (i = 0; i < num; i++)
+      {
+         buffers[i]->next = NULL;
+         *port->priv->core->queue_last = buffers[i];
+         port->priv->core->queue_last = &buffers[i]->next;
+      }
+      sent = num;
+   }
+   else
+   {
+      for (sent = 0; sent < num; sent++)
+      {
+         status = port->priv->pf_send(port, buffers[sent]);
+         if (status != MMAL_SUCCESS)
+            break;
+      }
+   }
+
+   for (i = 0; i < sent; i++)
+      mmal_port_count_buffer(port, MMAL_CORE_STATS_RX, stc);
+
+   if (status != MMAL_SUCCESS)
+   {
+      if (sent < num)
+      {
+         IN_TRANSIT_SUB(port, num - sent);
+      }
+      LOG_ERROR("%s: send failed after %u/%u buffers: %s", port->name, sent, num,
+                mmal_status_to_string(status));
+      for (i = 0; i < sent; i++)
+         buffers[i] = NULL;
+      for (; i < num; i++)
+         buffers[i]->priv->send_time = 0;
    }
 
    UNLOCK_SENDING(port);
@@ -852,7 +990,8 @@ MMAL_STATUS_T mmal_port_parameter_set(MMAL_PORT_T *port,
              param, param ? param->id : 0, param ? (int)param->size : 0);
 
    LOCK_PORT(port);
-   if (port->priv->pf_parameter_set)
+   /* Host-only core parameters are never passed to the component */
+   if (!mmal_port_parameter_is_core_only(param->id) && port->priv->pf_parameter_set)
       status = port->priv->pf_parameter_set(port, param);
    if (status == MMAL_ENOSYS)
    {
@@ -880,7 +1019,9 @@ MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port,
       return MMAL_EINVAL;
 
    LOCK_PORT(port);
-   if (port->priv->pf_parameter_get)
+   /* Host-only core parameters are never passed to the component, which
+    * would cost a round trip to VideoCore for nothing */
+   if (!mmal_port_parameter_is_core_only(param->id) && port->priv->pf_parameter_get)
       status = port->priv->pf_parameter_get(port, param);
    if (status == MMAL_ENOSYS)
    {
@@ -907,7 +1048,7 @@ void mmal_port_buffer_header_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *b
 
    if (MMAL_COLLECT_PORT_STATS_ENABLED)
    {
-      mmal_port_update_port_stats(port, MMAL_CORE_STATS_TX);
+      mmal_port_update_port_stats(port, buffer);
    }
 
    port->priv->core->buffer_header_callback(port, buffer);
@@ -1155,7 +1296,7 @@ MMAL_STATUS_T mmal_port_event_get(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T **buff
              (int)port->type, (int)port->index, port, (char *)&event);
 
    /* Get an event buffer from our event pool */
-   *buffer = mmal_queue_get(port->component->priv->event_pool->queue);
+   *buffer = mmal_pool_get(port->component->priv->event_pool);
    if (!*buffer)
    {
       LOG_ERROR("%s(%i:%i) port %p, no event buffer left for %4.4s", port->component->name,
@@ -1205,7 +1346,7 @@ static MMAL_STATUS_T mmal_port_populate_clock_ports(MMAL_PORT_T* output, MMAL_PO
 
    LOG_TRACE("output %s %p, input %s %p, pool: %p", output->name, output, input->name, input, pool);
 
-   buffer = mmal_queue_get(pool->queue);
+   buffer = mmal_pool_get(pool);
    while (buffer)
    {
       status = mmal_port_send_buffer(output, buffer);
@@ -1216,7 +1357,7 @@ static MMAL_STATUS_T mmal_port_populate_clock_ports(MMAL_PORT_T* output, MMAL_PO
          break;
       }
 
-      buffer = mmal_queue_get(pool->queue);
+      buffer = mmal_pool_get(pool);
       if (buffer)
       {
          status = mmal_port_send_buffer(input, buffer);
@@ -1226,7 +1367,7 @@ static MMAL_STATUS_T mmal_port_populate_clock_ports(MMAL_PORT_T* output, MMAL_PO
             mmal_buffer_header_release(buffer);
             break;
          }
-         buffer = mmal_queue_get(pool->queue);
+         buffer = mmal_pool_get(pool);
       }
    }
 
@@ -1236,32 +1377,41 @@ static MMAL_STATUS_T mmal_port_populate_clock_ports(MMAL_PORT_T* output, MMAL_PO
 /** Populate an output port with a pool of buffers */
 static MMAL_STATUS_T mmal_port_populate_from_pool(MMAL_PORT_T* port, MMAL_POOL_T* pool)
 {
-   MMAL_STATUS_T status = MMAL_SUCCESS;
-   uint32_t buffer_idx;
-   MMAL_BUFFER_HEADER_T *buffer;
+   MMAL_STATUS_T status = MMAL_SUCCESS, send_status;
+   uint32_t buffer_idx = 0;
+   MMAL_BUFFER_HEADER_T *buffers[16];
+   unsigned int i, num;
 
    if (!port->priv->pf_send)
       return MMAL_ENOSYS;
 
    LOG_TRACE("%s port %p, pool: %p", port->name, port, pool);
 
-   /* Populate port from pool */
-   for (buffer_idx = 0; buffer_idx < port->buffer_num; buffer_idx++)
+   /* Populate port from pool, sending the buffers in batches */
+   while (buffer_idx < port->buffer_num && status == MMAL_SUCCESS)
    {
-      buffer = mmal_queue_get(pool->queue);
-      if (!buffer)
+      for (num = 0; num < vcos_countof(buffers) && buffer_idx < port->buffer_num; num++, buffer_idx++)
       {
-         LOG_ERROR("too few buffers in the pool");
-         status = MMAL_ENOMEM;
-         break;
+         buffers[num] = mmal_pool_get(pool);
+         if (!buffers[num])
+         {
+            LOG_ERROR("too few buffers in the pool");
+            status = MMAL_ENOMEM;
+            break;
+         }
       }
 
-      status = mmal_port_send_buffer(port, buffer);
-      if (status != MMAL_SUCCESS)
+      if (!num)
+         break;
+
+      send_status = mmal_port_send_buffers(port, buffers, num);
+      if (send_status != MMAL_SUCCESS)
       {
          LOG_ERROR("failed to send buffer to port");
-         mmal_buffer_header_release(buffer);
-         break;
+         status = send_status;
+         for (i = 0; i < num; i++)
+            if (buffers[i])
+               mmal_buffer_header_release(buffers[i]);
       }
    }
 
@@ -1387,14 +1537,13 @@ static void mmal_port_name_update(MMAL_PORT_T *port)
             port->format && port->format->encoding ? (char *)&port->format->encoding : "");
 }
 
-static MMAL_STATUS_T mmal_port_get_core_stats(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param)
+/** Read (and optionally reset) the basic stats for one direction */
+static void mmal_port_read_core_stats(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR dir,
+                                      MMAL_BOOL_T reset, MMAL_CORE_STATISTICS_T *stats)
 {
-   MMAL_PARAMETER_CORE_STATISTICS_T *stats_param = (MMAL_PARAMETER_CORE_STATISTICS_T*)param;
-   MMAL_CORE_STATISTICS_T *stats = &stats_param->stats;
    MMAL_CORE_STATISTICS_T *src_stats;
-   MMAL_PORT_PRIVATE_CORE_T *core = port->priv->core;
-   vcos_mutex_lock(&core->stats_lock);
-   switch (stats_param->dir)
+
+   switch (dir)
    {
    case MMAL_CORE_STATS_RX:
       src_stats = &port->priv->core->stats.rx;
@@ -1403,38 +1552,151 @@ static MMAL_STATUS_T mmal_port_get_core_stats(MMAL_PORT_T *port, MMAL_PARAMETER_
       src_stats = &port->priv->core->stats.tx;
       break;
    }
-   *stats = *src_stats;
-   if (stats_param->reset)
-      memset(src_stats, 0, sizeof(*src_stats));
-   vcos_mutex_unlock(&core->stats_lock);
+
+   if (reset)
+   {
+      stats->buffer_count = STATS_SWAP(src_stats->buffer_count, 0);
+      stats->first_buffer_time = STATS_SWAP(src_stats->first_buffer_time, 0);
+      stats->last_buffer_time = STATS_SWAP(src_stats->last_buffer_time, 0);
+      stats->max_delay = STATS_SWAP(src_stats->max_delay, 0);
+   }
+   else
+   {
+      *stats = *src_stats;
+   }
+}
+
+static MMAL_STATUS_T mmal_port_get_core_stats(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param)
+{
+   MMAL_PARAMETER_CORE_STATISTICS_T *stats_param = (MMAL_PARAMETER_CORE_STATISTICS_T*)param;
+
+   if (param->size < sizeof(*stats_param))
+      return MMAL_EINVAL;
+
+   mmal_port_read_core_stats(port, stats_param->dir, stats_param->reset, &stats_param->stats);
    return MMAL_SUCCESS;
 }
 
-/** Update the port stats, called per buffer.
- *
+/** Fill in a histogram and its percentiles from an array of buckets */
+static void mmal_port_read_histogram(MMAL_CORE_HISTOGRAM_T *hist, uint32_t *bucket,
+                                     uint32_t max, MMAL_BOOL_T reset)
+{
+   static const uint32_t permille[] = {500, 990, 999};
+   uint32_t *percentile[] = {&hist->p50, &hist->p99, &hist->p999};
+   uint64_t sum = 0;
+   unsigned int i, j = 0;
+
+   memset(hist, 0, sizeof(*hist));
+   hist->max = max;
+   for (i = 0; i < MMAL_CORE_HISTOGRAM_BUCKETS; i++)
+   {
+      hist->bucket[i] = reset ? STATS_SWAP(bucket[i], 0) : bucket[i];
+      hist->count += hist->bucket[i];
+   }
+
+   for (i = 0; i < MMAL_CORE_HISTOGRAM_BUCKETS && j < vcos_countof(permille); i++)
+   {
+      sum += hist->bucket[i];
+      while (j < vcos_countof(permille) && hist->count &&
+             sum * 1000 >= (uint64_t)hist->count * permille[j])
+      {
+         /* Report the upper bound of the bucket, capped by the largest sample */
+         uint32_t bound = i ? (uint32_t)((1ULL << i) - 1) : 0;
+         if (i == MMAL_CORE_HISTOGRAM_BUCKETS - 1 || bound > max)
+            bound = max;
+         *percentile[j++] = bound;
+      }
+   }
+}
+
+static MMAL_STATUS_T mmal_port_get_core_stats_ext(MMAL_PORT_T *port, MMAL_PARAMETER_HEADER_T *param)
+{
+   MMAL_PARAMETER_CORE_STATISTICS_EXT_T *stats_param = (MMAL_PARAMETER_CORE_STATISTICS_EXT_T*)param;
+   MMAL_PORT_PRIVATE_CORE_T *core = port->priv->core;
+   unsigned int dir = stats_param->dir == MMAL_CORE_STATS_RX ? 0 : 1;
+   uint32_t max;
+
+   if (param->size < sizeof(*stats_param))
+      return MMAL_EINVAL;
+
+   mmal_port_read_core_stats(port, stats_param->dir, stats_param->reset, &stats_param->stats);
+   stats_param->in_transit = IN_TRANSIT_COUNT(port) > 0 ? IN_TRANSIT_COUNT(port) : 0;
+
+   mmal_port_read_histogram(&stats_param->inter_buffer, core->inter_buffer_hist[dir],
+                            stats_param->stats.max_delay, stats_param->reset);
+   max = stats_param->reset ? STATS_SWAP(core->latency_max, 0) : core->latency_max;
+   mmal_port_read_histogram(&stats_param->latency, core->latency_hist, max, stats_param->reset);
+
+   return MMAL_SUCCESS;
+}
+
+/* Index of the histogram bucket a duration falls in */
+static unsigned int mmal_port_stats_bucket(uint32_t us)
+{
+   unsigned int bucket;
+
+#if defined(__GNUC__)
+   bucket = us ? 32 - __builtin_clz(us) : 0;
+#else
+   for (bucket = 0; us; bucket++)
+      us >>= 1;
+#endif
+   return bucket < MMAL_CORE_HISTOGRAM_BUCKETS ? bucket : MMAL_CORE_HISTOGRAM_BUCKETS - 1;
+}
+
+static void mmal_port_stats_max(uint32_t *max, uint32_t value)
+{
+   uint32_t current = *max;
+   while (value > current && !STATS_CAS(*max, current, value))
+      current = *max;
+}
+
+/** Count a buffer passing through the port at time stc.
+ * This is lock-free so it can be called from any thread on every buffer.
  */
-static void mmal_port_update_port_stats(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR direction)
+static void mmal_port_count_buffer(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR direction, uint32_t stc)
 {
    MMAL_PORT_PRIVATE_CORE_T *core = port->priv->core;
    MMAL_CORE_STATISTICS_T *stats;
-   unsigned stc = vcos_getmicrosecs();
-
-   vcos_mutex_lock(&core->stats_lock);
+   unsigned int dir = direction == MMAL_CORE_STATS_RX ? 0 : 1;
+   uint32_t last;
 
    stats = direction == MMAL_CORE_STATS_RX ? &core->stats.rx : &core->stats.tx;
 
-   stats->buffer_count++;
+   STATS_ADD(stats->buffer_count, 1);
 
-   if (!stats->first_buffer_time)
+   last = STATS_SWAP(stats->last_buffer_time, stc);
+   if (!last)
    {
-      stats->last_buffer_time = stats->first_buffer_time = stc;
+      STATS_CAS(stats->first_buffer_time, 0, stc);
    }
    else
    {
-      stats->max_delay = vcos_max(stats->max_delay, stc-stats->last_buffer_time);
-      stats->last_buffer_time = stc;
+      mmal_port_stats_max(&stats->max_delay, stc - last);
+      STATS_ADD(core->inter_buffer_hist[dir][mmal_port_stats_bucket(stc - last)], 1);
+   }
+}
+
+/** Update the port stats for a buffer being returned by the port.
+ * Buffers sent to the port are counted and stamped before they are handed to
+ * the component. This is lock-free so it can be called from any thread on
+ * every buffer.
+ */
+static void mmal_port_update_port_stats(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_PORT_PRIVATE_CORE_T *core = port->priv->core;
+   uint32_t stc = vcos_getmicrosecs();
+
+   mmal_port_count_buffer(port, MMAL_CORE_STATS_TX, stc);
+
+   /* Time spent by the buffer in the port */
+   if (buffer->priv->send_time)
+   {
+      uint32_t latency = stc - buffer->priv->send_time;
+      buffer->priv->send_time = 0;
+      mmal_port_stats_max(&core->latency_max, latency);
+      STATS_ADD(core->latency_hist[mmal_port_stats_bucket(latency)], 1);
    }
-   vcos_mutex_unlock(&core->stats_lock);
 }
 
 static MMAL_STATUS_T mmal_port_private_parameter_get(MMAL_PORT_T *port,
@@ -1444,6 +1706,8 @@ static MMAL_STATUS_T mmal_port_private_parameter_get(MMAL_PORT_T *port,
    {
    case MMAL_PARAMETER_CORE_STATISTICS:
       return mmal_port_get_core_stats(port, param);
+   case MMAL_PARAMETER_CORE_STATISTICS_EXT:
+      return mmal_port_get_core_stats_ext(port, param);
    default:
       return MMAL_ENOSYS;
    }
@@ -28,6 +28,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "mmal.h"
 #include "mmal_queue.h"
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define MMAL_QUEUE_HAVE_LOCKLESS 1
+#endif
+
 /** Definition of the QUEUE */
 struct MMAL_QUEUE_T
 {
@@ -36,16 +43,39 @@ struct MMAL_QUEUE_T
    MMAL_BUFFER_HEADER_T *first;
    MMAL_BUFFER_HEADER_T **last;
    VCOS_SEMAPHORE_T semaphore;
+
+   uint32_t flags;
+
+   /* Lock-free multi-producer / single-consumer variant (see MMAL_QUEUE_FLAG_SINGLE_CONSUMER).
+    * Producers only ever touch head and count. Everything else belongs to the consumer. */
+   MMAL_BUFFER_HEADER_T * volatile head; /**< Most recently queued element */
+   MMAL_BUFFER_HEADER_T *tail;           /**< Oldest element still linked in the queue */
+   MMAL_BUFFER_HEADER_T *front;          /**< Elements put back by the consumer (LIFO) */
+   MMAL_BUFFER_HEADER_T stub;            /**< Dummy element keeping the list non-empty */
+   volatile int count;                   /**< Number of elements, also used as the futex word */
+   volatile int waiting;                 /**< Non-zero when the consumer sleeps on count */
 };
 
 /** Create a QUEUE of MMAL_BUFFER_HEADER_T */
 MMAL_QUEUE_T *mmal_queue_create(void)
+{
+   return mmal_queue_create_with_flags(0);
+}
+
+/** Create a QUEUE of MMAL_BUFFER_HEADER_T with the given implementation flags */
+MMAL_QUEUE_T *mmal_queue_create_with_flags(uint32_t flags)
 {
    MMAL_QUEUE_T *queue;
 
-   queue = vcos_malloc(sizeof(*queue), "MMAL queue");
+   queue = vcos_calloc(1, sizeof(*queue), "MMAL queue");
    if(!queue) return 0;
 
+#ifndef MMAL_QUEUE_HAVE_LOCKLESS
+   /* No futex available, fall back to the locked implementation */
+   flags &= ~MMAL_QUEUE_FLAG_SINGLE_CONSUMER;
+#endif
+   queue->flags = flags;
+
    if(vcos_mutex_create(&queue->lock, "MMAL queue lock") != VCOS_SUCCESS )
    {
       vcos_free(queue);
@@ -65,14 +95,169 @@ MMAL_QUEUE_T *mmal_queue_create(void)
    queue->last = &queue->first;
    /* gratuitous unlock for coverity */ vcos_mutex_unlock(&queue->lock);
 
+   queue->stub.next = 0;
+   queue->head = &queue->stub;
+   queue->tail = &queue->stub;
+   queue->front = 0;
+   queue->count = 0;
+   queue->waiting = 0;
+
    return queue;
 }
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+/*****************************************************************************
+ * Lock-free implementation.
+ * This is an intrusive MPSC list (using the next field of the buffer headers)
+ * where producers only need a single atomic exchange. The consumer only ever
+ * sleeps in the kernel when the queue is actually empty.
+ *****************************************************************************/
+
+static void mmal_queue_futex_wake(volatile int *addr)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void mmal_queue_futex_wait(volatile int *addr, int value, const struct timespec *timeout)
+{
+   syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void mmal_queue_lockless_link(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_BUFFER_HEADER_T *prev;
+
+   buffer->next = 0;
+   prev = __sync_lock_test_and_set(&queue->head, buffer);
+   __sync_synchronize();
+   prev->next = buffer; /* Publishes the element to the consumer */
+}
+
+static void mmal_queue_lockless_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+   mmal_queue_lockless_link(queue, buffer);
+
+   /* The count is only incremented once the element is reachable so a non-zero
+    * count guarantees the consumer will find something. */
+   __sync_fetch_and_add(&queue->count, 1);
+   if (queue->waiting)
+      mmal_queue_futex_wake(&queue->count);
+}
+
+static void mmal_queue_lockless_put_back(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
+{
+   /* Only the consumer can put a buffer back so the front list needs no locking */
+   buffer->next = queue->front;
+   queue->front = buffer;
+   __sync_fetch_and_add(&queue->count, 1);
+}
+
+static MMAL_BUFFER_HEADER_T *mmal_queue_lockless_pop(MMAL_QUEUE_T *queue)
+{
+   MMAL_BUFFER_HEADER_T *tail = queue->tail, *next = tail->next;
+
+   if (tail == &queue->stub)
+   {
+      if (!next)
+         return 0;
+      queue->tail = next;
+      tail = next;
+      next = next->next;
+   }
+
+   if (next)
+   {
+      queue->tail = next;
+      return tail;
+   }
+
+   /* A producer is between swapping the head and linking its element */
+   if (tail != queue->head)
+      return 0;
+
+   /* Tail is the last element, push the stub behind it so it can be detached */
+   mmal_queue_lockless_link(queue, &queue->stub);
+   next = tail->next;
+   if (next)
+   {
+      queue->tail = next;
+      return tail;
+   }
+   return 0;
+}
+
+static MMAL_BUFFER_HEADER_T *mmal_queue_lockless_get(MMAL_QUEUE_T *queue)
+{
+   MMAL_BUFFER_HEADER_T *buffer;
+
+   if (!queue->count)
+      return 0;
+
+   buffer = queue->front;
+   if (buffer)
+   {
+      queue->front = buffer->next;
+   }
+   else
+   {
+      /* The count tells us an element is on its way, wait for the producer
+       * to finish linking it in if we caught it half-way through. */
+      while ((buffer = mmal_queue_lockless_pop(queue)) == NULL)
+         sched_yield();
+   }
+
+   __sync_fetch_and_sub(&queue->count, 1);
+   return buffer;
+}
+
+/* Returns 0 on timeout. A timeout of -1 means wait forever. */
+static MMAL_BUFFER_HEADER_T *mmal_queue_lockless_wait(MMAL_QUEUE_T *queue, int64_t timeout)
+{
+   MMAL_BUFFER_HEADER_T *buffer;
+   int64_t deadline = 0;
+
+   if (timeout >= 0)
+      deadline = vcos_getmicrosecs64() + timeout * 1000;
+
+   while ((buffer = mmal_queue_lockless_get(queue)) == NULL)
+   {
+      struct timespec ts, *pts = NULL;
+
+      if (timeout >= 0)
+      {
+         int64_t remaining = deadline - (int64_t)vcos_getmicrosecs64();
+         if (remaining <= 0)
+            return 0;
+         ts.tv_sec = remaining / 1000000;
+         ts.tv_nsec = (remaining % 1000000) * 1000;
+         pts = &ts;
+      }
+
+      /* Announce ourselves before re-checking the count so a producer
+       * incrementing it is guaranteed to see the flag and wake us up. */
+      __sync_lock_test_and_set(&queue->waiting, 1);
+      if (!queue->count)
+         mmal_queue_futex_wait(&queue->count, 0, pts);
+      __sync_lock_test_and_set(&queue->waiting, 0);
+   }
+
+   return buffer;
+}
+#endif /* MMAL_QUEUE_HAVE_LOCKLESS */
+
 /** Put a MMAL_BUFFER_HEADER_T into a QUEUE */
 void mmal_queue_put(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
 {
    if(!queue || !buffer) return;
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+   if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+   {
+      mmal_queue_lockless_put(queue, buffer);
+      return;
+   }
+#endif
+
 	vcos_mutex_lock(&queue->lock);
    queue->length++;
    *queue->last = buffer;
@@ -87,6 +272,14 @@ void mmal_queue_put_back(MMAL_QUEUE_T *queue, MMAL_BUFFER_HEADER_T *buffer)
 {
    if(!queue || !buffer) return;
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+   if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+   {
+      mmal_queue_lockless_put_back(queue, buffer);
+      return;
+   }
+#endif
+
 	vcos_mutex_lock(&queue->lock);
    queue->length++;
    buffer->next = queue->first;
@@ -103,6 +296,11 @@ MMAL_BUFFER_HEADER_T *mmal_queue_get(MMAL_QUEUE_T *queue)
 
 	if(!queue) return 0;
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+   if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+      return mmal_queue_lockless_get(queue);
+#endif
+
    vcos_mutex_lock(&queue->lock);
    buffer = queue->first;
    if(!buffer)
@@ -128,6 +326,11 @@ MMAL_BUFFER_HEADER_T *mmal_queue_wait(MMAL_QUEUE_T *queue)
 {
 	if(!queue) return 0;
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+   if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+      return mmal_queue_lockless_wait(queue, -1);
+#endif
+
 	vcos_semaphore_wait(&queue->semaphore);
    vcos_semaphore_post(&queue->semaphore);
    return mmal_queue_get(queue);
@@ -139,6 +342,11 @@ MMAL_BUFFER_HEADER_T *mmal_queue_timedwait(MMAL_QUEUE_T *queue, VCOS_UNSIGNED ti
     if (!queue)
         return NULL;
 
+#ifdef MMAL_QUEUE_HAVE_LOCKLESS
+    if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+        return mmal_queue_lockless_wait(queue, timeout);
+#endif
+
     ret = vcos_semaphore_wait_timeout(&queue->semaphore, timeout);
 
     if (ret != VCOS_SUCCESS)
@@ -153,6 +361,9 @@ unsigned int mmal_queue_length(MMAL_QUEUE_T *queue)
 {
 	if(!queue) return 0;
 
+   if (queue->flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER)
+      return (unsigned int)queue->count;
+
 	return queue->length;
 }
 
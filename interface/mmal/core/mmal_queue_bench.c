@@ -0,0 +1,211 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Producer / consumer benchmark for buffer header queues.
+ *
+ * One to four producer threads put buffer headers into a queue which the
+ * main thread waits on, as the callback queues of components are used. Each
+ * producer recycles a small set of headers once the consumer has seen them,
+ * so the queue never grows past a few headers per producer. The same runs are
+ * made with the locked queue and with the lock-free single consumer queue,
+ * reporting headers per second and context switches per thousand headers. It
+ * also checks that the headers from each producer come out in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mmal.h"
+
+#define BENCH_MAX_PRODUCERS 4
+#define BENCH_MAX_IN_FLIGHT 256
+
+typedef struct BENCH_PRODUCER_T
+{
+   VCOS_THREAD_T thread;
+   MMAL_QUEUE_T *queue;
+   MMAL_BUFFER_HEADER_T header[BENCH_MAX_IN_FLIGHT];
+   volatile unsigned int consumed;   /**< Written by the consumer only */
+   unsigned int waits;               /**< Times the producer had to wait for a header */
+} BENCH_PRODUCER_T;
+
+static BENCH_PRODUCER_T producers[BENCH_MAX_PRODUCERS];
+static unsigned int iterations = 200000;
+static unsigned int in_flight = 16;
+
+static void *bench_producer(void *arg)
+{
+   BENCH_PRODUCER_T *producer = (BENCH_PRODUCER_T *)arg;
+   unsigned int i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      MMAL_BUFFER_HEADER_T *header = &producer->header[i % in_flight];
+
+      /* Headers come back in order, so this one is free once the consumer
+       * has seen all but in_flight - 1 of the ones already put */
+      if (i - producer->consumed >= in_flight)
+      {
+         producer->waits++;
+         while (i - producer->consumed >= in_flight)
+            sched_yield();
+      }
+      __sync_synchronize();
+
+      header->pts = i;
+      mmal_queue_put(producer->queue, header);
+   }
+
+   return NULL;
+}
+
+static unsigned long context_switches(void)
+{
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+static int bench_run(uint32_t flags, unsigned int num_producers)
+{
+   MMAL_QUEUE_T *queue;
+   VCOS_THREAD_ATTR_T attrs;
+   unsigned int i, total = num_producers * iterations, received, errors = 0, waits = 0;
+   unsigned long switches;
+   uint32_t start, elapsed;
+
+   queue = mmal_queue_create_with_flags(flags);
+   if (!queue)
+      return -1;
+
+   memset(producers, 0, sizeof(producers));
+   vcos_thread_attr_init(&attrs);
+   switches = context_switches();
+   start = vcos_getmicrosecs();
+
+   for (i = 0; i < num_producers; i++)
+   {
+      unsigned int j;
+
+      producers[i].queue = queue;
+      for (j = 0; j < in_flight; j++)
+         producers[i].header[j].user_data = &producers[i];
+      if (vcos_thread_create(&producers[i].thread, "bench", &attrs, bench_producer,
+                             &producers[i]) != VCOS_SUCCESS)
+         return -1;
+   }
+
+   for (received = 0; received < total; received++)
+   {
+      MMAL_BUFFER_HEADER_T *header = mmal_queue_wait(queue);
+      BENCH_PRODUCER_T *producer;
+
+      if (!header)
+      {
+         errors++;
+         break;
+      }
+      producer = (BENCH_PRODUCER_T *)header->user_data;
+      if (header->pts != producer->consumed)
+         errors++;
+      __sync_synchronize();
+      producer->consumed++;
+   }
+
+   for (i = 0; i < num_producers; i++)
+   {
+      vcos_thread_join(&producers[i].thread, NULL);
+      waits += producers[i].waits;
+   }
+
+   elapsed = vcos_getmicrosecs() - start;
+   switches = context_switches() - switches;
+
+   if (mmal_queue_length(queue) != 0)
+      errors++;
+   mmal_queue_destroy(queue);
+
+   printf("%s, %u producer%s: %9.0f headers/s, %7.1f context switches per 1000 headers, "
+          "%u producer waits, %u errors\n",
+          flags & MMAL_QUEUE_FLAG_SINGLE_CONSUMER ? "lock-free" : "locked   ",
+          num_producers, num_producers > 1 ? "s" : " ",
+          received * 1000000.0 / (elapsed ? elapsed : 1),
+          switches * 1000.0 / (received ? received : 1), waits, errors);
+
+   return errors ? -1 : 0;
+}
+
+static void usage(void)
+{
+   printf("Usage: mmal_queue_bench [-p <producers>] [-i <iters>] [-b <headers>]\n");
+   printf("    -p <n>      run with 1 up to n producers (default 4, at most %u)\n", BENCH_MAX_PRODUCERS);
+   printf("    -i <n>      headers put by each producer (default 200000)\n");
+   printf("    -b <n>      headers each producer can have in the queue (default 16, at most %u)\n",
+          BENCH_MAX_IN_FLIGHT);
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int max_producers = BENCH_MAX_PRODUCERS, i;
+   int argn, result = 0;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-p") && argn + 1 < argc)
+         max_producers = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-i") && argn + 1 < argc)
+         iterations = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         in_flight = atoi(argv[++argn]);
+      else
+         usage();
+   }
+
+   if (!max_producers || max_producers > BENCH_MAX_PRODUCERS || !iterations ||
+       !in_flight || in_flight > BENCH_MAX_IN_FLIGHT)
+      usage();
+
+   vcos_init();
+   printf("%u headers per producer, %u in flight per producer\n", iterations, in_flight);
+
+   for (i = 1; i <= max_producers; i++)
+   {
+      if (bench_run(0, i) != 0)
+         result = 1;
+      if (bench_run(MMAL_QUEUE_FLAG_SINGLE_CONSUMER, i) != 0)
+         result = 1;
+   }
+
+   return result;
+}
@@ -69,6 +69,24 @@ typedef struct MMAL_CORE_STATISTICS_T
    uint32_t max_delay;           /**< Max delay (us) between buffers, ignoring first few frames */
 } MMAL_CORE_STATISTICS_T;
 
+/** Number of buckets in a \ref MMAL_CORE_HISTOGRAM_T */
+#define MMAL_CORE_HISTOGRAM_BUCKETS 24
+
+/** Histogram of durations in microseconds, using log2 sized buckets.
+ * Bucket 0 counts durations of 0us and bucket i counts durations in the range
+ * [2^(i-1), 2^i). The last bucket also counts all the longer durations.
+ * Percentiles are reported as the upper bound of the bucket they fall in.
+ */
+typedef struct MMAL_CORE_HISTOGRAM_T
+{
+   uint32_t count;   /**< Number of samples in the histogram */
+   uint32_t max;     /**< Largest sample (us) */
+   uint32_t p50;     /**< Median (us) */
+   uint32_t p99;     /**< 99th percentile (us) */
+   uint32_t p999;    /**< 99.9th percentile (us) */
+   uint32_t bucket[MMAL_CORE_HISTOGRAM_BUCKETS]; /**< Number of samples in each bucket */
+} MMAL_CORE_HISTOGRAM_T;
+
 /** Statistics collected by the core on all ports, if enabled in the build.
  */
 typedef struct MMAL_CORE_PORT_STATISTICS_T
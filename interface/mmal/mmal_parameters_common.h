@@ -74,7 +74,9 @@ enum {
    MMAL_PARAMETER_LOGGING,                /**< Takes a MMAL_PARAMETER_LOGGING_T */
    MMAL_PARAMETER_SYSTEM_TIME,            /**< Takes a MMAL_PARAMETER_UINT64_T */
    MMAL_PARAMETER_NO_IMAGE_PADDING,       /**< Takes a MMAL_PARAMETER_BOOLEAN_T */
-   MMAL_PARAMETER_LOCKSTEP_ENABLE         /**< Takes a MMAL_PARAMETER_BOOLEAN_T */
+   MMAL_PARAMETER_LOCKSTEP_ENABLE,        /**< Takes a MMAL_PARAMETER_BOOLEAN_T */
+   MMAL_PARAMETER_CORE_STATISTICS_EXT     /**< Takes a MMAL_PARAMETER_CORE_STATISTICS_EXT_T. Handled
+                                               by the core on the host, never by components */
 };
 
 /**@}*/
@@ -167,6 +169,21 @@ typedef struct MMAL_PARAMETER_CORE_STATISTICS_T
    MMAL_CORE_STATISTICS_T stats;    /**< The statistics */
 } MMAL_PARAMETER_CORE_STATISTICS_T;
 
+/** Extended MMAL core statistics. These are collected by the core itself and
+ * add latency histograms to what \ref MMAL_PARAMETER_CORE_STATISTICS_T provides.
+ */
+typedef struct MMAL_PARAMETER_CORE_STATISTICS_EXT_T
+{
+   MMAL_PARAMETER_HEADER_T hdr;
+   MMAL_CORE_STATS_DIR dir;
+   MMAL_BOOL_T reset;                  /**< Reset to zero after reading */
+   MMAL_CORE_STATISTICS_T stats;       /**< The statistics */
+   uint32_t in_transit;                /**< Number of buffers currently in transit in the port */
+   MMAL_CORE_HISTOGRAM_T inter_buffer; /**< Delay between consecutive buffers in this direction */
+   MMAL_CORE_HISTOGRAM_T latency;      /**< Time between a buffer being sent to the port
+                                            and it being returned by the port (both directions) */
+} MMAL_PARAMETER_CORE_STATISTICS_EXT_T;
+
 /**
  * Component memory usage statistics.
  */
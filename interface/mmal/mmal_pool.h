@@ -148,6 +148,84 @@ typedef MMAL_BOOL_T (*MMAL_POOL_BH_CB_T)(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T
  */
 void mmal_pool_callback_set(MMAL_POOL_T *pool, MMAL_POOL_BH_CB_T cb, void *userdata);
 
+/** Get a buffer header from a pool.
+ * This is equivalent to calling mmal_queue_get() on the pool's queue, except that
+ * it will also look into the per-thread caches when those are enabled. Clients
+ * enabling per-thread caches must use this function instead of accessing the queue
+ * directly.
+ *
+ * @param pool     Pointer to a pool
+ * @return Pointer to a buffer header or NULL if none is available.
+ */
+MMAL_BUFFER_HEADER_T *mmal_pool_get(MMAL_POOL_T *pool);
+
+/** Give back a buffer header obtained with \ref mmal_pool_get which could not be used.
+ * This is equivalent to calling mmal_queue_put_back() on the pool's queue: the
+ * header is made available again, ahead of the others, without the release
+ * callback being called. With per-thread caches enabled, it goes back to the
+ * calling thread's cache.
+ *
+ * @param pool     Pointer to a pool
+ * @param header   Buffer header to give back
+ */
+void mmal_pool_put_back(MMAL_POOL_T *pool, MMAL_BUFFER_HEADER_T *header);
+
+/** Switch the queue of a pool to the single consumer implementation.
+ * This can be used when buffer headers are only ever taken from the pool by one
+ * thread at a time (see \ref MMAL_QUEUE_FLAG_SINGLE_CONSUMER), while they can be
+ * released from any thread. Releasing then never blocks on the queue lock.
+ * This replaces the pool's queue, so it must be called before the pool is used.
+ *
+ * @param pool     Pointer to a pool
+ * @return MMAL_SUCCESS or an error on failure.
+ */
+MMAL_STATUS_T mmal_pool_single_consumer_enable(MMAL_POOL_T *pool);
+
+/** Statistics of the per-thread caches of a pool */
+typedef struct MMAL_POOL_CACHE_STATS_T
+{
+   uint32_t hits;      /**< Gets served directly from the calling thread's cache */
+   uint32_t misses;    /**< Gets which had to go to the pool's queue */
+   uint32_t refills;   /**< Batches of headers moved from the queue into a cache */
+   uint32_t flushes;   /**< Batches of headers moved from a cache back to the queue */
+   uint32_t steals;    /**< Headers taken back from another thread's cache */
+   uint32_t contended; /**< Times a cache lock was found to be held by another thread */
+   uint32_t cached;    /**< Headers currently held in caches */
+} MMAL_POOL_CACHE_STATS_T;
+
+/** Enable per-thread caching of the buffer headers of a pool.
+ * Once enabled, buffer headers released to the pool are kept in a small cache local
+ * to the releasing thread and \ref mmal_pool_get serves headers from the calling
+ * thread's cache first. Caches exchange headers with the pool's queue in batches of
+ * half their size, which avoids contention on the queue when several threads
+ * release and get headers at high rate.
+ *
+ * The release callback set with \ref mmal_pool_callback_set is still called for every
+ * header released to the pool, before it gets cached.
+ * Cached headers are not in the pool's queue, so \ref mmal_pool_thread_cache_flush
+ * must be called before comparing the length of the queue with headers_num.
+ *
+ * @param pool     Pointer to a pool
+ * @param size     Maximum number of headers each thread can cache (at least 2)
+ * @return MMAL_SUCCESS or an error on failure.
+ */
+MMAL_STATUS_T mmal_pool_thread_cache_enable(MMAL_POOL_T *pool, unsigned int size);
+
+/** Return all the buffer headers held in per-thread caches to the pool's queue.
+ *
+ * @param pool     Pointer to a pool
+ */
+void mmal_pool_thread_cache_flush(MMAL_POOL_T *pool);
+
+/** Get the statistics of the per-thread caches of a pool.
+ * The statistics are accumulated over all the threads which used the pool.
+ *
+ * @param pool     Pointer to a pool
+ * @param stats    Statistics to fill in
+ * @return MMAL_SUCCESS or an error on failure.
+ */
+MMAL_STATUS_T mmal_pool_thread_cache_stats_get(MMAL_POOL_T *pool, MMAL_POOL_CACHE_STATS_T *stats);
+
 /** Set a pre-release callback for all buffer headers in the pool.
  * Each time a buffer header is about to be released to the pool, the callback
  * will be triggered.
@@ -216,6 +216,21 @@ MMAL_STATUS_T mmal_port_parameter_get(MMAL_PORT_T *port,
 MMAL_STATUS_T mmal_port_send_buffer(MMAL_PORT_T *port,
    MMAL_BUFFER_HEADER_T *buffer);
 
+/** Send several buffer headers to a port in one go.
+ * This is equivalent to calling \ref mmal_port_send_buffer for each buffer header
+ * in turn but is cheaper, as the port is only locked once for the whole batch.
+ *
+ * If an error is returned, the entries of the array corresponding to the buffer headers
+ * which have been sent are set to NULL. The caller still owns the other ones.
+ *
+ * @param port The port to which the buffer headers are to be sent.
+ * @param buffers Array of buffer headers to send.
+ * @param num Number of buffer headers in the array.
+ * @return MMAL_SUCCESS on success
+ */
+MMAL_STATUS_T mmal_port_send_buffers(MMAL_PORT_T *port,
+   MMAL_BUFFER_HEADER_T **buffers, unsigned int num);
+
 /** Connect an output port to an input port.
  *
  * When connected and enabled, buffers will automatically progress from the
@@ -48,6 +48,26 @@ typedef struct MMAL_QUEUE_T MMAL_QUEUE_T;
  */
 MMAL_QUEUE_T *mmal_queue_create(void);
 
+/** \name Queue creation flags
+ * \anchor queueflags
+ * The following flags can be passed to \ref mmal_queue_create_with_flags to select
+ * the queue implementation. */
+/* @{ */
+/** The queue will only ever be read (get, wait, timedwait and put_back) from one thread
+ * at a time, while any number of threads can put. This selects a lock-free implementation
+ * where putting never blocks and the consumer only sleeps when the queue is empty.
+ * Platforms without the required support silently fall back to the default implementation. */
+#define MMAL_QUEUE_FLAG_SINGLE_CONSUMER (1<<0)
+/* @} */
+
+/** Create a queue of MMAL_BUFFER_HEADER_T using a specific implementation.
+ *
+ * @param flags  Creation flags, see \ref queueflags "Queue creation flags"
+ *
+ * @return Pointer to the newly created queue or NULL on failure.
+ */
+MMAL_QUEUE_T *mmal_queue_create_with_flags(uint32_t flags);
+
 /** Put a MMAL_BUFFER_HEADER_T into a queue
  *
  * @param queue  Pointer to a queue
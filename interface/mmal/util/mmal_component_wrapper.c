@@ -305,6 +305,8 @@ MMAL_STATUS_T mmal_wrapper_port_disable(MMAL_PORT_T *port)
       while ((buffer = mmal_queue_get(queue)) != NULL)
          mmal_buffer_header_release(buffer);
 
+      /* Headers held in per-thread caches aren't in the queue */
+      mmal_pool_thread_cache_flush(pool);
       if ( !vcos_verify(mmal_queue_length(pool->queue) == pool->headers_num) )
       {
          LOG_ERROR("coul dnot release all buffers");
@@ -332,7 +334,7 @@ MMAL_STATUS_T mmal_wrapper_buffer_get_empty(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
       wrapper->input_pool[port->index] : wrapper->output_pool[port->index];
 
    while (wrapper->status == MMAL_SUCCESS &&
-          (*buffer = mmal_queue_get(pool->queue)) == NULL)
+          (*buffer = mmal_pool_get(pool)) == NULL)
    {
       if (!(flags & MMAL_WRAPPER_FLAG_WAIT))
          break;
@@ -344,15 +344,15 @@ MMAL_STATUS_T mmal_connection_enable(MMAL_CONNECTION_T *connection)
     * populate both connected clock ports */
    if ((out->type == MMAL_PORT_TYPE_CLOCK) && (in->type == MMAL_PORT_TYPE_CLOCK))
    {
-      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(connection->pool->queue);
+      MMAL_BUFFER_HEADER_T *buffer = mmal_pool_get(connection->pool);
       while (buffer)
       {
          mmal_port_send_buffer(out, buffer);
-         buffer = mmal_queue_get(connection->pool->queue);
+         buffer = mmal_pool_get(connection->pool);
          if (buffer)
          {
             mmal_port_send_buffer(in, buffer);
-            buffer = mmal_queue_get(connection->pool->queue);
+            buffer = mmal_pool_get(connection->pool);
          }
       }
    }
@@ -409,6 +409,8 @@ MMAL_STATUS_T mmal_connection_disable(MMAL_CONNECTION_T *connection)
       mmal_buffer_header_release(buffer);
       buffer = mmal_queue_get(connection->queue);
    }
+   /* Headers held in per-thread caches aren't in the queue */
+   mmal_pool_thread_cache_flush(connection->pool);
    vcos_assert(mmal_queue_length(connection->pool->queue) == connection->pool->headers_num);
 
  done:
@@ -33,10 +33,29 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "mmal_logging.h"
 
 #define GRAPH_CONNECTIONS_MAX 16
-#define PROCESSING_TIME_MAX 20000
+#define GRAPH_WORKERS_MAX 8
 
 /*****************************************************************************/
 
+/** Scheduling states of a connection */
+typedef enum
+{
+   GRAPH_CONNECTION_IDLE = 0,  /**< nothing to do */
+   GRAPH_CONNECTION_QUEUED,    /**< waiting in the ready queue */
+   GRAPH_CONNECTION_RUNNING,   /**< being processed by a worker */
+   GRAPH_CONNECTION_RERUN,     /**< being processed, and became ready again meanwhile */
+} GRAPH_CONNECTION_STATE_T;
+
+/** Scheduling state and statistics of a connection in the graph */
+typedef struct MMAL_GRAPH_CONNECTION_PRIVATE_T
+{
+   struct MMAL_COMPONENT_MODULE_T *graph;
+   MMAL_CONNECTION_T *connection;
+   GRAPH_CONNECTION_STATE_T state; /**< protected by the ready lock */
+   int64_t time_ready;             /**< time at which the connection was last queued */
+   MMAL_GRAPH_CONNECTION_STATS_T stats;
+} MMAL_GRAPH_CONNECTION_PRIVATE_T;
+
 /** Private context for our graph.
  * This also acts as a MMAL_COMPONENT_MODULE_T for when components are instantiated from graphs */
 typedef struct MMAL_COMPONENT_MODULE_T
@@ -49,7 +68,14 @@ typedef struct MMAL_COMPONENT_MODULE_T
 
    MMAL_CONNECTION_T *connection[GRAPH_CONNECTIONS_MAX];
    unsigned int connection_num;
-   unsigned int connection_current;
+   MMAL_GRAPH_CONNECTION_PRIVATE_T connection_private[GRAPH_CONNECTIONS_MAX];
+
+   /* Connections only get processed when their callback says they have something to do.
+    * Each one is in the ready queue at most once and is only processed by one worker at a time. */
+   VCOS_MUTEX_T ready_lock;      /**< protects the ready queue and the connection states */
+   unsigned int ready[GRAPH_CONNECTIONS_MAX]; /**< ring of indices of connections ready to be processed */
+   unsigned int ready_first;
+   unsigned int ready_num;
 
    MMAL_PORT_T *input[GRAPH_CONNECTIONS_MAX];
    unsigned int input_num;
@@ -58,9 +84,11 @@ typedef struct MMAL_COMPONENT_MODULE_T
 
    MMAL_COMPONENT_T *graph_component;
 
-   MMAL_BOOL_T stop_thread;      /**< informs the worker thread to exit */
-   VCOS_THREAD_T thread;         /**< worker thread which processes all internal connections */
-   VCOS_SEMAPHORE_T sema;        /**< informs the worker thread that buffers are available */
+   MMAL_BOOL_T stop_thread;      /**< informs the worker threads to exit */
+   VCOS_THREAD_T thread[GRAPH_WORKERS_MAX]; /**< worker threads which process the internal connections */
+   unsigned int thread_num;      /**< number of worker threads running */
+   unsigned int workers;         /**< number of worker threads to start */
+   VCOS_SEMAPHORE_T sema;        /**< informs the worker threads that connections are ready */
 
    MMAL_GRAPH_EVENT_CB event_cb; /**< callback for sending control port events to the client */
    void *event_cb_data;          /**< callback data supplied by the client */
@@ -71,7 +99,8 @@ typedef MMAL_GRAPH_PRIVATE_T MMAL_COMPONENT_MODULE_T;
 
 /*****************************************************************************/
 static MMAL_STATUS_T mmal_component_create_from_graph(const char *name, MMAL_COMPONENT_T *component);
-static MMAL_BOOL_T graph_do_processing(MMAL_GRAPH_PRIVATE_T *graph);
+static void graph_do_processing(MMAL_GRAPH_PRIVATE_T *graph);
+static void graph_connection_ready(MMAL_GRAPH_CONNECTION_PRIVATE_T *cx);
 static void graph_process_buffer(MMAL_GRAPH_PRIVATE_T *graph_private,
    MMAL_CONNECTION_T *connection, MMAL_BUFFER_HEADER_T *buffer);
 
@@ -98,17 +127,17 @@ static void graph_control_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 /*****************************************************************************/
 static void graph_connection_cb(MMAL_CONNECTION_T *connection)
 {
-   MMAL_GRAPH_PRIVATE_T *graph = (MMAL_GRAPH_PRIVATE_T *)connection->user_data;
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx = (MMAL_GRAPH_CONNECTION_PRIVATE_T *)connection->user_data;
    MMAL_BUFFER_HEADER_T *buffer;
 
    if (connection->flags == MMAL_CONNECTION_FLAG_DIRECT &&
        (buffer = mmal_queue_get(connection->queue)) != NULL)
    {
-      graph_process_buffer(graph, connection, buffer);
+      graph_process_buffer(cx->graph, connection, buffer);
       return;
    }
 
-   vcos_semaphore_post(&graph->sema);
+   graph_connection_ready(cx);
 }
 
 /*****************************************************************************/
@@ -121,7 +150,7 @@ static void* graph_worker_thread(void* ctx)
       vcos_semaphore_wait(&graph->sema);
       if (graph->stop_thread)
          break;
-      while(graph_do_processing(graph));
+      graph_do_processing(graph);
    }
 
    LOG_TRACE("worker thread exit %p", graph);
@@ -132,9 +161,14 @@ static void* graph_worker_thread(void* ctx)
 /*****************************************************************************/
 static void graph_stop_worker_thread(MMAL_GRAPH_PRIVATE_T *graph)
 {
+   unsigned int i;
+
    graph->stop_thread = MMAL_TRUE;
-   vcos_semaphore_post(&graph->sema);
-   vcos_thread_join(&graph->thread, NULL);
+   for (i = 0; i < graph->thread_num; i++)
+      vcos_semaphore_post(&graph->sema);
+   for (i = 0; i < graph->thread_num; i++)
+      vcos_thread_join(&graph->thread[i], NULL);
+   graph->thread_num = 0;
 }
 
 /*****************************************************************************/
@@ -161,6 +195,14 @@ MMAL_STATUS_T mmal_graph_create(MMAL_GRAPH_T **graph, unsigned int userdata_size
       vcos_free(private);
       return MMAL_ENOSPC;
    }
+   if (vcos_mutex_create(&private->ready_lock, "mmal graph ready") != VCOS_SUCCESS)
+   {
+      LOG_ERROR("failed to create mutex %p", graph);
+      vcos_semaphore_delete(&private->sema);
+      vcos_free(private);
+      return MMAL_ENOSPC;
+   }
+   private->workers = 1;
 
    return MMAL_SUCCESS;
 }
@@ -186,6 +228,7 @@ MMAL_STATUS_T mmal_graph_destroy(MMAL_GRAPH_T *graph)
    for (i = 0; i < private->component_num; i++)
       mmal_component_release(private->component[i]);
 
+   vcos_mutex_delete(&private->ready_lock);
    vcos_semaphore_delete(&private->sema);
 
    vcos_free(graph);
@@ -261,6 +304,8 @@ MMAL_STATUS_T mmal_graph_add_connection(MMAL_GRAPH_T *graph, MMAL_CONNECTION_T *
    }
 
    mmal_connection_acquire(cx);
+   private->connection_private[private->connection_num].graph = private;
+   private->connection_private[private->connection_num].connection = cx;
    private->connection[private->connection_num++] = cx;
    return MMAL_SUCCESS;
 }
@@ -351,6 +396,8 @@ MMAL_STATUS_T mmal_graph_new_connection(MMAL_GRAPH_T *graph, MMAL_PORT_T *out, M
    if (status != MMAL_SUCCESS)
       return status;
 
+   private->connection_private[private->connection_num].graph = private;
+   private->connection_private[private->connection_num].connection = cx;
    private->connection[private->connection_num++] = cx;
    if (connection)
    {
@@ -361,6 +408,22 @@ MMAL_STATUS_T mmal_graph_new_connection(MMAL_GRAPH_T *graph, MMAL_PORT_T *out, M
    return MMAL_SUCCESS;
 }
 
+/*****************************************************************************/
+MMAL_STATUS_T mmal_graph_set_workers(MMAL_GRAPH_T *graph, unsigned int workers)
+{
+   MMAL_GRAPH_PRIVATE_T *private = (MMAL_GRAPH_PRIVATE_T *)graph;
+
+   LOG_TRACE("graph: %p, workers: %u", graph, workers);
+
+   if (!workers || workers > GRAPH_WORKERS_MAX)
+      return MMAL_EINVAL;
+   if (private->thread_num)
+      return MMAL_EINVAL; /* Graph already enabled */
+
+   private->workers = workers;
+   return MMAL_SUCCESS;
+}
+
 /*****************************************************************************/
 MMAL_STATUS_T mmal_graph_enable(MMAL_GRAPH_T *graph, MMAL_GRAPH_EVENT_CB cb, void *cb_data)
 {
@@ -370,11 +433,17 @@ MMAL_STATUS_T mmal_graph_enable(MMAL_GRAPH_T *graph, MMAL_GRAPH_EVENT_CB cb, voi
 
    LOG_TRACE("graph: %p", graph);
 
-   if (vcos_thread_create(&private->thread, "mmal graph thread", NULL,
-                          graph_worker_thread, private) != VCOS_SUCCESS)
+   private->stop_thread = MMAL_FALSE;
+   for (i = 0; i < private->workers; i++)
    {
-      LOG_ERROR("failed to create worker thread %p", graph);
-      return MMAL_ENOSPC;
+      if (vcos_thread_create(&private->thread[i], "mmal graph thread", NULL,
+                             graph_worker_thread, private) != VCOS_SUCCESS)
+      {
+         LOG_ERROR("failed to create worker thread %p", graph);
+         graph_stop_worker_thread(private);
+         return MMAL_ENOSPC;
+      }
+      private->thread_num++;
    }
 
    private->event_cb = cb;
@@ -395,15 +464,16 @@ MMAL_STATUS_T mmal_graph_enable(MMAL_GRAPH_T *graph, MMAL_GRAPH_EVENT_CB cb, voi
       MMAL_CONNECTION_T *cx = private->connection[i];
 
       cx->callback = graph_connection_cb;
-      cx->user_data = private;
+      cx->user_data = &private->connection_private[i];
 
       status = mmal_connection_enable(cx);
       if (status != MMAL_SUCCESS)
          goto error;
    }
 
-   /* Trigger the worker thread to populate the output ports with empty buffers */
-   vcos_semaphore_post(&private->sema);
+   /* Trigger the worker threads to populate the output ports with empty buffers */
+   for (i = 0; i < private->connection_num; i++)
+      graph_connection_ready(&private->connection_private[i]);
    return status;
 
  error:
@@ -430,9 +500,53 @@ MMAL_STATUS_T mmal_graph_disable(MMAL_GRAPH_T *graph)
          break;
    }
 
+   /* Forget about anything still waiting to be processed */
+   vcos_mutex_lock(&private->ready_lock);
+   for (i = 0; i < private->connection_num; i++)
+      private->connection_private[i].state = GRAPH_CONNECTION_IDLE;
+   private->ready_num = 0;
+   vcos_mutex_unlock(&private->ready_lock);
+
+   for (i = 0; i < private->connection_num; i++)
+   {
+      MMAL_GRAPH_CONNECTION_STATS_T *stats = &private->connection_private[i].stats;
+      LOG_INFO("%s: %u buffers, %u events, %u runs, queue depth max %u, latency avg %"PRIi64" max %"PRIi64" us, busy %"PRIi64" us",
+               private->connection[i]->name, stats->buffers, stats->events, stats->runs,
+               stats->queue_depth_max, stats->runs ? stats->latency_total / stats->runs : 0,
+               stats->latency_max, stats->time_busy);
+   }
+
    return status;
 }
 
+/*****************************************************************************/
+MMAL_STATUS_T mmal_graph_connection_stats_get(MMAL_GRAPH_T *graph, MMAL_CONNECTION_T *connection,
+   MMAL_GRAPH_CONNECTION_STATS_T *stats, MMAL_BOOL_T reset)
+{
+   MMAL_GRAPH_PRIVATE_T *private = (MMAL_GRAPH_PRIVATE_T *)graph;
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx;
+   unsigned int i;
+
+   if (!graph || !connection || !stats)
+      return MMAL_EINVAL;
+
+   for (i = 0; i < private->connection_num; i++)
+      if (private->connection[i] == connection)
+         break;
+   if (i == private->connection_num)
+      return MMAL_EINVAL; /* Connection not found */
+   cx = &private->connection_private[i];
+
+   vcos_mutex_lock(&private->ready_lock);
+   *stats = cx->stats;
+   if (reset)
+      memset(&cx->stats, 0, sizeof(cx->stats));
+   vcos_mutex_unlock(&private->ready_lock);
+
+   stats->queue_depth = connection->queue ? mmal_queue_length(connection->queue) : 0;
+   return MMAL_SUCCESS;
+}
+
 /*****************************************************************************/
 MMAL_STATUS_T mmal_graph_build(MMAL_GRAPH_T *graph,
    const char *name, MMAL_COMPONENT_T **component)
@@ -475,18 +589,17 @@ static void graph_component_control_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *
 /*****************************************************************************/
 static void graph_component_connection_cb(MMAL_CONNECTION_T *connection)
 {
-   MMAL_COMPONENT_T *component = (MMAL_COMPONENT_T *)connection->user_data;
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx = (MMAL_GRAPH_CONNECTION_PRIVATE_T *)connection->user_data;
    MMAL_BUFFER_HEADER_T *buffer;
 
    if (connection->flags == MMAL_CONNECTION_FLAG_DIRECT &&
        (buffer = mmal_queue_get(connection->queue)) != NULL)
    {
-      graph_process_buffer((MMAL_GRAPH_PRIVATE_T *)component->priv->module,
-         connection, buffer);
+      graph_process_buffer(cx->graph, connection, buffer);
       return;
    }
 
-   mmal_component_action_trigger(component);
+   graph_connection_ready(cx);
 }
 
 /*****************************************************************************/
@@ -529,8 +642,16 @@ static void graph_port_event_handler(MMAL_CONNECTION_T *connection,
 static void graph_process_buffer(MMAL_GRAPH_PRIVATE_T *graph_private,
    MMAL_CONNECTION_T *connection, MMAL_BUFFER_HEADER_T *buffer)
 {
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx = (MMAL_GRAPH_CONNECTION_PRIVATE_T *)connection->user_data;
    MMAL_STATUS_T status;
 
+   /* In direct mode this runs from the callbacks of the output port, which
+    * can come from several threads at once */
+   if (buffer->cmd)
+      __sync_fetch_and_add(&cx->stats.events, 1);
+   else
+      __sync_fetch_and_add(&cx->stats.buffers, 1);
+
    /* Call user defined function first */
    if (graph_private->graph.pf_connection_buffer)
    {
@@ -558,73 +679,146 @@ static void graph_process_buffer(MMAL_GRAPH_PRIVATE_T *graph_private,
 }
 
 /*****************************************************************************/
-static MMAL_BOOL_T graph_do_processing(MMAL_GRAPH_PRIVATE_T *graph_private)
+/** Wake up whatever processes the connections of the graph */
+static void graph_wake(MMAL_GRAPH_PRIVATE_T *graph_private)
 {
-   MMAL_BUFFER_HEADER_T *buffer;
-   MMAL_BOOL_T run_again = 0;
-   MMAL_STATUS_T status;
-   unsigned int i, j;
+   if (graph_private->thread_num)
+      vcos_semaphore_post(&graph_private->sema);
+   else if (graph_private->graph_component)
+      mmal_component_action_trigger(graph_private->graph_component);
+}
+
+/** Add a connection to the back of the ready queue. Called with the ready lock held. */
+static void graph_connection_queue_locked(MMAL_GRAPH_CONNECTION_PRIVATE_T *cx)
+{
+   MMAL_GRAPH_PRIVATE_T *graph_private = cx->graph;
+   unsigned int index = cx - graph_private->connection_private;
+
+   cx->state = GRAPH_CONNECTION_QUEUED;
+   cx->time_ready = vcos_getmicrosecs64();
+   graph_private->ready[(graph_private->ready_first + graph_private->ready_num++) % GRAPH_CONNECTIONS_MAX] = index;
+}
+
+/** Signal that a connection may have buffers to process */
+static void graph_connection_ready(MMAL_GRAPH_CONNECTION_PRIVATE_T *cx)
+{
+   MMAL_GRAPH_PRIVATE_T *graph_private = cx->graph;
+   MMAL_BOOL_T wake = MMAL_FALSE;
 
-   /* Process all the empty buffers first */
-   for (i = 0, j = graph_private->connection_current;
-        i < graph_private->connection_num; i++, j++)
+   vcos_mutex_lock(&graph_private->ready_lock);
+   if (cx->state == GRAPH_CONNECTION_IDLE)
+   {
+      graph_connection_queue_locked(cx);
+      wake = MMAL_TRUE;
+   }
+   else if (cx->state == GRAPH_CONNECTION_RUNNING)
    {
-      MMAL_CONNECTION_T *connection =
-         graph_private->connection[j%graph_private->connection_num];
+      /* Whoever is processing it will have another go */
+      cx->state = GRAPH_CONNECTION_RERUN;
+   }
+   vcos_mutex_unlock(&graph_private->ready_lock);
 
-      if ((connection->flags & MMAL_CONNECTION_FLAG_TUNNELLING) ||
-          !connection->pool)
-         continue; /* Nothing else to do in tunnelling mode */
+   if (wake)
+      graph_wake(graph_private);
+}
 
-      /* Send empty buffers to the output port of the connection */
-      while ((buffer = mmal_queue_get(connection->pool->queue)) != NULL)
-      {
-         run_again = 1;
+/** Take the connection at the front of the ready queue */
+static MMAL_GRAPH_CONNECTION_PRIVATE_T *graph_connection_next(MMAL_GRAPH_PRIVATE_T *graph_private)
+{
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx = NULL;
+   int64_t latency;
 
-         status = mmal_port_send_buffer(connection->out, buffer);
-         if (status != MMAL_SUCCESS)
-         {
-            LOG_ERROR("mmal_port_send_buffer failed (%i)", status);
-            mmal_queue_put_back(connection->pool->queue, buffer);
-            run_again = 0;
-            // FIXME: send error ?
-            break;
-         }
-      }
+   vcos_mutex_lock(&graph_private->ready_lock);
+   if (graph_private->ready_num)
+   {
+      cx = &graph_private->connection_private[graph_private->ready[graph_private->ready_first]];
+      graph_private->ready_first = (graph_private->ready_first + 1) % GRAPH_CONNECTIONS_MAX;
+      graph_private->ready_num--;
+      cx->state = GRAPH_CONNECTION_RUNNING;
+
+      latency = vcos_getmicrosecs64() - cx->time_ready;
+      cx->stats.latency_total += latency;
+      if (latency > cx->stats.latency_max)
+         cx->stats.latency_max = latency;
+      cx->stats.runs++;
    }
+   vcos_mutex_unlock(&graph_private->ready_lock);
+
+   return cx;
+}
 
-   /* Loop through all the connections */
-   for (i = 0, j = graph_private->connection_current++;
-        i < graph_private->connection_num; i++, j++)
+/** Process the buffers of one connection.
+ * Only the buffers already queued are forwarded, so that a busy connection goes to the
+ * back of the ready queue instead of starving the others.
+ * @return MMAL_TRUE if there are more buffers to process */
+static MMAL_BOOL_T graph_connection_process(MMAL_GRAPH_PRIVATE_T *graph_private,
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx)
+{
+   MMAL_CONNECTION_T *connection = cx->connection;
+   MMAL_BUFFER_HEADER_T *buffer;
+   MMAL_STATUS_T status;
+   unsigned int depth;
+
+   if (connection->flags & MMAL_CONNECTION_FLAG_TUNNELLING)
+      return MMAL_FALSE; /* Nothing else to do in tunnelling mode */
+
+   /* Send empty buffers to the output port of the connection */
+   while (connection->pool && (buffer = mmal_pool_get(connection->pool)) != NULL)
    {
-      MMAL_CONNECTION_T *connection =
-         graph_private->connection[j%graph_private->connection_num];
-      int64_t duration = vcos_getmicrosecs64();
-
-      if (connection->flags & MMAL_CONNECTION_FLAG_TUNNELLING)
-         continue; /* Nothing else to do in tunnelling mode */
-      if (connection->flags & MMAL_CONNECTION_FLAG_DIRECT)
-         continue; /* Nothing else to do in direct mode */
-
-      /* Send any queued buffer to the next component.
-       * We also make sure no connection can starve the others by
-       * having a timeout. */
-      while (vcos_getmicrosecs64() - duration < PROCESSING_TIME_MAX &&
-             (buffer = mmal_queue_get(connection->queue)) != NULL)
+      status = mmal_port_send_buffer(connection->out, buffer);
+      if (status != MMAL_SUCCESS)
       {
-         run_again = 1;
-
-         graph_process_buffer(graph_private, connection, buffer);
+         LOG_ERROR("mmal_port_send_buffer failed (%i)", status);
+         mmal_pool_put_back(connection->pool, buffer);
+         // FIXME: send error ?
+         break;
       }
    }
 
-   return run_again;
+   if (connection->flags & MMAL_CONNECTION_FLAG_DIRECT)
+      return MMAL_FALSE; /* Nothing else to do in direct mode */
+
+   /* Send the queued buffers to the next component */
+   depth = mmal_queue_length(connection->queue);
+   if (depth > cx->stats.queue_depth_max)
+      cx->stats.queue_depth_max = depth;
+   while (depth-- && (buffer = mmal_queue_get(connection->queue)) != NULL)
+      graph_process_buffer(graph_private, connection, buffer);
+
+   return mmal_queue_length(connection->queue) != 0;
+}
+
+/*****************************************************************************/
+static void graph_do_processing(MMAL_GRAPH_PRIVATE_T *graph_private)
+{
+   MMAL_GRAPH_CONNECTION_PRIVATE_T *cx;
+   MMAL_BOOL_T wake;
+
+   /* Keep going while there is work, unless asked to stop */
+   while (!graph_private->stop_thread && (cx = graph_connection_next(graph_private)) != NULL)
+   {
+      int64_t start = vcos_getmicrosecs64();
+      MMAL_BOOL_T more = graph_connection_process(graph_private, cx);
+
+      vcos_mutex_lock(&graph_private->ready_lock);
+      cx->stats.time_busy += vcos_getmicrosecs64() - start;
+      wake = more || cx->state == GRAPH_CONNECTION_RERUN;
+      if (wake)
+         graph_connection_queue_locked(cx);
+      else
+         cx->state = GRAPH_CONNECTION_IDLE;
+      vcos_mutex_unlock(&graph_private->ready_lock);
+
+      /* Let another worker pick it up if there is one */
+      if (wake && graph_private->thread_num > 1)
+         vcos_semaphore_post(&graph_private->sema);
+   }
 }
 
 /*****************************************************************************/
 static void graph_do_processing_loop(MMAL_COMPONENT_T *component)
 {
-   while (graph_do_processing((MMAL_GRAPH_PRIVATE_T *)component->priv->module));
+   graph_do_processing((MMAL_GRAPH_PRIVATE_T *)component->priv->module);
 }
 
 /*****************************************************************************/
@@ -887,6 +1081,7 @@ static MMAL_STATUS_T graph_port_enable(MMAL_PORT_T *graph_port, MMAL_PORT_BH_CB_
    MMAL_GRAPH_PRIVATE_T *graph_private = graph_port->component->priv->module;
    MMAL_PORT_T *port;
    MMAL_STATUS_T status;
+   unsigned int i;
    MMAL_PARAM_UNUSED(cb);
 
    port = find_port_from_graph(graph_private, graph_port);
@@ -914,7 +1109,9 @@ static MMAL_STATUS_T graph_port_enable(MMAL_PORT_T *graph_port, MMAL_PORT_BH_CB_
    /* We need to enable all the connected connections */
    status = graph_port_state_propagate(graph_private, port, 1);
 
-   mmal_component_action_trigger(graph_port->component);
+   /* Populate the newly enabled output ports with empty buffers */
+   for (i = 0; i < graph_private->connection_num; i++)
+      graph_connection_ready(&graph_private->connection_private[i]);
    return status;
 }
 
@@ -1412,7 +1609,7 @@ static MMAL_STATUS_T mmal_component_create_from_graph(const char *name, MMAL_COM
    for (i = 0; i < graph->connection_num; i++)
    {
       graph->connection[i]->callback = graph_component_connection_cb;
-      graph->connection[i]->user_data = (void *)component;
+      graph->connection[i]->user_data = (void *)&graph->connection_private[i];
    }
 #endif
 
@@ -91,6 +91,21 @@ typedef struct MMAL_GRAPH_T
 
 } MMAL_GRAPH_T;
 
+/** Statistics kept by a graph for each of its internal connections */
+typedef struct MMAL_GRAPH_CONNECTION_STATS_T
+{
+   uint32_t buffers;          /**< Buffers sent on to the input port */
+   uint32_t events;           /**< Events received from the output port */
+   uint32_t runs;             /**< Number of times the connection was processed */
+   uint32_t queue_depth;      /**< Buffers currently waiting to be sent to the input port */
+   uint32_t queue_depth_max;  /**< Most buffers found waiting when the connection was processed */
+   int64_t latency_total;     /**< Total time between the connection having buffers to process and
+                                   it being processed (microseconds) */
+   int64_t latency_max;       /**< Longest time between the connection having buffers to process and
+                                   it being processed (microseconds) */
+   int64_t time_busy;         /**< Total time spent processing the connection (microseconds) */
+} MMAL_GRAPH_CONNECTION_STATS_T;
+
 /** Create an instance of a graph.
  * The newly created graph will need to be populated by the client.
  *
@@ -191,8 +206,42 @@ typedef void (*MMAL_GRAPH_EVENT_CB)(MMAL_GRAPH_T *graph, MMAL_PORT_T *port, MMAL
  */
 MMAL_STATUS_T mmal_graph_enable(MMAL_GRAPH_T *graph, MMAL_GRAPH_EVENT_CB cb, void *cb_data);
 
+/** Disable the graph and stop processing.
+ * The statistics of each connection are logged at info level.
+ *
+ * @param graph   the graph to disable
+ *
+ * @return MMAL_SUCCESS on success
+ */
 MMAL_STATUS_T mmal_graph_disable(MMAL_GRAPH_T *graph);
 
+/** Set the number of worker threads used to process the internal connections of the graph.
+ * This must be called before \ref mmal_graph_enable. By default a single worker is used.
+ * A connection is never processed by more than one worker at a time, so buffers on a
+ * connection stay in order, but with several workers a slow connection no longer holds
+ * up the others.
+ *
+ * @param graph   the graph
+ * @param workers number of worker threads
+ *
+ * @return MMAL_SUCCESS on success
+ */
+MMAL_STATUS_T mmal_graph_set_workers(MMAL_GRAPH_T *graph, unsigned int workers);
+
+/** Get the statistics of an internal connection of the graph.
+ * The counters are updated without stopping the graph, so they may be slightly
+ * inconsistent with each other while it is running.
+ *
+ * @param graph      the graph
+ * @param connection a connection of the graph
+ * @param stats      returned statistics
+ * @param reset      reset the counters after reading them
+ *
+ * @return MMAL_SUCCESS on success
+ */
+MMAL_STATUS_T mmal_graph_connection_stats_get(MMAL_GRAPH_T *graph, MMAL_CONNECTION_T *connection,
+   MMAL_GRAPH_CONNECTION_STATS_T *stats, MMAL_BOOL_T reset);
+
 /** Find a port in the graph.
  *
  * @param graph graph instance
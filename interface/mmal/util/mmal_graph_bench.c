@@ -0,0 +1,306 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Benchmark for the graph scheduler.
+ *
+ * Builds a graph of independent chains, each a software source connected to
+ * a software sink. The sink of the first chain blocks for a while on every
+ * buffer, as a sink waiting on hardware would, and the others consume their
+ * buffers straight away. The graph is run with various numbers of workers,
+ * reporting the throughput and end-to-end latency of each chain along with
+ * the statistics the graph keeps for each connection. It also checks that
+ * every sink receives its buffers in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmal.h"
+#include "util/mmal_graph.h"
+#include "core/mmal_component_private.h"
+#include "core/mmal_port_private.h"
+
+#define BENCH_MAX_CHAINS 8
+#define BENCH_MAX_MODES 8
+#define BENCH_BUFFER_SIZE 64
+
+typedef struct BENCH_CHAIN_T
+{
+   MMAL_COMPONENT_T *source;
+   MMAL_COMPONENT_T *sink;
+   MMAL_CONNECTION_T *connection;
+   unsigned int sink_delay_us;  /**< time the sink blocks for on each buffer */
+
+   int64_t sequence;            /**< next sequence number from the source */
+   int64_t expected;            /**< next sequence number the sink expects */
+   unsigned int received;
+   unsigned int out_of_order;
+   int64_t latency_total;       /**< time from source to sink (microseconds) */
+   int64_t latency_max;
+} BENCH_CHAIN_T;
+
+static BENCH_CHAIN_T chains[BENCH_MAX_CHAINS];
+static unsigned int num_buffers = 4;
+
+/*****************************************************************************/
+static MMAL_STATUS_T bench_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb)
+{
+   MMAL_PARAM_UNUSED(port);
+   MMAL_PARAM_UNUSED(cb);
+   return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T bench_port_disable(MMAL_PORT_T *port)
+{
+   MMAL_PARAM_UNUSED(port);
+   return MMAL_SUCCESS; /* Buffers are never held on to */
+}
+
+static MMAL_STATUS_T bench_port_flush(MMAL_PORT_T *port)
+{
+   MMAL_PARAM_UNUSED(port);
+   return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T bench_port_set_format(MMAL_PORT_T *port)
+{
+   MMAL_PARAM_UNUSED(port);
+   return MMAL_SUCCESS;
+}
+
+/* The source fills every empty buffer it is given straight away */
+static MMAL_STATUS_T bench_source_send(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   BENCH_CHAIN_T *chain = (BENCH_CHAIN_T *)port->component->priv->module;
+
+   buffer->length = BENCH_BUFFER_SIZE;
+   buffer->pts = chain->sequence++;
+   buffer->dts = vcos_getmicrosecs64();
+   mmal_port_buffer_header_callback(port, buffer);
+   return MMAL_SUCCESS;
+}
+
+/* The sink consumes every buffer it is given, possibly after blocking for a while */
+static MMAL_STATUS_T bench_sink_send(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   BENCH_CHAIN_T *chain = (BENCH_CHAIN_T *)port->component->priv->module;
+   int64_t latency;
+
+   if (chain->sink_delay_us)
+      usleep(chain->sink_delay_us);
+
+   if (buffer->pts != chain->expected)
+      chain->out_of_order++;
+   chain->expected = buffer->pts + 1;
+
+   latency = vcos_getmicrosecs64() - buffer->dts;
+   chain->latency_total += latency;
+   if (latency > chain->latency_max)
+      chain->latency_max = latency;
+   chain->received++;
+
+   buffer->length = 0;
+   mmal_port_buffer_header_callback(port, buffer);
+   return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T bench_component_destroy(MMAL_COMPONENT_T *component)
+{
+   if (component->input_num)
+      mmal_ports_free(component->input, component->input_num);
+   if (component->output_num)
+      mmal_ports_free(component->output, component->output_num);
+   return MMAL_SUCCESS;
+}
+
+static MMAL_STATUS_T bench_component_create(const char *name, MMAL_COMPONENT_T *component)
+{
+   MMAL_BOOL_T source = !strcmp(name, "source");
+   MMAL_PORT_T **ports;
+
+   component->priv->pf_destroy = bench_component_destroy;
+
+   ports = mmal_ports_alloc(component, 1, source ? MMAL_PORT_TYPE_OUTPUT : MMAL_PORT_TYPE_INPUT, 0);
+   if (!ports)
+      return MMAL_ENOMEM;
+   if (source)
+   {
+      component->output = ports;
+      component->output_num = 1;
+   }
+   else
+   {
+      component->input = ports;
+      component->input_num = 1;
+   }
+
+   ports[0]->priv->pf_enable = bench_port_enable;
+   ports[0]->priv->pf_disable = bench_port_disable;
+   ports[0]->priv->pf_flush = bench_port_flush;
+   ports[0]->priv->pf_set_format = bench_port_set_format;
+   ports[0]->priv->pf_send = source ? bench_source_send : bench_sink_send;
+   ports[0]->buffer_num_min = 1;
+   ports[0]->buffer_num_recommended = num_buffers;
+   ports[0]->buffer_size_min = ports[0]->buffer_size_recommended = BENCH_BUFFER_SIZE;
+   ports[0]->format->type = MMAL_ES_TYPE_UNKNOWN;
+
+   return MMAL_SUCCESS;
+}
+
+/*****************************************************************************/
+static int bench_run(unsigned int workers, unsigned int num_chains, unsigned int sink_delay_us,
+                     unsigned int duration_ms)
+{
+   MMAL_GRAPH_T *graph;
+   unsigned int i;
+   int result = 0;
+
+   if (mmal_graph_create(&graph, 0) != MMAL_SUCCESS ||
+       mmal_graph_set_workers(graph, workers) != MMAL_SUCCESS)
+   {
+      printf("failed to create graph with %u workers\n", workers);
+      return -1;
+   }
+
+   memset(chains, 0, sizeof(chains));
+   for (i = 0; i < num_chains; i++)
+   {
+      BENCH_CHAIN_T *chain = &chains[i];
+      chain->sink_delay_us = i ? 0 : sink_delay_us;
+
+      if (mmal_component_create_with_constructor("source", bench_component_create,
+             (struct MMAL_COMPONENT_MODULE_T *)chain, &chain->source) != MMAL_SUCCESS ||
+          mmal_component_create_with_constructor("sink", bench_component_create,
+             (struct MMAL_COMPONENT_MODULE_T *)chain, &chain->sink) != MMAL_SUCCESS ||
+          mmal_graph_add_component(graph, chain->source) != MMAL_SUCCESS ||
+          mmal_graph_add_component(graph, chain->sink) != MMAL_SUCCESS ||
+          mmal_graph_new_connection(graph, chain->source->output[0], chain->sink->input[0], 0,
+             &chain->connection) != MMAL_SUCCESS)
+      {
+         printf("failed to create chain %u\n", i);
+         return -1;
+      }
+      mmal_component_release(chain->source);
+      mmal_component_release(chain->sink);
+   }
+
+   if (mmal_graph_enable(graph, NULL, NULL) != MMAL_SUCCESS)
+   {
+      printf("failed to enable graph\n");
+      return -1;
+   }
+   vcos_sleep(duration_ms);
+   mmal_graph_disable(graph);
+
+   printf("%u worker%s:\n", workers, workers > 1 ? "s" : "");
+   printf("  chain   buffers/s  latency avg/max (us)  | runs  depth max  ready latency avg/max (us)  busy\n");
+   for (i = 0; i < num_chains; i++)
+   {
+      BENCH_CHAIN_T *chain = &chains[i];
+      MMAL_GRAPH_CONNECTION_STATS_T stats;
+
+      mmal_graph_connection_stats_get(graph, chain->connection, &stats, MMAL_FALSE);
+      printf("  %u%-5s %10.0f  %8"PRIi64" %10"PRIi64"  | %6u %6u  %9"PRIi64" %10"PRIi64"  %5.1f%%\n",
+             i, chain->sink_delay_us ? " slow" : "",
+             chain->received * 1000.0 / duration_ms,
+             chain->received ? chain->latency_total / chain->received : 0, chain->latency_max,
+             stats.runs, stats.queue_depth_max,
+             stats.runs ? stats.latency_total / stats.runs : 0, stats.latency_max,
+             stats.time_busy / (duration_ms * 10.0));
+
+      if (chain->out_of_order || stats.buffers != chain->received)
+      {
+         printf("  chain %u: %u buffers out of order, %u forwarded but %u received\n",
+                i, chain->out_of_order, stats.buffers, chain->received);
+         result = -1;
+      }
+      mmal_connection_release(chain->connection);
+   }
+
+   mmal_graph_destroy(graph);
+   return result;
+}
+
+static void usage(void)
+{
+   printf("Usage: mmal_graph_bench [-c <chains>] [-b <buffers>] [-s <us>] [-d <ms>] [-w <workers,...>]\n");
+   printf("    -c <n>      source to sink chains (default 4)\n");
+   printf("    -b <n>      buffers per connection (default 4)\n");
+   printf("    -s <us>     time the first sink blocks for on each buffer (default 2000)\n");
+   printf("    -d <ms>     duration of each run (default 2000)\n");
+   printf("    -w <list>   workers for each run (default 1,2,4)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int num_chains = 4, sink_delay_us = 2000, duration_ms = 2000;
+   unsigned int modes[BENCH_MAX_MODES] = {1, 2, 4};
+   unsigned int num_modes = 3, i;
+   int argn, result = 0;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-c") && argn + 1 < argc)
+         num_chains = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         num_buffers = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-s") && argn + 1 < argc)
+         sink_delay_us = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-d") && argn + 1 < argc)
+         duration_ms = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-w") && argn + 1 < argc)
+      {
+         char *list = argv[++argn];
+         for (num_modes = 0; num_modes < BENCH_MAX_MODES && *list; num_modes++)
+         {
+            modes[num_modes] = strtoul(list, &list, 10);
+            if (*list == ',')
+               list++;
+         }
+      }
+      else
+         usage();
+   }
+
+   if (!num_chains || num_chains > BENCH_MAX_CHAINS || !num_buffers || !duration_ms || !num_modes)
+      usage();
+
+   vcos_init();
+   printf("%u chains, %u buffers each, first sink blocks for %u us per buffer\n",
+          num_chains, num_buffers, sink_delay_us);
+
+   for (i = 0; i < num_modes; i++)
+      if (bench_run(modes[i], num_chains, sink_delay_us, duration_ms) != 0)
+         result = 1;
+
+   return result;
+}
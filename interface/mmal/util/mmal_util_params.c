@@ -221,3 +221,16 @@ MMAL_STATUS_T mmal_util_get_core_port_stats(MMAL_PORT_T *port,
       *stats = param.stats;
    return ret;
 }
+
+MMAL_STATUS_T mmal_util_get_core_port_stats_ext(MMAL_PORT_T *port,
+                                                MMAL_CORE_STATS_DIR dir,
+                                                MMAL_BOOL_T reset,
+                                                MMAL_PARAMETER_CORE_STATISTICS_EXT_T *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   stats->hdr.id = MMAL_PARAMETER_CORE_STATISTICS_EXT;
+   stats->hdr.size = sizeof(*stats);
+   stats->dir = dir;
+   stats->reset = reset;
+   return mmal_port_parameter_get(port, &stats->hdr);
+}
@@ -203,6 +203,17 @@ MMAL_STATUS_T mmal_util_camera_use_stc_timestamp(MMAL_PORT_T *port, MMAL_CAMERA_
 MMAL_STATUS_T mmal_util_get_core_port_stats(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR dir, MMAL_BOOL_T reset,
                                             MMAL_CORE_STATISTICS_T *stats);
 
+/** Get the extended MMAL core statistics (including latency histograms) for a given port.
+ *
+ * @param port  port to query
+ * @param dir   port direction
+ * @param reset reset the stats as well
+ * @param stats filled in with results
+ * @return MMAL_SUCCESS or error
+ */
+MMAL_STATUS_T mmal_util_get_core_port_stats_ext(MMAL_PORT_T *port, MMAL_CORE_STATS_DIR dir, MMAL_BOOL_T reset,
+                                                MMAL_PARAMETER_CORE_STATISTICS_EXT_T *stats);
+
 #ifdef __cplusplus
 }
 #endif
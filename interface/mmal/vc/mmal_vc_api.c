@@ -234,7 +234,7 @@ static MMAL_STATUS_T mmal_vc_port_enable(MMAL_PORT_T *port, MMAL_PORT_BH_CB_T cb
    {
       if (vcos_blockpool_create_on_heap(&module->pool, port->buffer_num,
              sizeof(MMAL_VC_CLIENT_BUFFER_CONTEXT_T),
-             VCOS_BLOCKPOOL_ALIGN_DEFAULT, VCOS_BLOCKPOOL_FLAG_NONE, "mmal vc port pool") != VCOS_SUCCESS)
+             VCOS_BLOCKPOOL_ALIGN_DEFAULT, VCOS_BLOCKPOOL_FLAG_CONCURRENT, "mmal vc port pool") != VCOS_SUCCESS)
       {
          LOG_ERROR("failed to create port pool");
          return MMAL_ENOMEM;
@@ -1079,15 +1079,27 @@ static MMAL_STATUS_T mmal_vc_port_set_format(MMAL_PORT_T *port)
    return MMAL_SUCCESS;
 }
 
-/** Set parameter on a port */
-static MMAL_STATUS_T mmal_vc_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param)
+/** Fetch the buffer requirements of all the input and output ports of a component */
+static MMAL_STATUS_T mmal_vc_component_requirements_get(MMAL_COMPONENT_T *component)
+{
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   unsigned int i;
+
+   for (i = 0; status == MMAL_SUCCESS && i < component->input_num; i++)
+      status = mmal_vc_port_requirements_get(component->input[i]);
+   for (i = 0; status == MMAL_SUCCESS && i < component->output_num; i++)
+      status = mmal_vc_port_requirements_get(component->output[i]);
+
+   return status;
+}
+
+/** Send a parameter set request for a port without waiting for the reply */
+static MMAL_STATUS_T mmal_vc_port_parameter_send(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param,
+                                                 mmal_worker_reply *reply, MMAL_VC_TOKEN_T *token)
 {
    MMAL_PORT_MODULE_T *module = port->priv->module;
-   MMAL_STATUS_T status;
    mmal_worker_port_param_set msg;
    size_t msglen = MMAL_OFFSET(mmal_worker_port_param_set, param) + param->size;
-   mmal_worker_reply reply;
-   size_t replylen = sizeof(reply);
 
    if(param->size > MMAL_WORKER_PORT_PARAMETER_SET_MAX)
    {
@@ -1109,32 +1121,110 @@ static MMAL_STATUS_T mmal_vc_port_parameter_set(MMAL_PORT_T *port, const MMAL_PA
    /* coverity[overrun-buffer-arg] */
    memcpy(&msg.param, param, param->size);
 
-   status = mmal_vc_sendwait_message(mmal_vc_get_client(), &msg.header, msglen,
-                                     MMAL_WORKER_PORT_PARAMETER_SET, &reply, &replylen, MMAL_FALSE);
+   return mmal_vc_send_message_async(mmal_vc_get_client(), &msg.header, msglen,
+                                     MMAL_WORKER_PORT_PARAMETER_SET, reply, sizeof(*reply), token);
+}
 
+/** Wait for the reply to a parameter set request sent with mmal_vc_port_parameter_send() */
+static MMAL_STATUS_T mmal_vc_port_parameter_wait(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param,
+                                                 mmal_worker_reply *reply, MMAL_VC_TOKEN_T token)
+{
+   MMAL_PORT_MODULE_T *module = port->priv->module;
+   size_t replylen;
+   MMAL_STATUS_T status;
+
+   status = mmal_vc_wait_message(mmal_vc_get_client(), token, &replylen);
    if (status == MMAL_SUCCESS)
    {
-      vcos_assert(replylen == sizeof(reply));
-      status = reply.status;
+      vcos_assert(replylen == sizeof(*reply));
+      status = reply->status;
    }
    if (status != MMAL_SUCCESS)
-   {
-      LOG_WARN("failed to set port parameter %u:%u %u:%u %s", msg.component_handle, msg.port_handle,
+      LOG_WARN("failed to set port parameter %u:%u %u:%u %s", module->component_handle, module->port_handle,
             param->id, param->size, mmal_status_to_string(status));
+
+   return status;
+}
+
+/** Set parameter on a port */
+static MMAL_STATUS_T mmal_vc_port_parameter_set(MMAL_PORT_T *port, const MMAL_PARAMETER_HEADER_T *param)
+{
+   MMAL_STATUS_T status;
+   mmal_worker_reply reply;
+   MMAL_VC_TOKEN_T token;
+
+   status = mmal_vc_port_parameter_send(port, param, &reply, &token);
+   if (status != MMAL_SUCCESS)
+      return status;
+
+   status = mmal_vc_port_parameter_wait(port, param, &reply, token);
+   if (status != MMAL_SUCCESS)
       return status;
-   }
 
    if (param->id == MMAL_PARAMETER_BUFFER_REQUIREMENTS)
    {
       /* This might have changed the buffer requirements of other ports so fetch them all */
-      MMAL_COMPONENT_T *component = port->component;
-      unsigned int i;
-      for (i = 0; status == MMAL_SUCCESS && i < component->input_num; i++)
-         status = mmal_vc_port_requirements_get(component->input[i]);
-      for (i = 0; status == MMAL_SUCCESS && i < component->output_num; i++)
-         status = mmal_vc_port_requirements_get(component->output[i]);
+      status = mmal_vc_component_requirements_get(port->component);
+   }
+
+   return status;
+}
+
+/** Set a list of port parameters, overlapping the round trips to VideoCore */
+MMAL_STATUS_T mmal_vc_port_parameters_set(MMAL_VC_PORT_PARAMETER_SET_T *sets, unsigned int count)
+{
+   mmal_worker_reply replies[MMAL_VC_PARAMETER_SET_WINDOW];
+   MMAL_VC_TOKEN_T tokens[MMAL_VC_PARAMETER_SET_WINDOW];
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   unsigned int first, issued, i, j;
+
+   for (first = 0; first < count; first += issued)
+   {
+      /* Issue a window's worth of requests... */
+      for (issued = 0; issued < MMAL_VC_PARAMETER_SET_WINDOW && first + issued < count; issued++)
+      {
+         MMAL_VC_PORT_PARAMETER_SET_T *set = &sets[first + issued];
+
+         tokens[issued] = NULL;
+         if (set->port->priv->pf_parameter_set != mmal_vc_port_parameter_set)
+            set->status = mmal_port_parameter_set(set->port, set->param);
+         else
+            set->status = mmal_vc_port_parameter_send(set->port, set->param,
+                                                      &replies[issued], &tokens[issued]);
+      }
+
+      /* ...then collect the replies, which VideoCore sends in the same order */
+      for (i = 0; i < issued; i++)
+      {
+         MMAL_VC_PORT_PARAMETER_SET_T *set = &sets[first + i];
+         if (tokens[i])
+            set->status = mmal_vc_port_parameter_wait(set->port, set->param, &replies[i], tokens[i]);
+      }
    }
 
+   /* Changing buffer requirements might have changed those of other ports
+    * so fetch them all, once per component */
+   for (i = 0; i < count; i++)
+   {
+      MMAL_COMPONENT_T *component = sets[i].port->component;
+
+      if (sets[i].status != MMAL_SUCCESS ||
+          sets[i].param->id != MMAL_PARAMETER_BUFFER_REQUIREMENTS ||
+          sets[i].port->priv->pf_parameter_set != mmal_vc_port_parameter_set)
+         continue;
+
+      for (j = 0; j < i; j++)
+         if (sets[j].status == MMAL_SUCCESS && sets[j].port->component == component &&
+             sets[j].param->id == MMAL_PARAMETER_BUFFER_REQUIREMENTS &&
+             sets[j].port->priv->pf_parameter_set == mmal_vc_port_parameter_set)
+            break;
+      if (j == i)
+         sets[i].status = mmal_vc_component_requirements_get(component);
+   }
+
+   for (i = 0; status == MMAL_SUCCESS && i < count; i++)
+      status = sets[i].status;
+
    return status;
 }
 
@@ -1398,8 +1488,9 @@ static MMAL_STATUS_T mmal_vc_component_create(const char *name, MMAL_COMPONENT_T
    component->clock_num = reply.clock_num;
 
    /* We want to do the buffer callbacks to the client into a separate thread.
-    * We'll need to queue these callbacks and have an action which does the actual callback. */
-   module->callback_queue = mmal_queue_create();
+    * We'll need to queue these callbacks and have an action which does the actual callback.
+    * Only the action, or a port disable holding the action lock, takes from the queue. */
+   module->callback_queue = mmal_queue_create_with_flags(MMAL_QUEUE_FLAG_SINGLE_CONSUMER);
    if (!module->callback_queue)
       goto fail;
    status = mmal_component_action_register(component, mmal_vc_do_callback_loop);
@@ -174,6 +174,38 @@ MMAL_STATUS_T mmal_vc_get_core_stats(MMAL_CORE_STATISTICS_T *stats,
                                      unsigned port,
                                      MMAL_CORE_STATS_DIR dir,
                                      MMAL_BOOL_T reset);
+/** Maximum number of parameter set requests kept in flight by
+ * mmal_vc_port_parameters_set().
+ */
+#define MMAL_VC_PARAMETER_SET_WINDOW 16
+
+/** One entry in a list of port parameters to set with
+ * mmal_vc_port_parameters_set().
+ */
+typedef struct MMAL_VC_PORT_PARAMETER_SET_T
+{
+   MMAL_PORT_T *port;                     /**< Port to set the parameter on */
+   const MMAL_PARAMETER_HEADER_T *param;  /**< Parameter to set */
+   MMAL_STATUS_T status;                  /**< Updated with the outcome for this entry */
+} MMAL_VC_PORT_PARAMETER_SET_T;
+
+/** Set a list of port parameters, as mmal_port_parameter_set() would for each
+ * entry in turn.
+ *
+ * Requests for ports of VideoCore components are sent without waiting for
+ * the previous reply, up to MMAL_VC_PARAMETER_SET_WINDOW at a time, so that
+ * their round trips overlap. VideoCore handles them in the order given, so
+ * later entries see the effect of earlier ones. Other ports are set
+ * synchronously. No entry is skipped because an earlier one failed. The ports
+ * must not be reconfigured by other threads during the call.
+ *
+ * @param sets   Parameters to set, each updated with its own status
+ * @param count  Number of entries in sets
+ * @return MMAL_SUCCESS if every parameter was set, otherwise the status of
+ *         the first entry that failed.
+ */
+MMAL_STATUS_T mmal_vc_port_parameters_set(MMAL_VC_PORT_PARAMETER_SET_T *sets, unsigned int count);
+
 /**
  * Stores an arbitrary text message in a circular buffer inside the MMAL VC server.
  * The purpose of this message is to log high level events from the host in order
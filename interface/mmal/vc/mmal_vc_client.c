@@ -43,11 +43,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdio.h>
 
-#define MAX_WAITERS 16
+#define MMAL_WAITER_BLOCK_SIZE 32    /**< Waiters per block, one bit each in the free mask */
+#define MMAL_WAITER_MAX_BLOCKS 32    /**< Limit on the number of requests in flight */
 static VCOS_ONCE_T once = VCOS_ONCE_INIT;
 static VCHIQ_INSTANCE_T mmal_vchiq_instance;
 static VCOS_LOG_CAT_T mmal_ipc_log_category;
 
+struct MMAL_WAITER_BLOCK_T;
+
 /** Client threads use one of these to wait for
  * a reply from VideoCore.
  */
@@ -57,17 +60,34 @@ typedef struct MMAL_WAITER_T
    unsigned inuse;
    void *dest;                   /**< Where to write reply */
    size_t destlen;               /**< Max length for reply */
+   struct MMAL_WAITER_BLOCK_T *block; /**< Block this waiter belongs to */
+   uint32_t mask;                /**< Bit for this waiter in the block's free mask */
 } MMAL_WAITER_T;
 
-/** We have an array of waiters and allocate them to waiting
-  * threads. They can be released back to the pool in any order.
-  * If there are none free, the calling thread will block until
-  * one becomes available.
+/** Waiters are allocated a block at a time. A waiter's address is sent to
+  * VideoCore with each request and echoed back in the reply, so blocks are
+  * never moved or freed while the client is in use.
+  */
+typedef struct MMAL_WAITER_BLOCK_T
+{
+   volatile uint32_t free;       /**< Bit n set when waiters[n] is free */
+   MMAL_WAITER_T waiters[MMAL_WAITER_BLOCK_SIZE];
+} MMAL_WAITER_BLOCK_T;
+
+/** Slot table of waiters, allocated to requesting threads. Waiters are
+  * claimed and released with atomic operations on the free masks, so no lock
+  * is taken on the request path. They can be released back to the pool in
+  * any order. The table grows a block at a time up to MMAL_WAITER_MAX_BLOCKS;
+  * if it is full at that size, the calling thread will block until a waiter
+  * becomes available.
   */
 typedef struct 
 {
-   MMAL_WAITER_T waiters[MAX_WAITERS];
-   VCOS_SEMAPHORE_T sem;
+   MMAL_WAITER_BLOCK_T *blocks[MMAL_WAITER_MAX_BLOCKS];
+   volatile unsigned int num_blocks;
+   VCOS_MUTEX_T grow_lock;       /**< Serialises adding blocks */
+   volatile unsigned int starved; /**< Threads waiting for a free waiter */
+   VCOS_SEMAPHORE_T sem;         /**< Posted on release while threads are starved */
 } MMAL_WAITPOOL_T;
 
 struct MMAL_CLIENT_T
@@ -92,73 +112,157 @@ static void init_once(void)
    vcos_mutex_create(&client.lock, VCOS_FUNCTION);
 }
 
-/** Create a pool of wait-structures.
+static void destroy_waiter_block(MMAL_WAITER_BLOCK_T *block, unsigned int num_waiters)
+{
+   unsigned int i;
+   for (i = 0; i < num_waiters; i++)
+      vcos_semaphore_delete(&block->waiters[i].sem);
+   vcos_free(block);
+}
+
+/** Add a block of waiters to the pool, unless another thread has already
+  * done so since the caller found the pool full with num_blocks blocks.
   */
-static MMAL_STATUS_T create_waitpool(MMAL_WAITPOOL_T *waitpool)
+static MMAL_STATUS_T grow_waitpool(MMAL_WAITPOOL_T *waitpool, unsigned int num_blocks)
 {
-   MMAL_STATUS_T status;
-   int i;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   MMAL_WAITER_BLOCK_T *block;
+   unsigned int i;
 
-   status = vcos_semaphore_create(&waitpool->sem, VCOS_FUNCTION,
-                                  MAX_WAITERS);
-   if (status != MMAL_SUCCESS)
-      return status;
+   vcos_mutex_lock(&waitpool->grow_lock);
+   if (waitpool->num_blocks != num_blocks)
+      goto end; /* Somebody else got there first */
+   if (num_blocks == MMAL_WAITER_MAX_BLOCKS)
+   {
+      status = MMAL_ENOSPC;
+      goto end;
+   }
 
-   for (i=0; i<MAX_WAITERS; i++)
+   block = vcos_calloc(1, sizeof(*block), "mmal waiters");
+   if (!block)
    {
-      waitpool->waiters[i].inuse = 0;
-      status = vcos_semaphore_create(&waitpool->waiters[i].sem,
-                                     "mmal waiter", 0);
-      if (status != MMAL_SUCCESS)
-         break;
+      status = MMAL_ENOMEM;
+      goto end;
    }
 
-   if (status != MMAL_SUCCESS)
+   for (i = 0; i < MMAL_WAITER_BLOCK_SIZE; i++)
    {
-      /* clean up */
-      i--;
-      while (i>=0)
+      block->waiters[i].block = block;
+      block->waiters[i].mask = 1u << i;
+      if (vcos_semaphore_create(&block->waiters[i].sem, "mmal waiter", 0) != VCOS_SUCCESS)
       {
-         vcos_semaphore_delete(&waitpool->waiters[i].sem);
-         i--;
+         destroy_waiter_block(block, i);
+         status = MMAL_ENOSPC;
+         goto end;
       }
-      vcos_semaphore_delete(&waitpool->sem);
    }
+   block->free = ~0u;
+
+   /* Make the block visible to get_waiter() only once it is fully set up */
+   waitpool->blocks[num_blocks] = block;
+   __sync_synchronize();
+   waitpool->num_blocks = num_blocks + 1;
+   LOG_TRACE("now %u waiters", (num_blocks + 1) * MMAL_WAITER_BLOCK_SIZE);
+
+ end:
+   vcos_mutex_unlock(&waitpool->grow_lock);
+   return status;
+}
+
+/** Create a pool of wait-structures.
+  */
+static MMAL_STATUS_T create_waitpool(MMAL_WAITPOOL_T *waitpool)
+{
+   MMAL_STATUS_T status;
+
+   memset(waitpool, 0, sizeof(*waitpool));
+   status = vcos_semaphore_create(&waitpool->sem, VCOS_FUNCTION, 0);
+   if (status != MMAL_SUCCESS)
+      return status;
+   status = vcos_mutex_create(&waitpool->grow_lock, VCOS_FUNCTION);
+   if (status != MMAL_SUCCESS)
+      goto fail_mutex;
+
+   status = grow_waitpool(waitpool, 0);
+   if (status != MMAL_SUCCESS)
+      goto fail_block;
+
+   return MMAL_SUCCESS;
+
+ fail_block:
+   vcos_mutex_delete(&waitpool->grow_lock);
+ fail_mutex:
+   vcos_semaphore_delete(&waitpool->sem);
    return status;
 }
 
 static void destroy_waitpool(MMAL_WAITPOOL_T *waitpool)
 {
-   int i;
-   for (i=0; i<MAX_WAITERS; i++)
-      vcos_semaphore_delete(&waitpool->waiters[i].sem);
+   unsigned int i;
+   for (i = 0; i < waitpool->num_blocks; i++)
+      destroy_waiter_block(waitpool->blocks[i], MMAL_WAITER_BLOCK_SIZE);
+   waitpool->num_blocks = 0;
 
+   vcos_mutex_delete(&waitpool->grow_lock);
    vcos_semaphore_delete(&waitpool->sem);
 }
 
+/** Try to claim a free waiter without blocking.
+  */
+static MMAL_WAITER_T *claim_waiter(MMAL_WAITPOOL_T *waitpool, unsigned int num_blocks)
+{
+   unsigned int i;
+
+   for (i = 0; i < num_blocks; i++)
+   {
+      MMAL_WAITER_BLOCK_T *block = waitpool->blocks[i];
+      uint32_t free = block->free;
+
+      while (free)
+      {
+         unsigned int bit = __builtin_ctz(free);
+         if (__sync_bool_compare_and_swap(&block->free, free, free & ~(1u << bit)))
+         {
+            block->waiters[bit].inuse = 1;
+            return &block->waiters[bit];
+         }
+         free = block->free;
+      }
+   }
+   return NULL;
+}
+
 /** Grab a waiter from the pool. Return immediately if one already
   * available, or wait for one to become available.
   */
 static MMAL_WAITER_T *get_waiter(MMAL_CLIENT_T *client)
 {
-   int i;
-   MMAL_WAITER_T *waiter = NULL;
-   vcos_semaphore_wait(&client->waitpool.sem);
-   vcos_mutex_lock(&client->lock);
-   for (i=0; i<MAX_WAITERS; i++)
-   {
-      if (client->waitpool.waiters[i].inuse == 0)
-         break;
-   }
-   /* If this fails, the semaphore is not working */
-   if (vcos_verify(i != MAX_WAITERS))
+   MMAL_WAITPOOL_T *waitpool = &client->waitpool;
+   MMAL_WAITER_T *waiter;
+   unsigned int num_blocks;
+
+   while (1)
    {
-      waiter = client->waitpool.waiters+i;
-      waiter->inuse = 1;
+      num_blocks = waitpool->num_blocks;
+      __sync_synchronize();
+      waiter = claim_waiter(waitpool, num_blocks);
+      if (waiter)
+         return waiter;
+
+      /* All busy. Add another block unless the table is at its limit. */
+      if (grow_waitpool(waitpool, num_blocks) == MMAL_SUCCESS)
+         continue;
+
+      /* Register as starved before having a last look, so that a waiter
+       * released from now on is sure to post the semaphore. */
+      __sync_fetch_and_add(&waitpool->starved, 1);
+      waiter = claim_waiter(waitpool, waitpool->num_blocks);
+      if (!waiter)
+         vcos_semaphore_wait(&waitpool->sem);
+      __sync_fetch_and_sub(&waitpool->starved, 1);
+      if (waiter)
+         return waiter;
    }
-   vcos_mutex_unlock(&client->lock);
-
-   return waiter;
 }
 
 /** Return a waiter to the pool.
@@ -169,7 +273,9 @@ static void release_waiter(MMAL_CLIENT_T *client, MMAL_WAITER_T *waiter)
    vcos_assert(waiter);
    vcos_assert(waiter->inuse);
    waiter->inuse = 0;
-   vcos_semaphore_post(&client->waitpool.sem);
+   __sync_fetch_and_or(&waiter->block->free, waiter->mask);
+   if (client->waitpool.starved)
+      vcos_semaphore_post(&client->waitpool.sem);
 }
 
 static MMAL_PORT_T *mmal_vc_port_by_number(MMAL_COMPONENT_T *component, uint32_t type, uint32_t number)
@@ -509,23 +615,16 @@ static VCHIQ_STATUS_T mmal_vc_vchiq_callback(VCHIQ_REASON_T reason,
    return VCHIQ_SUCCESS;
 }
 
-/** Send a message and wait for a reply.
-  *
-  * @param client       client to send message for
-  * @param msg_header   message vchiq_header to send
-  * @param size         length of message, including header
-  * @param msgid        message id
-  * @param dest         destination for reply
-  * @param destlen      size of destination, updated with actual length
-  * @param send_dummy_bulk whether to send a dummy bulk transfer
+/** Queue a request for which a reply is expected, without waiting for it.
   */
-MMAL_STATUS_T mmal_vc_sendwait_message(struct MMAL_CLIENT_T *client,
-                                       mmal_worker_msg_header *msg_header,
-                                       size_t size,
-                                       uint32_t msgid,
-                                       void *dest,
-                                       size_t *destlen,
-                                       MMAL_BOOL_T send_dummy_bulk)
+static MMAL_STATUS_T mmal_vc_queue_request(MMAL_CLIENT_T *client,
+                                           mmal_worker_msg_header *msg_header,
+                                           size_t size,
+                                           uint32_t msgid,
+                                           void *dest,
+                                           size_t destlen,
+                                           MMAL_BOOL_T send_dummy_bulk,
+                                           MMAL_WAITER_T **pwaiter)
 {
    MMAL_STATUS_T ret;
    MMAL_WAITER_T *waiter;
@@ -550,7 +649,7 @@ MMAL_STATUS_T mmal_vc_sendwait_message(struct MMAL_CLIENT_T *client,
    msg_header->magic  = MMAL_MAGIC;
 
    waiter->dest    = dest;
-   waiter->destlen = *destlen;
+   waiter->destlen = destlen;
    LOG_TRACE("wait %p, reply to %p", waiter, dest);
    mmal_vc_use_internal(client);
 
@@ -584,26 +683,100 @@ MMAL_STATUS_T mmal_vc_sendwait_message(struct MMAL_CLIENT_T *client,
       }
    }
 
-   /* now wait for the reply...
-    *
-    * FIXME: we could do with a timeout here. Need to be careful to cancel
+   *pwaiter = waiter;
+   return MMAL_SUCCESS;
+
+fail_msg:
+   mmal_vc_release_internal(client);
+
+   release_waiter(client, waiter);
+   return ret;
+}
+
+/** Send a message and return without waiting for the reply.
+  *
+  * The reply is written to dest when it arrives, so dest must remain valid
+  * until the request has been completed with mmal_vc_wait_message(). Every
+  * successfully sent request must be completed that way. VideoCore handles
+  * requests in the order they are sent, so several can be issued back to back
+  * to overlap their round trips.
+  *
+  * @param client       client to send message for
+  * @param msg_header   message header to send
+  * @param size         length of message, including header
+  * @param msgid        message id
+  * @param dest         destination for reply
+  * @param destlen      size of destination
+  * @param token        set to the token to pass to mmal_vc_wait_message()
+  */
+MMAL_STATUS_T mmal_vc_send_message_async(MMAL_CLIENT_T *client,
+                                         mmal_worker_msg_header *msg_header,
+                                         size_t size,
+                                         uint32_t msgid,
+                                         void *dest,
+                                         size_t destlen,
+                                         MMAL_VC_TOKEN_T *token)
+{
+   return mmal_vc_queue_request(client, msg_header, size, msgid, dest, destlen,
+                                MMAL_FALSE, token);
+}
+
+/** Wait for the reply to a request sent with mmal_vc_send_message_async().
+  *
+  * @param client       client the message was sent with
+  * @param token        token returned when the message was sent
+  * @param destlen      if not NULL, set to the actual length of the reply
+  */
+MMAL_STATUS_T mmal_vc_wait_message(MMAL_CLIENT_T *client,
+                                   MMAL_VC_TOKEN_T token,
+                                   size_t *destlen)
+{
+   MMAL_WAITER_T *waiter = token;
+
+   vcos_assert(waiter && waiter->inuse);
+
+   /* FIXME: we could do with a timeout here. Need to be careful to cancel
     * the semaphore on a timeout.
     */
    /* coverity[lock] This semaphore isn't being used as a mutex */
    vcos_semaphore_wait(&waiter->sem);
 
    mmal_vc_release_internal(client);
-   LOG_TRACE("got reply (len %i/%i)", (int)*destlen, (int)waiter->destlen);
-   *destlen = waiter->destlen;
+   LOG_TRACE("got reply (len %i)", (int)waiter->destlen);
+   if (destlen)
+      *destlen = waiter->destlen;
 
    release_waiter(client, waiter);
    return MMAL_SUCCESS;
+}
 
-fail_msg:
-   mmal_vc_release_internal(client);
+/** Send a message and wait for a reply.
+  *
+  * @param client       client to send message for
+  * @param msg_header   message vchiq_header to send
+  * @param size         length of message, including header
+  * @param msgid        message id
+  * @param dest         destination for reply
+  * @param destlen      size of destination, updated with actual length
+  * @param send_dummy_bulk whether to send a dummy bulk transfer
+  */
+MMAL_STATUS_T mmal_vc_sendwait_message(struct MMAL_CLIENT_T *client,
+                                       mmal_worker_msg_header *msg_header,
+                                       size_t size,
+                                       uint32_t msgid,
+                                       void *dest,
+                                       size_t *destlen,
+                                       MMAL_BOOL_T send_dummy_bulk)
+{
+   MMAL_WAITER_T *waiter;
+   MMAL_STATUS_T ret;
 
-   release_waiter(client, waiter);
-   return ret;
+   ret = mmal_vc_queue_request(client, msg_header, size, msgid, dest, *destlen,
+                               send_dummy_bulk, &waiter);
+   if (ret != MMAL_SUCCESS)
+      return ret;
+
+   return mmal_vc_wait_message(client, waiter, destlen);
 }
 
 /** Send a message and do not wait for a reply.
@@ -71,6 +71,21 @@ MMAL_STATUS_T mmal_vc_sendwait_message(MMAL_CLIENT_T *client,
                                        size_t *destlen,
                                        MMAL_BOOL_T send_dummy_bulk);
 
+/** Token identifying a request sent with mmal_vc_send_message_async(). */
+typedef struct MMAL_WAITER_T *MMAL_VC_TOKEN_T;
+
+MMAL_STATUS_T mmal_vc_send_message_async(MMAL_CLIENT_T *client,
+                                         mmal_worker_msg_header *header,
+                                         size_t size,
+                                         uint32_t msgid,
+                                         void *dest,
+                                         size_t destlen,
+                                         MMAL_VC_TOKEN_T *token);
+
+MMAL_STATUS_T mmal_vc_wait_message(MMAL_CLIENT_T *client,
+                                   MMAL_VC_TOKEN_T token,
+                                   size_t *destlen);
+
 MMAL_STATUS_T mmal_vc_send_message(MMAL_CLIENT_T *client,
                                    mmal_worker_msg_header *header, size_t size,
                                    uint8_t *data, size_t data_size,
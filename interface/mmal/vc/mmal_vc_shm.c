@@ -34,7 +34,26 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 # include "user-vcsm.h"
 #endif /* ENABLE_MMAL_VCSM */
 
-#define MMAL_VC_PAYLOAD_ELEM_MAX 512
+/* Registry of the shared memory buffers allocated by mmal_vc_shm_alloc.
+ *
+ * In zero-copy mode every buffer sent to or received from VideoCore is
+ * looked up, by ARM address on the way out and by VideoCore handle on the way
+ * in, so the registry is indexed by two open-addressed hash tables. Lookups
+ * take no lock. Changes are only made by allocating and freeing buffers,
+ * which serialise on the registry mutex and publish each entry with a
+ * barrier. Removed entries leave tombstones, which are reused by later
+ * insertions. When an index gets too full the tables are rebuilt, growing as
+ * needed. Each lookup is counted in one of several reader slots, picked by
+ * thread and each on a cache line of its own, so that lookups on different
+ * threads do not contend. A replaced table is freed once a later change has
+ * seen every reader slot idle since the table was replaced.
+ * Elements are allocated in blocks and recycled, but never freed.
+ */
+#define MMAL_VC_PAYLOAD_TABLE_MIN  64   /* Minimum slots in each index, power of 2 */
+#define MMAL_VC_PAYLOAD_ELEM_BLOCK 32   /* Elements allocated at a time */
+#define MMAL_VC_PAYLOAD_READER_BITS 4   /* log2 of the reader slots, at most 5 */
+#define MMAL_VC_PAYLOAD_READERS    (1 << MMAL_VC_PAYLOAD_READER_BITS)
+#define MMAL_VC_PAYLOAD_CACHE_LINE 64
 
 typedef struct MMAL_VC_PAYLOAD_ELEM_T
 {
@@ -45,87 +64,311 @@ typedef struct MMAL_VC_PAYLOAD_ELEM_T
    MMAL_BOOL_T in_use;
 } MMAL_VC_PAYLOAD_ELEM_T;
 
+typedef MMAL_VC_PAYLOAD_ELEM_T * volatile MMAL_VC_PAYLOAD_SLOT_T;
+
+typedef struct MMAL_VC_PAYLOAD_INDEX_T
+{
+   MMAL_VC_PAYLOAD_SLOT_T *slots;
+   unsigned int used;                       /**< Slots holding an element or a tombstone */
+} MMAL_VC_PAYLOAD_INDEX_T;
+
+typedef struct MMAL_VC_PAYLOAD_TABLE_T
+{
+   struct MMAL_VC_PAYLOAD_TABLE_T *next;    /**< Next retired table */
+   uint32_t busy;                           /**< Reader slots not seen idle since retired */
+   unsigned int size;                       /**< Slots in each index, power of 2 */
+   unsigned int shift;                      /**< 32 - log2(size) */
+   MMAL_VC_PAYLOAD_INDEX_T by_mem;
+   MMAL_VC_PAYLOAD_INDEX_T by_handle;
+} MMAL_VC_PAYLOAD_TABLE_T;
+
+typedef struct MMAL_VC_PAYLOAD_READERS_T
+{
+   volatile unsigned int count;             /**< Lookups in progress */
+   uint8_t pad[MMAL_VC_PAYLOAD_CACHE_LINE - sizeof(unsigned int)];
+} MMAL_VC_PAYLOAD_READERS_T;
+
 typedef struct MMAL_VC_PAYLOAD_LIST_T
 {
-   MMAL_VC_PAYLOAD_ELEM_T list[MMAL_VC_PAYLOAD_ELEM_MAX];
+   MMAL_VC_PAYLOAD_READERS_T readers[MMAL_VC_PAYLOAD_READERS];
+   MMAL_VC_PAYLOAD_TABLE_T * volatile table;
+   MMAL_VC_PAYLOAD_TABLE_T *retired;        /**< Replaced tables not yet freed */
+   MMAL_VC_PAYLOAD_ELEM_T *free_list;
+   unsigned int live;                       /**< Elements in the table */
    VCOS_MUTEX_T lock;
+   VCOS_ONCE_T once;
 } MMAL_VC_PAYLOAD_LIST_T;
 
-static MMAL_VC_PAYLOAD_LIST_T mmal_vc_payload_list;
+static MMAL_VC_PAYLOAD_LIST_T mmal_vc_payload_list = { .once = VCOS_ONCE_INIT };
 
-static void mmal_vc_payload_list_init()
+/* Marks a slot whose element has been removed, so that probes continue */
+static MMAL_VC_PAYLOAD_ELEM_T mmal_vc_payload_tombstone;
+
+static void mmal_vc_payload_list_create_lock(void)
 {
    vcos_mutex_create(&mmal_vc_payload_list.lock, "mmal_vc_payload_list");
 }
 
+static void mmal_vc_payload_list_init()
+{
+   vcos_once(&mmal_vc_payload_list.once, mmal_vc_payload_list_create_lock);
+}
+
+/* Fibonacci hashing, using the top bits so that page-aligned addresses and
+ * small consecutive handles both spread out */
+static inline unsigned int mmal_vc_payload_hash(const void *key, unsigned int shift)
+{
+   uint64_t k = (uint64_t)(uintptr_t)key;
+   return ((uint32_t)(k ^ (k >> 32)) * 2654435769u) >> shift;
+}
+
+static void mmal_vc_payload_index_insert(MMAL_VC_PAYLOAD_TABLE_T *table,
+   MMAL_VC_PAYLOAD_INDEX_T *index, const void *key, MMAL_VC_PAYLOAD_ELEM_T *elem)
+{
+   unsigned int i = mmal_vc_payload_hash(key, table->shift);
+
+   while (index->slots[i] && index->slots[i] != &mmal_vc_payload_tombstone)
+      i = (i + 1) & (table->size - 1);
+   if (!index->slots[i])
+      index->used++;
+   index->slots[i] = elem;
+}
+
+static void mmal_vc_payload_index_remove(MMAL_VC_PAYLOAD_TABLE_T *table,
+   MMAL_VC_PAYLOAD_INDEX_T *index, const void *key, MMAL_VC_PAYLOAD_ELEM_T *elem)
+{
+   unsigned int mask = table->size - 1;
+   unsigned int i = mmal_vc_payload_hash(key, table->shift);
+
+   for (; index->slots[i]; i = (i + 1) & mask)
+   {
+      if (index->slots[i] != elem)
+         continue;
+
+      index->slots[i] = &mmal_vc_payload_tombstone;
+
+      /* Tombstones at the end of a run can go, as no entry lies beyond them */
+      if (!index->slots[(i + 1) & mask])
+      {
+         while (index->slots[i] == &mmal_vc_payload_tombstone)
+         {
+            index->slots[i] = NULL;
+            index->used--;
+            i = (i - 1) & mask;
+         }
+      }
+      return;
+   }
+}
+
+/* Reader slot of the calling thread. Threads have stacks of their own, so
+ * the stack address tells them apart without a call. */
+static inline MMAL_VC_PAYLOAD_READERS_T *mmal_vc_payload_readers(void)
+{
+   unsigned int here;
+   return &mmal_vc_payload_list.readers[mmal_vc_payload_hash(
+      (void *)((uintptr_t)&here >> 16), 32 - MMAL_VC_PAYLOAD_READER_BITS)];
+}
+
+/* Free replaced tables no lookup can still be using. A lookup counts itself
+ * before reading the table pointer, so once a reader slot has been seen idle
+ * after a table was replaced, no lookup in that slot can hold it. Called with
+ * the lock held. */
+static void mmal_vc_payload_list_reclaim(void)
+{
+   MMAL_VC_PAYLOAD_TABLE_T *table, **link = &mmal_vc_payload_list.retired;
+   uint32_t idle = 0;
+   unsigned int i;
+
+   if (!*link)
+      return;
+
+   __sync_synchronize();
+   for (i = 0; i < MMAL_VC_PAYLOAD_READERS; i++)
+   {
+      if (!mmal_vc_payload_list.readers[i].count)
+         idle |= 1u << i;
+   }
+
+   while ((table = *link) != NULL)
+   {
+      table->busy &= ~idle;
+      if (table->busy)
+      {
+         link = &table->next;
+         continue;
+      }
+      *link = table->next;
+      vcos_free(table);
+   }
+}
+
+/* Replace the table by one with room for at least four times the live
+ * elements, dropping any tombstones. Called with the lock held. */
+static MMAL_STATUS_T mmal_vc_payload_list_rebuild(void)
+{
+   MMAL_VC_PAYLOAD_TABLE_T *old = mmal_vc_payload_list.table, *table;
+   unsigned int size = MMAL_VC_PAYLOAD_TABLE_MIN, shift = 32, i;
+
+   while (size < (mmal_vc_payload_list.live + 1) * 4)
+      size <<= 1;
+   for (i = size; i > 1; i >>= 1)
+      shift--;
+
+   table = vcos_calloc(1, sizeof(*table) + 2 * size * sizeof(MMAL_VC_PAYLOAD_SLOT_T),
+                       "mmal_vc_payload_table");
+   if (!table)
+      return MMAL_ENOMEM;
+
+   table->size = size;
+   table->shift = shift;
+   table->by_mem.slots = (MMAL_VC_PAYLOAD_SLOT_T *)(table + 1);
+   table->by_handle.slots = table->by_mem.slots + size;
+
+   for (i = 0; old && i < old->size; i++)
+   {
+      MMAL_VC_PAYLOAD_ELEM_T *elem = old->by_mem.slots[i];
+      if (!elem || elem == &mmal_vc_payload_tombstone)
+         continue;
+      mmal_vc_payload_index_insert(table, &table->by_mem, elem->mem, elem);
+      mmal_vc_payload_index_insert(table, &table->by_handle, elem->vc_handle, elem);
+   }
+
+   /* Fill in the table before making it visible */
+   __sync_synchronize();
+   mmal_vc_payload_list.table = table;
+
+   if (old)
+   {
+      old->busy = (uint32_t)(((uint64_t)1 << MMAL_VC_PAYLOAD_READERS) - 1);
+      old->next = mmal_vc_payload_list.retired;
+      mmal_vc_payload_list.retired = old;
+   }
+   mmal_vc_payload_list_reclaim();
+
+   LOG_DEBUG("payload table rebuilt with %u slots for %u buffers", size,
+             mmal_vc_payload_list.live);
+   return MMAL_SUCCESS;
+}
+
 static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_get()
 {
-   MMAL_VC_PAYLOAD_ELEM_T *elem = 0;
+   MMAL_VC_PAYLOAD_ELEM_T *elem;
    unsigned int i;
 
    vcos_mutex_lock(&mmal_vc_payload_list.lock);
-   for (i = 0; i < MMAL_VC_PAYLOAD_ELEM_MAX; i++)
+   if (!mmal_vc_payload_list.free_list)
    {
-      if (mmal_vc_payload_list.list[i].in_use)
-         continue;
-      elem = &mmal_vc_payload_list.list[i];
+      MMAL_VC_PAYLOAD_ELEM_T *block = vcos_calloc(MMAL_VC_PAYLOAD_ELEM_BLOCK,
+         sizeof(*block), "mmal_vc_payload_elems");
+      for (i = 0; block && i < MMAL_VC_PAYLOAD_ELEM_BLOCK; i++)
+      {
+         block[i].next = mmal_vc_payload_list.free_list;
+         mmal_vc_payload_list.free_list = &block[i];
+      }
+   }
+   elem = mmal_vc_payload_list.free_list;
+   if (elem)
+   {
+      mmal_vc_payload_list.free_list = elem->next;
+      elem->next = NULL;
       elem->in_use = 1;
-      break;
    }
    vcos_mutex_unlock(&mmal_vc_payload_list.lock);
 
    return elem;
 }
 
-static void mmal_vc_payload_list_release(MMAL_VC_PAYLOAD_ELEM_T *elem)
+/** Make an element obtained from mmal_vc_payload_list_get, and filled in,
+ * visible to lookups */
+static inline MMAL_STATUS_T mmal_vc_payload_list_add(MMAL_VC_PAYLOAD_ELEM_T *elem)
 {
+   MMAL_VC_PAYLOAD_TABLE_T *table;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+
    vcos_mutex_lock(&mmal_vc_payload_list.lock);
-   elem->handle = elem->vc_handle = 0;
-   elem->mem = 0;
-   elem->in_use = 0;
+   table = mmal_vc_payload_list.table;
+   /* Keep at least a quarter of the slots empty so that probes are short
+    * and always terminate */
+   if (!table || (table->by_mem.used + 1) * 4 > table->size * 3 ||
+       (table->by_handle.used + 1) * 4 > table->size * 3)
+   {
+      status = mmal_vc_payload_list_rebuild();
+      table = mmal_vc_payload_list.table;
+   }
+   if (status == MMAL_SUCCESS)
+   {
+      mmal_vc_payload_list.live++;
+      __sync_synchronize();
+      mmal_vc_payload_index_insert(table, &table->by_mem, elem->mem, elem);
+      mmal_vc_payload_index_insert(table, &table->by_handle, elem->vc_handle, elem);
+   }
+   mmal_vc_payload_list_reclaim();
    vcos_mutex_unlock(&mmal_vc_payload_list.lock);
+
+   return status;
 }
 
-static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_find_mem(uint8_t *mem)
+static void mmal_vc_payload_list_release(MMAL_VC_PAYLOAD_ELEM_T *elem)
 {
-   MMAL_VC_PAYLOAD_ELEM_T *elem = 0;
-   unsigned int i;
+   MMAL_VC_PAYLOAD_TABLE_T *table;
 
    vcos_mutex_lock(&mmal_vc_payload_list.lock);
-   for (i = 0; i < MMAL_VC_PAYLOAD_ELEM_MAX; i++)
+   table = mmal_vc_payload_list.table;
+   if (table && elem->mem)
    {
-      if (!mmal_vc_payload_list.list[i].in_use)
-         continue;
-      if (mmal_vc_payload_list.list[i].mem != mem)
-         continue;
-      elem = &mmal_vc_payload_list.list[i];
-      break;
+      mmal_vc_payload_index_remove(table, &table->by_mem, elem->mem, elem);
+      mmal_vc_payload_index_remove(table, &table->by_handle, elem->vc_handle, elem);
+      mmal_vc_payload_list.live--;
    }
+   elem->handle = elem->vc_handle = 0;
+   elem->mem = 0;
+   elem->in_use = 0;
+   elem->next = mmal_vc_payload_list.free_list;
+   mmal_vc_payload_list.free_list = elem;
+   mmal_vc_payload_list_reclaim();
    vcos_mutex_unlock(&mmal_vc_payload_list.lock);
-
-   return elem;
 }
 
-static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_find_handle(uint8_t *mem)
+static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_find(const void *key, MMAL_BOOL_T by_handle)
 {
-   MMAL_VC_PAYLOAD_ELEM_T *elem = 0;
+   MMAL_VC_PAYLOAD_READERS_T *readers = mmal_vc_payload_readers();
+   MMAL_VC_PAYLOAD_TABLE_T *table;
+   MMAL_VC_PAYLOAD_ELEM_T *elem = NULL;
    unsigned int i;
 
-   vcos_mutex_lock(&mmal_vc_payload_list.lock);
-   for (i = 0; i < MMAL_VC_PAYLOAD_ELEM_MAX; i++)
+   /* Announce the lookup before reading the table pointer, so that the table
+    * cannot be freed under our feet */
+   __sync_fetch_and_add(&readers->count, 1);
+
+   table = mmal_vc_payload_list.table;
+   if (table)
    {
-      if (!mmal_vc_payload_list.list[i].in_use)
-         continue;
-      if (mmal_vc_payload_list.list[i].vc_handle != (void *)mem)
-         continue;
-      elem = &mmal_vc_payload_list.list[i];
-      break;
+      MMAL_VC_PAYLOAD_SLOT_T *slots = by_handle ? table->by_handle.slots : table->by_mem.slots;
+      for (i = mmal_vc_payload_hash(key, table->shift); (elem = slots[i]) != NULL;
+           i = (i + 1) & (table->size - 1))
+      {
+         if (elem != &mmal_vc_payload_tombstone &&
+             (by_handle ? elem->vc_handle : (void *)elem->mem) == key)
+            break;
+      }
    }
-   vcos_mutex_unlock(&mmal_vc_payload_list.lock);
+
+   __sync_fetch_and_sub(&readers->count, 1);
 
    return elem;
 }
 
+static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_find_mem(uint8_t *mem)
+{
+   return mmal_vc_payload_list_find(mem, MMAL_FALSE);
+}
+
+static MMAL_VC_PAYLOAD_ELEM_T *mmal_vc_payload_list_find_handle(uint8_t *mem)
+{
+   return mmal_vc_payload_list_find(mem, MMAL_TRUE);
+}
+
 /** Initialise the shared memory system */
 MMAL_STATUS_T mmal_vc_shm_init(void)
 {
@@ -178,6 +421,14 @@ uint8_t *mmal_vc_shm_alloc(uint32_t size)
    payload_elem->mem = mem;
    payload_elem->handle = (void *)vcsm_handle;
    payload_elem->vc_handle = (void *)vc_handle;
+   if (mmal_vc_payload_list_add(payload_elem) != MMAL_SUCCESS)
+   {
+      LOG_ERROR("could not add buffer %p to the payload list", mem);
+      payload_elem->mem = 0;
+      mmal_vc_payload_list_release(payload_elem);
+      vcsm_free(vcsm_handle);
+      return NULL;
+   }
 #else /* ENABLE_MMAL_VCSM */
    MMAL_PARAM_UNUSED(size);
    mmal_vc_payload_list_release(payload_elem);
@@ -0,0 +1,239 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Stress benchmark for the zero-copy payload registry of mmal_vc_shm.
+ *
+ * Several "port" threads each cycle a set of buffers through
+ * mmal_vc_shm_unlock() and mmal_vc_shm_lock(), as mmal_vc_client does for
+ * every buffer sent to and returned from VideoCore, while another thread
+ * keeps registering and releasing buffers as if ports were being enabled and
+ * disabled. No VideoCore is needed: the registry is compiled in here and
+ * filled with fake VideoCore handles.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Only the registry is exercised, so leave out the VCSM calls */
+#undef ENABLE_MMAL_VCSM
+#include "mmal_vc_shm.c"
+
+#define BENCH_MAX_PORTS 64
+#define BENCH_CHURN_BATCH 32
+
+typedef struct
+{
+   VCOS_THREAD_T thread;
+   unsigned int index;
+   unsigned int num_buffers;
+   uint8_t **mem;
+   void **vc_handle;
+   unsigned int iters;
+   unsigned int errors;
+} BENCH_PORT_T;
+
+static unsigned int next_vc_handle = 1;
+static volatile int churn_stop;
+static unsigned int churn_cycles;
+
+static MMAL_VC_PAYLOAD_ELEM_T *bench_register(uint8_t *mem)
+{
+   MMAL_VC_PAYLOAD_ELEM_T *elem = mmal_vc_payload_list_get();
+
+   if (!elem)
+      return NULL;
+
+   elem->mem = mem;
+   elem->handle = (void *)(uintptr_t)next_vc_handle;
+   elem->vc_handle = (void *)(uintptr_t)__sync_fetch_and_add(&next_vc_handle, 1);
+   if (mmal_vc_payload_list_add(elem) != MMAL_SUCCESS)
+   {
+      elem->mem = 0;
+      mmal_vc_payload_list_release(elem);
+      return NULL;
+   }
+
+   return elem;
+}
+
+static void *bench_port(void *arg)
+{
+   BENCH_PORT_T *port = (BENCH_PORT_T *)arg;
+   unsigned int i, j;
+
+   for (i = 0; i < port->iters; i++)
+   {
+      for (j = 0; j < port->num_buffers; j++)
+      {
+         uint32_t length = 1;
+         uint8_t *vc = mmal_vc_shm_unlock(port->mem[j], &length, 0);
+         if (vc != port->vc_handle[j] || length != 0)
+            port->errors++;
+         if (mmal_vc_shm_lock(vc, 0) != port->mem[j])
+            port->errors++;
+      }
+   }
+
+   return NULL;
+}
+
+static void *bench_churn(void *arg)
+{
+   MMAL_VC_PAYLOAD_ELEM_T *elems[BENCH_CHURN_BATCH];
+   static uint8_t mem[BENCH_CHURN_BATCH][64];
+   unsigned int i;
+   MMAL_PARAM_UNUSED(arg);
+
+   while (!churn_stop)
+   {
+      for (i = 0; i < BENCH_CHURN_BATCH; i++)
+         elems[i] = bench_register(mem[i]);
+      for (i = 0; i < BENCH_CHURN_BATCH; i++)
+         if (elems[i])
+            mmal_vc_payload_list_release(elems[i]);
+      churn_cycles++;
+   }
+
+   return NULL;
+}
+
+static void usage(void)
+{
+   printf("Usage: mmal_vc_shm_bench [-p <ports>] [-b <buffers>] [-i <iters>] [-n]\n");
+   printf("    -p <n>      number of port threads (default 4)\n");
+   printf("    -b <n>      buffers in flight per port (default 64)\n");
+   printf("    -i <n>      passes over the buffers per port (default 10000)\n");
+   printf("    -n          no concurrent registration and release\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   BENCH_PORT_T ports[BENCH_MAX_PORTS];
+   unsigned int num_ports = 4, num_buffers = 64, iters = 10000;
+   unsigned int i, j, errors = 0;
+   int churn = 1, argn;
+   VCOS_THREAD_T churn_thread;
+   VCOS_THREAD_ATTR_T attrs;
+   uint32_t start, elapsed;
+   double lookups;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-p") && argn + 1 < argc)
+         num_ports = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         num_buffers = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-i") && argn + 1 < argc)
+         iters = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-n"))
+         churn = 0;
+      else
+         usage();
+   }
+
+   if (!num_ports || num_ports > BENCH_MAX_PORTS || !num_buffers)
+      usage();
+
+   vcos_init();
+   if (mmal_vc_shm_init() != MMAL_SUCCESS)
+      return 1;
+
+   /* Register every buffer up front, interleaving the ports as buffer
+    * allocation for several components would */
+   memset(ports, 0, sizeof(ports));
+   for (i = 0; i < num_ports; i++)
+   {
+      ports[i].index = i;
+      ports[i].num_buffers = num_buffers;
+      ports[i].iters = iters;
+      ports[i].mem = calloc(num_buffers, sizeof(ports[i].mem[0]));
+      ports[i].vc_handle = calloc(num_buffers, sizeof(ports[i].vc_handle[0]));
+      if (!ports[i].mem || !ports[i].vc_handle)
+         return 1;
+   }
+   for (j = 0; j < num_buffers; j++)
+   {
+      for (i = 0; i < num_ports; i++)
+      {
+         MMAL_VC_PAYLOAD_ELEM_T *elem;
+         ports[i].mem[j] = malloc(4096);
+         elem = ports[i].mem[j] ? bench_register(ports[i].mem[j]) : NULL;
+         if (!elem)
+         {
+            printf("failed to register buffer %u of port %u\n", j, i);
+            return 1;
+         }
+         ports[i].vc_handle[j] = elem->vc_handle;
+      }
+   }
+
+   printf("%u ports, %u buffers in flight, table of %u slots\n", num_ports,
+          num_ports * num_buffers, mmal_vc_payload_list.table->size);
+
+   vcos_thread_attr_init(&attrs);
+   if (churn && vcos_thread_create(&churn_thread, "churn", &attrs, bench_churn, NULL) != VCOS_SUCCESS)
+      return 1;
+
+   start = vcos_getmicrosecs();
+   for (i = 0; i < num_ports; i++)
+   {
+      if (vcos_thread_create(&ports[i].thread, "port", &attrs, bench_port, &ports[i]) != VCOS_SUCCESS)
+         return 1;
+   }
+   for (i = 0; i < num_ports; i++)
+   {
+      vcos_thread_join(&ports[i].thread, NULL);
+      errors += ports[i].errors;
+   }
+   elapsed = vcos_getmicrosecs() - start;
+
+   if (churn)
+   {
+      churn_stop = 1;
+      vcos_thread_join(&churn_thread, NULL);
+   }
+
+   lookups = 2.0 * num_ports * num_buffers * iters;
+   printf("%.0f lookups in %u us: %.1f ns per lookup, %u errors\n", lookups,
+          elapsed, elapsed * 1000.0 / lookups, errors);
+   if (churn)
+      printf("%u registration cycles of %u buffers, table of %u slots\n",
+             churn_cycles, BENCH_CHURN_BATCH, mmal_vc_payload_list.table->size);
+
+   for (i = 0; i < num_ports; i++)
+   {
+      for (j = 0; j < num_buffers; j++)
+         free(ports[i].mem[j]);
+      free(ports[i].mem);
+      free(ports[i].vc_handle);
+   }
+
+   return errors ? 1 : 0;
+}
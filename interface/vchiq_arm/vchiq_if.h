@@ -126,6 +126,50 @@ typedef struct vchiq_config_struct {
    short version_min;  /* The minimum compatible version of VCHIQ */
 } VCHIQ_CONFIG_T;
 
+/* Completions per AWAIT_COMPLETION call, bucketed by powers of two:
+ * bucket n counts batches of 2^n to 2^(n+1)-1 completions. */
+#define VCHIQ_COMPLETION_HISTOGRAM_BUCKETS 8
+
+typedef struct vchiq_completion_stats_struct {
+   unsigned int batches;         /* AWAIT_COMPLETION calls returning data */
+   unsigned int completions;     /* Completions delivered */
+   unsigned int full_batches;    /* Batches which filled the array */
+   unsigned int grows;           /* Times the batch size was increased */
+   unsigned int shrinks;         /* Times the batch size was decreased */
+   unsigned int batch_size;      /* Current batch size */
+   unsigned int msgbufs_allocated; /* Message buffers obtained from malloc */
+   unsigned int msgbufs_recycled;  /* Message buffers reused from the freelist */
+   unsigned int histogram[VCHIQ_COMPLETION_HISTOGRAM_BUCKETS];
+} VCHIQ_COMPLETION_STATS_T;
+
+/* Thread on which a service's callbacks are delivered. */
+typedef enum {
+   VCHIQ_DISPATCH_COMPLETION_THREAD, /* Directly on the completion thread */
+   VCHIQ_DISPATCH_DEDICATED,         /* On a thread of the service's own */
+   VCHIQ_DISPATCH_POOLED             /* On a thread shared with other services */
+} VCHIQ_DISPATCH_MODE_T;
+
+typedef struct vchiq_dispatch_params_struct {
+   VCHIQ_DISPATCH_MODE_T mode;
+   unsigned int queue_depth;     /* Callbacks held before the completion thread
+                                    waits; rounded up to a power of 2, 0 for
+                                    the default */
+} VCHIQ_DISPATCH_PARAMS_T;
+
+/* Delay between a completion being received from the driver and its callback
+ * starting, bucketed by powers of two: bucket n counts delays of 2^(n-1) to
+ * 2^n-1 microseconds, the last bucket collecting everything longer. */
+#define VCHIQ_DISPATCH_HISTOGRAM_BUCKETS 16
+
+typedef struct vchiq_dispatch_stats_struct {
+   unsigned int callbacks;       /* Callbacks delivered */
+   unsigned int queue_full;      /* Times the completion thread had to wait */
+   unsigned int max_queued;      /* Deepest the handoff queue has been */
+   unsigned int max_delay;       /* Longest queueing delay (us) */
+   uint64_t total_delay;         /* Sum of all queueing delays (us) */
+   unsigned int histogram[VCHIQ_DISPATCH_HISTOGRAM_BUCKETS];
+} VCHIQ_DISPATCH_STATS_T;
+
 typedef struct vchiq_instance_struct *VCHIQ_INSTANCE_T;
 typedef void (*VCHIQ_REMOTE_USE_CALLBACK_T)(void* cb_arg);
 
@@ -139,6 +183,10 @@ extern VCHIQ_STATUS_T vchiq_add_service(VCHIQ_INSTANCE_T instance,
 extern VCHIQ_STATUS_T vchiq_open_service(VCHIQ_INSTANCE_T instance,
    const VCHIQ_SERVICE_PARAMS_T *params,
    VCHIQ_SERVICE_HANDLE_T *pservice);
+extern VCHIQ_STATUS_T vchiq_open_service_dispatch(VCHIQ_INSTANCE_T instance,
+   const VCHIQ_SERVICE_PARAMS_T *params,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch,
+   VCHIQ_SERVICE_HANDLE_T *pservice);
 extern VCHIQ_STATUS_T vchiq_close_service(VCHIQ_SERVICE_HANDLE_T service);
 extern VCHIQ_STATUS_T vchiq_remove_service(VCHIQ_SERVICE_HANDLE_T service);
 extern VCHIQ_STATUS_T vchiq_use_service(VCHIQ_SERVICE_HANDLE_T service);
@@ -186,4 +234,9 @@ extern VCHIQ_STATUS_T vchiq_dump_phys_mem(VCHIQ_SERVICE_HANDLE_T service,
 extern VCHIQ_STATUS_T vchiq_get_peer_version(VCHIQ_SERVICE_HANDLE_T handle,
       short *peer_version);
 
+extern VCHIQ_STATUS_T vchiq_get_completion_stats(VCHIQ_INSTANCE_T instance,
+   VCHIQ_COMPLETION_STATS_T *stats, int reset);
+extern VCHIQ_STATUS_T vchiq_get_dispatch_stats(VCHIQ_SERVICE_HANDLE_T service,
+   VCHIQ_DISPATCH_STATS_T *stats, int reset);
+
 #endif /* VCHIQ_IF_H */
@@ -33,6 +33,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "vchiq.h"
 #include "vchiq_cfg.h"
 #include "vchiq_ioctl.h"
+#include "vchiq_loopback.h"
 #include "interface/vchi/vchi.h"
 #include "interface/vchi/common/endian.h"
 #include "interface/vcos/vcos.h"
@@ -41,10 +42,41 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define VCHIQ_MAX_INSTANCE_SERVICES 32
 #define MSGBUF_SIZE (VCHIQ_MAX_MSG_SIZE + sizeof(VCHIQ_HEADER_T))
 
+/* Limits on the number of completions requested per AWAIT_COMPLETION. The
+ * batch doubles whenever it is filled, and halves after SHRINK_BATCHES
+ * consecutive batches that are no more than a quarter full. */
+#define VCHIQ_MIN_COMPLETIONS 8
+#define VCHIQ_MAX_COMPLETIONS 128
+#define VCHIQ_SHRINK_BATCHES  32
+
+/* Callback dispatch threads - see vchiq_open_service_dispatch */
+#define VCHIQ_DISPATCH_DEFAULT_DEPTH 64
+#define VCHIQ_DISPATCH_MAX_DEPTH     1024
+#define VCHIQ_DISPATCH_POOL_THREADS  2
+/* Callbacks delivered for one service before a dispatcher moves on */
+#define VCHIQ_DISPATCH_BURST         16
+
 #define RETRY(r,x) do { r = x; } while ((r == -1) && (errno == EINTR))
 
+/* All driver requests go through the selected backend */
+#define VCHIQ_IOCTL(fd, request, arg) \
+   vchiq_backend->ioctl(fd, request, (void *)(uintptr_t)(arg))
+
 #define VCOS_LOG_CATEGORY (&vchiq_lib_log_category)
 
+typedef struct vchiq_dispatcher_struct VCHIQ_DISPATCHER_T;
+
+/* A completion handed from the completion thread to a dispatcher */
+typedef struct vchiq_dispatch_item_struct
+{
+   VCHIQ_REASON_T reason;
+   VCHIQ_HEADER_T *header;
+   void *bulk_userdata;
+   uint32_t received;         /* vcos_getmicrosecs() when the batch arrived */
+   int close_delivered;       /* CLOSE_DELIVERED has already been sent */
+   struct vchiq_dispatch_item_struct *next; /* Overflow list link */
+} VCHIQ_DISPATCH_ITEM_T;
+
 typedef struct vchiq_service_struct
 {
    VCHIQ_SERVICE_BASE_T base;
@@ -56,8 +88,43 @@ typedef struct vchiq_service_struct
    int peek_size;
    int client_id;
    char is_client;
+
+   /* Handoff queue, used when callbacks are made by a dispatcher. The
+    * completion thread is the only producer, and a service is on at most one
+    * run queue at a time, so there is only ever one consumer. */
+   VCHIQ_DISPATCHER_T *dispatcher;
+   VCHIQ_DISPATCH_ITEM_T *dispatch_items;
+   unsigned int dispatch_depth;
+   unsigned int dispatch_read;
+   unsigned int dispatch_write;
+   VCOS_EVENT_T dispatch_pop;          /* Signalled as entries are consumed */
+   VCOS_SEMAPHORE_T dispatch_drained;  /* Posted when a waited-for detach can proceed */
+   VCHIQ_DISPATCH_ITEM_T *dispatch_overflow; /* Beyond the queue, while closing */
+   VCHIQ_DISPATCH_ITEM_T *dispatch_overflow_tail;
+   volatile int dispatch_scheduled;    /* On a run queue or being delivered */
+   int dispatch_waiting;               /* A detach is waiting on dispatch_drained */
+   int dispatch_detached;              /* Detached by its own callback */
+   volatile int dispatch_closing;      /* Being closed by its own callback */
+   VCOS_THREAD_T *dispatch_thread;     /* Thread currently delivering callbacks */
+   struct vchiq_service_struct *dispatch_next;
+   VCHIQ_DISPATCH_STATS_T dispatch_stats;
 } VCHIQ_SERVICE_T;
 
+struct vchiq_dispatcher_struct
+{
+   VCHIQ_INSTANCE_T instance;
+   VCOS_MUTEX_T lock;
+   VCOS_SEMAPHORE_T work;     /* Posted for each service added to the run queue */
+   VCHIQ_SERVICE_T *run_head;
+   VCHIQ_SERVICE_T *run_tail;
+   int pooled;
+   int users;
+   int stopping;
+   int num_threads;
+   VCOS_THREAD_T threads[VCHIQ_DISPATCH_POOL_THREADS];
+   VCHIQ_DISPATCHER_T *next;
+};
+
 typedef struct vchiq_service_struct VCHI_SERVICE_T;
 
 struct vchiq_instance_struct
@@ -70,6 +137,8 @@ struct vchiq_instance_struct
    VCOS_MUTEX_T mutex;
    int used_services;
    VCHIQ_SERVICE_T services[VCHIQ_MAX_INSTANCE_SERVICES];
+   VCHIQ_COMPLETION_STATS_T completion_stats;
+   VCHIQ_DISPATCHER_T *dispatchers;
 } vchiq_instance;
 
 typedef struct vchiq_instance_struct VCHI_STATE_T;
@@ -77,10 +146,23 @@ typedef struct vchiq_instance_struct VCHI_STATE_T;
 /* Local data */
 static VCOS_LOG_LEVEL_T vchiq_default_lib_log_level = VCOS_LOG_WARN;
 static VCOS_LOG_CAT_T vchiq_lib_log_category;
-static VCOS_MUTEX_T vchiq_lib_mutex;
-static void *free_msgbufs;
+static void * volatile free_msgbufs;
 static unsigned int handle_seq;
 
+static int vchiq_device_open(void);
+static int vchiq_device_close(int fd);
+static int vchiq_device_ioctl(int fd, unsigned int request, void *arg);
+
+static const VCHIQ_LIB_BACKEND_T vchiq_device_backend =
+{
+   "device",
+   vchiq_device_open,
+   vchiq_device_close,
+   vchiq_device_ioctl
+};
+
+static const VCHIQ_LIB_BACKEND_T *vchiq_backend = &vchiq_device_backend;
+
 vcos_static_assert(IS_POWER_2(VCHIQ_MAX_INSTANCE_SERVICES));
 
 /* Local utility functions */
@@ -94,8 +176,38 @@ create_service(VCHIQ_INSTANCE_T instance,
    const VCHIQ_SERVICE_PARAMS_T *params,
    VCHI_CALLBACK_T vchi_callback,
    int is_open,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch,
    VCHIQ_SERVICE_HANDLE_T *phandle);
 
+static void
+deliver_callback(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   VCHIQ_REASON_T reason,
+   VCHIQ_HEADER_T *header,
+   void *bulk_userdata,
+   uint32_t received,
+   int close_delivered);
+
+static VCHIQ_STATUS_T
+dispatch_attach(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch);
+
+static void
+dispatch_detach(VCHIQ_SERVICE_T *service);
+
+static void
+dispatch_handoff(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   const VCHIQ_COMPLETION_DATA_T *completion,
+   uint32_t received);
+
+static void
+dispatchers_stop(VCHIQ_INSTANCE_T instance);
+
+static void
+dispatch_mark_closing(VCHIQ_SERVICE_T *service);
+
 static int
 fill_peek_buf(VCHI_SERVICE_T *service,
    VCHI_FLAGS_T flags);
@@ -103,9 +215,15 @@ fill_peek_buf(VCHI_SERVICE_T *service,
 static void *
 alloc_msgbuf(void);
 
+static void *
+alloc_msgbuf_cached(VCHIQ_INSTANCE_T instance, void **cache);
+
 static void
 free_msgbuf(void *buf);
 
+static void
+free_msgbuf_list(void *list);
+
 static __inline int
 is_valid_instance(VCHIQ_INSTANCE_T instance)
 {
@@ -181,13 +299,15 @@ vchiq_shutdown(VCHIQ_INSTANCE_T instance)
       if (instance->connected)
       {
          int ret;
-         RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_SHUTDOWN, 0));
+         RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_SHUTDOWN, 0));
          vcos_assert(ret == 0);
          vcos_thread_join(&instance->completion_thread, NULL);
          instance->connected = 0;
       }
 
-      close(instance->fd);
+      dispatchers_stop(instance);
+
+      vchiq_backend->close(instance->fd);
       instance->fd = -1;
    }
    else if (instance->initialised > 1)
@@ -229,7 +349,7 @@ vchiq_connect(VCHIQ_INSTANCE_T instance)
    if (instance->connected)
       goto out;
 
-   ret = ioctl(instance->fd, VCHIQ_IOC_CONNECT, 0);
+   ret = VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_CONNECT, 0);
    if (ret != 0)
    {
       status = VCHIQ_ERROR;
@@ -276,6 +396,7 @@ vchiq_add_service(VCHIQ_INSTANCE_T instance,
       params,
       NULL/*vchi_callback*/,
       0/*!open*/,
+      NULL/*dispatch*/,
       phandle);
 
    vcos_log_trace( "%s returning service handle = 0x%08x", __func__, (uint32_t)*phandle );
@@ -308,6 +429,51 @@ vchiq_open_service(VCHIQ_INSTANCE_T instance,
       params,
       NULL/*vchi_callback*/,
       1/*open*/,
+      NULL/*dispatch*/,
+      phandle);
+
+   vcos_log_trace( "%s returning service handle = 0x%08x", __func__, (uint32_t)*phandle );
+
+   return status;
+}
+
+VCHIQ_STATUS_T
+vchiq_open_service_dispatch(VCHIQ_INSTANCE_T instance,
+   const VCHIQ_SERVICE_PARAMS_T *params,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch,
+   VCHIQ_SERVICE_HANDLE_T *phandle)
+{
+   VCHIQ_STATUS_T status;
+
+   vcos_log_trace( "%s called fourcc = 0x%08x (%c%c%c%c) mode %d",
+                   __func__,
+                   params->fourcc,
+                   (params->fourcc >> 24) & 0xff,
+                   (params->fourcc >> 16) & 0xff,
+                   (params->fourcc >>  8) & 0xff,
+                   (params->fourcc      ) & 0xff,
+                   dispatch ? (int)dispatch->mode : -1 );
+
+   if (!params->callback)
+      return VCHIQ_ERROR;
+
+   if (!is_valid_instance(instance))
+      return VCHIQ_ERROR;
+
+   if (dispatch &&
+       (dispatch->mode != VCHIQ_DISPATCH_COMPLETION_THREAD) &&
+       (dispatch->mode != VCHIQ_DISPATCH_DEDICATED) &&
+       (dispatch->mode != VCHIQ_DISPATCH_POOLED))
+      return VCHIQ_ERROR;
+
+   if (dispatch && (dispatch->mode == VCHIQ_DISPATCH_COMPLETION_THREAD))
+      dispatch = NULL;
+
+   status = create_service(instance,
+      params,
+      NULL/*vchi_callback*/,
+      1/*open*/,
+      dispatch,
       phandle);
 
    vcos_log_trace( "%s returning service handle = 0x%08x", __func__, (uint32_t)*phandle );
@@ -326,10 +492,15 @@ vchiq_close_service(VCHIQ_SERVICE_HANDLE_T handle)
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_CLOSE_SERVICE, service->handle));
+   dispatch_mark_closing(service);
+
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_CLOSE_SERVICE, service->handle));
 
    if (service->is_client)
+   {
       service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
+      dispatch_detach(service);
+   }
 
    if (ret != 0)
       return VCHIQ_ERROR;
@@ -348,9 +519,12 @@ vchiq_remove_service(VCHIQ_SERVICE_HANDLE_T handle)
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_REMOVE_SERVICE, service->handle));
+   dispatch_mark_closing(service);
+
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_REMOVE_SERVICE, service->handle));
 
    service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
+   dispatch_detach(service);
 
    if (ret != 0)
       return VCHIQ_ERROR;
@@ -375,7 +549,7 @@ vchiq_queue_message(VCHIQ_SERVICE_HANDLE_T handle,
    args.handle = service->handle;
    args.elements = elements;
    args.count = count;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -409,7 +583,7 @@ vchiq_queue_bulk_transmit(VCHIQ_SERVICE_HANDLE_T handle,
    args.size = size;
    args.userdata = userdata;
    args.mode = VCHIQ_BULK_MODE_CALLBACK;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -434,7 +608,7 @@ vchiq_queue_bulk_receive(VCHIQ_SERVICE_HANDLE_T handle,
    args.size = size;
    args.userdata = userdata;
    args.mode = VCHIQ_BULK_MODE_CALLBACK;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -488,7 +662,7 @@ vchiq_bulk_transmit(VCHIQ_SERVICE_HANDLE_T handle,
    args.size = size;
    args.userdata = userdata;
    args.mode = mode;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -541,7 +715,7 @@ vchiq_bulk_receive_handle(VCHIQ_SERVICE_HANDLE_T handle,
    args.size = size;
    args.userdata = userdata;
    args.mode = mode;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -554,7 +728,7 @@ vchiq_get_client_id(VCHIQ_SERVICE_HANDLE_T handle)
    if (!service)
       return VCHIQ_ERROR;
 
-   return ioctl(service->fd, VCHIQ_IOC_GET_CLIENT_ID, service->handle);
+   return VCHIQ_IOCTL(service->fd, VCHIQ_IOC_GET_CLIENT_ID, service->handle);
 }
 
 void *
@@ -587,7 +761,7 @@ vchiq_get_config(VCHIQ_INSTANCE_T instance,
    args.config_size = config_size;
    args.pconfig = pconfig;
 
-   RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_GET_CONFIG, &args));
+   RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_GET_CONFIG, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -601,7 +775,7 @@ vchiq_use_service( const VCHIQ_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_USE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_USE_SERVICE, service->handle));
    return ret;
 }
 
@@ -614,10 +788,52 @@ vchiq_release_service( const VCHIQ_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_RELEASE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_RELEASE_SERVICE, service->handle));
    return ret;
 }
 
+VCHIQ_STATUS_T
+vchiq_get_completion_stats(VCHIQ_INSTANCE_T instance,
+   VCHIQ_COMPLETION_STATS_T *stats, int reset)
+{
+   unsigned int batch_size;
+
+   if (!is_valid_instance(instance) || !stats)
+      return VCHIQ_ERROR;
+
+   /* The counters are only written by the completion thread, so a snapshot
+    * taken during a batch may be slightly inconsistent but never corrupt */
+   *stats = instance->completion_stats;
+
+   if (reset)
+   {
+      batch_size = instance->completion_stats.batch_size;
+      memset(&instance->completion_stats, 0, sizeof(instance->completion_stats));
+      instance->completion_stats.batch_size = batch_size;
+   }
+
+   return VCHIQ_SUCCESS;
+}
+
+VCHIQ_STATUS_T
+vchiq_get_dispatch_stats(VCHIQ_SERVICE_HANDLE_T handle,
+   VCHIQ_DISPATCH_STATS_T *stats, int reset)
+{
+   VCHIQ_SERVICE_T *service = find_service_by_handle(handle);
+
+   if (!service || !stats)
+      return VCHIQ_ERROR;
+
+   /* As with the completion statistics, the counters are updated without a
+    * lock by the thread delivering the callbacks */
+   *stats = service->dispatch_stats;
+
+   if (reset)
+      memset(&service->dispatch_stats, 0, sizeof(service->dispatch_stats));
+
+   return VCHIQ_SUCCESS;
+}
+
 VCHIQ_STATUS_T
 vchiq_set_service_option(VCHIQ_SERVICE_HANDLE_T handle,
    VCHIQ_SERVICE_OPTION_T option, int value)
@@ -633,7 +849,7 @@ vchiq_set_service_option(VCHIQ_SERVICE_HANDLE_T handle,
    args.option = option;
    args.value  = value;
 
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_SET_SERVICE_OPTION, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_SET_SERVICE_OPTION, &args));
 
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
@@ -769,7 +985,7 @@ vchi_msg_queue( VCHI_SERVICE_HANDLE_T handle,
    args.handle = service->handle;
    args.elements = &element;
    args.count = 1;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
 
    return ret;
 }
@@ -822,7 +1038,7 @@ vchi_bulk_queue_receive( VCHI_SERVICE_HANDLE_T handle,
    args.data = data_dst;
    args.size = data_size;
    args.userdata = bulk_handle;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_RECEIVE, &args));
 
    return ret;
 }
@@ -876,7 +1092,7 @@ vchi_bulk_queue_transmit( VCHI_SERVICE_HANDLE_T handle,
    args.data = (void *)data_src;
    args.size = data_size;
    args.userdata = bulk_handle;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_BULK_TRANSMIT, &args));
 
    return ret;
 }
@@ -933,7 +1149,7 @@ vchi_msg_dequeue( VCHI_SERVICE_HANDLE_T handle,
       args.blocking = (flags == VCHI_FLAGS_BLOCK_UNTIL_OP_COMPLETE);
       args.bufsize = max_data_size_to_read;
       args.buf = data;
-      RETRY(ret, ioctl(service->fd, VCHIQ_IOC_DEQUEUE_MESSAGE, &args));
+      RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_DEQUEUE_MESSAGE, &args));
       if (ret >= 0)
       {
          *actual_msg_size = ret;
@@ -987,7 +1203,7 @@ vchi_msg_queuev( VCHI_SERVICE_HANDLE_T handle,
    args.handle = service->handle;
    args.elements = (const VCHIQ_ELEMENT_T *)vector;
    args.count = count;
-   RETRY(ret, ioctl(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
+   RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_QUEUE_MESSAGE, &args));
 
    return ret;
 }
@@ -1172,6 +1388,7 @@ vchi_service_open( VCHI_INSTANCE_T instance_handle,
       &params,
       setup->callback,
       1/*open*/,
+      NULL/*dispatch*/,
       (VCHIQ_SERVICE_HANDLE_T *)handle);
 
    return (status == VCHIQ_SUCCESS) ? 0 : -1;
@@ -1194,6 +1411,7 @@ vchi_service_create( VCHI_INSTANCE_T instance_handle,
       &params,
       setup->callback,
       0/*!open*/,
+      NULL/*dispatch*/,
       (VCHIQ_SERVICE_HANDLE_T *)handle);
 
    return (status == VCHIQ_SUCCESS) ? 0 : -1;
@@ -1208,7 +1426,7 @@ vchi_service_close( const VCHI_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_CLOSE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_CLOSE_SERVICE, service->handle));
 
    if (service->is_client)
       service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
@@ -1225,7 +1443,7 @@ vchi_service_destroy( const VCHI_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_REMOVE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_REMOVE_SERVICE, service->handle));
 
    service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
 
@@ -1299,7 +1517,7 @@ vchi_service_use( const VCHI_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_USE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_USE_SERVICE, service->handle));
    return ret;
 }
 
@@ -1321,7 +1539,7 @@ int32_t vchi_service_release( const VCHI_SERVICE_HANDLE_T handle )
    if (!service)
       return VCHIQ_ERROR;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_RELEASE_SERVICE, service->handle));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_RELEASE_SERVICE, service->handle));
    return ret;
 }
 
@@ -1352,7 +1570,7 @@ VCHIQ_STATUS_T vchiq_dump_phys_mem( VCHIQ_SERVICE_HANDLE_T handle,
    dump_mem.virt_addr = ptr;
    dump_mem.num_bytes = num_bytes;
 
-   RETRY(ret,ioctl(service->fd, VCHIQ_IOC_DUMP_PHYS_MEM, &dump_mem));
+   RETRY(ret,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_DUMP_PHYS_MEM, &dump_mem));
    return (ret >= 0) ? VCHIQ_SUCCESS : VCHIQ_ERROR;
 }
 
@@ -1385,7 +1603,11 @@ vchiq_lib_init(void)
 
    if (instance->initialised == 0)
    {
-      instance->fd = open("/dev/vchiq", O_RDWR);
+      vchiq_backend = vchiq_loopback_enabled() ?
+         &vchiq_loopback_backend : &vchiq_device_backend;
+      vcos_log_info("%s: using %s backend", __func__, vchiq_backend->name);
+
+      instance->fd = vchiq_backend->open();
       if (instance->fd >= 0)
       {
          VCHIQ_GET_CONFIG_T args;
@@ -1393,16 +1615,18 @@ vchiq_lib_init(void)
          int ret;
          args.config_size = sizeof(config);
          args.pconfig = &config;
-         RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_GET_CONFIG, &args));
+         RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_GET_CONFIG, &args));
          if ((ret == 0) && (config.version >= VCHIQ_VERSION_MIN) && (config.version_min <= VCHIQ_VERSION))
          {
             if (config.version >= VCHIQ_VERSION_LIB_VERSION)
             {
-               RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_LIB_VERSION, VCHIQ_VERSION));
+               RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_LIB_VERSION, VCHIQ_VERSION));
             }
             if (ret == 0)
             {
                instance->used_services = 0;
+               memset(&instance->completion_stats, 0, sizeof(instance->completion_stats));
+               instance->dispatchers = NULL;
                instance->use_close_delivered = (config.version >= VCHIQ_VERSION_CLOSE_DELIVERED);
                vcos_mutex_create(&instance->mutex, "VCHIQ instance");
                instance->initialised = 1;
@@ -1419,7 +1643,7 @@ vchiq_lib_init(void)
             {
                vcos_log_error("Very incompatible VCHIQ library - cannot retrieve driver version");
             }
-            close(instance->fd);
+            vchiq_backend->close(instance->fd);
             instance = NULL;
          }
       }
@@ -1442,34 +1666,30 @@ static void *
 completion_thread(void *arg)
 {
    VCHIQ_INSTANCE_T instance = (VCHIQ_INSTANCE_T)arg;
+   VCHIQ_COMPLETION_STATS_T *stats = &instance->completion_stats;
    VCHIQ_AWAIT_COMPLETION_T args;
-   VCHIQ_COMPLETION_DATA_T completions[8];
-   void *msgbufs[8];
+   VCHIQ_COMPLETION_DATA_T completions[VCHIQ_MAX_COMPLETIONS];
+   void *msgbufs[VCHIQ_MAX_COMPLETIONS];
+   void *msgbuf_cache = NULL;
+   unsigned int batch_size = VCHIQ_MIN_COMPLETIONS;
+   unsigned int quiet_batches = 0;
 
-   static const VCHI_CALLBACK_REASON_T vchiq_reason_to_vchi[] =
-   {
-      VCHI_CALLBACK_SERVICE_OPENED,        // VCHIQ_SERVICE_OPENED
-      VCHI_CALLBACK_SERVICE_CLOSED,        // VCHIQ_SERVICE_CLOSED
-      VCHI_CALLBACK_MSG_AVAILABLE,         // VCHIQ_MESSAGE_AVAILABLE
-      VCHI_CALLBACK_BULK_SENT,             // VCHIQ_BULK_TRANSMIT_DONE
-      VCHI_CALLBACK_BULK_RECEIVED,         // VCHIQ_BULK_RECEIVE_DONE
-      VCHI_CALLBACK_BULK_TRANSMIT_ABORTED, // VCHIQ_BULK_TRANSMIT_ABORTED
-      VCHI_CALLBACK_BULK_RECEIVE_ABORTED,  // VCHIQ_BULK_RECEIVE_ABORTED
-   };
-
-   args.count = vcos_countof(completions);
    args.buf = completions;
    args.msgbufsize = MSGBUF_SIZE;
    args.msgbufcount = 0;
    args.msgbufs = msgbufs;
 
+   stats->batch_size = batch_size;
+
    while (1)
    {
-      int ret, i;
+      int ret, i, bucket;
+      uint32_t received;
 
-      while ((unsigned int)args.msgbufcount < vcos_countof(msgbufs))
+      /* Any completion in the batch may carry a message */
+      while (args.msgbufcount < batch_size)
       {
-         void *msgbuf = alloc_msgbuf();
+         void *msgbuf = alloc_msgbuf_cached(instance, &msgbuf_cache);
          if (msgbuf)
          {
             msgbufs[args.msgbufcount++] = msgbuf;
@@ -1478,39 +1698,70 @@ completion_thread(void *arg)
          {
             fprintf(stderr, "vchiq_lib: failed to allocate a message buffer\n");
             vcos_demand(args.msgbufcount != 0);
+            break;
          }
       }
 
-      RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_AWAIT_COMPLETION, &args));
+      /* Keep any surplus after a shrink for later growth */
+      while (args.msgbufcount > batch_size)
+      {
+         void *msgbuf = msgbufs[--args.msgbufcount];
+         *(void **)msgbuf = msgbuf_cache;
+         msgbuf_cache = msgbuf;
+      }
+
+      args.count = batch_size;
+
+      RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_AWAIT_COMPLETION, &args));
 
       if (ret <= 0)
          break;
 
+      received = vcos_getmicrosecs();
+
       for (i = 0; i < ret; i++)
       {
          VCHIQ_COMPLETION_DATA_T *completion = &completions[i];
          VCHIQ_SERVICE_T *service = (VCHIQ_SERVICE_T *)completion->service_userdata;
-         if (service->base.callback)
-         {
-            vcos_log_trace( "callback(%x, %x, %x(%x,%x), %x)",
-               completion->reason, (uint32_t)completion->header,
-               (uint32_t)&service->base, (uint32_t)service->lib_handle, (uint32_t)service->base.userdata, (uint32_t)completion->bulk_userdata );
-            service->base.callback(completion->reason, completion->header,
-               service->lib_handle, completion->bulk_userdata);
-         }
-         else if (service->vchi_callback)
+         if (service->dispatcher)
+            dispatch_handoff(instance, service, completion, received);
+         else
+            deliver_callback(instance, service, completion->reason,
+               completion->header, completion->bulk_userdata, received, 0);
+      }
+
+      stats->batches++;
+      stats->completions += ret;
+      for (bucket = 0; (ret >> (bucket + 1)) && (bucket < VCHIQ_COMPLETION_HISTOGRAM_BUCKETS - 1); bucket++)
+         continue;
+      stats->histogram[bucket]++;
+
+      /* Adapt the batch size to the observed fill */
+      if ((unsigned int)ret == batch_size)
+      {
+         stats->full_batches++;
+         quiet_batches = 0;
+         if (batch_size < VCHIQ_MAX_COMPLETIONS)
          {
-            VCHI_CALLBACK_REASON_T vchi_reason =
-               vchiq_reason_to_vchi[completion->reason];
-            service->vchi_callback(service->base.userdata, vchi_reason, completion->bulk_userdata);
+            batch_size *= 2;
+            stats->grows++;
          }
-
-         if ((completion->reason == VCHIQ_SERVICE_CLOSED) &&
-             instance->use_close_delivered)
+      }
+      else if ((batch_size > VCHIQ_MIN_COMPLETIONS) &&
+               ((unsigned int)ret <= batch_size / 4))
+      {
+         if (++quiet_batches >= VCHIQ_SHRINK_BATCHES)
          {
-            RETRY(ret,ioctl(service->fd, VCHIQ_IOC_CLOSE_DELIVERED, service->handle));
+            batch_size /= 2;
+            stats->shrinks++;
+            quiet_batches = 0;
          }
       }
+      else
+      {
+         quiet_batches = 0;
+      }
+      stats->batch_size = batch_size;
    }
 
    while (args.msgbufcount)
@@ -1518,15 +1769,495 @@ completion_thread(void *arg)
       void *msgbuf = msgbufs[--args.msgbufcount];
       free_msgbuf(msgbuf);
    }
+   free_msgbuf_list(msgbuf_cache);
+
+   return NULL;
+}
+
+/* Make a callback for a completion, on whichever thread the service has
+ * chosen, recording how long the completion waited to be delivered. */
+static void
+deliver_callback(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   VCHIQ_REASON_T reason,
+   VCHIQ_HEADER_T *header,
+   void *bulk_userdata,
+   uint32_t received,
+   int close_delivered)
+{
+   VCHIQ_DISPATCH_STATS_T *stats = &service->dispatch_stats;
+   uint32_t delay = vcos_getmicrosecs() - received;
+   int bucket;
+
+   static const VCHI_CALLBACK_REASON_T vchiq_reason_to_vchi[] =
+   {
+      VCHI_CALLBACK_SERVICE_OPENED,        // VCHIQ_SERVICE_OPENED
+      VCHI_CALLBACK_SERVICE_CLOSED,        // VCHIQ_SERVICE_CLOSED
+      VCHI_CALLBACK_MSG_AVAILABLE,         // VCHIQ_MESSAGE_AVAILABLE
+      VCHI_CALLBACK_BULK_SENT,             // VCHIQ_BULK_TRANSMIT_DONE
+      VCHI_CALLBACK_BULK_RECEIVED,         // VCHIQ_BULK_RECEIVE_DONE
+      VCHI_CALLBACK_BULK_TRANSMIT_ABORTED, // VCHIQ_BULK_TRANSMIT_ABORTED
+      VCHI_CALLBACK_BULK_RECEIVE_ABORTED,  // VCHIQ_BULK_RECEIVE_ABORTED
+   };
+
+   stats->callbacks++;
+   stats->total_delay += delay;
+   if (delay > stats->max_delay)
+      stats->max_delay = delay;
+   for (bucket = 0; delay && (bucket < VCHIQ_DISPATCH_HISTOGRAM_BUCKETS - 1); bucket++)
+      delay >>= 1;
+   stats->histogram[bucket]++;
+
+   if (service->base.callback)
+   {
+      vcos_log_trace( "callback(%x, %x, %x(%x,%x), %x)",
+         reason, (uint32_t)header,
+         (uint32_t)&service->base, (uint32_t)service->lib_handle, (uint32_t)service->base.userdata, (uint32_t)bulk_userdata );
+      service->base.callback(reason, header, service->lib_handle, bulk_userdata);
+   }
+   else if (service->vchi_callback)
+   {
+      VCHI_CALLBACK_REASON_T vchi_reason = vchiq_reason_to_vchi[reason];
+      service->vchi_callback(service->base.userdata, vchi_reason, bulk_userdata);
+   }
+
+   if ((reason == VCHIQ_SERVICE_CLOSED) &&
+       instance->use_close_delivered && !close_delivered)
+   {
+      int status;
+      RETRY(status,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_CLOSE_DELIVERED, service->handle));
+   }
+}
+
+/* Deliver the queued callbacks of one service, then either put it back on
+ * the run queue or retire it. */
+static void
+dispatch_service(VCHIQ_DISPATCHER_T *dispatcher,
+   VCHIQ_SERVICE_T *service,
+   unsigned int write)
+{
+   unsigned int mask = service->dispatch_depth - 1;
+   unsigned int read = service->dispatch_read;
+   int count, detached, waiting;
+
+   for (count = 0; count < VCHIQ_DISPATCH_BURST; count++)
+   {
+      VCHIQ_DISPATCH_ITEM_T *item = NULL;
+
+      if (read == write)
+      {
+         /* Look for more work, taking from the overflow only once the queue
+          * (which holds the older completions) is empty */
+         vcos_mutex_lock(&dispatcher->lock);
+         write = service->dispatch_write;
+         if ((read == write) && service->dispatch_overflow)
+         {
+            item = service->dispatch_overflow;
+            service->dispatch_overflow = item->next;
+            if (!service->dispatch_overflow)
+               service->dispatch_overflow_tail = NULL;
+         }
+         vcos_mutex_unlock(&dispatcher->lock);
+
+         if (item)
+         {
+            deliver_callback(dispatcher->instance, service, item->reason,
+               item->header, item->bulk_userdata, item->received,
+               item->close_delivered);
+            vcos_free(item);
+            continue;
+         }
+
+         if (read == write)
+            break;
+      }
+
+      item = &service->dispatch_items[read & mask];
+      deliver_callback(dispatcher->instance, service, item->reason,
+         item->header, item->bulk_userdata, item->received,
+         item->close_delivered);
+      __sync_synchronize(); /* Finish with the entry before releasing it */
+      service->dispatch_read = ++read;
+      vcos_event_signal(&service->dispatch_pop);
+   }
+
+   vcos_mutex_lock(&dispatcher->lock);
+
+   service->dispatch_thread = NULL;
+
+   if ((read != service->dispatch_write) || service->dispatch_overflow)
+   {
+      /* Go to the back of the queue to give other services a turn */
+      service->dispatch_next = NULL;
+      if (dispatcher->run_tail)
+         dispatcher->run_tail->dispatch_next = service;
+      else
+         dispatcher->run_head = service;
+      dispatcher->run_tail = service;
+      vcos_mutex_unlock(&dispatcher->lock);
+      vcos_semaphore_post(&dispatcher->work);
+      return;
+   }
+
+   detached = service->dispatch_detached;
+   waiting = service->dispatch_waiting;
+   if (!detached)
+      service->dispatch_scheduled = 0;
+
+   vcos_mutex_unlock(&dispatcher->lock);
+
+   if (detached)
+   {
+      /* The service removed itself from a callback - tidy up on its behalf,
+       * releasing the slot last */
+      VCHIQ_DISPATCH_ITEM_T *items = service->dispatch_items;
+      vcos_event_delete(&service->dispatch_pop);
+      vcos_semaphore_delete(&service->dispatch_drained);
+      service->dispatch_items = NULL;
+      service->dispatcher = NULL;
+      vcos_free(items);
+      __sync_fetch_and_sub(&dispatcher->users, 1);
+      __sync_synchronize();
+      service->dispatch_scheduled = 0;
+   }
+   else if (waiting)
+   {
+      vcos_semaphore_post(&service->dispatch_drained);
+   }
+}
+
+static void *
+dispatch_thread(void *arg)
+{
+   VCHIQ_DISPATCHER_T *dispatcher = (VCHIQ_DISPATCHER_T *)arg;
+
+   while (1)
+   {
+      VCHIQ_SERVICE_T *service;
+      unsigned int write;
+
+      vcos_semaphore_wait(&dispatcher->work);
+
+      vcos_mutex_lock(&dispatcher->lock);
+      service = dispatcher->run_head;
+      if (!service)
+      {
+         int stopping = dispatcher->stopping;
+         vcos_mutex_unlock(&dispatcher->lock);
+         if (stopping)
+            break;
+         continue;
+      }
+      dispatcher->run_head = service->dispatch_next;
+      if (!dispatcher->run_head)
+         dispatcher->run_tail = NULL;
+      service->dispatch_thread = vcos_thread_current();
+      write = service->dispatch_write;
+      vcos_mutex_unlock(&dispatcher->lock);
+
+      dispatch_service(dispatcher, service, write);
+   }
 
    return NULL;
 }
 
+/* Find or create a dispatcher for a service. The pool is shared by all
+ * pooled services, while dedicated dispatchers are reused once idle. */
+static VCHIQ_DISPATCHER_T *
+dispatcher_acquire(VCHIQ_INSTANCE_T instance, VCHIQ_DISPATCH_MODE_T mode)
+{
+   VCHIQ_DISPATCHER_T *dispatcher;
+   VCOS_THREAD_ATTR_T attrs;
+   int pooled = (mode == VCHIQ_DISPATCH_POOLED);
+   int threads = pooled ? VCHIQ_DISPATCH_POOL_THREADS : 1;
+   int i;
+
+   vcos_mutex_lock(&instance->mutex);
+
+   for (dispatcher = instance->dispatchers; dispatcher; dispatcher = dispatcher->next)
+   {
+      if (pooled ? dispatcher->pooled :
+          (!dispatcher->pooled && __sync_bool_compare_and_swap(&dispatcher->users, 0, 1)))
+         break;
+   }
+
+   if (dispatcher)
+   {
+      if (pooled)
+         __sync_fetch_and_add(&dispatcher->users, 1);
+      goto out;
+   }
+
+   dispatcher = vcos_calloc(1, sizeof(*dispatcher), "vchiq dispatcher");
+   if (!dispatcher)
+      goto out;
+
+   dispatcher->instance = instance;
+   dispatcher->pooled = pooled;
+   dispatcher->users = 1;
+
+   if (vcos_mutex_create(&dispatcher->lock, "vchiq dispatch") != VCOS_SUCCESS)
+      goto fail_mutex;
+   if (vcos_semaphore_create(&dispatcher->work, "vchiq dispatch", 0) != VCOS_SUCCESS)
+      goto fail_semaphore;
+
+   vcos_thread_attr_init(&attrs);
+   for (i = 0; i < threads; i++)
+   {
+      if (vcos_thread_create(&dispatcher->threads[i],
+                             pooled ? "VCHIQ dispatch pool" : "VCHIQ dispatch",
+                             &attrs, dispatch_thread, dispatcher) != VCOS_SUCCESS)
+         break;
+      dispatcher->num_threads++;
+   }
+
+   if (dispatcher->num_threads == 0)
+      goto fail_thread;
+
+   dispatcher->next = instance->dispatchers;
+   instance->dispatchers = dispatcher;
+   goto out;
+
+fail_thread:
+   vcos_semaphore_delete(&dispatcher->work);
+fail_semaphore:
+   vcos_mutex_delete(&dispatcher->lock);
+fail_mutex:
+   vcos_free(dispatcher);
+   dispatcher = NULL;
+out:
+   vcos_mutex_unlock(&instance->mutex);
+   return dispatcher;
+}
+
+static VCHIQ_STATUS_T
+dispatch_attach(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch)
+{
+   unsigned int depth = VCHIQ_DISPATCH_DEFAULT_DEPTH;
+
+   if (dispatch->queue_depth)
+   {
+      for (depth = 1;
+           (depth < dispatch->queue_depth) && (depth < VCHIQ_DISPATCH_MAX_DEPTH);
+           depth <<= 1)
+         continue;
+   }
+
+   service->dispatch_items = vcos_malloc(depth * sizeof(VCHIQ_DISPATCH_ITEM_T),
+      "vchiq dispatch queue");
+   if (!service->dispatch_items)
+      return VCHIQ_ERROR;
+
+   if (vcos_event_create(&service->dispatch_pop, "vchiq dispatch") != VCOS_SUCCESS)
+      goto fail_pop;
+   if (vcos_semaphore_create(&service->dispatch_drained, "vchiq dispatch",
+                             0) != VCOS_SUCCESS)
+      goto fail_drained;
+
+   service->dispatch_depth = depth;
+   service->dispatch_overflow = NULL;
+   service->dispatch_overflow_tail = NULL;
+   service->dispatch_read = 0;
+   service->dispatch_write = 0;
+   service->dispatch_waiting = 0;
+   service->dispatch_detached = 0;
+   service->dispatch_thread = NULL;
+
+   service->dispatcher = dispatcher_acquire(instance, dispatch->mode);
+   if (service->dispatcher)
+      return VCHIQ_SUCCESS;
+
+   vcos_semaphore_delete(&service->dispatch_drained);
+fail_drained:
+   vcos_event_delete(&service->dispatch_pop);
+fail_pop:
+   vcos_free(service->dispatch_items);
+   service->dispatch_items = NULL;
+   return VCHIQ_ERROR;
+}
+
+/* Stop using a dispatcher once the driver has finished with the service.
+ * Waits for any queued callbacks to be delivered, unless called from one. */
+static void
+dispatch_detach(VCHIQ_SERVICE_T *service)
+{
+   VCHIQ_DISPATCHER_T *dispatcher = service->dispatcher;
+   int busy;
+
+   if (!dispatcher)
+      return;
+
+   vcos_mutex_lock(&dispatcher->lock);
+   busy = service->dispatch_scheduled;
+   if (busy)
+   {
+      if (service->dispatch_thread == vcos_thread_current())
+      {
+         /* dispatch_service will finish the job */
+         service->dispatch_detached = 1;
+         vcos_mutex_unlock(&dispatcher->lock);
+         return;
+      }
+      service->dispatch_waiting = 1;
+   }
+   vcos_mutex_unlock(&dispatcher->lock);
+
+   if (busy)
+      vcos_semaphore_wait(&service->dispatch_drained);
+
+   vcos_event_delete(&service->dispatch_pop);
+   vcos_semaphore_delete(&service->dispatch_drained);
+   vcos_free(service->dispatch_items);
+   service->dispatch_items = NULL;
+   service->dispatcher = NULL;
+   __sync_fetch_and_sub(&dispatcher->users, 1);
+}
+
+/* A close or remove made from one of the service's own callbacks would wait
+ * in the driver for a SERVICE_CLOSED callback that its own thread has yet to
+ * deliver. Flag it so that the completion thread sends CLOSE_DELIVERED at
+ * handoff instead. */
+static void
+dispatch_mark_closing(VCHIQ_SERVICE_T *service)
+{
+   if (service->dispatcher &&
+       (service->dispatch_thread == vcos_thread_current()))
+   {
+      service->dispatch_closing = 1;
+      vcos_event_signal(&service->dispatch_pop);
+   }
+}
+
+/* Pass a completion to the service's dispatcher, waiting for space if its
+ * queue is full. Called on the completion thread. */
+static void
+dispatch_handoff(VCHIQ_INSTANCE_T instance,
+   VCHIQ_SERVICE_T *service,
+   const VCHIQ_COMPLETION_DATA_T *completion,
+   uint32_t received)
+{
+   VCHIQ_DISPATCHER_T *dispatcher = service->dispatcher;
+   VCHIQ_DISPATCH_ITEM_T *item;
+   VCHIQ_DISPATCH_ITEM_T *overflow = NULL;
+   int close_delivered = 0;
+   unsigned int queued;
+
+   if (service->dispatch_closing)
+   {
+      if ((completion->reason == VCHIQ_SERVICE_CLOSED) &&
+          instance->use_close_delivered)
+      {
+         int status;
+         RETRY(status,VCHIQ_IOCTL(service->fd, VCHIQ_IOC_CLOSE_DELIVERED, service->handle));
+         close_delivered = 1;
+      }
+
+      /* The dispatcher is stuck in the close until the SERVICE_CLOSED
+       * completion has been seen, so waiting for space would deadlock.
+       * Once anything has overflowed, everything must, to keep the order. */
+      if (service->dispatch_overflow ||
+          (service->dispatch_write == service->dispatch_read + service->dispatch_depth))
+      {
+         service->dispatch_stats.queue_full++;
+         overflow = vcos_malloc(sizeof(*overflow), "vchiq dispatch overflow");
+         vcos_demand(overflow != NULL);
+      }
+   }
+   else if (service->dispatch_write == service->dispatch_read + service->dispatch_depth)
+   {
+      service->dispatch_stats.queue_full++;
+      /* dispatch_mark_closing also signals, as a full queue may never drain */
+      while ((service->dispatch_write == service->dispatch_read + service->dispatch_depth) &&
+             !service->dispatch_closing)
+         vcos_event_wait(&service->dispatch_pop);
+      if (service->dispatch_closing)
+      {
+         dispatch_handoff(instance, service, completion, received);
+         return;
+      }
+   }
+
+   item = overflow ? overflow :
+      &service->dispatch_items[service->dispatch_write & (service->dispatch_depth - 1)];
+   item->reason = completion->reason;
+   item->header = completion->header;
+   item->bulk_userdata = completion->bulk_userdata;
+   item->received = received;
+   item->close_delivered = close_delivered;
+
+   vcos_mutex_lock(&dispatcher->lock);
+
+   if (overflow)
+   {
+      overflow->next = NULL;
+      if (service->dispatch_overflow_tail)
+         service->dispatch_overflow_tail->next = overflow;
+      else
+         service->dispatch_overflow = overflow;
+      service->dispatch_overflow_tail = overflow;
+   }
+   else
+   {
+      service->dispatch_write++;
+   }
+   queued = service->dispatch_write - service->dispatch_read;
+
+   if (!service->dispatch_scheduled)
+   {
+      service->dispatch_scheduled = 1;
+      service->dispatch_next = NULL;
+      if (dispatcher->run_tail)
+         dispatcher->run_tail->dispatch_next = service;
+      else
+         dispatcher->run_head = service;
+      dispatcher->run_tail = service;
+      vcos_mutex_unlock(&dispatcher->lock);
+      vcos_semaphore_post(&dispatcher->work);
+   }
+   else
+   {
+      vcos_mutex_unlock(&dispatcher->lock);
+   }
+
+   if (queued > service->dispatch_stats.max_queued)
+      service->dispatch_stats.max_queued = queued;
+}
+
+/* Stop and free all dispatchers. By now all services have been removed, so
+ * the threads only have to finish what is already queued. */
+static void
+dispatchers_stop(VCHIQ_INSTANCE_T instance)
+{
+   while (instance->dispatchers)
+   {
+      VCHIQ_DISPATCHER_T *dispatcher = instance->dispatchers;
+      int i;
+
+      instance->dispatchers = dispatcher->next;
+
+      vcos_mutex_lock(&dispatcher->lock);
+      dispatcher->stopping = 1;
+      vcos_mutex_unlock(&dispatcher->lock);
+
+      for (i = 0; i < dispatcher->num_threads; i++)
+         vcos_semaphore_post(&dispatcher->work);
+      for (i = 0; i < dispatcher->num_threads; i++)
+         vcos_thread_join(&dispatcher->threads[i], NULL);
+
+      vcos_semaphore_delete(&dispatcher->work);
+      vcos_mutex_delete(&dispatcher->lock);
+      vcos_free(dispatcher);
+   }
+}
+
 static VCHIQ_STATUS_T
 create_service(VCHIQ_INSTANCE_T instance,
    const VCHIQ_SERVICE_PARAMS_T *params,
    VCHI_CALLBACK_T vchi_callback,
    int is_open,
+   const VCHIQ_DISPATCH_PARAMS_T *dispatch,
    VCHIQ_SERVICE_HANDLE_T *phandle)
 {
    VCHIQ_SERVICE_T *service = NULL;
@@ -1544,7 +2275,10 @@ create_service(VCHIQ_INSTANCE_T instance,
       /* Find a free service */
       for (i = 0; i < instance->used_services; i++)
       {
-         if (instance->services[i].lib_handle == VCHIQ_SERVICE_HANDLE_INVALID)
+         /* A slot may still be in use by a dispatcher finishing off the
+          * callbacks of a service that removed itself */
+         if ((instance->services[i].lib_handle == VCHIQ_SERVICE_HANDLE_INVALID) &&
+             !instance->services[i].dispatch_scheduled)
          {
             service = &instance->services[i];
             break;
@@ -1558,7 +2292,8 @@ create_service(VCHIQ_INSTANCE_T instance,
          VCHIQ_SERVICE_T *srv = &instance->services[i];
          if (srv->lib_handle == VCHIQ_SERVICE_HANDLE_INVALID)
          {
-            service = srv;
+            if (!srv->dispatch_scheduled)
+               service = srv;
          }
          else if (
             (srv->base.fourcc == params->fourcc) &&
@@ -1595,9 +2330,6 @@ create_service(VCHIQ_INSTANCE_T instance,
 
    if (service)
    {
-      VCHIQ_CREATE_SERVICE_T args;
-      int ret;
-
       service->base.fourcc = params->fourcc;
       service->base.callback = params->callback;
       service->vchi_callback = vchi_callback;
@@ -1606,13 +2338,25 @@ create_service(VCHIQ_INSTANCE_T instance,
       service->peek_size = -1;
       service->peek_buf = NULL;
       service->is_client = is_open;
+      service->dispatch_closing = 0;
+      memset(&service->dispatch_stats, 0, sizeof(service->dispatch_stats));
+
+      /* Callbacks can start as soon as the service is created */
+      if (dispatch)
+         status = dispatch_attach(instance, service, dispatch);
+   }
+
+   if (service && (status == VCHIQ_SUCCESS))
+   {
+      VCHIQ_CREATE_SERVICE_T args;
+      int ret;
 
       args.params = *params;
       args.params.userdata = service;
       args.is_open = is_open;
       args.is_vchi = (params->callback == NULL);
       args.handle = VCHIQ_SERVICE_HANDLE_INVALID; /* OUT parameter */
-      RETRY(ret, ioctl(instance->fd, VCHIQ_IOC_CREATE_SERVICE, &args));
+      RETRY(ret, VCHIQ_IOCTL(instance->fd, VCHIQ_IOC_CREATE_SERVICE, &args));
       if (ret == 0)
          service->handle = args.handle;
       else
@@ -1627,11 +2371,16 @@ create_service(VCHIQ_INSTANCE_T instance,
    }
    else
    {
-      vcos_mutex_lock(&instance->mutex);
+      if (service)
+      {
+         dispatch_detach(service);
 
-      service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
+         vcos_mutex_lock(&instance->mutex);
 
-      vcos_mutex_unlock(&instance->mutex);
+         service->lib_handle = VCHIQ_SERVICE_HANDLE_INVALID;
+
+         vcos_mutex_unlock(&instance->mutex);
+      }
 
       *phandle = VCHIQ_SERVICE_HANDLE_INVALID;
    }
@@ -1660,7 +2409,7 @@ fill_peek_buf(VCHI_SERVICE_T *service,
          args.bufsize = MSGBUF_SIZE;
          args.buf = service->peek_buf;
 
-         RETRY(ret, ioctl(service->fd, VCHIQ_IOC_DEQUEUE_MESSAGE, &args));
+         RETRY(ret, VCHIQ_IOCTL(service->fd, VCHIQ_IOC_DEQUEUE_MESSAGE, &args));
 
          if (ret >= 0)
          {
@@ -1682,25 +2431,98 @@ fill_peek_buf(VCHI_SERVICE_T *service,
 }
 
 
+static int
+vchiq_device_open(void)
+{
+   return open("/dev/vchiq", O_RDWR);
+}
+
+static int
+vchiq_device_close(int fd)
+{
+   return close(fd);
+}
+
+static int
+vchiq_device_ioctl(int fd, unsigned int request, void *arg)
+{
+   return ioctl(fd, request, arg);
+}
+
+/*
+ * Released message buffers are kept on a lock-free LIFO. Buffers are only
+ * ever taken off it by detaching the whole list, which avoids the ABA
+ * problem of popping single entries, so releasing a message never contends
+ * with the completion thread.
+ */
+
+static void
+free_msgbuf_chain(void *head, void *tail)
+{
+   void *old;
+
+   do
+   {
+      old = free_msgbufs;
+      *(void **)tail = old;
+   } while (!__sync_bool_compare_and_swap(&free_msgbufs, old, head));
+}
+
+static void
+free_msgbuf_list(void *list)
+{
+   void *tail = list;
+
+   if (!list)
+      return;
+
+   while (*(void **)tail)
+      tail = *(void **)tail;
+
+   free_msgbuf_chain(list, tail);
+}
+
 static void *
 alloc_msgbuf(void)
+{
+   void *msgbuf = __sync_lock_test_and_set(&free_msgbufs, NULL);
+
+   if (msgbuf)
+      free_msgbuf_list(*(void **)msgbuf);
+   else
+      msgbuf = malloc(MSGBUF_SIZE);
+
+   return msgbuf;
+}
+
+/* Allocation for the completion thread, which keeps the detached list to
+ * itself until it has been used up */
+static void *
+alloc_msgbuf_cached(VCHIQ_INSTANCE_T instance, void **cache)
 {
    void *msgbuf;
-   vcos_mutex_lock(&vchiq_lib_mutex);
-   msgbuf = free_msgbufs;
+
+   if (!*cache)
+      *cache = __sync_lock_test_and_set(&free_msgbufs, NULL);
+
+   msgbuf = *cache;
    if (msgbuf)
-      free_msgbufs = *(void **)msgbuf;
-   vcos_mutex_unlock(&vchiq_lib_mutex);
-   if (!msgbuf)
+   {
+      *cache = *(void **)msgbuf;
+      instance->completion_stats.msgbufs_recycled++;
+   }
+   else
+   {
       msgbuf = malloc(MSGBUF_SIZE);
+      if (msgbuf)
+         instance->completion_stats.msgbufs_allocated++;
+   }
+
    return msgbuf;
 }
 
 static void
 free_msgbuf(void *buf)
 {
-   vcos_mutex_lock(&vchiq_lib_mutex);
-   *(void **)buf = free_msgbufs;
-   free_msgbufs = buf;
-   vcos_mutex_unlock(&vchiq_lib_mutex);
+   free_msgbuf_chain(buf, buf);
 }
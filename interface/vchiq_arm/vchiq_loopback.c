@@ -0,0 +1,1428 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vchiq.h"
+#include "vchiq_cfg.h"
+#include "vchiq_ioctl.h"
+#include "vchiq_loopback.h"
+#include "interface/vcos/vcos.h"
+
+#define LOOPBACK_MAX_SERVICES 64
+#define LOOPBACK_MAX_FAKES    16
+#define LOOPBACK_FD           0x10c4
+
+#define RETURN_ERRNO(e) do { errno = (e); return -1; } while (0)
+
+vcos_static_assert((LOOPBACK_MAX_SERVICES & (LOOPBACK_MAX_SERVICES - 1)) == 0);
+
+typedef enum
+{
+   LB_SERVICE_FREE,
+   LB_SERVICE_LISTENING,
+   LB_SERVICE_OPENING,
+   LB_SERVICE_OPEN,
+   LB_SERVICE_CLOSED
+} LB_SERVICE_STATE_T;
+
+typedef enum
+{
+   LB_EVENT_MESSAGE_TO_REMOTE,
+   LB_EVENT_MESSAGE_TO_HOST,
+   LB_EVENT_BULK,
+   LB_EVENT_CLOSE
+} LB_EVENT_TYPE_T;
+
+typedef struct lb_bulk_struct
+{
+   struct lb_bulk_struct *next;
+   void *data;
+   unsigned int size;
+   void *userdata;
+   VCHIQ_BULK_MODE_T mode;
+   int is_transmit;
+   int done;               /* Blocking bulks only: 1 complete, -1 aborted */
+} LB_BULK_T;
+
+typedef struct
+{
+   LB_BULK_T *head;
+   LB_BULK_T *tail;
+} LB_BULK_QUEUE_T;
+
+typedef struct lb_message_struct
+{
+   struct lb_message_struct *next;
+   VCHIQ_HEADER_T *header;
+} LB_MESSAGE_T;
+
+typedef struct lb_completion_struct
+{
+   struct lb_completion_struct *next;
+   VCHIQ_COMPLETION_DATA_T data;
+} LB_COMPLETION_T;
+
+typedef struct lb_event_struct
+{
+   struct lb_event_struct *next;
+   LB_EVENT_TYPE_T type;
+   uint64_t due;
+   unsigned int handle;
+   VCHIQ_HEADER_T *header;
+   LB_BULK_T *host_bulk;
+   LB_BULK_T *remote_bulk;
+   const VCHIQ_LOOPBACK_SERVICE_T *fake;
+   void *conn;
+} LB_EVENT_T;
+
+typedef struct
+{
+   unsigned int handle;
+   LB_SERVICE_STATE_T state;
+   int fourcc;
+   int is_vchi;
+   void *userdata;            /* The vchiq_lib service, returned in completions */
+   const VCHIQ_LOOPBACK_SERVICE_T *fake;
+   void *conn;
+   int close_pending;
+   int use_count;
+   int options[VCHIQ_SERVICE_OPTION_SYNCHRONOUS + 1];
+   LB_MESSAGE_T *msg_head;    /* VCHI services only */
+   LB_MESSAGE_T *msg_tail;
+   LB_BULK_QUEUE_T host_tx;
+   LB_BULK_QUEUE_T host_rx;
+   LB_BULK_QUEUE_T remote_tx;
+   LB_BULK_QUEUE_T remote_rx;
+} LB_SERVICE_T;
+
+static struct
+{
+   pthread_mutex_t lock;
+   int enabled;
+   int link_set;
+   VCHIQ_LOOPBACK_LINK_T link;
+   VCHIQ_LOOPBACK_STATS_T stats;
+   VCHIQ_LOOPBACK_SERVICE_T fakes[LOOPBACK_MAX_FAKES];
+   int num_fakes;
+   int log_registered;
+
+   /* State below exists only while the backend is open */
+   int is_open;
+   int connected;
+   int shutdown;
+   int lib_version;
+   int worker_stop;
+   pthread_t worker;
+   pthread_cond_t worker_cond;
+   pthread_cond_t completion_cond;
+   pthread_cond_t service_cond;
+   int have_completion_thread;
+   pthread_t completion_thread;
+   LB_EVENT_T *events;
+   uint64_t link_free;
+   uint64_t last_due;
+   LB_COMPLETION_T *completion_head;
+   LB_COMPLETION_T *completion_tail;
+   unsigned int handle_seq;
+   LB_SERVICE_T services[LOOPBACK_MAX_SERVICES];
+} lb = { PTHREAD_MUTEX_INITIALIZER };
+
+static VCOS_LOG_CAT_T vchiq_loopback_log_category;
+#define VCOS_LOG_CATEGORY (&vchiq_loopback_log_category)
+
+/* Local utility functions */
+static void *lb_worker(void *arg);
+
+static uint64_t
+lb_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t
+lb_getenv_uint(const char *name, uint32_t def)
+{
+   const char *str = getenv(name);
+   char *end;
+   unsigned long value;
+
+   if (!str)
+      return def;
+
+   value = strtoul(str, &end, 0);
+   if (*end == 'k' || *end == 'K')
+      value *= 1000;
+   else if (*end == 'm' || *end == 'M')
+      value *= 1000000;
+
+   return (uint32_t)value;
+}
+
+static LB_SERVICE_T *
+lb_find_service(unsigned int handle)
+{
+   LB_SERVICE_T *service = &lb.services[handle & (LOOPBACK_MAX_SERVICES - 1)];
+
+   if (!lb.is_open || (handle == VCHIQ_SERVICE_HANDLE_INVALID) ||
+       (service->handle != handle) || (service->state == LB_SERVICE_FREE))
+      return NULL;
+   return service;
+}
+
+static const VCHIQ_LOOPBACK_SERVICE_T *
+lb_find_fake(int fourcc)
+{
+   int i;
+
+   for (i = 0; i < lb.num_fakes; i++)
+      if (lb.fakes[i].fourcc == fourcc)
+         return &lb.fakes[i];
+   return NULL;
+}
+
+static void
+lb_bulk_enqueue(LB_BULK_QUEUE_T *queue, LB_BULK_T *bulk)
+{
+   bulk->next = NULL;
+   if (queue->tail)
+      queue->tail->next = bulk;
+   else
+      queue->head = bulk;
+   queue->tail = bulk;
+}
+
+static LB_BULK_T *
+lb_bulk_dequeue(LB_BULK_QUEUE_T *queue)
+{
+   LB_BULK_T *bulk = queue->head;
+
+   if (bulk)
+   {
+      queue->head = bulk->next;
+      if (!queue->head)
+         queue->tail = NULL;
+      bulk->next = NULL;
+   }
+   return bulk;
+}
+
+/** Post a completion for the vchiq_lib completion thread. Called with the
+ * lock held. */
+static int
+lb_post_completion(LB_SERVICE_T *service, VCHIQ_REASON_T reason,
+   VCHIQ_HEADER_T *header, void *bulk_userdata)
+{
+   LB_COMPLETION_T *completion = malloc(sizeof(*completion));
+
+   if (!completion)
+   {
+      vcos_log_error("%s: out of memory", __func__);
+      return -1;
+   }
+
+   completion->next = NULL;
+   completion->data.reason = reason;
+   completion->data.header = header;
+   completion->data.service_userdata = service->userdata;
+   completion->data.bulk_userdata = bulk_userdata;
+
+   if (lb.completion_tail)
+      lb.completion_tail->next = completion;
+   else
+      lb.completion_head = completion;
+   lb.completion_tail = completion;
+
+   pthread_cond_signal(&lb.completion_cond);
+   return 0;
+}
+
+/** Queue an event for the loopback thread, ordered by due time. Events with
+ * the same due time are processed in the order they were queued. Called
+ * with the lock held. */
+static void
+lb_post_event(LB_EVENT_T *event)
+{
+   LB_EVENT_T **pprev = &lb.events;
+
+   while (*pprev && ((*pprev)->due <= event->due))
+      pprev = &(*pprev)->next;
+
+   event->next = *pprev;
+   *pprev = event;
+
+   if (event->due > lb.last_due)
+      lb.last_due = event->due;
+
+   if (pprev == &lb.events)
+      pthread_cond_signal(&lb.worker_cond);
+}
+
+static LB_EVENT_T *
+lb_new_event(LB_EVENT_TYPE_T type, unsigned int handle, uint64_t due)
+{
+   LB_EVENT_T *event = calloc(1, sizeof(*event));
+
+   if (event)
+   {
+      event->type = type;
+      event->handle = handle;
+      event->due = due;
+   }
+   return event;
+}
+
+/** Finish a host bulk transfer, successfully or not. Called with the lock
+ * held; service may be NULL if it has been removed. */
+static void
+lb_finish_host_bulk(LB_SERVICE_T *service, LB_BULK_T *bulk, int success)
+{
+   if (!success)
+      lb.stats.bulks_aborted++;
+
+   if (bulk->mode == VCHIQ_BULK_MODE_BLOCKING)
+   {
+      /* The waiting thread frees the bulk */
+      bulk->done = success ? 1 : -1;
+      pthread_cond_broadcast(&lb.service_cond);
+      return;
+   }
+
+   if (service && (bulk->mode == VCHIQ_BULK_MODE_CALLBACK))
+   {
+      VCHIQ_REASON_T reason;
+
+      if (bulk->is_transmit)
+         reason = success ? VCHIQ_BULK_TRANSMIT_DONE : VCHIQ_BULK_TRANSMIT_ABORTED;
+      else
+         reason = success ? VCHIQ_BULK_RECEIVE_DONE : VCHIQ_BULK_RECEIVE_ABORTED;
+      lb_post_completion(service, reason, NULL, bulk->userdata);
+   }
+
+   free(bulk);
+}
+
+/** Match queued host and remote bulks, in order, and schedule the transfers
+ * on the simulated link. Called with the lock held. */
+static void
+lb_pair_bulks(LB_SERVICE_T *service)
+{
+   int dir;
+
+   for (dir = 0; dir < 2; dir++)
+   {
+      LB_BULK_QUEUE_T *host = dir ? &service->host_rx : &service->host_tx;
+      LB_BULK_QUEUE_T *remote = dir ? &service->remote_tx : &service->remote_rx;
+
+      while (host->head && remote->head)
+      {
+         LB_EVENT_T *event;
+         uint64_t start, end;
+         unsigned int size = vcos_min(host->head->size, remote->head->size);
+
+         event = lb_new_event(LB_EVENT_BULK, service->handle, 0);
+         if (!event)
+         {
+            vcos_log_error("%s: out of memory", __func__);
+            return;
+         }
+
+         /* Transfers are serialised on the link */
+         start = vcos_max(lb_now(), lb.link_free);
+         end = start;
+         if (lb.link.bulk_bandwidth)
+            end += (uint64_t)size * 1000000 / lb.link.bulk_bandwidth;
+         lb.link_free = end;
+
+         event->due = end + lb.link.bulk_latency;
+         event->host_bulk = lb_bulk_dequeue(host);
+         event->remote_bulk = lb_bulk_dequeue(remote);
+         event->fake = service->fake;
+         event->conn = service->conn;
+         lb_post_event(event);
+      }
+   }
+}
+
+/** Abort all host bulks which have not yet been paired, and detach the
+ * unpaired remote bulks onto the close event. Called with the lock held. */
+static void
+lb_close_service_locked(LB_SERVICE_T *service)
+{
+   LB_EVENT_T *event;
+   LB_BULK_T *bulk;
+
+   service->state = LB_SERVICE_CLOSED;
+
+   while ((bulk = lb_bulk_dequeue(&service->host_tx)) != NULL)
+      lb_finish_host_bulk(service, bulk, 0);
+   while ((bulk = lb_bulk_dequeue(&service->host_rx)) != NULL)
+      lb_finish_host_bulk(service, bulk, 0);
+
+   /* The close is processed after everything already on the link, so the
+    * fake sees all outstanding callbacks before it is told of the close. */
+   event = lb_new_event(LB_EVENT_CLOSE, service->handle, vcos_max(lb.last_due, lb_now()));
+   if (event)
+   {
+      LB_BULK_QUEUE_T remote = { NULL, NULL };
+
+      while ((bulk = lb_bulk_dequeue(&service->remote_tx)) != NULL)
+         lb_bulk_enqueue(&remote, bulk);
+      while ((bulk = lb_bulk_dequeue(&service->remote_rx)) != NULL)
+         lb_bulk_enqueue(&remote, bulk);
+
+      event->remote_bulk = remote.head;
+      event->fake = service->fake;
+      event->conn = service->conn;
+      lb_post_event(event);
+   }
+   else
+   {
+      vcos_log_error("%s: out of memory", __func__);
+   }
+
+   if (lb_post_completion(service, VCHIQ_SERVICE_CLOSED, NULL, NULL) == 0)
+      service->close_pending = 1;
+}
+
+static void
+lb_free_service_locked(LB_SERVICE_T *service)
+{
+   while (service->msg_head)
+   {
+      LB_MESSAGE_T *msg = service->msg_head;
+      service->msg_head = msg->next;
+      free(msg->header);
+      free(msg);
+   }
+   service->msg_tail = NULL;
+   service->state = LB_SERVICE_FREE;
+   service->handle = VCHIQ_SERVICE_HANDLE_INVALID;
+}
+
+static VCHIQ_HEADER_T *
+lb_build_message(const VCHIQ_ELEMENT_T *elements, unsigned int count)
+{
+   VCHIQ_HEADER_T *header;
+   unsigned int size = 0, i;
+   char *dst;
+
+   for (i = 0; i < count; i++)
+   {
+      if (elements[i].size < 0)
+         return NULL;
+      size += elements[i].size;
+   }
+
+   if (size > VCHIQ_MAX_MSG_SIZE)
+      return NULL;
+
+   header = malloc(sizeof(*header) + size);
+   if (!header)
+      return NULL;
+
+   header->msgid = 0;
+   header->size = size;
+   dst = header->data;
+   for (i = 0; i < count; i++)
+   {
+      memcpy(dst, elements[i].data, elements[i].size);
+      dst += elements[i].size;
+   }
+
+   return header;
+}
+
+/*
+ * Backend operations
+ */
+
+static int
+lb_open(void)
+{
+   pthread_condattr_t attr;
+   int i;
+
+   pthread_mutex_lock(&lb.lock);
+
+   if (lb.is_open)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EBUSY);
+   }
+
+   if (!lb.log_registered)
+   {
+      vcos_log_register("vchiq_loopback", VCOS_LOG_CATEGORY);
+      lb.log_registered = 1;
+   }
+
+   if (!lb.link_set)
+   {
+      lb.link.bulk_bandwidth = lb_getenv_uint("VCHIQ_LOOPBACK_BANDWIDTH", 0);
+      lb.link.bulk_latency = lb_getenv_uint("VCHIQ_LOOPBACK_BULK_LATENCY", 0);
+      lb.link.msg_latency = lb_getenv_uint("VCHIQ_LOOPBACK_MSG_LATENCY", 0);
+   }
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&lb.worker_cond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_cond_init(&lb.completion_cond, NULL);
+   pthread_cond_init(&lb.service_cond, NULL);
+
+   lb.connected = 0;
+   lb.shutdown = 0;
+   lb.lib_version = 0;
+   lb.worker_stop = 0;
+   lb.have_completion_thread = 0;
+   lb.events = NULL;
+   lb.link_free = 0;
+   lb.last_due = 0;
+   lb.completion_head = lb.completion_tail = NULL;
+   for (i = 0; i < LOOPBACK_MAX_SERVICES; i++)
+      memset(&lb.services[i], 0, sizeof(lb.services[i]));
+
+   if (pthread_create(&lb.worker, NULL, lb_worker, NULL) != 0)
+   {
+      pthread_cond_destroy(&lb.worker_cond);
+      pthread_cond_destroy(&lb.completion_cond);
+      pthread_cond_destroy(&lb.service_cond);
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EAGAIN);
+   }
+
+   lb.is_open = 1;
+
+   vcos_log_info("loopback backend open - bandwidth %u B/s, bulk latency %uus, msg latency %uus",
+      lb.link.bulk_bandwidth, lb.link.bulk_latency, lb.link.msg_latency);
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return LOOPBACK_FD;
+}
+
+static int
+lb_close(int fd)
+{
+   int i;
+
+   if (fd != LOOPBACK_FD)
+      RETURN_ERRNO(EBADF);
+
+   pthread_mutex_lock(&lb.lock);
+   if (!lb.is_open)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EBADF);
+   }
+   lb.worker_stop = 1;
+   pthread_cond_signal(&lb.worker_cond);
+   pthread_mutex_unlock(&lb.lock);
+
+   pthread_join(lb.worker, NULL);
+
+   pthread_mutex_lock(&lb.lock);
+
+   lb.is_open = 0;
+
+   while (lb.events)
+   {
+      LB_EVENT_T *event = lb.events;
+      lb.events = event->next;
+      free(event->header);
+      free(event->host_bulk);
+      while (event->remote_bulk)
+      {
+         LB_BULK_T *bulk = event->remote_bulk;
+         event->remote_bulk = bulk->next;
+         free(bulk);
+      }
+      free(event);
+   }
+
+   while (lb.completion_head)
+   {
+      LB_COMPLETION_T *completion = lb.completion_head;
+      lb.completion_head = completion->next;
+      free(completion->data.header);
+      free(completion);
+   }
+   lb.completion_tail = NULL;
+
+   for (i = 0; i < LOOPBACK_MAX_SERVICES; i++)
+   {
+      LB_SERVICE_T *service = &lb.services[i];
+      LB_BULK_QUEUE_T *queues[4];
+      int q;
+
+      queues[0] = &service->host_tx;
+      queues[1] = &service->host_rx;
+      queues[2] = &service->remote_tx;
+      queues[3] = &service->remote_rx;
+      for (q = 0; q < 4; q++)
+      {
+         LB_BULK_T *bulk;
+         while ((bulk = lb_bulk_dequeue(queues[q])) != NULL)
+            free(bulk);
+      }
+      lb_free_service_locked(service);
+   }
+
+   pthread_cond_destroy(&lb.worker_cond);
+   pthread_cond_destroy(&lb.completion_cond);
+   pthread_cond_destroy(&lb.service_cond);
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return 0;
+}
+
+static int
+lb_create_service(VCHIQ_CREATE_SERVICE_T *args)
+{
+   const VCHIQ_LOOPBACK_SERVICE_T *fake = NULL;
+   LB_SERVICE_T *service = NULL;
+   void *conn = NULL;
+   unsigned int handle;
+   int i;
+
+   pthread_mutex_lock(&lb.lock);
+
+   if (args->is_open)
+   {
+      if (!lb.connected)
+      {
+         pthread_mutex_unlock(&lb.lock);
+         RETURN_ERRNO(ENOTCONN);
+      }
+
+      fake = lb_find_fake(args->params.fourcc);
+      if (!fake ||
+          (args->params.version < fake->version_min) ||
+          (args->params.version_min > fake->version))
+      {
+         pthread_mutex_unlock(&lb.lock);
+         RETURN_ERRNO(EIO);
+      }
+   }
+
+   for (i = 0; i < LOOPBACK_MAX_SERVICES; i++)
+   {
+      if (lb.services[i].state == LB_SERVICE_FREE)
+      {
+         service = &lb.services[i];
+         break;
+      }
+   }
+
+   if (!service)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(ENOMEM);
+   }
+
+   lb.handle_seq += LOOPBACK_MAX_SERVICES;
+   if (!lb.handle_seq)
+      lb.handle_seq = LOOPBACK_MAX_SERVICES;
+
+   memset(service, 0, sizeof(*service));
+   service->handle = handle = lb.handle_seq | i;
+   service->fourcc = args->params.fourcc;
+   service->is_vchi = args->is_vchi;
+   service->userdata = args->params.userdata;
+   service->fake = fake;
+   service->state = args->is_open ? LB_SERVICE_OPENING : LB_SERVICE_LISTENING;
+
+   pthread_mutex_unlock(&lb.lock);
+
+   if (fake && fake->open && (fake->open(handle, fake->userdata, &conn) != 0))
+   {
+      pthread_mutex_lock(&lb.lock);
+      lb_free_service_locked(service);
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EIO);
+   }
+
+   pthread_mutex_lock(&lb.lock);
+   if (fake)
+   {
+      service->conn = conn;
+      service->state = LB_SERVICE_OPEN;
+   }
+   pthread_mutex_unlock(&lb.lock);
+
+   args->handle = handle;
+   return 0;
+}
+
+/** Close a host service, waiting for the completion thread to deliver the
+ * SERVICE_CLOSED callback, as the driver does. Called with the lock held. */
+static void
+lb_close_and_wait_locked(LB_SERVICE_T *service)
+{
+   unsigned int handle = service->handle;
+
+   if (service->state == LB_SERVICE_OPEN)
+      lb_close_service_locked(service);
+
+   if ((lb.lib_version < VCHIQ_VERSION_CLOSE_DELIVERED) || !lb.connected ||
+       (lb.have_completion_thread && pthread_equal(lb.completion_thread, pthread_self())))
+      return;
+
+   while ((service->handle == handle) && service->close_pending && !lb.shutdown)
+      pthread_cond_wait(&lb.service_cond, &lb.lock);
+}
+
+static int
+lb_close_service(unsigned int handle, int remove)
+{
+   LB_SERVICE_T *service;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(handle);
+   if (!service)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EINVAL);
+   }
+
+   lb_close_and_wait_locked(service);
+
+   if (remove && (service->handle == handle))
+      lb_free_service_locked(service);
+
+   pthread_mutex_unlock(&lb.lock);
+   return 0;
+}
+
+static int
+lb_queue_message(const VCHIQ_QUEUE_MESSAGE_T *args)
+{
+   LB_SERVICE_T *service;
+   VCHIQ_HEADER_T *header;
+   LB_EVENT_T *event;
+
+   header = lb_build_message(args->elements, args->count);
+   if (!header)
+      RETURN_ERRNO(EINVAL);
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(args->handle);
+   if (!service || (service->state != LB_SERVICE_OPEN))
+   {
+      pthread_mutex_unlock(&lb.lock);
+      free(header);
+      RETURN_ERRNO(service ? EIO : EINVAL);
+   }
+
+   event = lb_new_event(LB_EVENT_MESSAGE_TO_REMOTE, service->handle,
+      lb_now() + lb.link.msg_latency);
+   if (!event)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      free(header);
+      RETURN_ERRNO(ENOMEM);
+   }
+
+   event->header = header;
+   lb_post_event(event);
+
+   lb.stats.msgs_to_remote++;
+   lb.stats.msg_bytes += header->size;
+
+   pthread_mutex_unlock(&lb.lock);
+   return 0;
+}
+
+static int
+lb_queue_bulk(const VCHIQ_QUEUE_BULK_TRANSFER_T *args, int is_transmit)
+{
+   LB_SERVICE_T *service;
+   LB_BULK_T *bulk;
+   int ret = 0;
+
+   bulk = calloc(1, sizeof(*bulk));
+   if (!bulk)
+      RETURN_ERRNO(ENOMEM);
+
+   bulk->data = args->data;
+   bulk->size = args->size;
+   bulk->userdata = args->userdata;
+   bulk->mode = args->mode;
+   bulk->is_transmit = is_transmit;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(args->handle);
+   if (!service || (service->state != LB_SERVICE_OPEN))
+   {
+      pthread_mutex_unlock(&lb.lock);
+      free(bulk);
+      RETURN_ERRNO(service ? EIO : EINVAL);
+   }
+
+   lb_bulk_enqueue(is_transmit ? &service->host_tx : &service->host_rx, bulk);
+   lb_pair_bulks(service);
+
+   if (args->mode == VCHIQ_BULK_MODE_BLOCKING)
+   {
+      while (!bulk->done)
+         pthread_cond_wait(&lb.service_cond, &lb.lock);
+      if (bulk->done < 0)
+      {
+         errno = EIO;
+         ret = -1;
+      }
+      free(bulk);
+   }
+
+   pthread_mutex_unlock(&lb.lock);
+   return ret;
+}
+
+static int
+lb_await_completion(VCHIQ_AWAIT_COMPLETION_T *args)
+{
+   unsigned int msgbufcount = args->msgbufcount;
+   unsigned int count = 0;
+
+   pthread_mutex_lock(&lb.lock);
+
+   lb.completion_thread = pthread_self();
+   lb.have_completion_thread = 1;
+
+   while (!lb.completion_head && !lb.shutdown)
+      pthread_cond_wait(&lb.completion_cond, &lb.lock);
+
+   while ((count < args->count) && lb.completion_head)
+   {
+      LB_COMPLETION_T *completion = lb.completion_head;
+      VCHIQ_COMPLETION_DATA_T *data = &args->buf[count];
+
+      *data = completion->data;
+
+      if (completion->data.header)
+      {
+         VCHIQ_HEADER_T *header = completion->data.header;
+         unsigned int size = sizeof(*header) + header->size;
+
+         /* The message is copied into a buffer supplied by the caller */
+         if ((msgbufcount == 0) || (size > args->msgbufsize))
+         {
+            if (count == 0)
+            {
+               pthread_mutex_unlock(&lb.lock);
+               RETURN_ERRNO((msgbufcount == 0) ? ENOMEM : EMSGSIZE);
+            }
+            break;
+         }
+
+         data->header = args->msgbufs[--msgbufcount];
+         memcpy(data->header, header, size);
+         free(header);
+      }
+
+      lb.completion_head = completion->next;
+      if (!lb.completion_head)
+         lb.completion_tail = NULL;
+      free(completion);
+      count++;
+   }
+
+   args->msgbufcount = msgbufcount;
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return count;
+}
+
+static int
+lb_dequeue_message(const VCHIQ_DEQUEUE_MESSAGE_T *args)
+{
+   LB_SERVICE_T *service;
+   LB_MESSAGE_T *msg;
+   unsigned int handle = args->handle;
+   int ret;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(handle);
+   if (!service || !service->is_vchi)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EINVAL);
+   }
+
+   while (!service->msg_head)
+   {
+      if (!args->blocking || (service->state != LB_SERVICE_OPEN) || lb.shutdown)
+      {
+         pthread_mutex_unlock(&lb.lock);
+         RETURN_ERRNO(args->blocking ? ENOTCONN : EWOULDBLOCK);
+      }
+      pthread_cond_wait(&lb.service_cond, &lb.lock);
+      if (service->handle != handle)
+      {
+         pthread_mutex_unlock(&lb.lock);
+         RETURN_ERRNO(ENOTCONN);
+      }
+   }
+
+   msg = service->msg_head;
+   if (msg->header->size > args->bufsize)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EMSGSIZE);
+   }
+
+   service->msg_head = msg->next;
+   if (!service->msg_head)
+      service->msg_tail = NULL;
+
+   memcpy(args->buf, msg->header->data, msg->header->size);
+   ret = msg->header->size;
+
+   pthread_mutex_unlock(&lb.lock);
+
+   free(msg->header);
+   free(msg);
+
+   return ret;
+}
+
+static int
+lb_service_ioctl(unsigned int request, unsigned int handle)
+{
+   LB_SERVICE_T *service;
+   int ret = 0;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(handle);
+   if (!service)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      RETURN_ERRNO(EINVAL);
+   }
+
+   switch (request)
+   {
+   case VCHIQ_IOC_GET_CLIENT_ID:
+      ret = 0;
+      break;
+   case VCHIQ_IOC_USE_SERVICE:
+      service->use_count++;
+      break;
+   case VCHIQ_IOC_RELEASE_SERVICE:
+      if (service->use_count > 0)
+         service->use_count--;
+      else
+      {
+         errno = EINVAL;
+         ret = -1;
+      }
+      break;
+   case VCHIQ_IOC_CLOSE_DELIVERED:
+      if (service->close_pending)
+      {
+         service->close_pending = 0;
+         pthread_cond_broadcast(&lb.service_cond);
+      }
+      break;
+   }
+
+   pthread_mutex_unlock(&lb.lock);
+   return ret;
+}
+
+static int
+lb_ioctl(int fd, unsigned int request, void *arg)
+{
+   if ((fd != LOOPBACK_FD) || !lb.is_open)
+      RETURN_ERRNO(EBADF);
+
+   switch (request)
+   {
+   case VCHIQ_IOC_CONNECT:
+      pthread_mutex_lock(&lb.lock);
+      lb.connected = 1;
+      pthread_mutex_unlock(&lb.lock);
+      return 0;
+
+   case VCHIQ_IOC_SHUTDOWN:
+      pthread_mutex_lock(&lb.lock);
+      lb.shutdown = 1;
+      pthread_cond_broadcast(&lb.completion_cond);
+      pthread_cond_broadcast(&lb.service_cond);
+      pthread_mutex_unlock(&lb.lock);
+      return 0;
+
+   case VCHIQ_IOC_CREATE_SERVICE:
+      return lb_create_service((VCHIQ_CREATE_SERVICE_T *)arg);
+
+   case VCHIQ_IOC_CLOSE_SERVICE:
+      return lb_close_service((unsigned int)(uintptr_t)arg, 0);
+
+   case VCHIQ_IOC_REMOVE_SERVICE:
+      return lb_close_service((unsigned int)(uintptr_t)arg, 1);
+
+   case VCHIQ_IOC_QUEUE_MESSAGE:
+      return lb_queue_message((const VCHIQ_QUEUE_MESSAGE_T *)arg);
+
+   case VCHIQ_IOC_QUEUE_BULK_TRANSMIT:
+      return lb_queue_bulk((const VCHIQ_QUEUE_BULK_TRANSFER_T *)arg, 1);
+
+   case VCHIQ_IOC_QUEUE_BULK_RECEIVE:
+      return lb_queue_bulk((const VCHIQ_QUEUE_BULK_TRANSFER_T *)arg, 0);
+
+   case VCHIQ_IOC_AWAIT_COMPLETION:
+      return lb_await_completion((VCHIQ_AWAIT_COMPLETION_T *)arg);
+
+   case VCHIQ_IOC_DEQUEUE_MESSAGE:
+      return lb_dequeue_message((const VCHIQ_DEQUEUE_MESSAGE_T *)arg);
+
+   case VCHIQ_IOC_GET_CONFIG:
+   {
+      VCHIQ_GET_CONFIG_T *args = (VCHIQ_GET_CONFIG_T *)arg;
+      VCHIQ_CONFIG_T config;
+
+      config.max_msg_size = VCHIQ_MAX_MSG_SIZE;
+      config.bulk_threshold = VCHIQ_MAX_MSG_SIZE;
+      config.max_outstanding_bulks = VCHIQ_NUM_SERVICE_BULKS;
+      config.max_services = LOOPBACK_MAX_SERVICES;
+      config.version = VCHIQ_VERSION;
+      config.version_min = VCHIQ_VERSION_MIN;
+      if (args->config_size > sizeof(config))
+         RETURN_ERRNO(EINVAL);
+      memcpy(args->pconfig, &config, args->config_size);
+      return 0;
+   }
+
+   case VCHIQ_IOC_SET_SERVICE_OPTION:
+   {
+      const VCHIQ_SET_SERVICE_OPTION_T *args = (const VCHIQ_SET_SERVICE_OPTION_T *)arg;
+      LB_SERVICE_T *service;
+
+      pthread_mutex_lock(&lb.lock);
+      service = lb_find_service(args->handle);
+      if (!service || ((unsigned int)args->option > VCHIQ_SERVICE_OPTION_SYNCHRONOUS))
+      {
+         pthread_mutex_unlock(&lb.lock);
+         RETURN_ERRNO(EINVAL);
+      }
+      service->options[args->option] = args->value;
+      pthread_mutex_unlock(&lb.lock);
+      return 0;
+   }
+
+   case VCHIQ_IOC_GET_CLIENT_ID:
+   case VCHIQ_IOC_USE_SERVICE:
+   case VCHIQ_IOC_RELEASE_SERVICE:
+   case VCHIQ_IOC_CLOSE_DELIVERED:
+      return lb_service_ioctl(request, (unsigned int)(uintptr_t)arg);
+
+   case VCHIQ_IOC_DUMP_PHYS_MEM:
+      return 0;
+
+   case VCHIQ_IOC_LIB_VERSION:
+      pthread_mutex_lock(&lb.lock);
+      lb.lib_version = (int)(uintptr_t)arg;
+      pthread_mutex_unlock(&lb.lock);
+      return 0;
+
+   default:
+      RETURN_ERRNO(ENOTTY);
+   }
+}
+
+const VCHIQ_LIB_BACKEND_T vchiq_loopback_backend =
+{
+   "loopback",
+   lb_open,
+   lb_close,
+   lb_ioctl
+};
+
+/*
+ * The loopback thread - the VideoCore side of the link
+ */
+
+static void
+lb_process_event(LB_EVENT_T *event)
+{
+   const VCHIQ_LOOPBACK_SERVICE_T *fake = NULL;
+   LB_SERVICE_T *service;
+   void *conn = NULL;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(event->handle);
+   if (service && (service->state == LB_SERVICE_OPEN))
+   {
+      fake = service->fake;
+      conn = service->conn;
+   }
+
+   switch (event->type)
+   {
+   case LB_EVENT_MESSAGE_TO_REMOTE:
+      pthread_mutex_unlock(&lb.lock);
+      if (fake && fake->message)
+         fake->message(event->handle, conn, event->header->data, event->header->size);
+      free(event->header);
+      break;
+
+   case LB_EVENT_MESSAGE_TO_HOST:
+      if (fake && service->is_vchi)
+      {
+         LB_MESSAGE_T *msg = malloc(sizeof(*msg));
+         if (msg)
+         {
+            msg->next = NULL;
+            msg->header = event->header;
+            if (service->msg_tail)
+               service->msg_tail->next = msg;
+            else
+               service->msg_head = msg;
+            service->msg_tail = msg;
+            event->header = NULL;
+            /* VCHI clients retrieve the message with DEQUEUE_MESSAGE */
+            lb_post_completion(service, VCHIQ_MESSAGE_AVAILABLE, NULL, NULL);
+            pthread_cond_broadcast(&lb.service_cond);
+         }
+      }
+      else if (fake)
+      {
+         if (lb_post_completion(service, VCHIQ_MESSAGE_AVAILABLE, event->header, NULL) == 0)
+            event->header = NULL;
+      }
+      pthread_mutex_unlock(&lb.lock);
+      free(event->header);
+      break;
+
+   case LB_EVENT_BULK:
+   {
+      LB_BULK_T *host = event->host_bulk;
+      LB_BULK_T *remote = event->remote_bulk;
+      VCHIQ_REASON_T reason;
+      int success = (fake != NULL);
+
+      if (success)
+      {
+         unsigned int size = vcos_min(host->size, remote->size);
+         if (host->is_transmit)
+         {
+            memcpy(remote->data, host->data, size);
+            lb.stats.bulks_to_remote++;
+         }
+         else
+         {
+            memcpy(host->data, remote->data, size);
+            lb.stats.bulks_to_host++;
+         }
+         lb.stats.bulk_bytes += size;
+      }
+
+      lb_finish_host_bulk(service, host, success);
+
+      pthread_mutex_unlock(&lb.lock);
+
+      if (remote->is_transmit)
+         reason = success ? VCHIQ_BULK_TRANSMIT_DONE : VCHIQ_BULK_TRANSMIT_ABORTED;
+      else
+         reason = success ? VCHIQ_BULK_RECEIVE_DONE : VCHIQ_BULK_RECEIVE_ABORTED;
+
+      /* The close callback for the connection has not been made yet, so the
+       * context captured when the bulks were paired is still valid. */
+      if (event->fake && event->fake->bulk)
+         event->fake->bulk(event->handle, event->conn, reason,
+            remote->data, remote->size, remote->userdata);
+      free(remote);
+      break;
+   }
+
+   case LB_EVENT_CLOSE:
+      pthread_mutex_unlock(&lb.lock);
+      fake = event->fake;
+      while (event->remote_bulk)
+      {
+         LB_BULK_T *bulk = event->remote_bulk;
+         event->remote_bulk = bulk->next;
+         if (fake && fake->bulk)
+            fake->bulk(event->handle, event->conn,
+               bulk->is_transmit ? VCHIQ_BULK_TRANSMIT_ABORTED : VCHIQ_BULK_RECEIVE_ABORTED,
+               bulk->data, bulk->size, bulk->userdata);
+         free(bulk);
+      }
+      if (fake && fake->close)
+         fake->close(event->handle, event->conn);
+      break;
+   }
+
+   free(event);
+}
+
+static void *
+lb_worker(void *arg)
+{
+   vcos_unused(arg);
+
+   pthread_mutex_lock(&lb.lock);
+
+   while (!lb.worker_stop)
+   {
+      LB_EVENT_T *event = lb.events;
+      uint64_t now;
+
+      if (!event)
+      {
+         pthread_cond_wait(&lb.worker_cond, &lb.lock);
+         continue;
+      }
+
+      now = lb_now();
+      if (event->due > now)
+      {
+         struct timespec ts;
+         ts.tv_sec = event->due / 1000000;
+         ts.tv_nsec = (event->due % 1000000) * 1000;
+         pthread_cond_timedwait(&lb.worker_cond, &lb.lock, &ts);
+         continue;
+      }
+
+      lb.events = event->next;
+      pthread_mutex_unlock(&lb.lock);
+      lb_process_event(event);
+      pthread_mutex_lock(&lb.lock);
+   }
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return NULL;
+}
+
+/*
+ * Public API
+ */
+
+void
+vchiq_loopback_enable(int enable)
+{
+   pthread_mutex_lock(&lb.lock);
+   lb.enabled = enable ? 1 : -1;
+   pthread_mutex_unlock(&lb.lock);
+}
+
+int
+vchiq_loopback_enabled(void)
+{
+   const char *env;
+
+   if (lb.enabled)
+      return lb.enabled > 0;
+
+   env = getenv("VCHIQ_LOOPBACK");
+   return env && *env && (strcmp(env, "0") != 0);
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_register_service(const VCHIQ_LOOPBACK_SERVICE_T *service)
+{
+   VCHIQ_STATUS_T status = VCHIQ_ERROR;
+
+   pthread_mutex_lock(&lb.lock);
+   if (!lb_find_fake(service->fourcc) && (lb.num_fakes < LOOPBACK_MAX_FAKES))
+   {
+      lb.fakes[lb.num_fakes++] = *service;
+      status = VCHIQ_SUCCESS;
+   }
+   pthread_mutex_unlock(&lb.lock);
+
+   return status;
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_unregister_service(int fourcc)
+{
+   VCHIQ_STATUS_T status = VCHIQ_ERROR;
+   const VCHIQ_LOOPBACK_SERVICE_T *fake;
+   int i;
+
+   pthread_mutex_lock(&lb.lock);
+   fake = lb_find_fake(fourcc);
+   if (fake)
+   {
+      for (i = 0; i < LOOPBACK_MAX_SERVICES; i++)
+      {
+         /* Live connections keep a pointer to the description */
+         if ((lb.services[i].state != LB_SERVICE_FREE) && (lb.services[i].fake == fake))
+            break;
+      }
+      if (i == LOOPBACK_MAX_SERVICES)
+      {
+         i = fake - lb.fakes;
+         memmove(&lb.fakes[i], &lb.fakes[i + 1], (lb.num_fakes - i - 1) * sizeof(lb.fakes[0]));
+         lb.num_fakes--;
+         status = VCHIQ_SUCCESS;
+      }
+   }
+   pthread_mutex_unlock(&lb.lock);
+
+   return status;
+}
+
+void
+vchiq_loopback_set_link(const VCHIQ_LOOPBACK_LINK_T *link)
+{
+   pthread_mutex_lock(&lb.lock);
+   lb.link = *link;
+   lb.link_set = 1;
+   pthread_mutex_unlock(&lb.lock);
+}
+
+void
+vchiq_loopback_get_stats(VCHIQ_LOOPBACK_STATS_T *stats, int reset)
+{
+   pthread_mutex_lock(&lb.lock);
+   *stats = lb.stats;
+   if (reset)
+      memset(&lb.stats, 0, sizeof(lb.stats));
+   pthread_mutex_unlock(&lb.lock);
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_queue_message(unsigned int handle,
+   const VCHIQ_ELEMENT_T *elements, unsigned int count)
+{
+   LB_SERVICE_T *service;
+   VCHIQ_HEADER_T *header;
+   LB_EVENT_T *event;
+
+   header = lb_build_message(elements, count);
+   if (!header)
+      return VCHIQ_ERROR;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(handle);
+   event = NULL;
+   if (service && (service->state == LB_SERVICE_OPEN))
+      event = lb_new_event(LB_EVENT_MESSAGE_TO_HOST, handle, lb_now() + lb.link.msg_latency);
+
+   if (!event)
+   {
+      pthread_mutex_unlock(&lb.lock);
+      free(header);
+      return VCHIQ_ERROR;
+   }
+
+   event->header = header;
+   lb_post_event(event);
+
+   lb.stats.msgs_to_host++;
+   lb.stats.msg_bytes += header->size;
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return VCHIQ_SUCCESS;
+}
+
+static VCHIQ_STATUS_T
+lb_queue_remote_bulk(unsigned int handle, void *data, unsigned int size,
+   void *userdata, int is_transmit)
+{
+   LB_SERVICE_T *service;
+   LB_BULK_T *bulk;
+
+   bulk = calloc(1, sizeof(*bulk));
+   if (!bulk)
+      return VCHIQ_ERROR;
+
+   bulk->data = data;
+   bulk->size = size;
+   bulk->userdata = userdata;
+   bulk->mode = VCHIQ_BULK_MODE_CALLBACK;
+   bulk->is_transmit = is_transmit;
+
+   pthread_mutex_lock(&lb.lock);
+
+   service = lb_find_service(handle);
+   if (!service || (service->state != LB_SERVICE_OPEN))
+   {
+      pthread_mutex_unlock(&lb.lock);
+      free(bulk);
+      return VCHIQ_ERROR;
+   }
+
+   lb_bulk_enqueue(is_transmit ? &service->remote_tx : &service->remote_rx, bulk);
+   lb_pair_bulks(service);
+
+   pthread_mutex_unlock(&lb.lock);
+
+   return VCHIQ_SUCCESS;
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_queue_bulk_transmit(unsigned int handle,
+   const void *data, unsigned int size, void *userdata)
+{
+   return lb_queue_remote_bulk(handle, (void *)data, size, userdata, 1);
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_queue_bulk_receive(unsigned int handle,
+   void *data, unsigned int size, void *userdata)
+{
+   return lb_queue_remote_bulk(handle, data, size, userdata, 0);
+}
+
+VCHIQ_STATUS_T
+vchiq_loopback_close_service(unsigned int handle)
+{
+   VCHIQ_STATUS_T status = VCHIQ_ERROR;
+   LB_SERVICE_T *service;
+
+   pthread_mutex_lock(&lb.lock);
+   service = lb_find_service(handle);
+   if (service && (service->state == LB_SERVICE_OPEN))
+   {
+      lb_close_service_locked(service);
+      status = VCHIQ_SUCCESS;
+   }
+   pthread_mutex_unlock(&lb.lock);
+
+   return status;
+}
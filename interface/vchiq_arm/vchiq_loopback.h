@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef VCHIQ_LOOPBACK_H
+#define VCHIQ_LOOPBACK_H
+
+/*
+ * In-process emulation of /dev/vchiq.
+ *
+ * The loopback backend implements the ioctl interface of the VCHIQ kernel
+ * driver inside the calling process, so that VCHIQ and VCHI clients can be
+ * exercised on a machine without a VideoCore. The "remote" end of each
+ * connection is a fake service registered with
+ * vchiq_loopback_register_service(). Fake service callbacks are made from a
+ * single loopback thread, which plays the part of the VideoCore, and the link
+ * between the two sides can be given a bulk bandwidth and a latency.
+ *
+ * The backend is used instead of the device when vchiq_loopback_enable(1) has
+ * been called, or when the VCHIQ_LOOPBACK environment variable is set to a
+ * non-zero value, at the time the first vchiq_initialise() is made. The
+ * environment variables VCHIQ_LOOPBACK_BANDWIDTH (bytes per second, with an
+ * optional k or M suffix), VCHIQ_LOOPBACK_BULK_LATENCY and
+ * VCHIQ_LOOPBACK_MSG_LATENCY (microseconds) supply the link parameters if
+ * vchiq_loopback_set_link() has not been called.
+ */
+
+#include "vchiq_if.h"
+
+/** Characteristics of the simulated link between host and VideoCore. */
+typedef struct
+{
+   uint32_t bulk_bandwidth;   /**< Bulk bytes per second, 0 for unlimited */
+   uint32_t bulk_latency;     /**< Microseconds added to each bulk transfer */
+   uint32_t msg_latency;      /**< Microseconds added to each message */
+} VCHIQ_LOOPBACK_LINK_T;
+
+/** Traffic counters for the loopback link. */
+typedef struct
+{
+   uint32_t msgs_to_remote;   /**< Messages sent by host services */
+   uint32_t msgs_to_host;     /**< Messages sent by fake services */
+   uint32_t bulks_to_remote;  /**< Completed host to fake bulk transfers */
+   uint32_t bulks_to_host;    /**< Completed fake to host bulk transfers */
+   uint32_t bulks_aborted;    /**< Bulk transfers aborted by a close */
+   uint64_t msg_bytes;        /**< Message payload bytes in both directions */
+   uint64_t bulk_bytes;       /**< Bulk payload bytes in both directions */
+} VCHIQ_LOOPBACK_STATS_T;
+
+/** Description of a fake VideoCore service.
+ *
+ * All callbacks other than open are made on the loopback thread. A service
+ * handle passed to a callback can be used with the vchiq_loopback_queue_*
+ * functions until the close callback has been made for it.
+ */
+typedef struct vchiq_loopback_service_struct
+{
+   int fourcc;                /**< Service identifier */
+   short version;             /**< Service version */
+   short version_min;         /**< Oldest version of the client accepted */
+
+   /** A host client is opening the service. Called on the thread calling
+    * vchiq_open_service(). Set *pconn to a per-connection context and return
+    * 0 to accept the connection. No messages can be queued until this
+    * returns. */
+   int (*open)(unsigned int handle, void *userdata, void **pconn);
+
+   /** The connection has been closed, by either side. No further callbacks
+    * are made for the handle. */
+   void (*close)(unsigned int handle, void *conn);
+
+   /** A message has arrived from the host. The data is only valid for the
+    * duration of the call. */
+   void (*message)(unsigned int handle, void *conn, const void *data,
+      unsigned int size);
+
+   /** A bulk transfer queued by the fake service has completed, or was
+    * aborted, as indicated by reason. */
+   void (*bulk)(unsigned int handle, void *conn, VCHIQ_REASON_T reason,
+      void *data, unsigned int size, void *bulk_userdata);
+
+   void *userdata;            /**< Passed to the open callback */
+} VCHIQ_LOOPBACK_SERVICE_T;
+
+/** Select (or deselect) the loopback backend for the next vchiq_initialise(). */
+void vchiq_loopback_enable(int enable);
+
+/** Return non-zero if the loopback backend will be, or is being, used. */
+int vchiq_loopback_enabled(void);
+
+/** Register a fake service. The description is copied. */
+VCHIQ_STATUS_T vchiq_loopback_register_service(const VCHIQ_LOOPBACK_SERVICE_T *service);
+
+/** Remove a fake service. Existing connections are not affected. */
+VCHIQ_STATUS_T vchiq_loopback_unregister_service(int fourcc);
+
+/** Set the characteristics of the simulated link. */
+void vchiq_loopback_set_link(const VCHIQ_LOOPBACK_LINK_T *link);
+
+/** Retrieve, and optionally reset, the link traffic counters. */
+void vchiq_loopback_get_stats(VCHIQ_LOOPBACK_STATS_T *stats, int reset);
+
+/*
+ * Functions for use by fake services.
+ */
+
+/** Send a message to the host end of a connection. */
+VCHIQ_STATUS_T vchiq_loopback_queue_message(unsigned int handle,
+   const VCHIQ_ELEMENT_T *elements, unsigned int count);
+
+/** Queue a bulk transfer to the host. */
+VCHIQ_STATUS_T vchiq_loopback_queue_bulk_transmit(unsigned int handle,
+   const void *data, unsigned int size, void *userdata);
+
+/** Queue a bulk transfer from the host. */
+VCHIQ_STATUS_T vchiq_loopback_queue_bulk_receive(unsigned int handle,
+   void *data, unsigned int size, void *userdata);
+
+/** Close a connection from the VideoCore side. */
+VCHIQ_STATUS_T vchiq_loopback_close_service(unsigned int handle);
+
+/*
+ * Backend interface used by vchiq_lib.
+ */
+
+typedef struct
+{
+   const char *name;
+   int (*open)(void);
+   int (*close)(int fd);
+   int (*ioctl)(int fd, unsigned int request, void *arg);
+} VCHIQ_LIB_BACKEND_T;
+
+extern const VCHIQ_LIB_BACKEND_T vchiq_loopback_backend;
+
+#endif /* VCHIQ_LOOPBACK_H */
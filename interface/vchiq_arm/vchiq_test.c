@@ -34,6 +34,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define USE_VCHIQ_ARM
 #endif
 #include "interface/vchi/vchi.h"
+#ifdef __linux__
+#include "vchiq_loopback.h"
+#endif
 
 #define NUM_BULK_BUFS 2
 #define BULK_SIZE (1024*256)
@@ -65,6 +68,7 @@ static volatile int g_sync_mode = 0;
 
 static VCOS_EVENT_T func_test_sync;
 static int want_echo = 1;
+static VCHIQ_DISPATCH_PARAMS_T g_dispatch = { VCHIQ_DISPATCH_COMPLETION_THREAD, 0 };
 static int func_error = 0;
 static int fun2_error = 0;
 static int func_data_test_start = -1;
@@ -87,6 +91,9 @@ static char clnt_service2_data[SERVICE2_DATA_SIZE];
 static VCOS_LOG_CAT_T vchiq_test_log_category;
 
 static int vchiq_test(int argc, char **argv);
+#ifdef __linux__
+static void loopback_echo_register(void);
+#endif
 static VCHIQ_STATUS_T vchiq_bulk_test(void);
 static VCHIQ_STATUS_T vchiq_ctrl_test(void);
 static VCHIQ_STATUS_T vchiq_functional_test(void);
@@ -114,6 +121,7 @@ static VCHIQ_STATUS_T func_clnt_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *
 static VCHIQ_STATUS_T fun2_clnt_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
                                          VCHIQ_SERVICE_HANDLE_T service, void *bulk_userdata);
 static int mem_check(const void *expected, const void *actual, int size);
+static void print_dispatch_stats(VCHIQ_SERVICE_HANDLE_T service);
 static void usage(void);
 static void check_timer(void);
 static char *buf_align(char *buf, int align_size, int align);
@@ -162,6 +170,7 @@ static int vchiq_test(int argc, char **argv)
    int run_functional_test = 0;
    int run_ping_test = 0;
    int run_signal_test = 0;
+   int use_loopback = 0;
    int verbose = 0;
    int argn;
  
@@ -193,6 +202,19 @@ static int vchiq_test(int argc, char **argv)
          run_ctrl_test = 1;
          g_params.blocksize = atoi(argv[argn++]);
       }
+      else if (strcmp(arg, "-d") == 0)
+      {
+         const char *mode = (argn < argc) ? argv[argn++] : "";
+         if (strcmp(mode, "dedicated") == 0)
+            g_dispatch.mode = VCHIQ_DISPATCH_DEDICATED;
+         else if (strcmp(mode, "pooled") == 0)
+            g_dispatch.mode = VCHIQ_DISPATCH_POOLED;
+         else
+         {
+            printf("* unknown dispatch mode '%s'\n", mode);
+            usage();
+         }
+      }
       else if (strcmp(arg, "-e") == 0)
       {
          want_echo = 0;
@@ -209,6 +231,12 @@ static int vchiq_test(int argc, char **argv)
       {
          run_signal_test = 1;
       }
+#ifdef __linux__
+      else if (strcmp(arg, "-l") == 0)
+      {
+         use_loopback = 1;
+      }
+#endif
       else if (strcmp(arg, "-m") == 0)
       {
          g_params.client_message_quota = atoi(argv[argn++]);
@@ -296,6 +324,17 @@ static int vchiq_test(int argc, char **argv)
    vcos_log_set_level(VCOS_LOG_CATEGORY, verbose ? VCOS_LOG_TRACE : VCOS_LOG_INFO);
    vcos_log_register("vchiq_test", VCOS_LOG_CATEGORY);
 
+#ifdef __linux__
+   if (use_loopback)
+   {
+      /* Run against an in-process echo server instead of the VideoCore */
+      vchiq_loopback_enable(1);
+      loopback_echo_register();
+   }
+#else
+   vcos_unused(use_loopback);
+#endif
+
 #ifdef VCHIQ_LOCAL
    {
       static VCOS_THREAD_T server_task;
@@ -394,7 +433,7 @@ vchiq_bulk_test(void)
    service_params.callback = clnt_callback;
    service_params.userdata = "clnt userdata";
 
-   if (vchiq_open_service(vchiq_instance, &service_params, &vchiq_service) != VCHIQ_SUCCESS)
+   if (vchiq_open_service_dispatch(vchiq_instance, &service_params, &g_dispatch, &vchiq_service) != VCHIQ_SUCCESS)
    {
       printf("* failed to open service - already in use?\n");
       return VCHIQ_ERROR;
@@ -457,6 +496,8 @@ vchiq_bulk_test(void)
       free(bulk_bufs[i]);
    }
 
+   print_dispatch_stats(vchiq_service);
+
    vchiq_remove_service(vchiq_service);
 
    vcos_log_trace("vchiq_test: shutting down");
@@ -520,7 +561,7 @@ vchiq_ctrl_test(void)
    service_params.version = VCHIQ_TEST_VER;
    service_params.version_min = VCHIQ_TEST_VER;
 
-   if (vchiq_open_service(vchiq_instance, &service_params, &vchiq_service) != VCHIQ_SUCCESS)
+   if (vchiq_open_service_dispatch(vchiq_instance, &service_params, &g_dispatch, &vchiq_service) != VCHIQ_SUCCESS)
    {
       printf("* failed to open service - already in use?\n");
       return VCHIQ_ERROR;
@@ -565,6 +606,8 @@ vchiq_ctrl_test(void)
 
    end = vcos_getmicrosecs();
 
+   print_dispatch_stats(vchiq_service);
+
    vchiq_remove_service(vchiq_service);
 
    vcos_log_trace("vchiq_test: shutting down");
@@ -670,7 +713,7 @@ vchiq_ping_test(void)
    vchi_service_close(vchi_service);
 
    INIT_PARAMS(&vchiq_service_params, fourcc, clnt_callback, "clnt userdata", VCHIQ_TEST_VER);
-   if (vchiq_open_service(vchiq_instance, &vchiq_service_params, &vchiq_service) != VCHIQ_SUCCESS)
+   if (vchiq_open_service_dispatch(vchiq_instance, &vchiq_service_params, &g_dispatch, &vchiq_service) != VCHIQ_SUCCESS)
    {
       printf("* failed to open service - already in use?\n");
       return VCHIQ_ERROR;
@@ -702,6 +745,8 @@ vchiq_ping_test(void)
       do_ping_test(vchiq_service, sizes[i], 1000, 1000, iter_count/50);
    }
 
+   print_dispatch_stats(vchiq_service);
+
    vchiq_close_service(vchiq_service);
 
    return VCHIQ_SUCCESS;
@@ -1068,7 +1113,11 @@ do_vchi_ping_test(VCHI_SERVICE_HANDLE_T service, int size, int async, int oneway
    {
       params->magic = MSG_SYNC;
 
+      /* Taking the mutex waits for the callback to finish draining the
+       * queue, so it cannot consume the replies meant for this thread */
+      vcos_mutex_lock(&g_mutex);
       g_sync_mode = 1;
+      vcos_mutex_unlock(&g_mutex);
 
       start = vcos_getmicrosecs();
       for (i = 0; i < iters; i++)
@@ -1314,11 +1363,13 @@ clnt_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
    vcos_mutex_lock(&g_mutex);
    if (reason == VCHIQ_MESSAGE_AVAILABLE)
    {
-      if (header->size <= 1)
+      /* Read before the message is released, as the buffer is reused */
+      unsigned int size = header->size;
+      if (size <= 1)
          vchiq_release_message(service, header);
       else
       /* Responses of length 0 are not sync points */
-      if ((header->size >= 4) && (*(int *)header->data == MSG_ECHO))
+      if ((size >= 4) && (*(int *)header->data == MSG_ECHO))
       {
          /* This is a complete echoed packet */
          if (g_params.verify && (mem_check(header->data, bulk_tx_data[ctrl_received % NUM_BULK_BUFS], g_params.blocksize) != 0))
@@ -1329,10 +1380,10 @@ clnt_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header,
             vcos_event_signal(&g_shutdown);
          vchiq_release_message(service, header);
       }
-      else if (header->size != 0)
+      else if (size != 0)
          g_server_error = header->data;
 
-      if ((header->size != 0) || g_server_error)
+      if ((size != 0) || g_server_error)
          vcos_event_signal(&g_server_reply);
    }
    else if (reason == VCHIQ_BULK_TRANSMIT_DONE)
@@ -1585,14 +1636,29 @@ static int mem_check(const void *expected, const void *actual, int size)
    return 0;
 }
 
+static void print_dispatch_stats(VCHIQ_SERVICE_HANDLE_T service)
+{
+   VCHIQ_DISPATCH_STATS_T stats;
+
+   if ((vchiq_get_dispatch_stats(service, &stats, 0) != VCHIQ_SUCCESS) ||
+       (stats.callbacks == 0))
+      return;
+
+   printf("Callback delay: %dus average, %dus max, queue depth %d max, %d full\n",
+      (int)(stats.total_delay / stats.callbacks), stats.max_delay,
+      stats.max_queued, stats.queue_full);
+}
+
 static void usage(void)
 {
    printf("Usage: vchiq_test [<options>] <mode> <iters>\n");
    printf("  where <options> is any of:\n");
    printf("    -a <c> <s>  set the client and server bulk alignment (modulo 32)\n");
    printf("    -A <c> <s>  set the client and server bulk alignment (modulo 4096)\n");
+   printf("    -d <mode>   deliver callbacks on a 'dedicated' or 'pooled' thread\n");
    printf("    -e          disable echoing in the main bulk transfer mode\n");
    printf("    -k <n>      skip the first <n> func data tests\n");
+   printf("    -l          use the loopback backend with a built-in echo server\n");
    printf("    -m <n>      set the client message quota to <n>\n");
    printf("    -M <n>      set the server message quota to <n>\n");
    printf("    -q          disable data verification\n");
@@ -1610,6 +1676,158 @@ static void usage(void)
    exit(1);
 }
 
+#ifdef __linux__
+
+/*
+ * A fake "echo" server for the loopback backend, implementing the part of
+ * the VideoCore test server protocol used by the ctrl, bulk and ping tests.
+ */
+
+#define ECHO_MAX_PENDING_RX 4
+
+typedef struct
+{
+   struct test_params params;
+   int rx_remaining;    /* Bulk receives still to be queued */
+   int rx_pending;      /* Bulk receives queued but not complete */
+} ECHO_CONN_T;
+
+static void
+echo_reply(unsigned int handle, const void *data, int size)
+{
+   VCHIQ_ELEMENT_T element;
+
+   element.data = data;
+   element.size = size;
+   vchiq_loopback_queue_message(handle, &element, 1);
+}
+
+static void
+echo_queue_receives(unsigned int handle, ECHO_CONN_T *conn)
+{
+   while ((conn->rx_remaining > 0) && (conn->rx_pending < ECHO_MAX_PENDING_RX))
+   {
+      void *buf = malloc(conn->params.blocksize);
+      if (!buf ||
+          (vchiq_loopback_queue_bulk_receive(handle, buf, conn->params.blocksize, buf) != VCHIQ_SUCCESS))
+      {
+         free(buf);
+         break;
+      }
+      conn->rx_remaining--;
+      conn->rx_pending++;
+   }
+}
+
+static int
+echo_open(unsigned int handle, void *userdata, void **pconn)
+{
+   ECHO_CONN_T *conn = calloc(1, sizeof(*conn));
+
+   vcos_unused(handle);
+   vcos_unused(userdata);
+
+   *pconn = conn;
+   return conn ? 0 : -1;
+}
+
+static void
+echo_close(unsigned int handle, void *conn)
+{
+   vcos_unused(handle);
+   free(conn);
+}
+
+static void
+echo_message(unsigned int handle, void *context, const void *data, unsigned int size)
+{
+   static const char sync_reply = 0;
+   static const char bad_config[] = "bad config";
+   static const char bad_message[] = "unexpected message";
+   ECHO_CONN_T *conn = (ECHO_CONN_T *)context;
+   int magic;
+
+   if (size < sizeof(magic))
+   {
+      echo_reply(handle, bad_message, sizeof(bad_message));
+      return;
+   }
+
+   memcpy(&magic, data, sizeof(magic));
+
+   switch (magic)
+   {
+   case MSG_CONFIG:
+      if (size < sizeof(conn->params))
+      {
+         echo_reply(handle, bad_config, sizeof(bad_config));
+         break;
+      }
+      memcpy(&conn->params, data, sizeof(conn->params));
+      conn->rx_remaining = (conn->params.blocksize > 0) ? conn->params.iters : 0;
+      echo_queue_receives(handle, conn);
+      echo_reply(handle, &sync_reply, 1);
+      break;
+   case MSG_SYNC:
+      echo_reply(handle, &sync_reply, 1);
+      break;
+   case MSG_ASYNC:
+      /* Responses of length 0 are not sync points */
+      echo_reply(handle, &sync_reply, 0);
+      break;
+   case MSG_ONEWAY:
+      break;
+   case MSG_ECHO:
+      echo_reply(handle, data, size);
+      break;
+   default:
+      echo_reply(handle, bad_message, sizeof(bad_message));
+      break;
+   }
+}
+
+static void
+echo_bulk(unsigned int handle, void *context, VCHIQ_REASON_T reason,
+   void *data, unsigned int size, void *bulk_userdata)
+{
+   ECHO_CONN_T *conn = (ECHO_CONN_T *)context;
+
+   vcos_unused(bulk_userdata);
+
+   if ((reason == VCHIQ_BULK_RECEIVE_DONE) || (reason == VCHIQ_BULK_RECEIVE_ABORTED))
+      conn->rx_pending--;
+
+   if (reason == VCHIQ_BULK_RECEIVE_DONE)
+   {
+      /* The buffer is freed when the echo has been sent */
+      if (conn->params.echo &&
+          (vchiq_loopback_queue_bulk_transmit(handle, data, size, data) == VCHIQ_SUCCESS))
+         data = NULL;
+      echo_queue_receives(handle, conn);
+   }
+
+   free(data);
+}
+
+static void
+loopback_echo_register(void)
+{
+   VCHIQ_LOOPBACK_SERVICE_T echo;
+
+   memset(&echo, 0, sizeof(echo));
+   echo.fourcc = VCHIQ_MAKE_FOURCC(g_servname[0], g_servname[1], g_servname[2], g_servname[3]);
+   echo.version = VCHIQ_TEST_VER;
+   echo.version_min = VCHIQ_TEST_VER;
+   echo.open = echo_open;
+   echo.close = echo_close;
+   echo.message = echo_message;
+   echo.bulk = echo_bulk;
+
+   vchiq_loopback_register_service(&echo);
+}
+
+#endif
+
 static void check_timer(void)
 {
    uint32_t start = vcos_getmicrosecs();
@@ -75,6 +75,304 @@ static VCOS_LOG_CAT_T vcos_blockpool_log =
 VCOS_LOG_INIT("vcos_blockpool", VCOS_BLOCKPOOL_TRACE_LEVEL);
 #endif
 
+/* Free blocks are kept on a Treiber stack in each subpool, with a tag in the
+ * head that changes on every push and pop. All changes to a stack go through
+ * its head, so a successful compare-and-swap of the head means that nothing
+ * below it moved in the meantime and the links read on the way are good. The
+ * links may be read from blocks that have just been allocated, which is
+ * harmless because subpool memory stays mapped for as long as a pop can be
+ * in progress: until the pool is deleted in concurrent mode, and under the
+ * pool mutex otherwise.
+ *
+ * The pool keeps a bitmap of subpools whose stacks may be non-empty, so that
+ * an allocation goes straight to the first subpool with free blocks. A bit is
+ * set after a push; an allocator that finds a stack empty clears its bit and
+ * then looks again, setting it back if a push slipped in between.
+ */
+#define FREE_STACK_OFFSET(s)        ((uint32_t) (s))
+#define FREE_STACK_TAG(s)           ((uint32_t) ((s) >> 32))
+#define FREE_STACK_MAKE(offset, tag) \
+   (((uint64_t) (tag) << 32) | (uint32_t) (offset))
+
+/* Per-thread cache of free blocks, with VCOS_BLOCKPOOL_FLAG_THREAD_CACHE.
+ * Only the owning thread touches blocks and subpools; count is also read,
+ * without synchronisation, for the pool statistics. */
+typedef struct VCOS_BLOCKPOOL_MAGAZINE_TAG
+{
+   struct VCOS_BLOCKPOOL_MAGAZINE_TAG *next;
+   VCOS_BLOCKPOOL_T *pool;
+   volatile VCOS_UNSIGNED count;
+   VCOS_BLOCKPOOL_HEADER_T *blocks[VCOS_BLOCKPOOL_MAGAZINE_MAX];
+   VCOS_BLOCKPOOL_SUBPOOL_T *subpools[VCOS_BLOCKPOOL_MAGAZINE_MAX];
+} VCOS_BLOCKPOOL_MAGAZINE_T;
+
+/* One in this many blocks of a pool may sit in the cache of one thread */
+#define VCOS_BLOCKPOOL_MAGAZINE_RATIO 8
+
+static VCOS_UNSIGNED vcos_generic_blockpool_stack_offset(
+      VCOS_BLOCKPOOL_SUBPOOL_T *subpool, VCOS_BLOCKPOOL_HEADER_T *block)
+{
+   return block ? (VCOS_UNSIGNED) ((char *) block - (char *) subpool->mem) + 1 : 0;
+}
+
+static VCOS_BLOCKPOOL_HEADER_T *vcos_generic_blockpool_stack_block(
+      VCOS_BLOCKPOOL_SUBPOOL_T *subpool, uint32_t offset)
+{
+   return offset ? (VCOS_BLOCKPOOL_HEADER_T *) ((char *) subpool->mem + offset - 1) : NULL;
+}
+
+/* Without VCOS_BLOCKPOOL_FLAG_CONCURRENT the stacks and the bitmap are only
+ * changed with the pool mutex held, so plain updates are enough. */
+static int vcos_generic_blockpool_swap_head(VCOS_BLOCKPOOL_SUBPOOL_T *subpool,
+      uint64_t head, uint64_t new_head)
+{
+   if (subpool->owner->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT)
+      return __sync_bool_compare_and_swap(&subpool->free_stack, head, new_head);
+   subpool->free_stack = new_head;
+   return 1;
+}
+
+static void vcos_generic_blockpool_set_nonempty(VCOS_BLOCKPOOL_T *pool,
+      uint32_t bit, int nonempty)
+{
+   if (!(pool->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT))
+   {
+      if (nonempty)
+         pool->nonempty_subpools |= bit;
+      else
+         pool->nonempty_subpools &= ~bit;
+   }
+   else if (nonempty)
+      __sync_fetch_and_or(&pool->nonempty_subpools, bit);
+   else
+      __sync_fetch_and_and(&pool->nonempty_subpools, ~bit);
+}
+
+/* Push a chain of count blocks, linked from first to last, onto the free
+ * stack of a subpool. */
+static void vcos_generic_blockpool_push(VCOS_BLOCKPOOL_T *pool,
+      VCOS_BLOCKPOOL_SUBPOOL_T *subpool, VCOS_BLOCKPOOL_HEADER_T *first,
+      VCOS_BLOCKPOOL_HEADER_T *last, VCOS_UNSIGNED count)
+{
+   uint32_t bit = 1 << (subpool - pool->subpools);
+   uint64_t head;
+
+   do
+   {
+      head = subpool->free_stack;
+      last->owner.next = vcos_generic_blockpool_stack_block(subpool,
+            FREE_STACK_OFFSET(head));
+   } while (!vcos_generic_blockpool_swap_head(subpool, head,
+         FREE_STACK_MAKE(vcos_generic_blockpool_stack_offset(subpool, first),
+            FREE_STACK_TAG(head) + 1)));
+
+   if (pool->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT)
+      __sync_fetch_and_add(&subpool->available_blocks, count);
+   else
+      subpool->available_blocks += count;
+   if (!(pool->nonempty_subpools & bit))
+      vcos_generic_blockpool_set_nonempty(pool, bit, 1);
+}
+
+/* Pop a chain of up to max blocks from the free stack of a subpool. Returns
+ * the first block, or NULL if the stack was empty, and the number popped
+ * in *count. */
+static VCOS_BLOCKPOOL_HEADER_T *vcos_generic_blockpool_pop(
+      VCOS_BLOCKPOOL_SUBPOOL_T *subpool, VCOS_UNSIGNED max, VCOS_UNSIGNED *count)
+{
+   VCOS_BLOCKPOOL_HEADER_T *first, *last, *next;
+   uint64_t head;
+   VCOS_UNSIGNED n;
+
+   do
+   {
+      head = subpool->free_stack;
+      first = vcos_generic_blockpool_stack_block(subpool, FREE_STACK_OFFSET(head));
+      if (!first)
+         return NULL;
+
+      /* Links read here may be stale if the stack is changing under us, in
+       * which case the swap below fails. They are range checked so that a
+       * stale one is never followed out of the subpool. */
+      last = first;
+      next = last->owner.next;
+      for (n = 1; n < max && (void *) next >= subpool->start &&
+            (void *) next < subpool->end; n++)
+      {
+         last = next;
+         next = last->owner.next;
+      }
+      if ((void *) next < subpool->start || (void *) next >= subpool->end)
+         next = NULL;
+   } while (!vcos_generic_blockpool_swap_head(subpool, head,
+         FREE_STACK_MAKE(vcos_generic_blockpool_stack_offset(subpool, next),
+            FREE_STACK_TAG(head) + 1)));
+
+   if (subpool->owner->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT)
+      __sync_fetch_and_sub(&subpool->available_blocks, n);
+   else
+      subpool->available_blocks -= n;
+   *count = n;
+   return first;
+}
+
+/* Pop up to max blocks from the first subpool that has any. */
+static VCOS_BLOCKPOOL_HEADER_T *vcos_generic_blockpool_take(
+      VCOS_BLOCKPOOL_T *pool, VCOS_UNSIGNED max, VCOS_UNSIGNED *count,
+      VCOS_BLOCKPOOL_SUBPOOL_T **subpool_out)
+{
+   uint32_t nonempty;
+
+   while ((nonempty = pool->nonempty_subpools) != 0)
+   {
+      uint32_t i = __builtin_ctz(nonempty);
+      VCOS_BLOCKPOOL_SUBPOOL_T *subpool = &pool->subpools[i];
+      VCOS_BLOCKPOOL_HEADER_T *block =
+         vcos_generic_blockpool_pop(subpool, max, count);
+
+      if (block)
+      {
+         *subpool_out = subpool;
+         return block;
+      }
+
+      /* Found it empty. Clear the bit, unless a free has got in since. */
+      vcos_generic_blockpool_set_nonempty(pool, 1 << i, 0);
+      if (FREE_STACK_OFFSET(subpool->free_stack))
+         vcos_generic_blockpool_set_nonempty(pool, 1 << i, 1);
+   }
+
+   return NULL;
+}
+
+/* Return the calling thread's block cache, creating it if necessary. */
+static VCOS_BLOCKPOOL_MAGAZINE_T *vcos_generic_blockpool_magazine(
+      VCOS_BLOCKPOOL_T *pool)
+{
+   VCOS_BLOCKPOOL_MAGAZINE_T *magazine = vcos_tls_get(pool->magazine_key);
+
+   if (!magazine)
+   {
+      magazine = vcos_calloc(1, sizeof(*magazine), "vcos blockpool magazine");
+      if (!magazine)
+         return NULL;
+
+      magazine->pool = pool;
+      if (vcos_tls_set(pool->magazine_key, magazine) != VCOS_SUCCESS)
+      {
+         vcos_free(magazine);
+         return NULL;
+      }
+
+      vcos_mutex_lock(&pool->mutex);
+      magazine->next = pool->magazines;
+      pool->magazines = magazine;
+      vcos_mutex_unlock(&pool->mutex);
+   }
+
+   return magazine;
+}
+
+/* Return the oldest spill blocks of a cache to the subpools, one chain
+ * per subpool. */
+static void vcos_generic_blockpool_magazine_spill(VCOS_BLOCKPOOL_T *pool,
+      VCOS_BLOCKPOOL_MAGAZINE_T *magazine, VCOS_UNSIGNED spill)
+{
+   VCOS_BLOCKPOOL_HEADER_T *first[VCOS_BLOCKPOOL_MAX_SUBPOOLS];
+   VCOS_BLOCKPOOL_HEADER_T *last[VCOS_BLOCKPOOL_MAX_SUBPOOLS];
+   VCOS_UNSIGNED count[VCOS_BLOCKPOOL_MAX_SUBPOOLS];
+   VCOS_UNSIGNED i;
+
+   memset(count, 0, sizeof(count));
+   for (i = 0; i < spill; i++)
+   {
+      VCOS_BLOCKPOOL_HEADER_T *block = magazine->blocks[i];
+      uint32_t id = magazine->subpools[i] - pool->subpools;
+
+      if (count[id]++)
+         last[id]->owner.next = block;
+      else
+         first[id] = block;
+      last[id] = block;
+   }
+
+   for (i = 0; i < VCOS_BLOCKPOOL_MAX_SUBPOOLS; i++)
+   {
+      if (count[i])
+         vcos_generic_blockpool_push(pool, &pool->subpools[i],
+               first[i], last[i], count[i]);
+   }
+
+   magazine->count -= spill;
+   memmove(magazine->blocks, magazine->blocks + spill,
+         magazine->count * sizeof(magazine->blocks[0]));
+   memmove(magazine->subpools, magazine->subpools + spill,
+         magazine->count * sizeof(magazine->subpools[0]));
+}
+
+/* Called as a thread that used the pool exits. Give its cached blocks back
+ * to the subpools, where other threads can allocate them. */
+static void vcos_generic_blockpool_magazine_release(void *arg)
+{
+   VCOS_BLOCKPOOL_MAGAZINE_T *magazine = arg;
+   VCOS_BLOCKPOOL_T *pool = magazine->pool;
+   VCOS_BLOCKPOOL_MAGAZINE_T **link;
+
+   vcos_generic_blockpool_magazine_spill(pool, magazine, magazine->count);
+
+   vcos_mutex_lock(&pool->mutex);
+   for (link = &pool->magazines; *link != magazine; link = &(*link)->next)
+      ;
+   *link = magazine->next;
+   vcos_mutex_unlock(&pool->mutex);
+
+   vcos_free(magazine);
+}
+
+/* Refill an empty cache with half its size of blocks from one subpool. */
+static void vcos_generic_blockpool_magazine_fill(VCOS_BLOCKPOOL_T *pool,
+      VCOS_BLOCKPOOL_MAGAZINE_T *magazine)
+{
+   VCOS_BLOCKPOOL_SUBPOOL_T *subpool = NULL;
+   VCOS_BLOCKPOOL_HEADER_T *block;
+   VCOS_UNSIGNED count = 0, i;
+
+   block = vcos_generic_blockpool_take(pool, pool->magazine_size / 2,
+         &count, &subpool);
+   for (i = 0; i < count; i++)
+   {
+      magazine->blocks[i] = block;
+      magazine->subpools[i] = subpool;
+      block = block->owner.next;
+   }
+   magazine->count = count;
+}
+
+static void vcos_generic_blockpool_set_magazine_size(VCOS_BLOCKPOOL_T *pool,
+      VCOS_UNSIGNED num_blocks)
+{
+   VCOS_UNSIGNED size = num_blocks / VCOS_BLOCKPOOL_MAGAZINE_RATIO;
+
+   if (!(pool->flags & VCOS_BLOCKPOOL_FLAG_THREAD_CACHE))
+      return;
+
+   if (size > VCOS_BLOCKPOOL_MAGAZINE_MAX)
+      size = VCOS_BLOCKPOOL_MAGAZINE_MAX;
+   /* A cache must hold at least two blocks to move them in batches */
+   pool->magazine_size = size >= 2 ? size : 0;
+}
+
+/* Number of free blocks held in thread caches. Called with the mutex held. */
+static VCOS_UNSIGNED vcos_generic_blockpool_cached_count(VCOS_BLOCKPOOL_T *pool)
+{
+   VCOS_BLOCKPOOL_MAGAZINE_T *magazine;
+   VCOS_UNSIGNED ret = 0;
+
+   for (magazine = pool->magazines; magazine; magazine = magazine->next)
+      ret += magazine->count;
+   return ret;
+}
+
 static void vcos_generic_blockpool_subpool_init(
       VCOS_BLOCKPOOL_T *pool, VCOS_BLOCKPOOL_SUBPOOL_T *subpool,
       void *mem, size_t pool_size, VCOS_UNSIGNED num_blocks, int align,
@@ -83,8 +381,6 @@ static void vcos_generic_blockpool_subpool_init(
    VCOS_BLOCKPOOL_HEADER_T *block;
    VCOS_BLOCKPOOL_HEADER_T *end;
 
-   vcos_unused(flags);
-
    vcos_log_trace(
          "%s: pool %p subpool %p mem %p pool_size %d " \
          "num_blocks %d align %d flags %x",
@@ -94,6 +390,7 @@ static void vcos_generic_blockpool_subpool_init(
 
    subpool->magic = VCOS_BLOCKPOOL_SUBPOOL_MAGIC;
    subpool->mem = mem;
+   subpool->flags = flags;
 
    /* The block data pointers must be aligned according to align and the
     * block header pre-preceeds the first block data.
@@ -114,7 +411,6 @@ static void vcos_generic_blockpool_subpool_init(
 
    subpool->num_blocks = num_blocks;
    subpool->available_blocks = num_blocks;
-   subpool->free_list = NULL;
    subpool->owner = pool;
 
    /* Initialise to a predictable bit pattern unless the pool is so big
@@ -127,14 +423,17 @@ static void vcos_generic_blockpool_subpool_init(
       ((char *) subpool->start + (pool->block_size * num_blocks));
    subpool->end = end;
 
-   /* Initialise the free list for this subpool */
+   /* Initialise the free stack for this subpool, lowest address first */
    while (block < end)
    {
-      block->owner.next = subpool->free_list;
-      subpool->free_list = block;
-      block = (VCOS_BLOCKPOOL_HEADER_T*)((char*) block + pool->block_size);
+      VCOS_BLOCKPOOL_HEADER_T *next = (VCOS_BLOCKPOOL_HEADER_T*)
+         ((char*) block + pool->block_size);
+      block->owner.next = next < end ? next : NULL;
+      block = next;
    }
-
+   subpool->free_stack = FREE_STACK_MAKE(
+         vcos_generic_blockpool_stack_offset(subpool, subpool->start),
+         FREE_STACK_TAG(subpool->free_stack) + 1);
 }
 
 VCOS_STATUS_T vcos_generic_blockpool_init(VCOS_BLOCKPOOL_T *pool,
@@ -145,7 +444,6 @@ VCOS_STATUS_T vcos_generic_blockpool_init(VCOS_BLOCKPOOL_T *pool,
    VCOS_STATUS_T status = VCOS_SUCCESS;
 
    vcos_unused(name);
-   vcos_unused(flags);
 
    vcos_log_trace(
          "%s: pool %p num_blocks %d block_size %d start %p pool_size %d name %p",
@@ -175,10 +473,21 @@ VCOS_STATUS_T vcos_generic_blockpool_init(VCOS_BLOCKPOOL_T *pool,
       return VCOS_ENOMEM;
    }
 
+   if (flags & VCOS_BLOCKPOOL_FLAG_THREAD_CACHE)
+      flags |= VCOS_BLOCKPOOL_FLAG_CONCURRENT;
+
    status = vcos_mutex_create(&pool->mutex, "vcos blockpool mutex");
    if (status != VCOS_SUCCESS)
       return status;
 
+   if ((flags & VCOS_BLOCKPOOL_FLAG_THREAD_CACHE) &&
+         vcos_tls_create_with_destructor(&pool->magazine_key,
+            vcos_generic_blockpool_magazine_release) != VCOS_SUCCESS)
+   {
+      vcos_log_warn("%s: no thread caches for pool %p", VCOS_FUNCTION, pool);
+      flags &= ~VCOS_BLOCKPOOL_FLAG_THREAD_CACHE;
+   }
+
    pool->block_data_size = block_size;
 
    /* TODO - create flag that if set forces the header to be in its own cache
@@ -191,10 +500,15 @@ VCOS_STATUS_T vcos_generic_blockpool_init(VCOS_BLOCKPOOL_T *pool,
    pool->num_subpools = 1;
    pool->num_extension_blocks = 0;
    pool->align = align;
+   pool->flags = flags;
+   pool->magazine_size = 0;
+   pool->magazines = NULL;
    memset(pool->subpools, 0, sizeof(pool->subpools));
 
    vcos_generic_blockpool_subpool_init(pool, &pool->subpools[0], start,
          pool_size, num_blocks, align, VCOS_BLOCKPOOL_SUBPOOL_FLAG_NONE);
+   pool->nonempty_subpools = 1;
+   vcos_generic_blockpool_set_magazine_size(pool, num_blocks);
 
    return status;
 }
@@ -249,6 +563,8 @@ VCOS_STATUS_T vcos_generic_blockpool_extend(VCOS_BLOCKPOOL_T *pool,
 
    pool->num_subpools += num_extensions;
    pool->num_extension_blocks = num_blocks;
+   vcos_generic_blockpool_set_magazine_size(pool, pool->subpools[0].num_blocks +
+         num_extensions * num_blocks);
 
    /* Mark these subpools as valid but unallocated */
    for (i = 1; i < pool->num_subpools; ++i)
@@ -261,71 +577,95 @@ VCOS_STATUS_T vcos_generic_blockpool_extend(VCOS_BLOCKPOOL_T *pool,
    return VCOS_SUCCESS;
 }
 
-void *vcos_generic_blockpool_alloc(VCOS_BLOCKPOOL_T *pool)
+/* Allocate a new extension subpool, if there is room for one, and add its
+ * blocks to the pool. Called with the mutex held. */
+static void vcos_generic_blockpool_grow(VCOS_BLOCKPOOL_T *pool)
 {
    VCOS_UNSIGNED i;
+
+   for (i = 1; i < pool->num_subpools; ++i)
+   {
+      if (! pool->subpools[i].start)
+      {
+         VCOS_BLOCKPOOL_SUBPOOL_T *s = &pool->subpools[i];
+         size_t size = VCOS_BLOCKPOOL_SIZE(pool->num_extension_blocks,
+               pool->block_data_size, pool->align);
+         void *mem = vcos_malloc(size, pool->name);
+         if (mem)
+         {
+            vcos_log_trace("%s: Allocated subpool %d", VCOS_FUNCTION, i);
+            vcos_generic_blockpool_subpool_init(pool, s, mem, size,
+                  pool->num_extension_blocks,
+                  pool->align,
+                  VCOS_BLOCKPOOL_SUBPOOL_FLAG_OWNS_MEM |
+                  VCOS_BLOCKPOOL_SUBPOOL_FLAG_EXTENSION);
+            /* Publishes the initialised subpool to lock-free allocators */
+            vcos_generic_blockpool_set_nonempty(pool, 1 << i, 1);
+            break; /* Created a subpool */
+         }
+         else
+         {
+            vcos_log_warn("%s: Failed to allocate subpool", VCOS_FUNCTION);
+         }
+      }
+   }
+}
+
+void *vcos_generic_blockpool_alloc(VCOS_BLOCKPOOL_T *pool)
+{
+   VCOS_UNSIGNED count;
    void* ret = NULL;
    VCOS_BLOCKPOOL_SUBPOOL_T *subpool = NULL;
+   VCOS_BLOCKPOOL_HEADER_T* nb = NULL;
+   int concurrent;
 
    ASSERT_POOL(pool);
-   vcos_mutex_lock(&pool->mutex);
+   concurrent = pool->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT;
 
-   /* Starting with the main pool try and find a free block */
-   for (i = 0; i < pool->num_subpools; ++i)
+   if (pool->magazine_size)
    {
-      if (pool->subpools[i].start && pool->subpools[i].available_blocks > 0)
+      VCOS_BLOCKPOOL_MAGAZINE_T *magazine = vcos_generic_blockpool_magazine(pool);
+      if (magazine)
       {
-         subpool = &pool->subpools[i];
-         break; /* Found a subpool with free blocks */
+         if (!magazine->count)
+            vcos_generic_blockpool_magazine_fill(pool, magazine);
+         if (magazine->count)
+         {
+            --magazine->count;
+            nb = magazine->blocks[magazine->count];
+            subpool = magazine->subpools[magazine->count];
+         }
       }
    }
 
-   if (! subpool)
+   if (!nb)
    {
-      /* All current subpools are full, try to allocate a new one */
-      for (i = 1; i < pool->num_subpools; ++i)
+      if (concurrent)
+         nb = vcos_generic_blockpool_take(pool, 1, &count, &subpool);
+
+      if (!nb)
       {
-         if (! pool->subpools[i].start)
+         vcos_mutex_lock(&pool->mutex);
+         /* Starting with the main pool try and find a free block */
+         nb = vcos_generic_blockpool_take(pool, 1, &count, &subpool);
+         if (!nb)
          {
-            VCOS_BLOCKPOOL_SUBPOOL_T *s = &pool->subpools[i];
-            size_t size = VCOS_BLOCKPOOL_SIZE(pool->num_extension_blocks,
-                  pool->block_data_size, pool->align);
-            void *mem = vcos_malloc(size, pool->name);
-            if (mem)
-            {
-               vcos_log_trace("%s: Allocated subpool %d", VCOS_FUNCTION, i);
-               vcos_generic_blockpool_subpool_init(pool, s, mem, size,
-                     pool->num_extension_blocks,
-                     pool->align,
-                     VCOS_BLOCKPOOL_SUBPOOL_FLAG_OWNS_MEM |
-                     VCOS_BLOCKPOOL_SUBPOOL_FLAG_EXTENSION);
-               subpool = s;
-               break; /* Created a subpool */
-            }
-            else
-            {
-               vcos_log_warn("%s: Failed to allocate subpool", VCOS_FUNCTION);
-            }
+            /* All current subpools are full, try to allocate a new one */
+            vcos_generic_blockpool_grow(pool);
+            nb = vcos_generic_blockpool_take(pool, 1, &count, &subpool);
          }
+         vcos_mutex_unlock(&pool->mutex);
       }
    }
 
-   if (subpool)
+   if (nb)
    {
-      /* Remove from free list */
-      VCOS_BLOCKPOOL_HEADER_T* nb = subpool->free_list;
-
-      vcos_assert(subpool->free_list);
-      subpool->free_list = nb->owner.next;
-
       /* Owner is pool so free can be called without passing pool
        * as a parameter */
       nb->owner.subpool = subpool;
 
       ret = nb + 1; /* Return pointer to block data */
-      --(subpool->available_blocks);
    }
-   vcos_mutex_unlock(&pool->mutex);
    VCOS_BLOCKPOOL_DEBUG_LOG("pool %p subpool %p ret %p", pool, subpool, ret);
 
    if (ret)
@@ -357,16 +697,37 @@ void vcos_generic_blockpool_free(void *block)
       pool = subpool->owner;
       ASSERT_POOL(pool);
 
+      if (VCOS_BLOCKPOOL_OVERWRITE_ON_FREE)
+         memset(block, 0xBD, pool->block_data_size); /* For debugging */
+
+      if (pool->flags & VCOS_BLOCKPOOL_FLAG_CONCURRENT)
+      {
+         VCOS_BLOCKPOOL_MAGAZINE_T *magazine = pool->magazine_size ?
+            vcos_generic_blockpool_magazine(pool) : NULL;
+
+         /* Change ownership of block to be the free list */
+         hdr->owner.next = NULL;
+         if (magazine)
+         {
+            if (magazine->count >= pool->magazine_size)
+               vcos_generic_blockpool_magazine_spill(pool, magazine,
+                     magazine->count / 2);
+            magazine->blocks[magazine->count] = hdr;
+            magazine->subpools[magazine->count] = subpool;
+            ++magazine->count;
+         }
+         else
+         {
+            vcos_generic_blockpool_push(pool, subpool, hdr, hdr, 1);
+         }
+         return;
+      }
+
       vcos_mutex_lock(&pool->mutex);
       vcos_assert((unsigned) subpool->available_blocks < subpool->num_blocks);
 
       /* Change ownership of block to be the free list */
-      hdr->owner.next = subpool->free_list;
-      subpool->free_list = hdr;
-      ++(subpool->available_blocks);
-
-      if (VCOS_BLOCKPOOL_OVERWRITE_ON_FREE)
-         memset(block, 0xBD, pool->block_data_size); /* For debugging */
+      vcos_generic_blockpool_push(pool, subpool, hdr, hdr, 1);
 
       if ( (subpool->flags & VCOS_BLOCKPOOL_SUBPOOL_FLAG_EXTENSION) &&
             subpool->available_blocks == subpool->num_blocks)
@@ -374,6 +735,8 @@ void vcos_generic_blockpool_free(void *block)
          VCOS_BLOCKPOOL_DEBUG_LOG("%s: freeing subpool %p mem %p", VCOS_FUNCTION,
                subpool, subpool->mem);
          /* Free the sub-pool if it was dynamically allocated */
+         vcos_generic_blockpool_set_nonempty(pool,
+               1 << (subpool - pool->subpools), 0);
          vcos_free(subpool->mem);
          subpool->mem = NULL;
          subpool->start = NULL;
@@ -400,6 +763,7 @@ VCOS_UNSIGNED vcos_generic_blockpool_available_count(VCOS_BLOCKPOOL_T *pool)
       else
          ret += pool->num_extension_blocks;
    }
+   ret += vcos_generic_blockpool_cached_count(pool);
    vcos_mutex_unlock(&pool->mutex);
    return ret;
 }
@@ -419,6 +783,7 @@ VCOS_UNSIGNED vcos_generic_blockpool_used_count(VCOS_BLOCKPOOL_T *pool)
       if (subpool->start)
          ret += (subpool->num_blocks - subpool->available_blocks);
    }
+   ret -= vcos_generic_blockpool_cached_count(pool);
    vcos_mutex_unlock(&pool->mutex);
    return ret;
 }
@@ -450,6 +815,14 @@ void vcos_generic_blockpool_delete(VCOS_BLOCKPOOL_T *pool)
             subpool->start = NULL;
          }
       }
+      while (pool->magazines)
+      {
+         VCOS_BLOCKPOOL_MAGAZINE_T *magazine = pool->magazines;
+         pool->magazines = magazine->next;
+         vcos_free(magazine);
+      }
+      if (pool->flags & VCOS_BLOCKPOOL_FLAG_THREAD_CACHE)
+         vcos_tls_delete(pool->magazine_key);
       vcos_mutex_delete(&pool->mutex);
       memset(pool, 0xBE, sizeof(VCOS_BLOCKPOOL_T)); /* For debugging */
    }
@@ -70,6 +70,22 @@ extern "C" {
 #define VCOS_BLOCKPOOL_ALIGN_DEFAULT sizeof(unsigned long)
 #define VCOS_BLOCKPOOL_FLAG_NONE 0
 
+/** Allocate and free blocks without taking the pool mutex. Free blocks are
+ * kept on a lock-free stack in each subpool, so extension subpools are only
+ * released when the pool is deleted rather than as soon as they empty. */
+#define VCOS_BLOCKPOOL_FLAG_CONCURRENT    (1 << 0)
+
+/** Keep a small cache (magazine) of free blocks for each thread using the
+ * pool, exchanging them with the subpools in batches. Implies
+ * VCOS_BLOCKPOOL_FLAG_CONCURRENT. A cache holds at most 1/8th of the blocks
+ * in the pool, and none for pools of fewer than 16 blocks, but blocks cached
+ * by a thread can only be allocated by that thread until it exits. A thread
+ * that used the pool must not exit while the pool is being deleted. */
+#define VCOS_BLOCKPOOL_FLAG_THREAD_CACHE  (1 << 1)
+
+/** Largest number of blocks held in the cache of one thread */
+#define VCOS_BLOCKPOOL_MAGAZINE_MAX 16
+
 typedef struct VCOS_BLOCKPOOL_HEADER_TAG
 {
    /* Blocks either refer to to the pool if they are allocated
@@ -85,7 +101,11 @@ typedef struct VCOS_BLOCKPOOL_SUBPOOL_TAG
 {
    /** VCOS_BLOCKPOOL_SUBPOOL_MAGIC */
    uint32_t magic;
-   VCOS_BLOCKPOOL_HEADER_T* free_list;
+   /** Stack of free blocks, linked through the block headers. The low 32 bits
+    * are one more than the byte offset of the top block from mem (zero when
+    * the stack is empty) and the high 32 bits are a tag incremented by every
+    * push and pop, so that a stale head can never be swapped back in. */
+   volatile uint64_t free_stack;
    /* The start of the pool memory */
    void *mem;
    /* Address of the first block header */
@@ -94,8 +114,8 @@ typedef struct VCOS_BLOCKPOOL_SUBPOOL_TAG
    void *end;
    /** The number of blocks in this sub-pool */
    VCOS_UNSIGNED num_blocks;
-   /** Current number of available blocks in this sub-pool */
-   VCOS_UNSIGNED available_blocks;
+   /** Current number of blocks on the free stack of this sub-pool */
+   volatile VCOS_UNSIGNED available_blocks;
    /** Pointers to the pool that owns this sub-pool */
    struct VCOS_BLOCKPOOL_TAG* owner;
    /** Define properties such as memory ownership */
@@ -106,7 +126,8 @@ typedef struct VCOS_BLOCKPOOL_TAG
 {
    /** VCOS_BLOCKPOOL_MAGIC */
    uint32_t magic;
-   /** Thread safety for Alloc, Free, Delete, Stats */
+   /** Thread safety for Alloc, Free, Delete, Stats. With
+    * VCOS_BLOCKPOOL_FLAG_CONCURRENT only needed to add a subpool. */
    VCOS_MUTEX_T mutex;
    /** Alignment of block data pointers */
    VCOS_UNSIGNED align;
@@ -122,6 +143,14 @@ typedef struct VCOS_BLOCKPOOL_TAG
    VCOS_UNSIGNED num_subpools;
    /** Number of blocks in each dynamically allocated subpool */
    VCOS_UNSIGNED num_extension_blocks;
+   /** Bit n is set if subpool n may have blocks on its free stack */
+   volatile uint32_t nonempty_subpools;
+   /** Per-thread block caches, with VCOS_BLOCKPOOL_FLAG_THREAD_CACHE */
+   VCOS_TLS_KEY_T magazine_key;
+   /** Number of blocks a thread may cache, or zero if there are no caches */
+   VCOS_UNSIGNED magazine_size;
+   /** Every cache created for the pool. Protected by mutex. */
+   struct VCOS_BLOCKPOOL_MAGAZINE_TAG *magazines;
    /** Array of subpools. Subpool zero is is not deleted until the pool is
     * destroed. If the index of the pool is < num_subpools and
     * subpool[index.mem] is null then the subpool entry is valid but
@@ -145,6 +145,15 @@ VCOS_STATUS_T vcos_tls_create(VCOS_TLS_KEY_T *key) {
    return vcos_generic_tls_create(key);
 }
 
+/** Emulated TLS has no hook on thread exit, so the destructor is not used.
+  */
+VCOS_INLINE_IMPL
+VCOS_STATUS_T vcos_tls_create_with_destructor(VCOS_TLS_KEY_T *key,
+                                              void (*destructor)(void *)) {
+   (void)destructor;
+   return vcos_generic_tls_create(key);
+}
+
 VCOS_INLINE_IMPL
 void vcos_tls_delete(VCOS_TLS_KEY_T tls) {
    vcos_generic_tls_delete(tls);
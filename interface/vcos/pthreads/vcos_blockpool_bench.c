@@ -0,0 +1,237 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+/*
+ * Stress benchmark for VCOS block pools.
+ *
+ * Several threads allocate blocks from one pool and hand them to each other
+ * through a shared array of slots, so that most blocks are freed by a thread
+ * other than the one that allocated them, as happens with the client contexts
+ * of mmal_vc ports. Every block is marked while it is allocated to catch a
+ * block being handed out twice, and handles and validity checks are made on
+ * a sample of blocks. The pool can be run with the mutex, in concurrent mode
+ * or with per-thread caches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+
+#define BENCH_MAX_THREADS 32
+#define BENCH_SLOTS 64
+#define BENCH_HELD 8
+
+/* in_use is 1 while a block is allocated. Blocks that have never been
+ * allocated hold the pattern a new subpool is filled with. */
+typedef struct
+{
+   volatile uint32_t in_use;
+   uint32_t owner;
+} BENCH_BLOCK_T;
+
+typedef struct
+{
+   VCOS_THREAD_T thread;
+   unsigned int index;
+   unsigned int allocs;
+   unsigned int failures;
+   unsigned int errors;
+} BENCH_THREAD_T;
+
+static VCOS_BLOCKPOOL_T pool;
+static BENCH_BLOCK_T * volatile slots[BENCH_SLOTS];
+static unsigned int iterations = 200000;
+
+static int bench_check(BENCH_BLOCK_T *block)
+{
+   uint32_t handle = vcos_blockpool_elem_to_handle(block);
+
+   return vcos_blockpool_elem_from_handle(&pool, handle) == block &&
+      vcos_blockpool_is_valid_elem(&pool, block);
+}
+
+static void *bench_thread(void *arg)
+{
+   BENCH_THREAD_T *t = (BENCH_THREAD_T *)arg;
+   BENCH_BLOCK_T *held[BENCH_HELD];
+   unsigned int seed = t->index * 7919 + 1, i, n;
+
+   for (i = 0; i < iterations; i++)
+   {
+      BENCH_BLOCK_T *block = vcos_blockpool_alloc(&pool);
+
+      if (!block)
+      {
+         t->failures++;
+         continue;
+      }
+      t->allocs++;
+      if (__sync_lock_test_and_set(&block->in_use, 1) == 1)
+         t->errors++;
+      block->owner = t->index;
+      if ((i & 15) == 0 && !bench_check(block))
+         t->errors++;
+
+      /* Swap the block with one left by any thread, and free that one */
+      seed = seed * 1103515245 + 12345;
+      block = __sync_lock_test_and_set(&slots[(seed >> 16) % BENCH_SLOTS], block);
+      if (!block)
+         continue;
+
+      /* Sometimes hold on to a few blocks before freeing them together */
+      if ((seed >> 8) & 1)
+      {
+         held[0] = block;
+         for (n = 1; n < BENCH_HELD; n++)
+         {
+            held[n] = vcos_blockpool_alloc(&pool);
+            if (!held[n])
+               break;
+            if (__sync_lock_test_and_set(&held[n]->in_use, 1) == 1)
+               t->errors++;
+         }
+      }
+      else
+      {
+         held[0] = block;
+         n = 1;
+      }
+
+      while (n--)
+      {
+         __sync_lock_release(&held[n]->in_use);
+         vcos_blockpool_free(held[n]);
+      }
+   }
+
+   return NULL;
+}
+
+static void usage(void)
+{
+   printf("Usage: vcos_blockpool_bench [-t <threads>] [-b <blocks>] [-e <extensions>] [-i <iters>] [-m lock|concurrent|cache]\n");
+   printf("    -t <n>      number of threads (default 4)\n");
+   printf("    -b <n>      blocks in the pool and in each extension (default 256)\n");
+   printf("    -e <n>      extension subpools (default 0)\n");
+   printf("    -i <n>      allocations per thread (default 200000)\n");
+   printf("    -m <mode>   pool mode (default cache)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   BENCH_THREAD_T threads[BENCH_MAX_THREADS];
+   unsigned int num_threads = 4, num_blocks = 256, extensions = 0;
+   unsigned int i, allocs = 0, failures = 0, errors = 0, total;
+   VCOS_UNSIGNED flags = VCOS_BLOCKPOOL_FLAG_THREAD_CACHE;
+   VCOS_THREAD_ATTR_T attrs;
+   uint32_t start, elapsed;
+   int argn;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-t") && argn + 1 < argc)
+         num_threads = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         num_blocks = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-e") && argn + 1 < argc)
+         extensions = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-i") && argn + 1 < argc)
+         iterations = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-m") && argn + 1 < argc)
+      {
+         argn++;
+         if (!strcmp(argv[argn], "lock"))
+            flags = VCOS_BLOCKPOOL_FLAG_NONE;
+         else if (!strcmp(argv[argn], "concurrent"))
+            flags = VCOS_BLOCKPOOL_FLAG_CONCURRENT;
+         else if (!strcmp(argv[argn], "cache"))
+            flags = VCOS_BLOCKPOOL_FLAG_THREAD_CACHE;
+         else
+            usage();
+      }
+      else
+         usage();
+   }
+
+   if (!num_threads || num_threads > BENCH_MAX_THREADS || !num_blocks ||
+         extensions >= VCOS_BLOCKPOOL_MAX_SUBPOOLS)
+      usage();
+
+   vcos_init();
+   if (vcos_blockpool_create_on_heap(&pool, num_blocks, sizeof(BENCH_BLOCK_T),
+         VCOS_BLOCKPOOL_ALIGN_DEFAULT, flags, "bench pool") != VCOS_SUCCESS)
+      return 1;
+   if (extensions &&
+         vcos_blockpool_extend(&pool, extensions, num_blocks) != VCOS_SUCCESS)
+      return 1;
+   total = vcos_blockpool_available_count(&pool);
+
+   memset(threads, 0, sizeof(threads));
+   vcos_thread_attr_init(&attrs);
+   start = vcos_getmicrosecs();
+   for (i = 0; i < num_threads; i++)
+   {
+      threads[i].index = i;
+      if (vcos_thread_create(&threads[i].thread, "bench", &attrs, bench_thread, &threads[i]) != VCOS_SUCCESS)
+         return 1;
+   }
+   for (i = 0; i < num_threads; i++)
+   {
+      vcos_thread_join(&threads[i].thread, NULL);
+      allocs += threads[i].allocs;
+      failures += threads[i].failures;
+      errors += threads[i].errors;
+   }
+   elapsed = vcos_getmicrosecs() - start;
+
+   for (i = 0; i < BENCH_SLOTS; i++)
+   {
+      if (slots[i])
+      {
+         __sync_lock_release(&slots[i]->in_use);
+         vcos_blockpool_free(slots[i]);
+      }
+   }
+
+   printf("%u threads, %u blocks: %u allocations in %u us, %.1f ns per allocation and free\n",
+          num_threads, total, allocs, elapsed, elapsed * 1000.0 / (allocs ? allocs : 1));
+   printf("%u failed allocations, %u errors\n", failures, errors);
+
+   /* Blocks left in the caches of exited threads still count as available */
+   if (vcos_blockpool_used_count(&pool) != 0 ||
+         vcos_blockpool_available_count(&pool) != total)
+   {
+      printf("pool counts wrong at the end: %u used, %u available\n",
+             vcos_blockpool_used_count(&pool),
+             vcos_blockpool_available_count(&pool));
+      errors++;
+   }
+
+   vcos_blockpool_delete(&pool);
+   return errors ? 1 : 0;
+}
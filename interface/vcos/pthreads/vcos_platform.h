@@ -125,13 +125,13 @@ typedef __timer_t timer_t;
 #endif
 typedef struct VCOS_TIMER_T
 {
-   pthread_t thread;                      /**< id of the timer thread */
+   struct VCOS_TIMER_T *next;             /**< next timer in the same timer wheel list*/
+   struct VCOS_TIMER_T **pprev;           /**< link to this timer in its list, or NULL if in none*/
+   uint64_t expires;                      /**< expiry time in timer wheel ticks on the monotonic clock*/
+   int slot;                              /**< timer wheel slot holding the timer, or -1*/
+   int state;                             /**< whether the timer is set, or its routine due to run*/
 
-   pthread_mutex_t lock;                  /**< lock protecting all other members of the struct */
-   pthread_cond_t settings_changed;       /**< cond. var. for informing the timer thread about changes*/
-   int quit;                              /**< non-zero if the timer thread is requested to quit*/
-
-   struct timespec expires;               /**< absolute time of next expiration, or 0 if disarmed*/
+   pthread_mutex_t lock;                  /**< held by set and cancel, and while the routine runs*/
 
    void (*orig_expiration_routine)(void*);/**< the expiration routine provided by the user of the timer*/
    void *orig_context;                    /**< the context for exp. routine provided by the user*/
@@ -627,6 +627,13 @@ VCOS_STATUS_T vcos_tls_create(VCOS_TLS_KEY_T *key) {
    return st == 0 ? VCOS_SUCCESS: VCOS_ENOMEM;
 }
 
+VCOS_INLINE_IMPL
+VCOS_STATUS_T vcos_tls_create_with_destructor(VCOS_TLS_KEY_T *key,
+                                              void (*destructor)(void *)) {
+   int st = pthread_key_create(key, destructor);
+   return st == 0 ? VCOS_SUCCESS: VCOS_ENOMEM;
+}
+
 VCOS_INLINE_IMPL
 void vcos_tls_delete(VCOS_TLS_KEY_T tls) {
    pthread_key_delete(tls);
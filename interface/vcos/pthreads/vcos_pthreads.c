@@ -665,80 +665,327 @@ VCOS_THREAD_T *vcos_dummy_thread_create(void)
  *
  ***********************************************************/
 
-/* On Linux we could use POSIX timers with a bit of synchronization.
- * Unfortunately POSIX timers on Bionic are NOT POSIX compliant
- * what makes that option not viable.
- * That's why we ended up with our own implementation of timers.
- * NOTE: That condition variables on Bionic are also buggy and
- * they work incorrectly with CLOCK_MONOTONIC, so we have to
- * use CLOCK_REALTIME (and hope that no one will change the time
- * significantly after the timer has been set up
+/* Timers are kept in a hierarchical timer wheel, served by a single thread
+ * shared by every timer in the process rather than a thread per timer.
+ * Time is counted in ticks of 100us on CLOCK_MONOTONIC, so changes to the wall
+ * clock do not affect timers. Level 0 of the wheel has a slot for each of the
+ * next 64 ticks, and each level above has slots 64 times the span of those below;
+ * a slot of an upper level is cascaded into the levels below when the time it
+ * covers comes round. Setting and cancelling a timer are O(1).
+ *
+ * Expiration routines are called on the wheel thread, one at a time, with the
+ * timer's own (recursive) lock held. The routine can therefore set or cancel
+ * its timer, and vcos_timer_cancel() does not return while it is running.
+ *
+ * NOTE: Condition variables on Bionic are buggy and work incorrectly with
+ * CLOCK_MONOTONIC, so there the wheel thread sleeps against CLOCK_REALTIME,
+ * converting its monotonic deadline each time it goes to sleep.
  */
 #define NSEC_IN_SEC  (1000*1000*1000)
-#define MSEC_IN_SEC  (1000)
 #define NSEC_IN_MSEC (1000*1000)
 
-static int _timespec_is_zero(struct timespec *ts)
+#define TIMER_WHEEL_TICK_NS    (100*1000)
+#define TIMER_WHEEL_TICKS_PER_MSEC (NSEC_IN_MSEC / TIMER_WHEEL_TICK_NS)
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SIZE   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 5
+/* Span of the wheel. Later timers wait in the top level until in range. */
+#define TIMER_WHEEL_RANGE  ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_NEVER  (~(uint64_t)0)
+
+/* VCOS_TIMER_T.state */
+#define TIMER_IDLE    0  /* not set */
+#define TIMER_PENDING 1  /* in a wheel slot or on the expired list */
+#define TIMER_FIRING  2  /* taken off the expired list by the wheel thread */
+
+static struct
+{
+   pthread_mutex_t lock;               /* protects all of this and the list members of every timer */
+   pthread_cond_t changed;             /* signalled when a timer is due before sleep_until */
+   pthread_cond_t fired;               /* broadcast when firing is cleared */
+   pthread_t thread;
+   VCOS_STATUS_T status;               /* result of starting the wheel thread */
+
+   uint64_t now;                       /* tick up to which the wheel has been run */
+   uint64_t sleep_until;               /* when the wheel thread will wake, or 0 if awake */
+   uint64_t occupied[TIMER_WHEEL_LEVELS]; /* bit set for each non-empty slot */
+   VCOS_TIMER_T *slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE];
+   VCOS_TIMER_T *expired;              /* timers due, oldest first */
+   VCOS_TIMER_T **expired_tail;
+   VCOS_TIMER_T *firing;               /* timer whose routine is about to run or running */
+} timer_wheel = { PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t timer_wheel_once = PTHREAD_ONCE_INIT;
+
+/* Current tick of the monotonic clock, rounded up if round_up is set */
+static uint64_t _timer_wheel_time(int round_up)
 {
-   return ((ts->tv_sec == 0) && (ts->tv_nsec == 0));
+   struct timespec now;
+   uint64_t ns;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   ns = (uint64_t)now.tv_sec * NSEC_IN_SEC + now.tv_nsec;
+   return (ns + (round_up ? TIMER_WHEEL_TICK_NS - 1 : 0)) / TIMER_WHEEL_TICK_NS;
 }
 
-static void _timespec_set_zero(struct timespec *ts)
+static void _timer_link(VCOS_TIMER_T **head, VCOS_TIMER_T *timer)
 {
-   ts->tv_sec = ts->tv_nsec = 0;
+   timer->next = *head;
+   if (timer->next)
+      timer->next->pprev = &timer->next;
+   timer->pprev = head;
+   *head = timer;
 }
 
-/* Adds left to right and stores the result in left */
-static void _timespec_add(struct timespec *left, struct timespec *right)
+static void _timer_unlink(VCOS_TIMER_T *timer)
 {
-   left->tv_sec += right->tv_sec;
-   left->tv_nsec += right->tv_nsec;
-   if (left->tv_nsec >= (NSEC_IN_SEC))
+   if (timer_wheel.expired_tail == &timer->next)
+      timer_wheel.expired_tail = timer->pprev;
+
+   *timer->pprev = timer->next;
+   if (timer->next)
+      timer->next->pprev = timer->pprev;
+
+   if (timer->slot >= 0 && !timer_wheel.slots[timer->slot])
+      timer_wheel.occupied[timer->slot >> TIMER_WHEEL_BITS] &=
+         ~((uint64_t)1 << (timer->slot & TIMER_WHEEL_MASK));
+
+   timer->next = NULL;
+   timer->pprev = NULL;
+}
+
+/* Put a timer in the slot covering its expiry time */
+static void _timer_wheel_insert(VCOS_TIMER_T *timer)
+{
+   uint64_t expires = timer->expires;
+   uint64_t delta;
+   int level = 0, slot;
+
+   vcos_assert(expires >= timer_wheel.now);
+   delta = expires - timer_wheel.now;
+   if (delta >= TIMER_WHEEL_RANGE)
    {
-      left->tv_nsec -= NSEC_IN_SEC;
-      left->tv_sec++;
+      expires = timer_wheel.now + TIMER_WHEEL_RANGE - 1;
+      delta = TIMER_WHEEL_RANGE - 1;
    }
+
+   while (delta >> (TIMER_WHEEL_BITS * (level + 1)))
+      level++;
+
+   slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+   timer->slot = (level << TIMER_WHEEL_BITS) + slot;
+   _timer_link(&timer_wheel.slots[timer->slot], timer);
+   timer_wheel.occupied[level] |= (uint64_t)1 << slot;
 }
 
-static int _timespec_is_larger(struct timespec *left, struct timespec *right)
+/* Return the next time at which a slot of the wheel needs attention. For
+ * level 0 this is when its timers expire, for the others when they are
+ * cascaded. */
+static uint64_t _timer_wheel_next(void)
 {
-   if (left->tv_sec != right->tv_sec)
-      return left->tv_sec > right->tv_sec;
-   else
-      return left->tv_nsec > right->tv_nsec;
+   uint64_t next = TIMER_WHEEL_NEVER;
+   int level;
+
+   for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+   {
+      int shift = TIMER_WHEEL_BITS * level;
+      uint64_t occupied = timer_wheel.occupied[level];
+      uint64_t pos = timer_wheel.now >> shift;
+      uint64_t later, when;
+      unsigned int index = pos & TIMER_WHEEL_MASK;
+
+      if (!occupied)
+         continue;
+
+      /* Slots after the current one come round in this rotation, the rest
+       * (including the current one) in the next */
+      later = index == TIMER_WHEEL_MASK ? 0 : occupied & (~(uint64_t)0 << (index + 1));
+      if (later)
+         when = ((pos & ~(uint64_t)TIMER_WHEEL_MASK) | __builtin_ctzll(later)) << shift;
+      else
+         when = (((pos & ~(uint64_t)TIMER_WHEEL_MASK) | __builtin_ctzll(occupied)) << shift) +
+                ((uint64_t)1 << (shift + TIMER_WHEEL_BITS));
+
+      if (when < next)
+         next = when;
+   }
+
+   return next;
 }
 
-static void* _timer_thread(void *arg)
+/* Run the wheel forward to the given time, moving timers that have
+ * expired to the expired list */
+static void _timer_wheel_advance(uint64_t to)
 {
-   VCOS_TIMER_T *timer = (VCOS_TIMER_T*)arg;
+   while (1)
+   {
+      uint64_t next = _timer_wheel_next();
+      VCOS_TIMER_T *timer;
+      int level;
 
-   pthread_mutex_lock(&timer->lock);
-   while (!timer->quit)
+      if (next > to)
+         break;
+
+      /* Nothing needs doing between now and next, so skip straight there */
+      timer_wheel.now = next;
+
+      /* Cascade the upper level slots whose time has come */
+      for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+      {
+         int shift = TIMER_WHEEL_BITS * level;
+         int slot;
+
+         if (next & (((uint64_t)1 << shift) - 1))
+            break;
+
+         slot = (level << TIMER_WHEEL_BITS) + ((next >> shift) & TIMER_WHEEL_MASK);
+         while ((timer = timer_wheel.slots[slot]) != NULL)
+         {
+            _timer_unlink(timer);
+            _timer_wheel_insert(timer);
+         }
+      }
+
+      /* Everything in the current level 0 slot has expired */
+      while ((timer = timer_wheel.slots[next & TIMER_WHEEL_MASK]) != NULL)
+      {
+         vcos_assert(timer->expires == next);
+         _timer_unlink(timer);
+         timer->slot = -1;
+         timer->next = NULL;
+         timer->pprev = timer_wheel.expired_tail;
+         *timer_wheel.expired_tail = timer;
+         timer_wheel.expired_tail = &timer->next;
+      }
+   }
+
+   if (to > timer_wheel.now)
+      timer_wheel.now = to;
+}
+
+/* Wait on the changed condition until the given tick */
+static void _timer_wheel_sleep(uint64_t until)
+{
+   struct timespec deadline;
+
+   if (until == TIMER_WHEEL_NEVER)
    {
-      struct timespec now;
+      pthread_cond_wait(&timer_wheel.changed, &timer_wheel.lock);
+      return;
+   }
 
-      /* Wait until next expiry time, or until timer's settings are changed */
-      if (_timespec_is_zero(&timer->expires))
-         pthread_cond_wait(&timer->settings_changed, &timer->lock);
-      else
-         pthread_cond_timedwait(&timer->settings_changed, &timer->lock, &timer->expires);
+#ifdef ANDROID
+   {
+      struct timespec mono, real;
+      int64_t ns;
+
+      clock_gettime(CLOCK_MONOTONIC, &mono);
+      clock_gettime(CLOCK_REALTIME, &real);
+      ns = (int64_t)until * TIMER_WHEEL_TICK_NS - ((int64_t)mono.tv_sec * NSEC_IN_SEC + mono.tv_nsec);
+      if (ns < 0)
+         ns = 0;
+      ns += (int64_t)real.tv_sec * NSEC_IN_SEC + real.tv_nsec;
+      deadline.tv_sec = ns / NSEC_IN_SEC;
+      deadline.tv_nsec = ns % NSEC_IN_SEC;
+   }
+#else
+   deadline.tv_sec = until / (NSEC_IN_SEC / TIMER_WHEEL_TICK_NS);
+   deadline.tv_nsec = (until % (NSEC_IN_SEC / TIMER_WHEEL_TICK_NS)) * TIMER_WHEEL_TICK_NS;
+#endif
+
+   pthread_cond_timedwait(&timer_wheel.changed, &timer_wheel.lock, &deadline);
+}
 
-      /* See if the timer has expired - reloop if it didn't */
-      clock_gettime(CLOCK_REALTIME, &now);
-      if (_timespec_is_zero(&timer->expires) || _timespec_is_larger(&timer->expires, &now))
+static void* _timer_wheel_thread(void *arg)
+{
+   (void)arg;
+
+   pthread_mutex_lock(&timer_wheel.lock);
+   while (1)
+   {
+      VCOS_TIMER_T *timer;
+      int run;
+
+      _timer_wheel_advance(_timer_wheel_time(0));
+
+      timer = timer_wheel.expired;
+      if (!timer)
+      {
+         timer_wheel.sleep_until = _timer_wheel_next();
+         _timer_wheel_sleep(timer_wheel.sleep_until);
+         timer_wheel.sleep_until = 0;
          continue;
+      }
 
-      /* The timer has expired. Clear the expiry time and call the
-       * expiration routine
+      /* Take the timer off the expired list, then call its expiration
+       * routine, with its lock held, unless it has been set again or
+       * cancelled in the meantime
        */
-      _timespec_set_zero(&timer->expires);
-      timer->orig_expiration_routine(timer->orig_context);
+      _timer_unlink(timer);
+      timer->state = TIMER_FIRING;
+      timer_wheel.firing = timer;
+      pthread_mutex_unlock(&timer_wheel.lock);
+
+      pthread_mutex_lock(&timer->lock);
+
+      pthread_mutex_lock(&timer_wheel.lock);
+      run = timer->state == TIMER_FIRING;
+      if (run)
+         timer->state = TIMER_IDLE;
+      pthread_mutex_unlock(&timer_wheel.lock);
+
+      if (run)
+         timer->orig_expiration_routine(timer->orig_context);
+
+      pthread_mutex_unlock(&timer->lock);
+
+      pthread_mutex_lock(&timer_wheel.lock);
+      timer_wheel.firing = NULL;
+      pthread_cond_broadcast(&timer_wheel.fired);
    }
-   pthread_mutex_unlock(&timer->lock);
 
    return NULL;
 }
 
+static void _timer_wheel_init(void)
+{
+   pthread_condattr_t attr;
+   int rc;
+
+   timer_wheel.expired_tail = &timer_wheel.expired;
+   timer_wheel.now = _timer_wheel_time(0);
+
+   rc = pthread_condattr_init(&attr);
+#ifndef ANDROID
+   if (rc == 0)
+      rc = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+   if (rc == 0)
+      rc = pthread_cond_init(&timer_wheel.changed, &attr);
+   pthread_condattr_destroy(&attr);
+
+   if (rc == 0)
+   {
+      rc = pthread_cond_init(&timer_wheel.fired, NULL);
+      if (rc != 0)
+         pthread_cond_destroy(&timer_wheel.changed);
+   }
+
+   if (rc == 0)
+   {
+      rc = pthread_create(&timer_wheel.thread, NULL, _timer_wheel_thread, NULL);
+      if (rc != 0)
+      {
+         pthread_cond_destroy(&timer_wheel.fired);
+         pthread_cond_destroy(&timer_wheel.changed);
+      }
+   }
+
+   timer_wheel.status = rc == 0 ? VCOS_SUCCESS : vcos_pthreads_map_error(rc);
+}
+
 VCOS_STATUS_T vcos_timer_init(void)
 {
    return VCOS_SUCCESS;
@@ -750,87 +997,40 @@ VCOS_STATUS_T vcos_timer_create(VCOS_TIMER_T *timer,
                                 void *context)
 {
    pthread_mutexattr_t lock_attr;
-   VCOS_STATUS_T result = VCOS_SUCCESS;
-   int settings_changed_initialized = 0;
-   int lock_attr_initialized = 0;
-   int lock_initialized = 0;
+   int rc;
 
    (void)name;
 
    vcos_assert(timer);
    vcos_assert(expiration_routine);
 
+   /* Start the wheel thread when the first timer is created */
+   pthread_once(&timer_wheel_once, _timer_wheel_init);
+   if (timer_wheel.status != VCOS_SUCCESS)
+      return timer_wheel.status;
+
    memset(timer, 0, sizeof(VCOS_TIMER_T));
 
    timer->orig_expiration_routine = expiration_routine;
    timer->orig_context = context;
+   timer->state = TIMER_IDLE;
+   timer->slot = -1;
 
-   /* Create conditional variable for notifying the timer's thread
-    * when settings change.
-    */
-   if (result == VCOS_SUCCESS)
-   {
-      int rc = pthread_cond_init(&timer->settings_changed, NULL);
-      if (rc == 0)
-         settings_changed_initialized = 1;
-      else
-         result = vcos_pthreads_map_error(rc);
-   }
-
-   /* Create attributes for the lock (we want it to be recursive) */
-   if (result == VCOS_SUCCESS)
-   {
-      int rc = pthread_mutexattr_init(&lock_attr);
-      if (rc == 0)
-      {
-         pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
-         lock_attr_initialized = 1;
-      }
-      else
-      {
-         result = vcos_pthreads_map_error(rc);
-      }
-   }
-
-   /* Create lock for the timer structure */
-   if (result == VCOS_SUCCESS)
-   {
-      int rc = pthread_mutex_init(&timer->lock, &lock_attr);
-      if (rc == 0)
-         lock_initialized = 1;
-      else
-         result = vcos_pthreads_map_error(rc);
-   }
-
-   /* Lock attributes are no longer needed */
-   if (lock_attr_initialized)
-      pthread_mutexattr_destroy(&lock_attr);
-
-   /* Create the underlying thread */
-   if (result == VCOS_SUCCESS)
-   {
-      int rc = pthread_create(&timer->thread, NULL, _timer_thread, timer);
-      if (rc != 0)
-         result = vcos_pthreads_map_error(rc);
-   }
-
-   /* Clean up if anything went wrong */
-   if (result != VCOS_SUCCESS)
-   {
-      if (lock_initialized)
-         pthread_mutex_destroy(&timer->lock);
+   /* Create lock for the timer, which is recursive so that the expiration
+    * routine can set or cancel the timer */
+   rc = pthread_mutexattr_init(&lock_attr);
+   if (rc != 0)
+      return vcos_pthreads_map_error(rc);
 
-      if (settings_changed_initialized)
-         pthread_cond_destroy(&timer->settings_changed);
-   }
+   pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
+   rc = pthread_mutex_init(&timer->lock, &lock_attr);
+   pthread_mutexattr_destroy(&lock_attr);
 
-   return result;
+   return rc == 0 ? VCOS_SUCCESS : vcos_pthreads_map_error(rc);
 }
 
 void vcos_timer_set(VCOS_TIMER_T *timer, VCOS_UNSIGNED delay_ms)
 {
-   struct timespec now;
-
    vcos_assert(timer);
 
    /* Other implementations of this function do undefined things
@@ -841,16 +1041,24 @@ void vcos_timer_set(VCOS_TIMER_T *timer, VCOS_UNSIGNED delay_ms)
       return;
 
    pthread_mutex_lock(&timer->lock);
+   pthread_mutex_lock(&timer_wheel.lock);
+
+   if (timer->pprev)
+      _timer_unlink(timer);
 
-   /* Calculate the new absolute expiry time */
-   clock_gettime(CLOCK_REALTIME, &now);
-   timer->expires.tv_sec = delay_ms / MSEC_IN_SEC;
-   timer->expires.tv_nsec = (delay_ms % MSEC_IN_SEC) * NSEC_IN_MSEC;
-   _timespec_add(&timer->expires, &now);
+   /* Round the current time up, so the timer never fires early */
+   timer->expires = _timer_wheel_time(1) + (uint64_t)delay_ms * TIMER_WHEEL_TICKS_PER_MSEC;
+   timer->state = TIMER_PENDING;
+   _timer_wheel_insert(timer);
 
-   /* Notify the timer's thread about the change */
-   pthread_cond_signal(&timer->settings_changed);
+   /* Wake the wheel thread if it would otherwise sleep past the expiry time */
+   if (timer_wheel.sleep_until && timer->expires < timer_wheel.sleep_until)
+   {
+      timer_wheel.sleep_until = timer->expires;
+      pthread_cond_signal(&timer_wheel.changed);
+   }
 
+   pthread_mutex_unlock(&timer_wheel.lock);
    pthread_mutex_unlock(&timer->lock);
 }
 
@@ -859,10 +1067,13 @@ void vcos_timer_cancel(VCOS_TIMER_T *timer)
    vcos_assert(timer);
 
    pthread_mutex_lock(&timer->lock);
+   pthread_mutex_lock(&timer_wheel.lock);
 
-   _timespec_set_zero(&timer->expires);
-   pthread_cond_signal(&timer->settings_changed);
+   if (timer->pprev)
+      _timer_unlink(timer);
+   timer->state = TIMER_IDLE;
 
+   pthread_mutex_unlock(&timer_wheel.lock);
    pthread_mutex_unlock(&timer->lock);
 }
 
@@ -875,28 +1086,25 @@ void vcos_timer_delete(VCOS_TIMER_T *timer)
 {
    vcos_assert(timer);
 
-   pthread_mutex_lock(&timer->lock);
+   pthread_mutex_lock(&timer_wheel.lock);
 
    /* Other implementation of this function (e.g. ThreadX)
     * disallow it being called from the expiration routine
     */
-   vcos_assert(pthread_self() != timer->thread);
-
-   /* Stop the timer and set flag telling the timer thread to quit */
-   _timespec_set_zero(&timer->expires);
-   timer->quit = 1;
+   vcos_assert(timer_wheel.firing != timer || !pthread_equal(pthread_self(), timer_wheel.thread));
 
-   /* Notify the timer's thread about the change */
-   pthread_cond_signal(&timer->settings_changed);
+   /* Stop the timer */
+   if (timer->pprev)
+      _timer_unlink(timer);
+   timer->state = TIMER_IDLE;
 
-   /* Release the lock, so that the timer's thread can quit */
-   pthread_mutex_unlock(&timer->lock);
+   /* Wait for the wheel thread to finish with it */
+   while (timer_wheel.firing == timer)
+      pthread_cond_wait(&timer_wheel.fired, &timer_wheel.lock);
 
-   /* Wait for the timer thread to finish */
-   pthread_join(timer->thread, NULL);
+   pthread_mutex_unlock(&timer_wheel.lock);
 
    /* Free resources used by the timer */
    pthread_mutex_destroy(&timer->lock);
-   pthread_cond_destroy(&timer->settings_changed);
 }
 
@@ -0,0 +1,224 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Benchmark for VCOS timers.
+ *
+ * Creates a large number of timers, sets each of them to expire after a
+ * random delay, and measures how late each one fires (its jitter). Part of
+ * the timers are first set well beyond the others, then cancelled or set
+ * again before they expire, to check that those do not fire at the wrong
+ * time. The cost of vcos_timer_set() and vcos_timer_cancel() is reported
+ * along with the number of threads the process ended up with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "interface/vcos/vcos.h"
+
+typedef struct
+{
+   VCOS_TIMER_T timer;
+   int64_t due;             /* When the timer should fire, in us */
+   int64_t fired;           /* When it did, or 0 */
+   unsigned int count;      /* Times the routine has been called */
+} BENCH_TIMER_T;
+
+static VCOS_SEMAPHORE_T done;
+static volatile unsigned int remaining;
+
+static void bench_expired(void *context)
+{
+   BENCH_TIMER_T *t = (BENCH_TIMER_T *)context;
+
+   t->fired = vcos_getmicrosecs64();
+   t->count++;
+   if (__sync_sub_and_fetch(&remaining, 1) == 0)
+      vcos_semaphore_post(&done);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+   int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+static unsigned int thread_count(void)
+{
+   char line[128];
+   unsigned int threads = 0;
+   FILE *f = fopen("/proc/self/status", "r");
+
+   if (!f)
+      return 0;
+   while (fgets(line, sizeof(line), f))
+      if (sscanf(line, "Threads: %u", &threads) == 1)
+         break;
+   fclose(f);
+   return threads;
+}
+
+static void usage(void)
+{
+   printf("Usage: vcos_timer_bench [-n <timers>] [-d <min>,<max>] [-c <percent>]\n");
+   printf("    -n <n>        number of timers (default 10000)\n");
+   printf("    -d <min>,<max> range of delays in ms (default 10,1000)\n");
+   printf("    -c <percent>  timers cancelled or set again before expiry (default 20)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int num_timers = 10000, min_delay = 10, max_delay = 1000, churn = 20;
+   unsigned int i, n, early = 0, wrong = 0;
+   BENCH_TIMER_T *timers;
+   int64_t *jitter, start, elapsed, sum = 0;
+   int argn;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-n") && argn + 1 < argc)
+         num_timers = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-d") && argn + 1 < argc)
+      {
+         if (sscanf(argv[++argn], "%u,%u", &min_delay, &max_delay) != 2)
+            usage();
+      }
+      else if (!strcmp(argv[argn], "-c") && argn + 1 < argc)
+         churn = atoi(argv[++argn]);
+      else
+         usage();
+   }
+
+   if (!num_timers || !min_delay || max_delay < min_delay || churn > 100)
+      usage();
+
+   vcos_init();
+   timers = calloc(num_timers, sizeof(*timers));
+   jitter = calloc(num_timers, sizeof(*jitter));
+   if (!timers || !jitter || vcos_semaphore_create(&done, "done", 0) != VCOS_SUCCESS)
+      return 1;
+
+   start = vcos_getmicrosecs64();
+   for (i = 0; i < num_timers; i++)
+   {
+      if (vcos_timer_create(&timers[i].timer, "bench", bench_expired, &timers[i]) != VCOS_SUCCESS)
+      {
+         printf("failed to create timer %u\n", i);
+         return 1;
+      }
+   }
+   elapsed = vcos_getmicrosecs64() - start;
+   printf("created %u timers in %lld us, %u threads in the process\n", num_timers,
+          (long long)elapsed, thread_count());
+
+   /* Set them all, with a spread of delays, except that those to be
+    * churned are set to expire after everything else */
+   srand(1);
+   remaining = num_timers;
+   n = num_timers * churn / 100;
+   start = vcos_getmicrosecs64();
+   for (i = 0; i < num_timers; i++)
+   {
+      unsigned int delay = i < num_timers - n ?
+         min_delay + rand() % (max_delay - min_delay + 1) : 2 * max_delay;
+      timers[i].due = vcos_getmicrosecs64() + delay * 1000;
+      vcos_timer_set(&timers[i].timer, delay);
+   }
+   elapsed = vcos_getmicrosecs64() - start;
+   printf("set: %.2f us per timer\n", (double)elapsed / num_timers);
+
+   /* Bring half of those forward, and cancel the rest */
+   start = vcos_getmicrosecs64();
+   for (i = num_timers - n; i < num_timers; i++)
+   {
+      BENCH_TIMER_T *t = &timers[i];
+
+      if (i & 1)
+      {
+         vcos_timer_cancel(&t->timer);
+         t->due = 0;
+         __sync_sub_and_fetch(&remaining, 1);
+      }
+      else
+      {
+         unsigned int delay = min_delay + rand() % (max_delay - min_delay + 1);
+         t->due = vcos_getmicrosecs64() + delay * 1000;
+         vcos_timer_set(&t->timer, delay);
+      }
+   }
+   elapsed = vcos_getmicrosecs64() - start;
+   if (n)
+      printf("cancel/set again: %.2f us per timer\n", (double)elapsed / n);
+
+   if (remaining)
+      vcos_semaphore_wait(&done);
+   /* Give the cancelled timers a chance to show they are still pending */
+   vcos_sleep(max_delay + 10);
+
+   for (i = 0, n = 0; i < num_timers; i++)
+   {
+      BENCH_TIMER_T *t = &timers[i];
+
+      if (!t->due)
+      {
+         if (t->count)
+            wrong++;
+         continue;
+      }
+      if (t->count != 1)
+      {
+         wrong++;
+         continue;
+      }
+      jitter[n] = t->fired - t->due;
+      if (jitter[n] < 0)
+         early++;
+      sum += jitter[n];
+      n++;
+   }
+
+   qsort(jitter, n, sizeof(*jitter), compare_int64);
+   if (n)
+   {
+      printf("%u timers fired, jitter in us: mean %lld, median %lld, 99%% %lld, max %lld\n",
+             n, (long long)(sum / n), (long long)jitter[n / 2], (long long)jitter[n * 99 / 100],
+             (long long)jitter[n - 1]);
+   }
+   printf("%u fired early, %u fired when they should not have or more than once\n", early, wrong);
+
+   for (i = 0; i < num_timers; i++)
+      vcos_timer_delete(&timers[i].timer);
+   vcos_semaphore_delete(&done);
+   free(timers);
+   free(jitter);
+   vcos_deinit();
+
+   return early || wrong ? 1 : 0;
+}
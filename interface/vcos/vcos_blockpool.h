@@ -59,7 +59,9 @@ extern "C" {
  * @param pool_size   The size of the pool in bytes.
  * @param align       Alignment for block data. Use VCOS_BLOCKPOOL_ALIGN_DEFAULT
  *                    for default word alignment.
- * @param flags       Reserved for future use.
+ * @param flags       VCOS_BLOCKPOOL_FLAG_NONE, or VCOS_BLOCKPOOL_FLAG_CONCURRENT
+ *                    or VCOS_BLOCKPOOL_FLAG_THREAD_CACHE for pools used by
+ *                    several threads at once.
  * @param name        Name of the pool. Used for diagnostics.
  *
  * @return VCOS_SUCCESS if the pool was created.
@@ -82,7 +84,9 @@ VCOS_STATUS_T vcos_blockpool_init(VCOS_BLOCKPOOL_T *pool,
  * @param block_size  The size of an individual block.
  * @param align       Alignment for block data. Use VCOS_BLOCKPOOL_ALIGN_DEFAULT
  *                    for default word alignment.
- * @param flags       Reserved for future use.
+ * @param flags       VCOS_BLOCKPOOL_FLAG_NONE, or VCOS_BLOCKPOOL_FLAG_CONCURRENT
+ *                    or VCOS_BLOCKPOOL_FLAG_THREAD_CACHE for pools used by
+ *                    several threads at once.
  * @param name        Name of the pool. Used for diagnostics.
  *
  * @return VCOS_SUCCESS if the pool was created.
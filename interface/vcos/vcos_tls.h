@@ -48,6 +48,18 @@ extern "C" {
 VCOS_INLINE_DECL
 VCOS_STATUS_T vcos_tls_create(VCOS_TLS_KEY_T *key);
 
+/** Create a new thread local storage data key, with a function called with
+  * the value of a thread that exits while its value is not NULL.
+  *
+  * @param key         The key to create
+  * @param destructor  Called on thread exit, or NULL for none. Not called
+  *                    for values left when the key is deleted, and never
+  *                    called where TLS is emulated by VCOS.
+  */
+VCOS_INLINE_DECL
+VCOS_STATUS_T vcos_tls_create_with_destructor(VCOS_TLS_KEY_T *key,
+                                              void (*destructor)(void *));
+
 /** Delete an existing TLS data key.
   */
 VCOS_INLINE_DECL
@@ -105,6 +105,72 @@ typedef struct
 
 #define FILE_INFO_TABLE_CHUNK_LEN   20
 
+/*
+ *  Sequential reads of regular files are served from a readahead pipeline.
+ *  Each open regular file (up to READAHEAD_MAX_STREAMS of them) gets a stream
+ *  holding a few chunks of the file beyond the last read.  The chunks are
+ *  filled by a small pool of threads, so the disk read for the next request
+ *  overlaps the transfer of the current one, and files read through different
+ *  file descriptors are read from disk concurrently.
+ *
+ *  Chunks are read with pread() into buffers of their own.  Files are not
+ *  mapped, as another process truncating one would fault the server.
+ *
+ *  While a file has a stream its file offset is tracked here and only
+ *  applied to the file descriptor when something other than a read needs it.
+ *
+ *  The number of chunks per stream is taken from the VC_HOSTFS_READAHEAD
+ *  environment variable (0 disables readahead) and defaults to
+ *  READAHEAD_DEFAULT_CHUNKS.
+ */
+
+#define READAHEAD_CHUNK_LEN         (64*1024)
+#define READAHEAD_MAX_CHUNKS        8
+#define READAHEAD_DEFAULT_CHUNKS    2
+#define READAHEAD_THREADS           2
+#define READAHEAD_MAX_STREAMS       8
+
+typedef enum
+{
+   RA_CHUNK_EMPTY,
+   RA_CHUNK_WANTED,        // waiting for a readahead thread
+   RA_CHUNK_FILLING,       // being read by a readahead thread
+   RA_CHUNK_READY
+} ra_chunk_state_t;
+
+typedef struct
+{
+   ra_chunk_state_t state;
+   int stale;              // filled data is out of date, discard when done
+   int64_t offset;         // file offset of the first byte
+   int len;                // bytes valid once ready, short at end of file
+   char *buf;              // allocated when first needed
+} ra_chunk_t;
+
+typedef struct
+{
+   int fd;                 // -1 if the slot is free
+   dev_t dev;
+   ino_t ino;
+   int64_t pos;            // current file offset
+   int synced;             // non-zero if the fd's offset is pos
+   int64_t next;           // offset following the last read
+   int64_t ra_end;         // offset following the last chunk requested
+   ra_chunk_t chunk[READAHEAD_MAX_CHUNKS];
+} ra_stream_t;
+
+static struct
+{
+   int chunks;             // chunks per stream, 0 if disabled
+   int started;
+   int quit;
+   VCOS_MUTEX_T lock;
+   VCOS_SEMAPHORE_T work;  // posted for each chunk wanted, and to stop
+   VCOS_EVENT_T filled;    // signalled each time a chunk has been filled
+   VCOS_THREAD_T thread[READAHEAD_THREADS];
+   ra_stream_t stream[READAHEAD_MAX_STREAMS];
+} readahead;
+
 /******************************************************************************
 Static data.
 ******************************************************************************/
@@ -118,6 +184,381 @@ Static functions.
 
 static void backslash_to_slash( char *s );
 
+/******************************************************************************
+Readahead.
+******************************************************************************/
+
+static void *readahead_thread(void *arg)
+{
+   (void)arg;
+
+   vcos_mutex_lock(&readahead.lock);
+   while (!readahead.quit)
+   {
+      ra_stream_t *s = NULL;
+      ra_chunk_t *c = NULL;
+      int i, j, len;
+
+      for (i = 0; i < READAHEAD_MAX_STREAMS && c == NULL; i++)
+      {
+         for (j = 0; j < readahead.chunks; j++)
+         {
+            if (readahead.stream[i].fd >= 0 &&
+                readahead.stream[i].chunk[j].state == RA_CHUNK_WANTED)
+            {
+               s = &readahead.stream[i];
+               c = &s->chunk[j];
+               break;
+            }
+         }
+      }
+
+      if (c == NULL)
+      {
+         vcos_mutex_unlock(&readahead.lock);
+         vcos_semaphore_wait(&readahead.work);
+         vcos_mutex_lock(&readahead.lock);
+         continue;
+      }
+
+      c->state = RA_CHUNK_FILLING;
+      c->stale = 0;
+      vcos_mutex_unlock(&readahead.lock);
+
+      len = (int)pread(s->fd, c->buf, READAHEAD_CHUNK_LEN, c->offset);
+
+      vcos_mutex_lock(&readahead.lock);
+      if (len < 0 || c->stale)
+      {
+         c->state = RA_CHUNK_EMPTY;
+      }
+      else
+      {
+         c->len = len;
+         c->state = RA_CHUNK_READY;
+      }
+      vcos_event_signal(&readahead.filled);
+   }
+   vcos_mutex_unlock(&readahead.lock);
+
+   return NULL;
+}
+
+// Called with the lock held. Returns with it held, after a chunk has been
+// filled.
+static void readahead_wait(void)
+{
+   vcos_mutex_unlock(&readahead.lock);
+   vcos_event_wait(&readahead.filled);
+   vcos_mutex_lock(&readahead.lock);
+}
+
+static int readahead_start(void)
+{
+   int i;
+
+   if (readahead.started)
+      return 0;
+
+   if (vcos_semaphore_create(&readahead.work, "hostfs-ra", 0) != VCOS_SUCCESS)
+      return -1;
+   if (vcos_event_create(&readahead.filled, "hostfs-ra") != VCOS_SUCCESS)
+   {
+      vcos_semaphore_delete(&readahead.work);
+      return -1;
+   }
+
+   readahead.quit = 0;
+   for (i = 0; i < READAHEAD_THREADS; i++)
+   {
+      if (vcos_thread_create(&readahead.thread[i], "hostfs-ra", NULL,
+                             readahead_thread, NULL) != VCOS_SUCCESS)
+         break;
+   }
+   if (i == 0)
+   {
+      vcos_event_delete(&readahead.filled);
+      vcos_semaphore_delete(&readahead.work);
+      return -1;
+   }
+
+   readahead.started = i;
+   return 0;
+}
+
+static void readahead_stop(void)
+{
+   int i;
+
+   if (!readahead.started)
+      return;
+
+   vcos_mutex_lock(&readahead.lock);
+   readahead.quit = 1;
+   vcos_mutex_unlock(&readahead.lock);
+
+   for (i = 0; i < readahead.started; i++)
+      vcos_semaphore_post(&readahead.work);
+   for (i = 0; i < readahead.started; i++)
+      vcos_thread_join(&readahead.thread[i], NULL);
+
+   vcos_event_delete(&readahead.filled);
+   vcos_semaphore_delete(&readahead.work);
+   readahead.started = 0;
+}
+
+// Called with the lock held.
+static ra_stream_t *readahead_find(int fildes)
+{
+   int i;
+
+   if (readahead.chunks == 0 || fildes < 0)
+      return NULL;
+
+   for (i = 0; i < READAHEAD_MAX_STREAMS; i++)
+   {
+      if (readahead.stream[i].fd == fildes)
+         return &readahead.stream[i];
+   }
+   return NULL;
+}
+
+// Called with the lock held. Applies the tracked offset to the fd.
+static int readahead_sync(ra_stream_t *s)
+{
+   if (!s->synced)
+   {
+      if (lseek64(s->fd, s->pos, SEEK_SET) < 0)
+         return -1;
+      s->synced = 1;
+   }
+   return 0;
+}
+
+// Called with the lock held. Drops every chunk that is not being filled
+// and makes sure the ones that are get discarded.
+static void readahead_flush(ra_stream_t *s)
+{
+   int j;
+
+   for (j = 0; j < readahead.chunks; j++)
+   {
+      if (s->chunk[j].state == RA_CHUNK_FILLING)
+         s->chunk[j].stale = 1;
+      else
+         s->chunk[j].state = RA_CHUNK_EMPTY;
+   }
+   s->ra_end = s->pos;
+}
+
+// Called with the lock held. Requests the chunks following the current
+// offset that are not there yet.
+static void readahead_schedule(ra_stream_t *s)
+{
+   int64_t window_end = s->pos + (int64_t)readahead.chunks * READAHEAD_CHUNK_LEN;
+   int j;
+
+   if (s->ra_end < s->pos)
+      s->ra_end = s->pos;
+
+   // Recycle chunks that have been read past
+   for (j = 0; j < readahead.chunks; j++)
+   {
+      ra_chunk_t *c = &s->chunk[j];
+      if (c->state == RA_CHUNK_READY && c->offset + READAHEAD_CHUNK_LEN <= s->pos)
+         c->state = RA_CHUNK_EMPTY;
+   }
+
+   for (j = 0; j < readahead.chunks && s->ra_end < window_end; j++)
+   {
+      ra_chunk_t *c = &s->chunk[j];
+      if (c->state != RA_CHUNK_EMPTY)
+         continue;
+      if (c->buf == NULL && (c->buf = malloc(READAHEAD_CHUNK_LEN)) == NULL)
+         break;
+
+      c->offset = s->ra_end;
+      c->len = 0;
+      c->stale = 0;
+      c->state = RA_CHUNK_WANTED;
+      s->ra_end += READAHEAD_CHUNK_LEN;
+      vcos_semaphore_post(&readahead.work);
+   }
+}
+
+// Called with the lock held. Moves the offset on after a read of nbyte
+// bytes at 'start', and keeps the pipeline going if the reads are
+// sequential.
+static void readahead_advance(ra_stream_t *s, int64_t start, int nbyte)
+{
+   s->pos = start + nbyte;
+   if (start == s->next)
+   {
+      readahead_schedule(s);
+   }
+   else
+   {
+      // A jump: forget what was read ahead and wait to see if reading
+      // carries on sequentially from here.
+      readahead_flush(s);
+   }
+   s->next = s->pos;
+}
+
+// Called with the lock held. Waits for any chunk still being filled.
+static void readahead_drain(ra_stream_t *s)
+{
+   int j, filling;
+
+   do
+   {
+      filling = 0;
+      for (j = 0; j < readahead.chunks; j++)
+      {
+         if (s->chunk[j].state == RA_CHUNK_WANTED)
+            s->chunk[j].state = RA_CHUNK_EMPTY;
+         else if (s->chunk[j].state == RA_CHUNK_FILLING)
+            filling = 1;
+      }
+      if (filling)
+         readahead_wait();
+   } while (filling);
+}
+
+// Called with the lock held. Leaves the fd at the tracked offset.
+static void readahead_release(ra_stream_t *s)
+{
+   int j;
+
+   readahead_drain(s);
+   readahead_sync(s);
+   for (j = 0; j < readahead.chunks; j++)
+   {
+      free(s->chunk[j].buf);
+      s->chunk[j].buf = NULL;
+      s->chunk[j].state = RA_CHUNK_EMPTY;
+   }
+   s->fd = -1;
+}
+
+// Called with the lock held. Forgets the data read ahead for any stream on
+// the given file, which is about to be changed.
+static void readahead_flush_file(dev_t dev, ino_t ino)
+{
+   int i;
+
+   for (i = 0; i < READAHEAD_MAX_STREAMS; i++)
+   {
+      ra_stream_t *s = &readahead.stream[i];
+      if (s->fd >= 0 && s->dev == dev && s->ino == ino)
+         readahead_flush(s);
+   }
+}
+
+// Called with the lock held. Forgets the data read ahead for any stream on
+// the same file as 'fildes', which is about to be changed through it.
+static void readahead_invalidate_file(int fildes)
+{
+   struct stat st;
+   int i;
+
+   for (i = 0; i < READAHEAD_MAX_STREAMS; i++)
+   {
+      if (readahead.stream[i].fd >= 0)
+         break;
+   }
+   if (i == READAHEAD_MAX_STREAMS || fstat(fildes, &st) != 0)
+      return;
+
+   readahead_flush_file(st.st_dev, st.st_ino);
+}
+
+// Sets up a stream for a newly opened file if it is a regular file.
+static void readahead_open(int fildes, const struct stat *st)
+{
+   ra_stream_t *s = NULL;
+   int i;
+
+   if (readahead.chunks == 0 || !S_ISREG(st->st_mode))
+      return;
+
+   vcos_mutex_lock(&readahead.lock);
+
+   for (i = 0; i < READAHEAD_MAX_STREAMS && s == NULL; i++)
+   {
+      if (readahead.stream[i].fd < 0)
+         s = &readahead.stream[i];
+   }
+   if (s == NULL || readahead_start() != 0)
+      goto out;
+
+   memset(s, 0, sizeof(*s));
+   s->dev = st->st_dev;
+   s->ino = st->st_ino;
+   s->synced = 1;
+   s->fd = fildes;
+   DEBUG_MINOR("vc_hostfs_open: readahead on fildes %d", fildes);
+
+out:
+   vcos_mutex_unlock(&readahead.lock);
+}
+
+// Reads from a stream. Called with the lock held.
+static int readahead_read(ra_stream_t *s, void *buf, unsigned int nbyte)
+{
+   int64_t start = s->pos;
+   int64_t off;
+   unsigned int got = 0;
+   int j, ret;
+
+   while (got < nbyte)
+   {
+      ra_chunk_t *c = NULL;
+      unsigned int n;
+
+      off = start + got;
+
+      for (j = 0; j < readahead.chunks; j++)
+      {
+         if (s->chunk[j].state != RA_CHUNK_EMPTY && !s->chunk[j].stale &&
+             s->chunk[j].offset <= off && off < s->chunk[j].offset + READAHEAD_CHUNK_LEN)
+         {
+            c = &s->chunk[j];
+            break;
+         }
+      }
+
+      if (c && c->state != RA_CHUNK_READY)
+      {
+         readahead_wait();
+         continue;
+      }
+
+      if (c && off < c->offset + c->len)
+      {
+         n = (unsigned int)vcos_min((int64_t)(nbyte - got), c->offset + c->len - off);
+         memcpy((char *)buf + got, c->buf + (off - c->offset), n);
+         got += n;
+         continue;
+      }
+
+      // Not read ahead, or past what was the end of the file: read the rest
+      // directly.
+      vcos_mutex_unlock(&readahead.lock);
+      ret = (int)pread(s->fd, (char *)buf + got, nbyte - got, off);
+      vcos_mutex_lock(&readahead.lock);
+      if (ret < 0 && got == 0)
+         return -1;
+      if (ret > 0)
+         got += (unsigned int)ret;
+      break;
+   }
+
+   s->synced = 0;
+   readahead_advance(s, start, (int)got);
+   return (int)got;
+}
+
 /******************************************************************************
 Global functions.
 ******************************************************************************/
@@ -161,6 +602,22 @@ void vc_hostfs_init(void)
    {
       file_info_table_len = FILE_INFO_TABLE_CHUNK_LEN;
    }
+
+   if (readahead.chunks == 0)
+   {
+      const char *env = getenv("VC_HOSTFS_READAHEAD");
+      int i;
+
+      readahead.chunks = env ? atoi(env) : READAHEAD_DEFAULT_CHUNKS;
+      if (readahead.chunks < 0)
+         readahead.chunks = 0;
+      if (readahead.chunks > READAHEAD_MAX_CHUNKS)
+         readahead.chunks = READAHEAD_MAX_CHUNKS;
+      for (i = 0; i < READAHEAD_MAX_STREAMS; i++)
+         readahead.stream[i].fd = -1;
+      if (readahead.chunks && vcos_mutex_create(&readahead.lock, "hostfs-ra") != VCOS_SUCCESS)
+         readahead.chunks = 0;
+   }
 }
 
 /** Terminate this library. Clean up resources.
@@ -168,6 +625,22 @@ void vc_hostfs_init(void)
 
 void vc_hostfs_exit(void)
 {
+   if (readahead.chunks)
+   {
+      int i;
+
+      vcos_mutex_lock(&readahead.lock);
+      for (i = 0; i < READAHEAD_MAX_STREAMS; i++)
+      {
+         if (readahead.stream[i].fd >= 0)
+            readahead_release(&readahead.stream[i]);
+      }
+      vcos_mutex_unlock(&readahead.lock);
+      readahead_stop();
+      vcos_mutex_delete(&readahead.lock);
+      readahead.chunks = 0;
+   }
+
    vcos_log_unregister(&hostfs_log_cat);
    if (p_file_info_table)
    {
@@ -194,6 +667,15 @@ RETURNS
 int vc_hostfs_close(int fildes)
 {
    DEBUG_MINOR("vc_hostfs_close(%d)", fildes);
+   if (readahead.chunks)
+   {
+      ra_stream_t *s;
+
+      vcos_mutex_lock(&readahead.lock);
+      if ((s = readahead_find(fildes)) != NULL)
+         readahead_release(s);
+      vcos_mutex_unlock(&readahead.lock);
+   }
    return close(fildes);
 }
 
@@ -280,7 +762,39 @@ int64_t vc_hostfs_lseek64(int fildes, int64_t offset, int whence)
       else
       {
          // File is not a FIFO, so do the seek
-         read_offset = lseek64(fildes, offset, whence);
+         ra_stream_t *s = NULL;
+
+         if (readahead.chunks)
+         {
+            vcos_mutex_lock(&readahead.lock);
+            s = readahead_find(fildes);
+         }
+
+         if (s && whence == SEEK_SET && offset >= 0)
+         {
+            // Applied to the fd when needed
+            s->pos = offset;
+            s->synced = 0;
+            read_offset = offset;
+         }
+         else if (s && whence == SEEK_CUR && s->pos + offset >= 0)
+         {
+            s->pos += offset;
+            s->synced = 0;
+            read_offset = s->pos;
+         }
+         else
+         {
+            if (s == NULL || readahead_sync(s) == 0)
+               read_offset = lseek64(fildes, offset, whence);
+            else
+               read_offset = -1;
+            if (s && read_offset >= 0)
+               s->pos = read_offset;
+         }
+
+         if (readahead.chunks)
+            vcos_mutex_unlock(&readahead.lock);
       }
       p_file_info_table[fildes].read_offset = read_offset;
       DEBUG_MINOR("vc_hostfs_lseek returning %lld)", read_offset);
@@ -348,6 +862,14 @@ int vc_hostfs_open(const char *inPath, int vc_oflag)
    if (vc_oflag & VC_O_TRUNC)   flags |= O_TRUNC;
    if (vc_oflag & VC_O_EXCL)    flags |= O_EXCL;
 
+   // Data read ahead from a file that is about to be truncated is out of date
+   if ((flags & O_TRUNC) && readahead.chunks && stat(path, &fileStat) == 0)
+   {
+      vcos_mutex_lock(&readahead.lock);
+      readahead_flush_file(fileStat.st_dev, fileStat.st_ino);
+      vcos_mutex_unlock(&readahead.lock);
+   }
+
    //while (*path == '\\') path++; // do not want initial '\'
    if (flags & O_CREAT)
       ret = open(path, flags, S_IRUSR | S_IWUSR );
@@ -413,6 +935,10 @@ int vc_hostfs_open(const char *inPath, int vc_oflag)
          p_file_info_table[ret].is_fifo = 1;
          DEBUG_MINOR("vc_hostfs_open: file with fildes %d is a FIFO", ret);
       }
+      else
+      {
+         readahead_open(ret, &fileStat);
+      }
    }
 
    free( path );
@@ -450,7 +976,27 @@ int vc_hostfs_read(int fildes, void *buf, unsigned int nbyte)
    {
       // There is entry in the file info table for this file descriptor, so go
       // ahead and handle the read
-      int ret = (int) read(fildes, buf, nbyte);
+      ra_stream_t *s;
+      int ret;
+
+      if (readahead.chunks)
+      {
+         vcos_mutex_lock(&readahead.lock);
+         if ((s = readahead_find(fildes)) != NULL)
+         {
+            ret = readahead_read(s, buf, nbyte);
+            vcos_mutex_unlock(&readahead.lock);
+            DEBUG_MINOR("vc_hostfs_read(%d,%p,%u) = %d (readahead)", fildes, buf, nbyte, ret);
+            if (ret > 0)
+            {
+               p_file_info_table[fildes].read_offset += (long) ret;
+            }
+            return ret;
+         }
+         vcos_mutex_unlock(&readahead.lock);
+      }
+
+      ret = (int) read(fildes, buf, nbyte);
       DEBUG_MINOR("vc_hostfs_read(%d,%p,%u) = %d", fildes, buf, nbyte, ret);
       if (ret > 0)
       {
@@ -478,7 +1024,33 @@ RETURNS
 
 int vc_hostfs_write(int fildes, const void *buf, unsigned int nbyte)
 {
-   int ret = (int) write(fildes, buf, nbyte);
+   ra_stream_t *s = NULL;
+   int ret;
+
+   if (readahead.chunks)
+   {
+      vcos_mutex_lock(&readahead.lock);
+      s = readahead_find(fildes);
+      if (s)
+         readahead_sync(s);
+      readahead_invalidate_file(fildes);
+      vcos_mutex_unlock(&readahead.lock);
+   }
+
+   ret = (int) write(fildes, buf, nbyte);
+
+   if (s)
+   {
+      vcos_mutex_lock(&readahead.lock);
+      if (readahead_find(fildes) == s)
+      {
+         s->pos = lseek64(fildes, 0, SEEK_CUR);
+         s->next = s->pos;
+         readahead_flush(s);
+      }
+      vcos_mutex_unlock(&readahead.lock);
+   }
+
    DEBUG_MINOR("vc_hostfs_write(%d,%p,%u) = %d", fildes, buf, nbyte, ret);
    return ret;
 }
@@ -966,6 +1538,17 @@ int vc_hostfs_setend(int filedes)
 {
     off_t   currPosn;
 
+    if (readahead.chunks)
+    {
+       ra_stream_t *s;
+
+       vcos_mutex_lock(&readahead.lock);
+       if ((s = readahead_find(filedes)) != NULL)
+          readahead_sync(s);
+       readahead_invalidate_file(filedes);
+       vcos_mutex_unlock(&readahead.lock);
+    }
+
     if (( currPosn = lseek( filedes, 0, SEEK_CUR )) != (off_t)-1 )
     {
         if ( ftruncate( filedes, currPosn ) == 0 )
@@ -30,7 +30,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef VC_ILCS_DEFS_H
 #define VC_ILCS_DEFS_H
 
-#define VC_ILCS_VERSION 1
+#define VC_ILCS_VERSION 2
+
+// oldest version we can talk to. Version 2 added IL_PASS_BUFFER_BATCH,
+// which is only sent to peers that accept a version_min of 2
+#define VC_ILCS_VERSION_MIN 1
 
 #ifdef USE_VCHIQ_ARM
 #include "interface/vchiq_arm/vchiq.h"
@@ -70,6 +74,9 @@ typedef enum {
    IL_GET_DEBUG_INFORMATION,
 
    IL_SERVICE_QUIT,
+
+   IL_PASS_BUFFER_BATCH,
+
    IL_FUNCTION_MAX_NUM,
    IL_FUNCTION_MAX = 0x7fffffff
 } IL_FUNCTION_T;
@@ -222,6 +229,21 @@ typedef struct {
    OMX_U32 bufferLen;
 } IL_PASS_BUFFER_EXECUTE_T;
 
+// several empty/fill this buffer calls sent as one message.  The message
+// is a sequence of records, each a header followed by the call's own
+// message data padded to a multiple of IL_BATCH_ALIGN bytes.  Each call
+// gets its own response, and any bulk transfers follow the message in
+// record order.
+#define IL_BATCH_ALIGN 16
+#define IL_BATCH_PAD(len) (((len)+IL_BATCH_ALIGN-1) & ~(IL_BATCH_ALIGN-1))
+
+typedef struct {
+   IL_FUNCTION_T func;
+   OMX_U32 xid;
+   OMX_U32 len;
+   OMX_U32 reserved;
+} IL_BATCH_RECORD_T;
+
 // get component version
 typedef struct {
    IL_FUNCTION_T func;
@@ -312,6 +312,7 @@ void vc_filesys_stop ()
 
    vcos_event_delete(&vc_filesys_client.filesys_msg_avail);
    vcos_event_delete(&vc_filesys_client.response_event);
+   vcos_mutex_unlock(&vc_filesys_client.filesys_lock);
    vcos_mutex_delete(&vc_filesys_client.filesys_lock);
 
    if(vc_filesys_client.bulk_buffer)
@@ -0,0 +1,359 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Throughput benchmark for the host side of the file service.
+ *
+ * Runs vc_vchi_filesys against the vchiq loopback backend, with a fake
+ * VideoCore file service client on the far side. The client opens a number
+ * of host files and reads them to the end, one request at a time as the
+ * real client does, taking the requests in turn from each file. The time
+ * taken and the resulting throughput are reported.
+ *
+ * The files are created in a scratch directory and evicted from the page
+ * cache before the run, so that the disk reads are part of the measurement.
+ * Set the VC_HOSTFS_READAHEAD environment variable (or use -r) to compare
+ * the host readahead settings.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "interface/vcos/vcos.h"
+#include "interface/vchi/vchi.h"
+#include "interface/vchiq_arm/vchiq_loopback.h"
+#include "interface/vmcs_host/vc_vchi_filesys.h"
+#include "interface/vmcs_host/vc_vchi_fileservice_defs.h"
+#include "interface/vmcs_host/vc_fileservice_defs.h"
+
+#define BENCH_MAX_FILES 16
+
+typedef struct
+{
+   char path[256];
+   int fd;                  /* Host file descriptor, -1 until opened */
+   int done;                /* End of file reached */
+   uint64_t bytes;          /* Bytes read so far */
+} BENCH_FILE_T;
+
+static struct
+{
+   unsigned int handle;
+   BENCH_FILE_T file[BENCH_MAX_FILES];
+   unsigned int num_files;
+   unsigned int block;      /* Bytes asked for by each read */
+   unsigned int current;    /* File the outstanding request is for */
+   uint32_t xid;
+   unsigned int requests;
+   unsigned int bulks;
+   int failed;
+   char *rx_buf;
+   VCOS_SEMAPHORE_T done;
+} bench;
+
+static void bench_send(uint32_t cmd, uint32_t p0, uint32_t p1, uint32_t p2,
+   uint32_t p3, const char *str)
+{
+   FILESERV_MSG_T msg;
+   VCHIQ_ELEMENT_T element;
+   unsigned int len = 24;
+
+   memset(&msg, 0, 24);
+   /* The top bit marks requests from the VideoCore */
+   msg.xid = 0x80000000UL | ++bench.xid;
+   msg.cmd_code = cmd;
+   msg.params[0] = p0;
+   msg.params[1] = p1;
+   msg.params[2] = p2;
+   msg.params[3] = p3;
+   if (str)
+   {
+      strcpy(msg.data, str);
+      len += strlen(str) + 1;
+   }
+
+   element.data = &msg;
+   element.size = len;
+   bench.requests++;
+   vchiq_loopback_queue_message(bench.handle, &element, 1);
+}
+
+/* Issues the next request, or signals the end of the run */
+static void bench_next(void)
+{
+   unsigned int i;
+
+   for (i = 0; i < bench.num_files; i++)
+   {
+      BENCH_FILE_T *f = &bench.file[(bench.current + 1 + i) % bench.num_files];
+
+      if (f->fd < 0)
+      {
+         bench.current = f - bench.file;
+         bench_send(VC_FILESYS_OPEN, VC_O_RDONLY, 0, 0, 0, f->path);
+         return;
+      }
+      if (!f->done)
+      {
+         bench.current = f - bench.file;
+         bench_send(VC_FILESYS_READ, f->fd, 0xffffffffUL, bench.block, 0, NULL);
+         return;
+      }
+   }
+   vcos_semaphore_post(&bench.done);
+}
+
+static void bench_fail(const char *what)
+{
+   printf("%s failed for %s\n", what, bench.file[bench.current].path);
+   bench.failed = 1;
+   vcos_semaphore_post(&bench.done);
+}
+
+static int bench_open(unsigned int handle, void *userdata, void **pconn)
+{
+   vcos_unused(userdata);
+   bench.handle = handle;
+   *pconn = NULL;
+   return 0;
+}
+
+static void bench_close(unsigned int handle, void *conn)
+{
+   vcos_unused(handle);
+   vcos_unused(conn);
+}
+
+static void bench_message(unsigned int handle, void *conn, const void *data,
+   unsigned int size)
+{
+   FILESERV_MSG_T msg;
+   BENCH_FILE_T *f = &bench.file[bench.current];
+
+   vcos_unused(conn);
+
+   memset(&msg, 0, sizeof(msg));
+   memcpy(&msg, data, vcos_min(size, sizeof(msg)));
+
+   if (msg.cmd_code == FILESERV_RESP_ERROR)
+   {
+      bench_fail(f->fd < 0 ? "open" : "read");
+      return;
+   }
+
+   if (f->fd < 0)
+   {
+      f->fd = (int)msg.params[0];
+      bench_next();
+      return;
+   }
+
+   f->bytes += msg.params[0];
+   if (msg.cmd_code == FILESERV_BULK_WRITE)
+   {
+      /* The rest of the data follows as a bulk transfer */
+      if (vchiq_loopback_queue_bulk_receive(handle, bench.rx_buf, msg.params[2], NULL) != VCHIQ_SUCCESS)
+         bench_fail("bulk receive");
+      return;
+   }
+
+   if (msg.params[0] == 0)
+      f->done = 1;
+   bench_next();
+}
+
+static void bench_bulk(unsigned int handle, void *conn, VCHIQ_REASON_T reason,
+   void *data, unsigned int size, void *bulk_userdata)
+{
+   vcos_unused(handle);
+   vcos_unused(conn);
+   vcos_unused(data);
+   vcos_unused(size);
+   vcos_unused(bulk_userdata);
+
+   if (reason != VCHIQ_BULK_RECEIVE_DONE)
+   {
+      bench_fail("bulk transfer");
+      return;
+   }
+   bench.bulks++;
+   bench_next();
+}
+
+static int bench_create_file(const char *path, uint64_t size)
+{
+   char *buf = malloc(1 << 20);
+   uint64_t written = 0;
+   int fd, ret = -1;
+
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd < 0 || !buf)
+      goto out;
+
+   memset(buf, 0x5a, 1 << 20);
+   while (written < size)
+   {
+      size_t n = (size_t)vcos_min(size - written, (uint64_t)(1 << 20));
+      if (write(fd, buf, n) != (ssize_t)n)
+         goto out;
+      written += n;
+   }
+
+   /* Make sure the data has to come from the disk */
+   fsync(fd);
+   posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+   ret = 0;
+
+out:
+   if (fd >= 0)
+      close(fd);
+   free(buf);
+   return ret;
+}
+
+static void usage(void)
+{
+   printf("Usage: vc_vchi_filesys_bench [-n <files>] [-s <MB>] [-b <bytes>] [-d <dir>] [-r <chunks>] [-w <MB/s>]\n");
+   printf("    -n <n>        number of files read in turn (default 2)\n");
+   printf("    -s <MB>       size of each file (default 64)\n");
+   printf("    -b <bytes>    bytes asked for by each read (default %u)\n", FILESERV_MAX_BULK);
+   printf("    -d <dir>      directory for the files (default /tmp)\n");
+   printf("    -r <chunks>   host readahead chunks per file, 0 to disable\n");
+   printf("    -w <MB/s>     bandwidth of the simulated link (default unlimited)\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   VCHIQ_LOOPBACK_SERVICE_T service;
+   VCHIQ_LOOPBACK_LINK_T link;
+   VCHI_INSTANCE_T instance = NULL;
+   VCHI_CONNECTION_T *connection = NULL;
+   const char *dir = "/tmp";
+   unsigned int size_mb = 64, bandwidth = 0, i;
+   uint64_t total = 0;
+   int64_t start, elapsed;
+   int argn;
+
+   bench.num_files = 2;
+   bench.block = FILESERV_MAX_BULK;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-n") && argn + 1 < argc)
+         bench.num_files = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-s") && argn + 1 < argc)
+         size_mb = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-b") && argn + 1 < argc)
+         bench.block = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-d") && argn + 1 < argc)
+         dir = argv[++argn];
+      else if (!strcmp(argv[argn], "-r") && argn + 1 < argc)
+         setenv("VC_HOSTFS_READAHEAD", argv[++argn], 1);
+      else if (!strcmp(argv[argn], "-w") && argn + 1 < argc)
+         bandwidth = atoi(argv[++argn]);
+      else
+         usage();
+   }
+
+   if (!bench.num_files || bench.num_files > BENCH_MAX_FILES || !size_mb ||
+       !bench.block || bench.block > FILESERV_MAX_BULK)
+      usage();
+
+   vcos_init();
+   bench.rx_buf = vcos_malloc_aligned(FILESERV_MAX_BULK, VCHI_BULK_ALIGN, "bench rx");
+   if (!bench.rx_buf || vcos_semaphore_create(&bench.done, "bench", 0) != VCOS_SUCCESS)
+      return 1;
+
+   for (i = 0; i < bench.num_files; i++)
+   {
+      BENCH_FILE_T *f = &bench.file[i];
+
+      snprintf(f->path, sizeof(f->path), "%s/vc_filesys_bench.%d.%u", dir, getpid(), i);
+      f->fd = -1;
+      if (bench_create_file(f->path, (uint64_t)size_mb << 20) != 0)
+      {
+         printf("failed to create %s\n", f->path);
+         return 1;
+      }
+   }
+
+   memset(&service, 0, sizeof(service));
+   service.fourcc = FILESERV_4CC;
+   service.version = VC_FILESERV_VER;
+   service.version_min = VC_FILESERV_VER;
+   service.open = bench_open;
+   service.close = bench_close;
+   service.message = bench_message;
+   service.bulk = bench_bulk;
+
+   memset(&link, 0, sizeof(link));
+   link.bulk_bandwidth = bandwidth << 20;
+   vchiq_loopback_set_link(&link);
+   vchiq_loopback_enable(1);
+   vchiq_loopback_register_service(&service);
+
+   if (vchi_initialise(&instance) != 0 ||
+       vchi_connect(NULL, 0, instance) != 0 ||
+       vc_vchi_filesys_init(instance, &connection, 1) < 0)
+   {
+      printf("failed to start the file service\n");
+      return 1;
+   }
+
+   start = vcos_getmicrosecs64();
+   bench_next();
+   vcos_semaphore_wait(&bench.done);
+   elapsed = vcos_getmicrosecs64() - start;
+
+   for (i = 0; i < bench.num_files; i++)
+   {
+      total += bench.file[i].bytes;
+      if (bench.file[i].bytes != (uint64_t)size_mb << 20)
+         bench.failed = 1;
+   }
+
+   printf("read %u files of %u MB in %lld us: %.1f MB/s, %u requests, %u bulk transfers\n",
+          bench.num_files, size_mb, (long long)elapsed,
+          elapsed ? (double)total / elapsed * 1000000.0 / (1 << 20) : 0.0,
+          bench.requests, bench.bulks);
+   if (bench.failed)
+      printf("short or failed reads\n");
+
+   vc_filesys_stop();
+   for (i = 0; i < bench.num_files; i++)
+      unlink(bench.file[i].path);
+   vcos_free(bench.rx_buf);
+   vcos_semaphore_delete(&bench.done);
+
+   return bench.failed;
+}
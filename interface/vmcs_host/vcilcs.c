@@ -26,6 +26,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 /* Project includes */
 #include "vcinclude/common.h"
@@ -62,6 +63,14 @@ Private types and defines.
 #define ILCS_MAX_NUM_MSGS (ILCS_MAX_WAITING+1)
 #define ILCS_MSG_INUSE_MASK ((1<<ILCS_MAX_NUM_MSGS)-1)
 
+// maximum number of empty/fill this buffer calls that can be outstanding
+// without anyone waiting for their response.  Must be a power of 2.
+#define ILCS_MAX_ASYNC 16
+
+// xids of calls with no waiting thread have this bit set, so their
+// responses can be told apart from those of ordinary calls
+#define ILCS_XID_ASYNC 0x80000000
+
 typedef struct {
    int xid;
    void *resp;
@@ -69,6 +78,18 @@ typedef struct {
    VCOS_EVENT_T event;
 } ILCS_WAIT_T;
 
+typedef struct {
+   IL_FUNCTION_T func;
+   void *reference;
+   OMX_BUFFERHEADERTYPE *buffer;
+} ILCS_ASYNC_T;
+
+typedef struct {
+   VCHI_MEM_HANDLE_T mem_handle;
+   void *offset;
+   int len;
+} ILCS_BULK_T;
+
 typedef enum {
    NORMAL_SERVICE  = 0,  // process all messages
    ABORTED_BULK    = 1,  // reject incoming calls
@@ -104,6 +125,25 @@ struct ILCS_SERVICE_T {
    int next_xid;
    VCOS_EVENT_T wait_event;  // for signalling when a wait becomes free
 
+   // buffer calls that return without waiting for their response.
+   // async_buffers is set with send_sem held, the rest is protected
+   // by wait_mtx
+   int async_buffers;
+   ILCS_ASYNC_T async[ILCS_MAX_ASYNC];
+   uint32_t next_async_xid;
+   int async_inflight; // sent but not yet answered
+
+   // buffer calls waiting to be sent as one IL_PASS_BUFFER_BATCH message,
+   // protected by send_sem.  A batch is sent when the remote side has no
+   // calls to work on, or when it answers one, so it never waits for us.
+   int batch_capable;
+   volatile int batch_kick; // a response arrived since the batch was started
+   int batch_count;
+   int batch_len;
+   int batch_bulks;
+   ILCS_BULK_T batch_bulk[ILCS_MAX_ASYNC];
+   unsigned char batch[VC_ILCS_MAX_INLINE];
+
    // don't need locking around msg_inuse as only touched by
    // the server thread in ilcs_process_message
    unsigned int msg_inuse;
@@ -121,6 +161,7 @@ static VCHIQ_STATUS_T ilcs_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *heade
 static int ilcs_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header, void *service_user, void *bulk_user);
 #endif
 static void *ilcs_task(void *param);
+static void ilcs_cleanup(ILCS_SERVICE_T *st);
 static void ilcs_response(ILCS_SERVICE_T *st, uint32_t xid, const unsigned char *msg, int len );
 static void ilcs_transmit(ILCS_SERVICE_T *st, uint32_t cmd, uint32_t xid,
                           const unsigned char *msg, int len,
@@ -198,13 +239,22 @@ ILCS_SERVICE_T *ilcs_init(VCHIQ_STATE_T *state, void **connection, ILCS_CONFIG_T
    params.callback = ilcs_callback;
    params.userdata = st;
    params.version = VC_ILCS_VERSION;
-   params.version_min = VC_ILCS_VERSION;
+   params.version_min = VC_ILCS_VERSION_MIN;
 
    if (use_memmgr == 0)
    {
-      // Host side, which will connect to a listening VideoCore side
-      if (vchiq_open_service(st->vchiq, &params, &st->service) != VCHIQ_SUCCESS)
-         goto fail_service;
+      // Host side, which will connect to a listening VideoCore side.
+      // Ask for a side that understands batched buffer calls first, then
+      // settle for anything we can talk to.
+      params.version_min = VC_ILCS_VERSION;
+      if (vchiq_open_service(st->vchiq, &params, &st->service) == VCHIQ_SUCCESS)
+         st->batch_capable = 1;
+      else
+      {
+         params.version_min = VC_ILCS_VERSION_MIN;
+         if (vchiq_open_service(st->vchiq, &params, &st->service) != VCHIQ_SUCCESS)
+            goto fail_service;
+      }
    }
    else
    {
@@ -237,6 +287,15 @@ ILCS_SERVICE_T *ilcs_init(VCHIQ_STATE_T *state, void **connection, ILCS_CONFIG_T
    if(vcos_thread_create(&st->thread, st->name, &thread_attrs, ilcs_task, st) != VCOS_SUCCESS)
       goto fail_thread;
 
+#ifndef _VIDEOCORE
+   if(use_memmgr == 0)
+   {
+      const char *async = getenv("VC_ILCS_ASYNC_BUFFERS");
+      if(async && atoi(async))
+         ilcs_set_async_buffers(st, 1);
+   }
+#endif
+
    return st;
 
  fail_thread:
@@ -303,6 +362,10 @@ void ilcs_deinit(ILCS_SERVICE_T *st)
    st->kill_service = DEINIT_CALLED;
    ilcs_send_quit(st);
    vcos_thread_join(&st->thread, &data);
+
+   // only tidy up now that ilcs_send_quit can't still be signalling
+   // the queue and events we are about to delete
+   ilcs_cleanup(st);
    vcos_free(st);
 }
 
@@ -404,20 +467,12 @@ static int ilcs_callback(VCHIQ_REASON_T reason, VCHIQ_HEADER_T *header, void *se
 }
 
 /* ----------------------------------------------------------------------
- * send a message and wait for reply.
- * repeats continuously, on each connection
+ * releases everything ilcs_init created, once the thread has finished
  * -------------------------------------------------------------------- */
-static void *ilcs_task(void *param)
+static void ilcs_cleanup(ILCS_SERVICE_T *st)
 {
-   ILCS_SERVICE_T *st = (ILCS_SERVICE_T *) param;
    int i;
 
-   st->config.ilcs_thread_init(st->ilcs_common);
-
-   while(st->kill_service < CLOSED_CALLBACK)
-      ilcs_process_message(st, 1);
-
-   // tidy up after ourselves
    st->config.ilcs_common_deinit(st->ilcs_common);
 #ifdef USE_VCHIQ_ARM
    vchiq_remove_service(st->service);
@@ -430,9 +485,25 @@ static void *ilcs_task(void *param)
    vcos_event_delete(&st->wait_event);
    vcos_semaphore_delete(&st->send_sem);
    vcos_mutex_delete(&st->wait_mtx);
+}
+
+/* ----------------------------------------------------------------------
+ * send a message and wait for reply.
+ * repeats continuously, on each connection
+ * -------------------------------------------------------------------- */
+static void *ilcs_task(void *param)
+{
+   ILCS_SERVICE_T *st = (ILCS_SERVICE_T *) param;
+
+   st->config.ilcs_thread_init(st->ilcs_common);
+
+   while(st->kill_service < CLOSED_CALLBACK)
+      ilcs_process_message(st, 1);
 
    if(st->kill_service == CLOSED_CALLBACK)
    {
+      // tidy up after ourselves
+      ilcs_cleanup(st);
 #ifdef _VIDEOCORE
       // need vcos reaper thread to do join/free for us
       vcos_thread_reap(&st->thread, vcos_free, st);
@@ -522,6 +593,107 @@ static int ilcs_process_message(ILCS_SERVICE_T *st, int block)
    return 1;
 }
 
+/* ----------------------------------------------------------------------
+ * helper function to queue a bulk transfer following a message
+ * -------------------------------------------------------------------- */
+static void ilcs_queue_bulk(ILCS_SERVICE_T *st, VCHI_MEM_HANDLE_T mem_handle, void *offset, int len)
+{
+#ifdef USE_VCHIQ_ARM
+   vchiq_queue_bulk_transmit_handle(st->service, mem_handle, offset, len, NULL);
+#else
+   vchiq_queue_bulk_transmit(st->vchiq, st->fourcc, mem_handle, offset, len, NULL);
+#endif
+}
+
+/* ----------------------------------------------------------------------
+ * sends any batched buffer calls, must hold send_sem
+ * -------------------------------------------------------------------- */
+static void ilcs_batch_flush(ILCS_SERVICE_T *st)
+{
+   int i;
+
+   if(st->batch_count == 0)
+      return;
+
+   // count them in before the responses can start arriving
+   vcos_mutex_lock(&st->wait_mtx);
+   st->async_inflight += st->batch_count;
+   vcos_mutex_unlock(&st->wait_mtx);
+
+   if(st->batch_count == 1)
+   {
+      // no point wrapping a single call
+      IL_BATCH_RECORD_T *rec = (IL_BATCH_RECORD_T *) st->batch;
+      ilcs_transmit(st, rec->func, rec->xid, (unsigned char *) (rec+1), rec->len, NULL, 0);
+   }
+   else
+      ilcs_transmit(st, IL_PASS_BUFFER_BATCH, 0, st->batch, st->batch_len, NULL, 0);
+
+   for(i=0; i<st->batch_bulks; i++)
+      ilcs_queue_bulk(st, st->batch_bulk[i].mem_handle, st->batch_bulk[i].offset, st->batch_bulk[i].len);
+
+   st->batch_count = 0;
+   st->batch_len = 0;
+   st->batch_bulks = 0;
+   st->batch_kick = 0;
+}
+
+/* ----------------------------------------------------------------------
+ * releases send_sem, first sending the batched buffer calls if the
+ * remote side is idle or has answered a call since the batch was
+ * started.  A response that arrives while someone else holds send_sem
+ * just sets batch_kick, so check for one again after letting go.
+ * -------------------------------------------------------------------- */
+static void ilcs_batch_release(ILCS_SERVICE_T *st)
+{
+   do {
+      if(st->batch_count && (st->batch_kick || st->async_inflight == 0))
+         ilcs_batch_flush(st);
+
+      vcos_semaphore_post(&st->send_sem);
+   } while(st->batch_kick && st->batch_count &&
+           vcos_semaphore_trywait(&st->send_sem) == VCOS_SUCCESS);
+}
+
+/* ----------------------------------------------------------------------
+ * received response to a buffer call that nobody is waiting for.
+ * failures are reported through the ilcs_buffer_error function.
+ * -------------------------------------------------------------------- */
+static void ilcs_async_response(ILCS_SERVICE_T *st, uint32_t xid, const unsigned char *msg, int len)
+{
+   ILCS_ASYNC_T *slot = &st->async[xid & (ILCS_MAX_ASYNC-1)];
+   ILCS_ASYNC_T async;
+   IL_RESPONSE_HEADER_T resp;
+
+   if(len == sizeof(resp))
+      memcpy(&resp, msg, sizeof(resp));
+   else
+      resp.err = OMX_ErrorHardware;
+
+   vcos_mutex_lock(&st->wait_mtx);
+   async = *slot;
+   slot->buffer = NULL;
+   if(async.buffer)
+      st->async_inflight--;
+   vcos_mutex_unlock(&st->wait_mtx);
+
+   if(async.buffer == NULL)
+   {
+      // response to a call we didn't make
+      vcos_assert(0);
+      return;
+   }
+
+   if(resp.err != OMX_ErrorNone && st->config.ilcs_buffer_error)
+      st->config.ilcs_buffer_error(st->ilcs_common, async.reference, async.func, async.buffer, resp.err);
+
+   // the remote side has got through one call, so send it the next lot
+   // now rather than when it runs out of work
+   st->batch_kick = 1;
+   if(st->batch_count && vcos_semaphore_trywait(&st->send_sem) == VCOS_SUCCESS)
+      ilcs_batch_release(st);
+}
+
 /* ----------------------------------------------------------------------
  * received response to an ILCS command
  * -------------------------------------------------------------------- */
@@ -530,6 +702,12 @@ static void ilcs_response(ILCS_SERVICE_T *st, uint32_t xid, const unsigned char
    ILCS_WAIT_T *wait;
    int i, copy = len;
 
+   if(xid & ILCS_XID_ASYNC)
+   {
+      ilcs_async_response(st, xid, msg, len);
+      return;
+   }
+
    // atomically retrieve given ->wait entry
    vcos_mutex_lock(&st->wait_mtx);
    for (i=0; i<ILCS_MAX_WAITING; i++) {
@@ -590,6 +768,31 @@ static void ilcs_transmit(ILCS_SERVICE_T *st, uint32_t cmd, uint32_t xid,
 #endif
 }
 
+/* ----------------------------------------------------------------------
+ * received a batch of buffer calls, execute each one in turn
+ * -------------------------------------------------------------------- */
+static void ilcs_batch(ILCS_SERVICE_T *st, unsigned char *msg, int len)
+{
+   while(len >= (int) sizeof(IL_BATCH_RECORD_T))
+   {
+      IL_BATCH_RECORD_T *rec = (IL_BATCH_RECORD_T *) msg;
+      int size;
+
+      if(rec->len > len - sizeof(IL_BATCH_RECORD_T) ||
+         (rec->func != IL_EMPTY_THIS_BUFFER && rec->func != IL_FILL_THIS_BUFFER))
+      {
+         vcos_assert(0);
+         return;
+      }
+
+      size = sizeof(IL_BATCH_RECORD_T) + IL_BATCH_PAD(rec->len);
+      ilcs_command(st, rec->func, rec->xid, (unsigned char *) (rec+1), rec->len);
+
+      msg += size;
+      len -= size;
+   }
+}
+
 /* ----------------------------------------------------------------------
  * received response to an ILCS command
  * -------------------------------------------------------------------- */
@@ -602,6 +805,11 @@ ilcs_command(ILCS_SERVICE_T *st, uint32_t cmd, uint32_t xid, unsigned char *msg,
    int rlen = -1;
    IL_FN_T fn;
 
+   if(cmd == IL_PASS_BUFFER_BATCH) {
+      ilcs_batch(st, msg, len);
+      return;
+   }
+
    if(cmd >= IL_FUNCTION_MAX_NUM) {
       vcos_assert(0);
       return;
@@ -675,7 +883,7 @@ static int ilcs_execute_function_ex(ILCS_SERVICE_T *st, IL_FUNCTION_T func,
 
    // if resp is NULL, we do not expect any response
    if(resp == NULL) {
-      xid = st->next_xid++;
+      xid = st->next_xid++ & ~ILCS_XID_ASYNC;
    }
    else
    {
@@ -745,25 +953,21 @@ static int ilcs_execute_function_ex(ILCS_SERVICE_T *st, IL_FUNCTION_T func,
       
       wait->resp = resp;
       wait->rlen = rlen;
-      xid = wait->xid = st->next_xid++;
+      xid = wait->xid = st->next_xid++ & ~ILCS_XID_ASYNC;
    }
 
    vcos_mutex_unlock(&st->wait_mtx);
-   
-   if(bulk_len != 0)
-      vcos_semaphore_wait(&st->send_sem);
+
+   // also keeps this call behind any buffer calls still being batched
+   vcos_semaphore_wait(&st->send_sem);
+   ilcs_batch_flush(st);
 
    ilcs_transmit(st, func, xid, data, len, data2, len2);
-      
+
    if(bulk_len != 0)
-   {
-#ifdef USE_VCHIQ_ARM
-      vchiq_queue_bulk_transmit_handle(st->service, bulk_mem_handle, bulk_offset, bulk_len, NULL);
-#else
-      vchiq_queue_bulk_transmit(st->vchiq, st->fourcc, bulk_mem_handle, bulk_offset, bulk_len, NULL);
-#endif
-      vcos_semaphore_post(&st->send_sem);
-   }
+      ilcs_queue_bulk(st, bulk_mem_handle, bulk_offset, bulk_len);
+
+   vcos_semaphore_post(&st->send_sem);
 
    if(!wait)
    {
@@ -807,6 +1011,98 @@ int ilcs_execute_function(ILCS_SERVICE_T *st, IL_FUNCTION_T func, void *data, in
    return ilcs_execute_function_ex(st, func, data, len, NULL, 0, VCHI_MEM_HANDLE_INVALID, 0, 0, resp, rlen);
 }
 
+/* ----------------------------------------------------------------------
+ * send a buffer call without waiting for its response.  returns 0 if the
+ * call was sent or batched, 1 if there is no room to track another call
+ * (make an ordinary call instead) and -1 on failure.
+ * -------------------------------------------------------------------- */
+static int ilcs_pass_buffer_async(ILCS_SERVICE_T *st, IL_FUNCTION_T func, void *reference,
+                                  OMX_BUFFERHEADERTYPE *pBuffer,
+                                  void *data, int len, void *data2, int len2,
+                                  VCHI_MEM_HANDLE_T bulk_mem_handle, void *bulk_offset, int bulk_len)
+{
+   ILCS_ASYNC_T *async;
+   uint32_t xid;
+   int size = sizeof(IL_BATCH_RECORD_T) + IL_BATCH_PAD(len + len2);
+
+   if(st->kill_service)
+      return -1;
+
+   vcos_mutex_lock(&st->wait_mtx);
+
+   xid = st->next_async_xid | ILCS_XID_ASYNC;
+   async = &st->async[xid & (ILCS_MAX_ASYNC-1)];
+   if(async->buffer != NULL)
+   {
+      vcos_mutex_unlock(&st->wait_mtx);
+      return 1;
+   }
+
+   st->next_async_xid = (st->next_async_xid + 1) & ~ILCS_XID_ASYNC;
+   async->func = func;
+   async->reference = reference;
+   async->buffer = pBuffer;
+
+   vcos_mutex_unlock(&st->wait_mtx);
+
+   vcos_semaphore_wait(&st->send_sem);
+
+   if(!st->batch_capable || size > VC_ILCS_MAX_INLINE)
+   {
+      // send it now, after anything already batched
+      ilcs_batch_flush(st);
+
+      vcos_mutex_lock(&st->wait_mtx);
+      st->async_inflight++;
+      vcos_mutex_unlock(&st->wait_mtx);
+
+      ilcs_transmit(st, func, xid, data, len, data2, len2);
+      if(bulk_len != 0)
+         ilcs_queue_bulk(st, bulk_mem_handle, bulk_offset, bulk_len);
+   }
+   else
+   {
+      IL_BATCH_RECORD_T *rec;
+
+      if(st->batch_len + size > VC_ILCS_MAX_INLINE)
+         ilcs_batch_flush(st);
+
+      rec = (IL_BATCH_RECORD_T *) (st->batch + st->batch_len);
+      rec->func = func;
+      rec->xid = xid;
+      rec->len = len + len2;
+      rec->reserved = 0;
+      memcpy(rec+1, data, len);
+      if(len2)
+         memcpy(((unsigned char *) (rec+1)) + len, data2, len2);
+
+      if(bulk_len != 0)
+      {
+         ILCS_BULK_T *bulk = &st->batch_bulk[st->batch_bulks++];
+         bulk->mem_handle = bulk_mem_handle;
+         bulk->offset = bulk_offset;
+         bulk->len = bulk_len;
+      }
+
+      st->batch_len += size;
+      st->batch_count++;
+   }
+
+   ilcs_batch_release(st);
+   return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * choose whether empty/fill this buffer calls wait for their response
+ * -------------------------------------------------------------------- */
+void ilcs_set_async_buffers(ILCS_SERVICE_T *st, int enable)
+{
+   vcos_semaphore_wait(&st->send_sem);
+   ilcs_batch_flush(st);
+   st->async_buffers = enable;
+   vcos_semaphore_post(&st->send_sem);
+}
+
 /* ----------------------------------------------------------------------
  * send a buffer via the IL component service.
  * -------------------------------------------------------------------- */
@@ -934,8 +1230,25 @@ OMX_ERRORTYPE ilcs_pass_buffer(ILCS_SERVICE_T *st, IL_FUNCTION_T func, void *ref
    // when used for callbacks to client, no need for response
    // so only set ret when use component to component
    if(func == IL_EMPTY_THIS_BUFFER || func == IL_FILL_THIS_BUFFER)
+   {
       ret = &resp;
 
+      if(st->async_buffers)
+      {
+         int async = ilcs_pass_buffer_async(st, func, reference, pBuffer, &exe, sizeof(IL_PASS_BUFFER_EXECUTE_T),
+                                            data2, len2, mem_handle, bulk_offset, bulk_len);
+
+         // if there's no room to track it, wait for this one's response
+         if(async <= 0)
+         {
+            if(ptr != NULL)
+               st->config.ilcs_mem_unlock(pBuffer);
+
+            return async == 0 ? OMX_ErrorNone : OMX_ErrorHardware;
+         }
+      }
+   }
+
    if(ilcs_execute_function_ex(st, func, &exe, sizeof(IL_PASS_BUFFER_EXECUTE_T),
                                data2, len2, mem_handle, bulk_offset, bulk_len, ret, &rlen) < 0 || rlen != sizeof(resp))
    {
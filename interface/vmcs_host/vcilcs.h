@@ -48,6 +48,10 @@ typedef struct {
    void (*ilcs_thread_init)(ILCS_COMMON_T *st);
    unsigned char *(*ilcs_mem_lock)(OMX_BUFFERHEADERTYPE *buffer);
    void (*ilcs_mem_unlock)(OMX_BUFFERHEADERTYPE *buffer);
+   // reports the failure of an empty/fill this buffer call that did not wait
+   // for its response, may be NULL
+   void (*ilcs_buffer_error)(ILCS_COMMON_T *st, void *reference, IL_FUNCTION_T func,
+                             OMX_BUFFERHEADERTYPE *buffer, OMX_ERRORTYPE err);
 } ILCS_CONFIG_T;
 
 // initialise the VideoCore IL Component service
@@ -69,6 +73,12 @@ VCHPRE_ ILCS_COMMON_T *ilcs_get_common(ILCS_SERVICE_T *ilcs);
 
 VCHPRE_ int VCHPOST_ ilcs_execute_function(ILCS_SERVICE_T *ilcs, IL_FUNCTION_T func, void *data, int len, void *resp, int *rlen);
 VCHPRE_ OMX_ERRORTYPE VCHPOST_ ilcs_pass_buffer(ILCS_SERVICE_T *ilcs, IL_FUNCTION_T func, void *reference, OMX_BUFFERHEADERTYPE *pBuffer);
+// sets whether empty/fill this buffer calls return as soon as they are
+// sent rather than waiting for the remote side's response.  Errors are
+// then reported through the config's ilcs_buffer_error function.
+// Calls issued back to back may also be sent as a single message.
+VCHPRE_ void VCHPOST_ ilcs_set_async_buffers(ILCS_SERVICE_T *ilcs, int enable);
+
 VCHPRE_ OMX_BUFFERHEADERTYPE * VCHPOST_ ilcs_receive_buffer(ILCS_SERVICE_T *ilcs, void *call, int clen, OMX_COMPONENTTYPE **pComp);
 
 // bulks are 16 bytes aligned, implicit in use of vchiq
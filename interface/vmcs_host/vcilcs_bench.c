@@ -0,0 +1,344 @@
+/*
+Copyright (c) 2012, Broadcom Europe Ltd
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/*
+ * Benchmark for passing buffers to VideoCore over the IL component service.
+ *
+ * Runs ilcs against the vchiq loopback backend, with a fake VideoCore ILCS
+ * service on the far side that answers every call straight away. A stream
+ * of EmptyThisBuffer calls is made and the rate they are got through is
+ * reported, along with the number of messages it took. Use -a to let the
+ * calls return without waiting for their responses, and -v 1 to make the
+ * fake service too old to accept batched calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interface/vcos/vcos.h"
+#include "interface/vchiq_arm/vchiq.h"
+#include "interface/vchiq_arm/vchiq_loopback.h"
+#include "interface/vmcs_host/vcilcs.h"
+
+#define BENCH_BUFFERS 16
+
+struct ILCS_COMMON_T
+{
+   unsigned int errors;     /* Failures reported through ilcs_buffer_error */
+};
+
+static struct
+{
+   unsigned int calls;      /* Buffer calls seen by the fake service */
+   unsigned int batches;    /* Of which arrived in batches */
+   unsigned int fail_every; /* Fail every nth call, 0 for never */
+   unsigned int failed;     /* Calls the fake service failed */
+   unsigned char *rx_buf;
+} bench;
+
+static ILCS_COMMON_T bench_common;
+
+static void bench_respond(unsigned int handle, uint32_t func, uint32_t xid, OMX_ERRORTYPE err)
+{
+   uint32_t cmd = IL_RESPONSE;
+   IL_RESPONSE_HEADER_T resp;
+   VCHIQ_ELEMENT_T elements[3];
+
+   resp.func = (IL_FUNCTION_T)func;
+   resp.err = err;
+   elements[0].data = &cmd;
+   elements[0].size = sizeof(cmd);
+   elements[1].data = &xid;
+   elements[1].size = sizeof(xid);
+   elements[2].data = &resp;
+   elements[2].size = sizeof(resp);
+   vchiq_loopback_queue_message(handle, elements, 3);
+}
+
+/* Plays the part of VideoCore's EmptyThisBuffer */
+static void bench_call(unsigned int handle, uint32_t func, uint32_t xid,
+   const unsigned char *data, unsigned int len)
+{
+   OMX_ERRORTYPE err = OMX_ErrorNone;
+
+   if (func == IL_EMPTY_THIS_BUFFER)
+   {
+      IL_PASS_BUFFER_EXECUTE_T exe;
+
+      if (len < sizeof(exe))
+         return;
+      memcpy(&exe, data, sizeof(exe));
+
+      if (exe.method == IL_BUFFER_BULK)
+      {
+         IL_BUFFER_BULK_T fixup;
+
+         memcpy(&fixup, data + sizeof(exe), sizeof(fixup));
+         vchiq_loopback_queue_bulk_receive(handle, bench.rx_buf,
+            exe.bufferLen - fixup.headerlen - fixup.trailerlen, NULL);
+      }
+
+      bench.calls++;
+      if (bench.fail_every && (bench.calls % bench.fail_every) == 0)
+      {
+         err = OMX_ErrorIncorrectStateOperation;
+         bench.failed++;
+      }
+   }
+
+   /* Anything else is just answered, which makes a handy barrier */
+   bench_respond(handle, func, xid, err);
+}
+
+static int bench_open(unsigned int handle, void *userdata, void **pconn)
+{
+   vcos_unused(handle);
+   vcos_unused(userdata);
+   *pconn = NULL;
+   return 0;
+}
+
+static void bench_close(unsigned int handle, void *conn)
+{
+   vcos_unused(handle);
+   vcos_unused(conn);
+}
+
+static void bench_message(unsigned int handle, void *conn, const void *data,
+   unsigned int size)
+{
+   const unsigned char *msg = data;
+   uint32_t cmd, xid;
+
+   vcos_unused(conn);
+
+   if (size < 8)
+      return;
+   memcpy(&cmd, msg, sizeof(cmd));
+   memcpy(&xid, msg + 4, sizeof(xid));
+   msg += 8;
+   size -= 8;
+
+   if (cmd != IL_PASS_BUFFER_BATCH)
+   {
+      bench_call(handle, cmd, xid, msg, size);
+      return;
+   }
+
+   while (size >= sizeof(IL_BATCH_RECORD_T))
+   {
+      IL_BATCH_RECORD_T rec;
+
+      memcpy(&rec, msg, sizeof(rec));
+      if (rec.len > size - sizeof(rec))
+         break;
+      bench.batches++;
+      bench_call(handle, rec.func, rec.xid, msg + sizeof(rec), rec.len);
+      msg += sizeof(rec) + IL_BATCH_PAD(rec.len);
+      size -= vcos_min(size, sizeof(rec) + IL_BATCH_PAD(rec.len));
+   }
+}
+
+static void bench_bulk(unsigned int handle, void *conn, VCHIQ_REASON_T reason,
+   void *data, unsigned int size, void *bulk_userdata)
+{
+   vcos_unused(handle);
+   vcos_unused(conn);
+   vcos_unused(reason);
+   vcos_unused(data);
+   vcos_unused(size);
+   vcos_unused(bulk_userdata);
+}
+
+static ILCS_COMMON_T *bench_common_init(ILCS_SERVICE_T *ilcs)
+{
+   vcos_unused(ilcs);
+   return &bench_common;
+}
+
+static void bench_common_deinit(ILCS_COMMON_T *st)
+{
+   vcos_unused(st);
+}
+
+static void bench_thread_init(ILCS_COMMON_T *st)
+{
+   vcos_unused(st);
+}
+
+static unsigned char *bench_mem_lock(OMX_BUFFERHEADERTYPE *buffer)
+{
+   return buffer->pBuffer;
+}
+
+static void bench_mem_unlock(OMX_BUFFERHEADERTYPE *buffer)
+{
+   vcos_unused(buffer);
+}
+
+static void bench_buffer_error(ILCS_COMMON_T *st, void *reference, IL_FUNCTION_T func,
+   OMX_BUFFERHEADERTYPE *buffer, OMX_ERRORTYPE err)
+{
+   vcos_unused(reference);
+   vcos_unused(func);
+   vcos_unused(buffer);
+   vcos_unused(err);
+   st->errors++;
+}
+
+static void usage(void)
+{
+   printf("Usage: vcilcs_bench [-n <calls>] [-s <bytes>] [-l <us>] [-a] [-v <version>] [-f <n>]\n");
+   printf("    -n <calls>    number of EmptyThisBuffer calls (default 100000)\n");
+   printf("    -s <bytes>    bytes in each buffer (default 0)\n");
+   printf("    -l <us>       latency of each message on the simulated link (default 50)\n");
+   printf("    -a            don't wait for the response to each call\n");
+   printf("    -v <version>  ILCS version of the fake VideoCore side (default %d)\n", VC_ILCS_VERSION);
+   printf("    -f <n>        fail every nth call\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   static IL_FN_T fns[IL_FUNCTION_MAX_NUM];
+   VCHIQ_LOOPBACK_SERVICE_T service;
+   VCHIQ_LOOPBACK_LINK_T link;
+   VCHIQ_LOOPBACK_STATS_T stats;
+   VCHIQ_INSTANCE_T instance;
+   ILCS_CONFIG_T config;
+   ILCS_SERVICE_T *ilcs;
+   OMX_BUFFERHEADERTYPE hdr[BENCH_BUFFERS];
+   unsigned char *buffers;
+   unsigned int count = 100000, size = 0, latency = 50, errors = 0, i;
+   int async = 0, version = VC_ILCS_VERSION, argn, rlen;
+   IL_RESPONSE_HEADER_T resp;
+   void *reference = &bench;
+   int64_t start, elapsed;
+
+   for (argn = 1; argn < argc; argn++)
+   {
+      if (!strcmp(argv[argn], "-n") && argn + 1 < argc)
+         count = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-s") && argn + 1 < argc)
+         size = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-l") && argn + 1 < argc)
+         latency = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-a"))
+         async = 1;
+      else if (!strcmp(argv[argn], "-v") && argn + 1 < argc)
+         version = atoi(argv[++argn]);
+      else if (!strcmp(argv[argn], "-f") && argn + 1 < argc)
+         bench.fail_every = atoi(argv[++argn]);
+      else
+         usage();
+   }
+
+   if (!count)
+      usage();
+
+   vcos_init();
+   buffers = vcos_malloc_aligned(BENCH_BUFFERS * (size + ILCS_ALIGN), ILCS_ALIGN, "bench buffers");
+   bench.rx_buf = vcos_malloc_aligned(size + ILCS_ALIGN, ILCS_ALIGN, "bench rx");
+   if (!buffers || !bench.rx_buf)
+      return 1;
+
+   memset(hdr, 0, sizeof(hdr));
+   for (i = 0; i < BENCH_BUFFERS; i++)
+   {
+      hdr[i].nSize = sizeof(OMX_BUFFERHEADERTYPE);
+      hdr[i].pBuffer = buffers + i * (size + ILCS_ALIGN);
+      hdr[i].nAllocLen = size + ILCS_ALIGN;
+      hdr[i].pInputPortPrivate = &hdr[i];
+   }
+
+   memset(&service, 0, sizeof(service));
+   service.fourcc = VCHIQ_MAKE_FOURCC('I', 'L', 'C', 'S');
+   service.version = version;
+   service.version_min = VC_ILCS_VERSION_MIN;
+   service.open = bench_open;
+   service.close = bench_close;
+   service.message = bench_message;
+   service.bulk = bench_bulk;
+
+   memset(&link, 0, sizeof(link));
+   link.msg_latency = latency;
+   vchiq_loopback_set_link(&link);
+   vchiq_loopback_enable(1);
+   vchiq_loopback_register_service(&service);
+
+   memset(&config, 0, sizeof(config));
+   config.fns = fns;
+   config.ilcs_common_init = bench_common_init;
+   config.ilcs_common_deinit = bench_common_deinit;
+   config.ilcs_thread_init = bench_thread_init;
+   config.ilcs_mem_lock = bench_mem_lock;
+   config.ilcs_mem_unlock = bench_mem_unlock;
+   config.ilcs_buffer_error = bench_buffer_error;
+
+   if (vchiq_initialise(&instance) != VCHIQ_SUCCESS ||
+       vchiq_connect(instance) != VCHIQ_SUCCESS ||
+       (ilcs = ilcs_init(instance, NULL, &config, 0)) == NULL)
+   {
+      printf("failed to start the IL component service\n");
+      return 1;
+   }
+
+   ilcs_set_async_buffers(ilcs, async);
+   vchiq_loopback_get_stats(&stats, 1);
+
+   start = vcos_getmicrosecs64();
+   for (i = 0; i < count; i++)
+   {
+      OMX_BUFFERHEADERTYPE *h = &hdr[i % BENCH_BUFFERS];
+
+      h->nFilledLen = size;
+      if (ilcs_pass_buffer(ilcs, IL_EMPTY_THIS_BUFFER, reference, h) != OMX_ErrorNone)
+         errors++;
+   }
+
+   /* Once this is answered, so have all the buffer calls */
+   rlen = sizeof(resp);
+   ilcs_execute_function(ilcs, IL_GET_STATE, &reference, sizeof(reference), &resp, &rlen);
+   elapsed = vcos_getmicrosecs64() - start;
+
+   vchiq_loopback_get_stats(&stats, 0);
+   errors += bench_common.errors;
+
+   printf("%u calls of %u bytes in %lld us: %.0f calls/s, %u messages, %u batched, %u/%u errors reported\n",
+          count, size, (long long)elapsed,
+          elapsed ? (double)count * 1000000.0 / elapsed : 0.0,
+          stats.msgs_to_remote, bench.batches, errors, bench.failed);
+
+   ilcs_deinit(ilcs);
+   vchiq_shutdown(instance);
+   vcos_free(buffers);
+   vcos_free(bench.rx_buf);
+
+   return bench.calls != count || errors != bench.failed;
+}
@@ -60,7 +60,8 @@ static IL_FN_T vcilcs_fns[] = {NULL, // response
                                NULL, // component name enum
                                NULL, // get debug information
 
-                               NULL
+                               NULL, // service quit
+                               NULL, // pass buffer batch
 };
 
 static ILCS_COMMON_T *vcilcs_common_init(ILCS_SERVICE_T *ilcs)
@@ -118,5 +119,6 @@ void vcilcs_config(ILCS_CONFIG_T *config)
    config->ilcs_thread_init = vcilcs_thread_init;
    config->ilcs_mem_lock = vcilcs_mem_lock;
    config->ilcs_mem_unlock = vcilcs_mem_unlock;
+   config->ilcs_buffer_error = vcil_out_buffer_error;
 }
 
@@ -77,6 +77,11 @@ VCHPRE_ void VCHPOST_ vcil_out_event_handler(ILCS_COMMON_T *st, void *call, int
 VCHPRE_ void VCHPOST_ vcil_out_empty_buffer_done(ILCS_COMMON_T *st, void *call, int clen, void *resp, int *rlen);
 VCHPRE_ void VCHPOST_ vcil_out_fill_buffer_done(ILCS_COMMON_T *st, void *call, int clen, void *resp, int *rlen);
 
+// reports failure of an empty/fill this buffer call that did not wait
+// for its response to the component's event handler
+VCHPRE_ void VCHPOST_ vcil_out_buffer_error(ILCS_COMMON_T *st, void *reference, IL_FUNCTION_T func,
+                                            OMX_BUFFERHEADERTYPE *buffer, OMX_ERRORTYPE err);
+
 // functions used by the host IL core
 VCHPRE_ OMX_ERRORTYPE VCHPOST_ vcil_out_get_debug_information(ILCS_COMMON_T *st, OMX_STRING debugInfo, OMX_S32 *pLen);
 VCHPRE_ OMX_ERRORTYPE VCHPOST_ vcil_out_create_component(ILCS_COMMON_T *st, OMX_HANDLETYPE hComponent, OMX_STRING component_name);
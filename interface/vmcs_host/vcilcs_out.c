@@ -913,3 +913,23 @@ void vcil_out_fill_buffer_done(ILCS_COMMON_T *st, void *call, int clen, void *re
       comp->callbacks.FillBufferDone(pComp, comp->callback_state, pHeader);
    }
 }
+
+// Called on host side when an empty/fill this buffer call that returned
+// without waiting has failed on VideoCore.  The buffer won't come back
+// through the done callbacks, so it is passed with the error event.
+void vcil_out_buffer_error(ILCS_COMMON_T *st, void *reference, IL_FUNCTION_T func,
+                           OMX_BUFFERHEADERTYPE *buffer, OMX_ERRORTYPE err)
+{
+   VC_PRIVATE_COMPONENT_T *comp;
+
+   vcos_semaphore_wait(&st->component_lock);
+
+   comp = st->component_list;
+   while (comp != NULL && comp->reference != reference)
+      comp = comp->next;
+
+   vcos_semaphore_post(&st->component_lock);
+
+   if (comp != NULL && comp->callbacks.EventHandler)
+      comp->callbacks.EventHandler(comp->comp, comp->callback_state, OMX_EventError, err, 0, buffer);
+}